@@ -0,0 +1,263 @@
+/*
+ * Heap allocations and time of the scanner's record batches.
+ *
+ * Compares the per-record containers the scan used to keep (a list of
+ * FileInfos per change kind, a sorted vector of FileRecords per directory
+ * looked up and erased from as entries are seen) with RecordBatch, for
+ * directories and batches of the requested sizes. Allocations are counted
+ * by replacing the global operator new. Each measurement is printed as a
+ * single "key=value" line, like db_bench.
+ *
+ * Usage:
+ *   batch_bench [--rows 100,1000,10000] [--rounds N]
+ */
+
+#include "../record_batch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+size_t g_allocations = 0;
+
+struct Config
+{
+    std::vector<size_t> rows = { 100, 1000, 10000 };
+    size_t              rounds = 100;
+};
+
+
+std::vector<size_t> parseSizes(const std::string& text)
+{
+    std::vector<size_t> result;
+    std::istringstream in(text);
+    std::string item;
+
+    while (std::getline(in, item, ','))
+    {
+        result.push_back(std::stoull(item));
+    }
+
+    return result;
+}
+
+
+FileRecords makeRows(size_t rows)
+{
+    FileRecords result;
+    char buff[256];
+
+    for (size_t i = 0; i < rows; ++i)
+    {
+        snprintf(buff, sizeof(buff),
+                "/bench/artist%05zu/album%03zu/%02zu some longer track title.flac",
+                i / 100, i / 10 % 10, i % 10);
+        FileInfo info{ 2, 1600000000, false, buff };
+        info.size = 10000000 + i;
+        result.push_back(make_Record(RecordID(i + 3), std::move(info)));
+    }
+
+    return result;
+}
+
+
+struct CmpByPath
+{
+    bool operator()(const FileRecord& left, const FileRecord& right) const
+    {
+        return left.second.fileName < right.second.fileName;
+    }
+};
+
+
+// a scan of a directory nothing has changed in: every old record is found
+// by the name of its entry, what is left over would be deleted
+void scanRecords(const FileRecords& rows, const std::vector<std::string>& names)
+{
+    FileRecords oldRecords;
+
+    for (const FileRecord& rec : rows)
+    {
+        oldRecords.push_back(rec);
+    }
+
+    std::sort(oldRecords.begin(), oldRecords.end(), CmpByPath());
+
+    for (const std::string& name : names)
+    {
+        FileRecord const key = make_Record(RecordID(), FileInfo{ 0, 0, false, name });
+        auto const range = std::equal_range(
+                oldRecords.begin(), oldRecords.end(), key, CmpByPath());
+
+        if (range.first != range.second)
+        {
+            oldRecords.erase(range.first);
+        }
+    }
+}
+
+
+void scanBatch(RecordBatch& oldRecords, const FileRecords& rows,
+               const std::vector<std::string>& names)
+{
+    oldRecords.clear();
+
+    for (const FileRecord& rec : rows)
+    {
+        oldRecords.push_back(RecordView(rec));
+    }
+
+    oldRecords.indexByName();
+
+    for (const std::string& name : names)
+    {
+        size_t const i = oldRecords.find(name);
+
+        if (i != RecordBatch::npos)
+        {
+            oldRecords.take(i);
+        }
+    }
+}
+
+
+void collectList(const FileRecords& rows)
+{
+    std::list<FileInfo> added;
+
+    for (const FileRecord& rec : rows)
+    {
+        added.push_back(rec.second);
+    }
+}
+
+
+void collectBatch(RecordBatch& added, const FileRecords& rows)
+{
+    added.clear();
+
+    for (const FileRecord& rec : rows)
+    {
+        added.push_back(RecordView(rec));
+    }
+}
+
+
+template<typename Func>
+void measure(const Config& cfg, size_t rows, const char* op, Func&& func)
+{
+    size_t const before = g_allocations;
+    auto const start = Clock::now();
+
+    for (size_t i = 0; i < cfg.rounds; ++i)
+    {
+        func();
+    }
+
+    auto const elapsed = Clock::now() - start;
+    auto const us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+
+    std::cout << "op=" << op
+              << " rows=" << rows
+              << " allocs_per_round=" << (g_allocations - before) / cfg.rounds
+              << " us_per_round=" << us.count() / cfg.rounds << std::endl;
+}
+
+
+void run(const Config& cfg, size_t rows)
+{
+    FileRecords const records = makeRows(rows);
+    std::vector<std::string> names;
+
+    for (const FileRecord& rec : records)
+    {
+        names.push_back(rec.second.fileName);
+    }
+
+    std::reverse(names.begin(), names.end()); // not in the order of the db
+
+    // the scanner reuses its batches, the first round takes the capacity
+    RecordBatch batch;
+
+    measure(cfg, rows, "collect_list", [&] { collectList(records); });
+    measure(cfg, rows, "collect_batch", [&] { collectBatch(batch, records); });
+    measure(cfg, rows, "scan_records", [&] { scanRecords(records, names); });
+    measure(cfg, rows, "scan_batch", [&] { scanBatch(batch, records, names); });
+}
+
+} // end of anonymous namespace
+
+
+void* operator new(size_t size)
+{
+    ++g_allocations;
+
+    if (void* p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+
+
+int main(int argc, char* argv[])
+try
+{
+    Config cfg;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string const arg = argv[i];
+        auto value = [&]() -> std::string
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+
+            return argv[++i];
+        };
+
+        if (arg == "--rows")            cfg.rows = parseSizes(value());
+        else if (arg == "--rounds")     cfg.rounds = std::stoull(value());
+        else throw std::invalid_argument("unknown argument " + arg);
+    }
+
+    for (size_t rows : cfg.rows)
+    {
+        run(cfg, rows);
+    }
+
+    return 0;
+}
+catch(const std::exception& ex)
+{
+    std::cerr << "Benchmark failed: " << ex.what() << std::endl;
+    return 1;
+}
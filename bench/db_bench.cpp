@@ -0,0 +1,702 @@
+/*
+ * Microbenchmarks for DbOwner / DbReader operations.
+ *
+ * Builds a synthetic library (root / label / artist / album / track) of the
+ * requested size and measures every public database operation with cold and
+ * warm cache, plus a writer/reader contention scenario. A label holds about
+ * --subtree files, it is the subtree enumerated and deleted within the rest
+ * of the library. Each measurement is printed as a
+ * single "key=value" line, so results of runs with different journal modes,
+ * page sizes and index strategies can be joined and compared directly.
+ *
+ * Usage:
+ *   db_bench [--rows 10000,100000,...] [--journal delete|truncate|persist|wal]
+ *            [--page-size BYTES] [--index none|parent|parent_dir]
+ *            [--samples N] [--subtree FILES] [--dir PATH] [--keep]
+ */
+
+#include "../database.hpp"
+
+#include "../sqlite3/sqlite3.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+namespace fs = std::filesystem;
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Config
+{
+    std::vector<size_t> rows = { 10000, 100000, 1000000 };
+    std::string         journal = "delete";
+    int                 pageSize = 4096;
+    std::string         index = "parent";
+    size_t              samples = 1000;
+    size_t              subtree = 100000;
+    fs::path            dir = fs::temp_directory_path();
+    bool                keep = false;
+};
+
+
+// Gives the benchmark access to the raw connection to apply the pragmas and
+// indexes being compared, without exposing them in the plugin's API.
+class BenchDb : public DbOwner
+{
+public:
+    BenchDb(const std::string& fileName, const Config& cfg)
+        : DbOwner(fileName)
+    {
+        exec("PRAGMA journal_mode = " + cfg.journal);
+
+        if (cfg.index == "parent" || cfg.index == "parent_dir")
+        {
+            exec("CREATE INDEX IF NOT EXISTS bench_files_parent"
+                 " ON files(parent_id)");
+        }
+
+        if (cfg.index == "parent_dir")
+        {
+            exec("CREATE INDEX IF NOT EXISTS bench_files_is_dir"
+                 " ON files(is_dir)");
+        }
+    }
+
+    void exec(const std::string& sql)
+    {
+        auto res = sqlite3_exec(pDb_, sql.c_str(), nullptr, nullptr, nullptr);
+
+        if (res != SQLITE_OK)
+        {
+            throw DbException(res);
+        }
+    }
+};
+
+
+struct Library
+{
+    std::vector<RecordID> dirs;
+    std::vector<RecordID> labels;
+    std::vector<RecordID> albums;
+    std::vector<RecordID> files;
+    std::vector<RecordID> artists;
+};
+
+
+struct Stats
+{
+    std::vector<double> samplesUs;
+
+    void add(Clock::duration d)
+    {
+        samplesUs.push_back(
+            std::chrono::duration<double, std::micro>(d).count());
+    }
+
+    std::string format()
+    {
+        if (samplesUs.empty())
+        {
+            return "n=0";
+        }
+
+        std::sort(samplesUs.begin(), samplesUs.end());
+        double total = 0;
+
+        for (double s : samplesUs)
+        {
+            total += s;
+        }
+
+        auto pct = [this](double p)
+        {
+            size_t idx = static_cast<size_t>(p * (samplesUs.size() - 1));
+            return samplesUs[idx];
+        };
+
+        std::ostringstream out;
+        out.setf(std::ios::fixed);
+        out.precision(2);
+        out << "n=" << samplesUs.size()
+            << " mean_us=" << total / samplesUs.size()
+            << " p50_us=" << pct(0.5)
+            << " p99_us=" << pct(0.99)
+            << " max_us=" << samplesUs.back()
+            << " ops_s=" << (total > 0 ? samplesUs.size() * 1e6 / total : 0);
+        return out.str();
+    }
+};
+
+
+template<typename Func>
+Clock::duration timed(Func&& func)
+{
+    auto const start = Clock::now();
+    func();
+    return Clock::now() - start;
+}
+
+
+void report(const Config& cfg, size_t rows, const char* op,
+            const char* cache, Stats& stats)
+{
+    std::cout << "op=" << op
+              << " rows=" << rows
+              << " cache=" << cache
+              << " journal=" << cfg.journal
+              << " page=" << cfg.pageSize
+              << " index=" << cfg.index
+              << " " << stats.format() << std::endl;
+}
+
+
+// page_size only takes effect before the database file is initialised,
+// so it is applied through a separate connection before DbOwner creates it
+void createEmptyDb(const std::string& fileName, int pageSize)
+{
+    sqlite3* pDb = nullptr;
+    auto res = sqlite3_open(fileName.c_str(), &pDb);
+
+    if (res == SQLITE_OK)
+    {
+        std::string const sql = "PRAGMA page_size = " + std::to_string(pageSize)
+            + "; CREATE TABLE bench_init(x); DROP TABLE bench_init;";
+        res = sqlite3_exec(pDb, sql.c_str(), nullptr, nullptr, nullptr);
+    }
+
+    sqlite3_close(pDb);
+
+    if (res != SQLITE_OK)
+    {
+        throw DbException(res);
+    }
+}
+
+
+void dropOsCache(const std::string& fileName)
+{
+    for (const char* suffix : { "", "-wal", "-journal" })
+    {
+        int fd = ::open((fileName + suffix).c_str(), O_RDONLY);
+
+        if (fd >= 0)
+        {
+            ::fdatasync(fd);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+}
+
+
+std::string trackName(size_t label, size_t artist, size_t album, size_t track)
+{
+    char buff[128];
+    snprintf(buff, sizeof(buff), 
+             "/bench/label%03zu/artist%05zu/album%03zu/%02zu track.flac",
+             label, artist, album, track);
+    return buff;
+}
+
+
+Library populate(DbOwner& db, size_t rows, size_t labelFiles)
+{
+    constexpr size_t albumsPerArtist = 10;
+    constexpr size_t tracksPerAlbum = 12;
+    constexpr size_t batchSize = 10000;
+
+    Library lib;
+    size_t inBatch = 0;
+    size_t count = 0;
+
+    auto add = [&](FileInfo&& info)
+    {
+        if (inBatch == 0)
+        {
+            db.beginTransaction();
+        }
+
+        RecordID id = db.addFile(info);
+        db.indexFile(id, info.fileName);
+        ++count;
+
+        if (++inBatch == batchSize)
+        {
+            db.commit();
+            inBatch = 0;
+        }
+
+        return id;
+    };
+
+    RecordID const rootId = add(FileInfo{ NULL_RECORD_ID, 1, true, "/bench" });
+    lib.dirs.push_back(rootId);
+    RecordID labelId = NULL_RECORD_ID;
+    size_t labelStart = 0;
+
+    for (size_t artist = 0; count < rows; ++artist)
+    {
+        if (labelId == NULL_RECORD_ID || lib.files.size() - labelStart >= labelFiles)
+        {
+            std::string const labelPath = fs::path(
+                    trackName(lib.labels.size(), 0, 0, 0)).parent_path()
+                        .parent_path().parent_path();
+            labelId = add(FileInfo{ rootId, 1, true, labelPath });
+            labelStart = lib.files.size();
+            lib.dirs.push_back(labelId);
+            lib.labels.push_back(labelId);
+        }
+
+        size_t const label = lib.labels.size() - 1;
+        std::string const artistPath = fs::path(
+                trackName(label, artist, 0, 0)).parent_path().parent_path();
+        RecordID const artistId = add(FileInfo{ labelId, 1, true, artistPath });
+        lib.dirs.push_back(artistId);
+        lib.artists.push_back(artistId);
+
+        for (size_t album = 0; album < albumsPerArtist && count < rows; ++album)
+        {
+            std::string const albumPath =
+                    fs::path(trackName(label, artist, album, 0)).parent_path();
+            RecordID const albumId = add(FileInfo{ artistId, 1, true, albumPath });
+            lib.dirs.push_back(albumId);
+            lib.albums.push_back(albumId);
+
+            for (size_t track = 0; track < tracksPerAlbum && count < rows; ++track)
+            {
+                lib.files.push_back(add(FileInfo{
+                    albumId, 1, false, trackName(label, artist, album, track) }));
+            }
+        }
+    }
+
+    if (inBatch != 0)
+    {
+        db.commit();
+    }
+
+    return lib;
+}
+
+
+class Runner
+{
+public:
+    Runner(const Config& cfg, size_t rows)
+        : cfg_(cfg)
+        , rows_(rows)
+        , fileName_((cfg.dir / ("medialib_bench_" + std::to_string(rows) + ".db")).string())
+        , rnd_(rows)
+    {
+    }
+
+    ~Runner()
+    {
+        pDb_.reset();
+
+        if (!cfg_.keep)
+        {
+            for (const char* suffix : { "", "-wal", "-shm", "-journal" })
+            {
+                std::error_code ec;
+                fs::remove(fileName_ + suffix, ec);
+            }
+        }
+    }
+
+    void run()
+    {
+        setup();
+
+        for (const char* cache : { "cold", "warm" })
+        {
+            bool const cold = cache[0] == 'c';
+
+            measure("getFile", cache, cold, cfg_.samples, [this]
+            {
+                pDb_->getFile(pick(lib_.files));
+            });
+
+            // a reader invalidated by scan events, as the widget's is; reads
+            // within the rows browsed, which fit in the cache
+            if (!cold)
+            {
+                DbReader reader = pDb_->createReader();
+                reader.enableFileCache(4096);
+                std::vector<RecordID> const browsed(lib_.files.begin(),
+                        lib_.files.begin() + std::min<size_t>(lib_.files.size(), 1000));
+
+                measure("getFile_cached", cache, cold, cfg_.samples, [&]
+                {
+                    reader.getFile(pick(browsed));
+                });
+            }
+
+            measure("childrenFiles", cache, cold, cfg_.samples, [this]
+            {
+                pDb_->childrenFiles(pick(lib_.albums));
+            });
+
+            measure("getFiles_1000", cache, cold, cfg_.samples, [this]
+            {
+                std::vector<RecordID> ids(1000);
+
+                for (RecordID& id : ids)
+                {
+                    id = pick(lib_.files);
+                }
+
+                pDb_->getFiles(ids);
+            });
+
+            measure("subtreeFiles", cache, cold, cfg_.samples, [this]
+            {
+                pDb_->subtreeFiles(pick(lib_.artists));
+            });
+
+            // every file of the library, e.g. 100k of them with --rows 100000
+            measure("subtreeFiles_root", cache, cold, 5, [this]
+            {
+                pDb_->subtreeFiles(lib_.dirs.front());
+            });
+
+            measure("countSubtreeFiles_root", cache, cold, 5, [this]
+            {
+                pDb_->countSubtreeFiles(lib_.dirs.front());
+            });
+
+            // --subtree files, within the other labels
+            measure("subtreeFiles_label", cache, cold, 5, [this]
+            {
+                pDb_->subtreeFiles(lib_.labels.front());
+            });
+
+            measure("countSubtreeFiles_label", cache, cold, 5, [this]
+            {
+                pDb_->countSubtreeFiles(lib_.labels.front());
+            });
+
+            measure("largestDirs", cache, cold, cfg_.samples, [this]
+            {
+                pDb_->largestDirs(20);
+            });
+
+            // a copy of the library whose albums differ in a few places:
+            // their artists and the root are walked, the rest is skipped
+            {
+                std::unordered_map<std::string, uint64_t> snapshot;
+
+                for (const FileRecord& dir : pDb_->dirs())
+                {
+                    snapshot[dir.second.fileName] = dir.second.digest;
+                }
+
+                for (int i = 0; i < 10; ++i)
+                {
+                    fs::path path = pDb_->getFile(pick(lib_.albums)).fileName;
+
+                    for (; path != "/"; path = path.parent_path())
+                    {
+                        ++snapshot[path.string()];
+                    }
+                }
+
+                measure("differingDirs", cache, cold, cfg_.samples, [&]
+                {
+                    pDb_->differingDirs(ROOT_RECORD_ID, 
+                        [&snapshot](const std::string& name) -> std::optional<uint64_t>
+                        {
+                            auto const it = snapshot.find(name);
+                            return it != snapshot.end() ? 
+                                    std::optional<uint64_t>(it->second) : std::nullopt;
+                        });
+                });
+            }
+
+            measure("dirs", cache, cold, cold ? 1 : 5, [this]
+            {
+                pDb_->dirs();
+            });
+
+            measure("forEachDir", cache, cold, cold ? 1 : 5, [this]
+            {
+                size_t count = 0;
+                pDb_->forEachDir([&count](const RecordView&) { ++count; });
+            });
+
+            measure("replaceFile", cache, cold, cfg_.samples, [this]
+            {
+                RecordID const id = pick(lib_.files);
+                FileInfo info = pDb_->getFile(id);
+                ++info.lastWriteTime;
+                pDb_->replaceFile(id, info);
+            });
+
+            // a few dozen matches, and more than the result limit
+            measure("search_selective", cache, cold, cfg_.samples, [this]
+            {
+                char query[32];
+                snprintf(query, sizeof(query), "ist%05zu",
+                         rnd_() % lib_.artists.size());
+                pDb_->search(query, 500);
+            });
+
+            measure("search_common", cache, cold, cfg_.samples, [this]
+            {
+                pDb_->search("Track", 500);
+            });
+
+            measure("addFile", cache, cold, cfg_.samples, [this]
+            {
+                RecordID const parent = pick(lib_.albums);
+                lib_.files.push_back(pDb_->addFile(FileInfo{ parent, 1, false,
+                    "/bench/added/" + std::to_string(lib_.files.size()) + ".mp3" }));
+            });
+        }
+
+        reportStatements();
+        contention();
+
+        // subtree deletion is destructive, so it goes last
+        for (const char* cache : { "cold", "warm" })
+        {
+            bool const cold = cache[0] == 'c';
+            size_t const n = std::min<size_t>(lib_.artists.size() / 4,
+                                              cold ? 5 : 50);
+
+            measure("delFile_subtree", cache, cold, n, [this]
+            {
+                RecordID const id = lib_.artists.back();
+                lib_.artists.pop_back();
+                pDb_->delFile(id);
+            });
+        }
+
+        // repopulated, so that a whole label goes, then the rest of the library
+        pDb_.reset();
+        setup();
+        measure("delFile_label", "cold", true, 1, [this]
+        {
+            pDb_->beginTransaction();
+            pDb_->delFile(lib_.labels.front());
+            pDb_->commit();
+        });
+
+        measure("delFile_root", "cold", true, 1, [this]
+        {
+            pDb_->beginTransaction();
+            pDb_->delFile(lib_.dirs.front());
+            pDb_->commit();
+        });
+    }
+
+private:
+    void setup()
+    {
+        std::clog << "[Bench] populating " << fileName_
+                  << " with " << rows_ << " rows" << std::endl;
+
+        for (const char* suffix : { "", "-wal", "-shm", "-journal" })
+        {
+            std::error_code ec;
+            fs::remove(fileName_ + suffix, ec);
+        }
+
+        createEmptyDb(fileName_, cfg_.pageSize);
+        pDb_.reset(new BenchDb(fileName_, cfg_));
+        lib_ = populate(*pDb_, rows_, cfg_.subtree);
+    }
+
+    void reopen()
+    {
+        pDb_.reset();
+        dropOsCache(fileName_);
+        pDb_.reset(new BenchDb(fileName_, cfg_));
+    }
+
+    RecordID pick(const std::vector<RecordID>& ids)
+    {
+        return ids[std::uniform_int_distribution<size_t>(0, ids.size() - 1)(rnd_)];
+    }
+
+    // Cold samples reopen the database and drop the OS page cache before
+    // every operation; warm samples run back to back after a warm-up pass.
+    template<typename Op>
+    void measure(const char* name, const char* cache, bool cold,
+                 size_t samples, Op&& op)
+    {
+        Stats stats;
+
+        if (cold)
+        {
+            samples = std::max<size_t>(1, std::min<size_t>(samples, 20));
+        }
+        else
+        {
+            for (size_t i = 0; i < std::min<size_t>(samples, 100); ++i)
+            {
+                op();
+            }
+        }
+
+        for (size_t i = 0; i < samples; ++i)
+        {
+            if (cold)
+            {
+                reopen();
+            }
+
+            stats.add(timed(op));
+        }
+
+        report(cfg_, rows_, name, cache, stats);
+    }
+
+    // Runs of each statement on the connection of the warm samples, which
+    // also ran the last cold one.
+    void reportStatements()
+    {
+        for (const StatementStats& stmt : pDb_->statementStats())
+        {
+            std::cout << "stmt=" << stmt.name
+                      << " rows=" << rows_
+                      << " journal=" << cfg_.journal
+                      << " page=" << cfg_.pageSize
+                      << " index=" << cfg_.index
+                      << " runs=" << stmt.runs
+                      << " mean_us=" << stmt.nsec / 1000.0 / stmt.runs
+                      << std::endl;
+        }
+    }
+
+    // Writer keeps committing small batches while a reader created via
+    // createReader() queries the same database from another thread.
+    void contention()
+    {
+        std::atomic<bool> stop(false);
+        Stats readStats;
+        Stats writeStats;
+        std::vector<RecordID> const albums = lib_.albums;
+
+        std::thread reader([&]
+        {
+            DbReader db = pDb_->createReader();
+            std::mt19937_64 rnd(rows_ + 1);
+            std::uniform_int_distribution<size_t> dist(0, albums.size() - 1);
+
+            while (!stop)
+            {
+                RecordID const id = albums[dist(rnd)];
+                readStats.add(timed([&] { db.childrenFiles(id); }));
+            }
+        });
+
+        for (size_t i = 0; i < cfg_.samples / 10 + 1; ++i)
+        {
+            writeStats.add(timed([this]
+            {
+                pDb_->beginTransaction();
+
+                for (int j = 0; j < 10; ++j)
+                {
+                    RecordID const id = pick(lib_.files);
+                    FileInfo info = pDb_->getFile(id);
+                    ++info.lastWriteTime;
+                    pDb_->replaceFile(id, info);
+                }
+
+                pDb_->commit();
+            }));
+        }
+
+        stop = true;
+        reader.join();
+
+        report(cfg_, rows_, "contention_write_batch10", "warm", writeStats);
+        report(cfg_, rows_, "contention_read_childrenFiles", "warm", readStats);
+    }
+
+    const Config&               cfg_;
+    const size_t                rows_;
+    const std::string           fileName_;
+    std::mt19937_64             rnd_;
+    std::unique_ptr<BenchDb>    pDb_;
+    Library                     lib_;
+};
+
+
+std::vector<size_t> parseSizes(const std::string& arg)
+{
+    std::vector<size_t> sizes;
+    std::istringstream in(arg);
+    std::string item;
+
+    while (std::getline(in, item, ','))
+    {
+        sizes.push_back(std::stoull(item));
+    }
+
+    return sizes;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char* argv[])
+try
+{
+    Config cfg;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string const arg = argv[i];
+        auto value = [&]() -> std::string
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+
+            return argv[++i];
+        };
+
+        if (arg == "--rows")            cfg.rows = parseSizes(value());
+        else if (arg == "--journal")    cfg.journal = value();
+        else if (arg == "--page-size")  cfg.pageSize = std::stoi(value());
+        else if (arg == "--index")      cfg.index = value();
+        else if (arg == "--samples")    cfg.samples = std::stoull(value());
+        else if (arg == "--subtree")    cfg.subtree = std::stoull(value());
+        else if (arg == "--dir")        cfg.dir = value();
+        else if (arg == "--keep")       cfg.keep = true;
+        else throw std::invalid_argument("unknown argument " + arg);
+    }
+
+    for (size_t rows : cfg.rows)
+    {
+        Runner(cfg, rows).run();
+    }
+
+    return 0;
+}
+catch(const std::exception& ex)
+{
+    std::cerr << "Benchmark failed: " << ex.what() << std::endl;
+    return 1;
+}
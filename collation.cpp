@@ -0,0 +1,270 @@
+#include "collation.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// longest digit run encoded at once, its length has to fit in a byte
+constexpr size_t MAX_DIGITS = 254;
+
+// base letters of U+00C0..U+00FF, nullptr where the character is kept
+const char * const LATIN1_BASE[64] =
+{
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i",
+    "d", "n", "o", "o", "o", "o", "o", nullptr, "o", "u", "u", "u", "u", "y", "th", "ss",
+    "a", "a", "a", "a", "a", "a", "ae", "c", "e", "e", "e", "e", "i", "i", "i", "i",
+    "d", "n", "o", "o", "o", "o", "o", nullptr, "o", "u", "u", "u", "u", "y", "th", "y"
+};
+
+// base letters of U+0100..U+017F, '*' marks the ligatures IJ and OE
+const char LATIN_EXT_A_BASE[] =
+    "aaaaaa" "cccccccc" "dddd" "eeeeeeeeee" "gggggggg" "hhhh" "iiiiiiiiii"
+    "**" "jj" "kkk" "llllllllll" "nnnnnnn" "nn" "oooooo" "**" "rrrrrr"
+    "ssssssss" "tttttt" "uuuuuuuuuuuu" "ww" "yyy" "zzzzzz" "s";
+
+static_assert(sizeof(LATIN_EXT_A_BASE) == 0x80 + 1, "U+0100..U+017F");
+
+
+// next code point, invalid sequences yield their first byte as is
+char32_t decode(const std::string& text, size_t& pos, bool& valid)
+{
+    auto const byte = [&](size_t i)
+    {
+        return static_cast<unsigned char>(text[i]);
+    };
+
+    unsigned char const lead = byte(pos);
+    size_t length = 0;
+    char32_t c = 0;
+
+    if (lead < 0x80)
+    {
+        ++pos;
+        valid = true;
+        return lead;
+    }
+    else if ((lead & 0xE0) == 0xC0)
+    {
+        length = 2;
+        c = lead & 0x1F;
+    }
+    else if ((lead & 0xF0) == 0xE0)
+    {
+        length = 3;
+        c = lead & 0x0F;
+    }
+    else if ((lead & 0xF8) == 0xF0)
+    {
+        length = 4;
+        c = lead & 0x07;
+    }
+
+    valid = length > 0 && pos + length <= text.size();
+
+    for (size_t i = 1; valid && i < length; ++i)
+    {
+        valid = (byte(pos + i) & 0xC0) == 0x80;
+        c = (c << 6) | (byte(pos + i) & 0x3F);
+    }
+
+    if (!valid)
+    {
+        ++pos;
+        return lead;
+    }
+
+    pos += length;
+    return c;
+}
+
+
+void encode(char32_t c, std::string& out)
+{
+    if (c < 0x80)
+    {
+        out += static_cast<char>(c);
+    }
+    else if (c < 0x800)
+    {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        out += static_cast<char>(0xF0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+}
+
+
+// lowercase Greek letter of an accented or capital one, 0 if not folded
+char32_t foldGreek(char32_t c)
+{
+    switch (c)
+    {
+    case 0x0386: case 0x03AC:                           return 0x03B1; // alpha
+    case 0x0388: case 0x03AD:                           return 0x03B5; // epsilon
+    case 0x0389: case 0x03AE:                           return 0x03B7; // eta
+    case 0x038A: case 0x0390: case 0x03AA: case 0x03AF:
+    case 0x03CA:                                        return 0x03B9; // iota
+    case 0x038C: case 0x03CC:                           return 0x03BF; // omicron
+    case 0x038E: case 0x03AB: case 0x03B0: case 0x03CB:
+    case 0x03CD:                                        return 0x03C5; // upsilon
+    case 0x038F: case 0x03CE:                           return 0x03C9; // omega
+    case 0x03C2:                                        return 0x03C3; // final sigma
+    }
+
+    return c >= 0x0391 && c <= 0x03A9 ? c + 0x20 : 0;
+}
+
+
+void appendFolded(char32_t c, std::string& out)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        out += static_cast<char>(c + ('a' - 'A'));
+    }
+    else if (c < 0xC0)
+    {
+        encode(c, out);
+    }
+    else if (c < 0x100)
+    {
+        const char * const szBase = LATIN1_BASE[c - 0xC0];
+
+        if (szBase)
+        {
+            out += szBase;
+        }
+        else
+        {
+            encode(c, out);
+        }
+    }
+    else if (c < 0x180)
+    {
+        char const base = LATIN_EXT_A_BASE[c - 0x100];
+
+        if (base != '*')
+        {
+            out += base;
+        }
+        else
+        {
+            out += c < 0x150 ? "ij" : "oe";
+        }
+    }
+    else if (c >= 0x0300 && c <= 0x036F)
+    {
+        // combining diacritical marks are dropped
+    }
+    else if (c >= 0x0386 && c <= 0x03CE)
+    {
+        char32_t const folded = foldGreek(c);
+        encode(folded ? folded : c, out);
+    }
+    else if (c == 0x0400 || c == 0x0401 || c == 0x0450 || c == 0x0451)
+    {
+        encode(0x0435, out); // io and ie with grave, either case, as ie
+    }
+    else if (c >= 0x0400 && c <= 0x040F)
+    {
+        encode(c + 0x50, out);
+    }
+    else if (c >= 0x0410 && c <= 0x042F)
+    {
+        encode(c + 0x20, out);
+    }
+    else
+    {
+        encode(c, out);
+    }
+}
+
+
+bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+} // end of anonymous namespace
+
+
+std::string foldText(const std::string& text)
+{
+    std::string result;
+    result.reserve(text.size());
+
+    for (size_t pos = 0; pos < text.size();)
+    {
+        bool valid;
+        size_t const start = pos;
+        char32_t const c = decode(text, pos, valid);
+
+        if (valid)
+        {
+            appendFolded(c, result);
+        }
+        else
+        {
+            result += text[start];
+        }
+    }
+
+    return result;
+}
+
+
+/*
+ * A digit run becomes '0', the count of its significant digits plus one and
+ * those digits. The marker keeps numbers before letters as in plain byte
+ * order, the count orders shorter numbers first, leading zeros are ignored.
+ */
+std::string sortKey(const std::string& text)
+{
+    std::string const folded = foldText(text);
+    std::string key;
+    key.reserve(folded.size() + 4);
+
+    for (size_t i = 0; i < folded.size();)
+    {
+        if (!isDigit(folded[i]))
+        {
+            key += folded[i++];
+            continue;
+        }
+
+        size_t end = i;
+
+        while (end < folded.size() && isDigit(folded[end]))
+        {
+            ++end;
+        }
+
+        while (i < end && folded[i] == '0')
+        {
+            ++i;
+        }
+
+        do
+        { // longer runs continue as another number, zeros and all
+            size_t const count = std::min(end - i, MAX_DIGITS);
+
+            key += '0';
+            key += static_cast<char>(count + 1);
+            key.append(folded, i, count);
+            i += count;
+        }
+        while (i < end);
+    }
+
+    return key;
+}
@@ -0,0 +1,19 @@
+#ifndef COLLATION_HPP
+#define	COLLATION_HPP
+
+#include <string>
+
+/*
+ * Case and diacritic insensitive forms of UTF-8 names, computed once when a
+ * name is stored so that sorting and searching compare plain bytes. Folding
+ * covers Latin, Greek and Cyrillic letters, other characters are kept as is.
+ */
+
+// lowercased, accents and other combining marks removed
+std::string foldText(const std::string& text);
+
+// folded text with digit runs ordered by their value ("2" < "10"); keys
+// compare with memcmp and never contain NUL bytes
+std::string sortKey(const std::string& text);
+
+#endif	/* COLLATION_HPP */
@@ -1,17 +1,652 @@
 #include "database.hpp"
+#include "collation.hpp"
 
 #include "sqlite3/sqlite_locked.h"
 #include "sqlite3/sqlite3.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <tuple>
 #include <assert.h>
 
 #define CHECK_SQLITE(expr) \
     { auto res = expr; if (res != SQLITE_OK) throw DbException(res); }
 
-DbOwner::DbOwner(const std::string& fileName)
+// every statement run through PreparedStatements, in the order of STATEMENTS
+enum class Statement : uint8_t
+{
+    // the owner's
+    USER_VERSION,
+    ALL_FILE_NAMES,
+    SET_SORT_KEY,
+    ALL_DIR_IDS,
+    NEEDS_TAG_GROUPS,
+    NEEDS_SEARCH_INDEX,
+    FILE_TEXTS,
+    INSERT_FILE,
+    FILE_TO_DELETE,
+    DELETE_FILE_TRACK,
+    DELETE_FILE_SCHEDULE,
+    DELETE_FILE,
+    DELETE_SUBTREE_TRACKS,
+    DELETE_SUBTREE_TRIGRAMS,
+    DELETE_SUBTREE_SCHEDULES,
+    DELETE_SUBTREE,
+    UPDATE_FILE,
+    SET_DIR_SCHEDULE,
+    UPDATE_TRACK,
+    INSERT_TRACK,
+    FILE_PARENT,
+    DELETE_TRIGRAMS,
+    INSERT_TRIGRAM,
+    INSERT_ARTIST,
+    ARTIST_ID,
+    INSERT_ALBUM,
+    ALBUM_ID,
+    BEGIN,
+    COMMIT,
+    ROLLBACK,
+    SAVEPOINT_DIRS,
+    RELEASE_DIRS,
+    ROLLBACK_DIRS,
+    STALE_DIRS,
+    ADD_STALE_DIR,
+    CLEAR_STALE_DIRS,
+    DIR_DEPTH,
+    DIR_CHILDREN,
+    DIR_TOTALS,
+    SET_DIR_TOTALS,
+    // any connection's
+    ANCESTORS,
+    FILE_BY_ID,
+    FILES_BY_IDS,
+    CHILDREN,
+    DIRS,
+    DIR_SCHEDULES,
+    STALE_TRACKS,
+    TAG_GROUPS,
+    GROUP_OF,
+    ARTIST_TRACKS,
+    ARTIST_ALBUM_TRACKS,
+    ALBUM_TRACKS,
+    GENRE_TRACKS,
+    YEAR_TRACKS,
+    DIR_NAME,
+    SUBTREE_FILES,
+    COUNT_SUBTREE_FILES,
+    LARGEST_DIRS,
+    SEEK_TRIGRAM,
+    FILE_TEXT,
+    
+    COUNT
+};
+
+
+namespace {
+
+// how often a search checks whether it's still wanted
+constexpr unsigned CANCEL_CHECK_STEPS = 256;
+
+// ids bound per getFiles() query, below SQLITE_MAX_VARIABLE_NUMBER
+constexpr size_t ID_CHUNK = 500;
+
+// stored as PRAGMA user_version, see DbOwner::migrate()
+constexpr int SCHEMA_VERSION = 6;
+
+// virtual machine steps between checks whether opening was cancelled
+constexpr int CANCEL_CHECK_OPS = 10000;
+
+constexpr size_t STATEMENT_COUNT = static_cast<size_t>(Statement::COUNT);
+
+// getFiles()' statement has ID_CHUNK parameters, unused ones stay NULL
+constexpr char FILES_BY_IDS_HEAD[] =
+   "SELECT id, parent_id, write_time, is_dir, name, sort_key, size, digest,"
+   " file_count, total_size, duration"
+   " FROM files WHERE id IN (?";
+
+using FilesByIdsSQL = std::array<char, sizeof(FILES_BY_IDS_HEAD) + 2 * ID_CHUNK - 1>;
+
+constexpr FilesByIdsSQL filesByIdsSQL()
+{
+    FilesByIdsSQL sql{}; // the rest is the terminating NUL
+    size_t n = 0;
+    
+    for (size_t i = 0; i + 1 < sizeof(FILES_BY_IDS_HEAD); ++i)
+    {
+        sql[n++] = FILES_BY_IDS_HEAD[i];
+    }
+    
+    for (size_t i = 1; i < ID_CHUNK; ++i)
+    {
+        sql[n++] = ',';
+        sql[n++] = '?';
+    }
+    
+    sql[n] = ')';
+    return sql;
+}
+
+constexpr FilesByIdsSQL FILES_BY_IDS_SQL = filesByIdsSQL();
+
+// connections which prepare a statement as they open, the owner prepares
+// all of them; the others are prepared by get() if ever needed
+enum Connections { OWNER, ANY };
+
+struct StatementSpec
+{
+    Statement    id;
+    const char * name;
+    Connections  connections;
+    const char * sql;
+};
+
+constexpr StatementSpec STATEMENTS[] =
+{
+    { Statement::USER_VERSION, "USER_VERSION", OWNER,
+       "PRAGMA user_version" },
+    { Statement::ALL_FILE_NAMES, "ALL_FILE_NAMES", OWNER,
+       "SELECT id, name FROM files" },
+    { Statement::SET_SORT_KEY, "SET_SORT_KEY", OWNER,
+       "UPDATE files SET sort_key = :sort_key WHERE id = :id" },
+    { Statement::ALL_DIR_IDS, "ALL_DIR_IDS", OWNER,
+       "SELECT id FROM files WHERE is_dir" },
+    { Statement::NEEDS_TAG_GROUPS, "NEEDS_TAG_GROUPS", OWNER,
+       "SELECT EXISTS (SELECT 1 FROM tracks)"
+       " AND NOT EXISTS (SELECT 1 FROM tag_groups)" },
+    { Statement::NEEDS_SEARCH_INDEX, "NEEDS_SEARCH_INDEX", OWNER,
+       "SELECT EXISTS (SELECT 1 FROM files)"
+       " AND NOT EXISTS (SELECT 1 FROM trigrams)" },
+    { Statement::FILE_TEXTS, "FILE_TEXTS", OWNER,
+       "SELECT f.id, f.name, t.title, ar.name, al.title"
+       " FROM files f LEFT JOIN tracks t ON t.file_id = f.id"
+       " LEFT JOIN artists ar ON ar.id = t.artist_id"
+       " LEFT JOIN albums al ON al.id = t.album_id" },
+    { Statement::INSERT_FILE, "INSERT_FILE", OWNER,
+       "INSERT INTO files"
+       " (parent_id, write_time, is_dir, name, sort_key, size, root_id)"
+       " VALUES(:parent_id, :write_time, :is_dir, :name, :sort_key, :size,"
+       " (SELECT IFNULL(root_id, id) FROM files WHERE id = :parent_id))" },
+    { Statement::FILE_TO_DELETE, "FILE_TO_DELETE", OWNER,
+       "SELECT parent_id, is_dir, name, IFNULL(root_id, id) FROM files"
+       " WHERE id = :id" },
+    // nothing references files, the rows of a file are deleted along with it
+    { Statement::DELETE_FILE_TRACK, "DELETE_FILE_TRACK", OWNER,
+       "DELETE FROM tracks WHERE file_id = :id" },
+    { Statement::DELETE_FILE_SCHEDULE, "DELETE_FILE_SCHEDULE", OWNER,
+       "DELETE FROM dir_schedule WHERE dir_id = :id" },
+    { Statement::DELETE_FILE, "DELETE_FILE", OWNER,
+       "DELETE FROM files WHERE id = :id" },
+    { Statement::DELETE_SUBTREE_TRACKS, "DELETE_SUBTREE_TRACKS", OWNER,
+       "DELETE FROM tracks WHERE file_id IN (SELECT id FROM files"
+       " WHERE root_id = :root_id AND name >= :from AND name < :to)" },
+    { Statement::DELETE_SUBTREE_TRIGRAMS, "DELETE_SUBTREE_TRIGRAMS", OWNER,
+       "DELETE FROM trigrams WHERE file_id IN (SELECT id FROM files"
+       " WHERE root_id = :root_id AND name >= :from AND name < :to)" },
+    { Statement::DELETE_SUBTREE_SCHEDULES, "DELETE_SUBTREE_SCHEDULES", OWNER,
+       "DELETE FROM dir_schedule WHERE dir_id IN (SELECT id FROM files"
+       " WHERE root_id = :root_id AND name >= :from AND name < :to"
+       " AND is_dir)" },
+    { Statement::DELETE_SUBTREE, "DELETE_SUBTREE", OWNER,
+       "DELETE FROM files"
+       " WHERE root_id = :root_id AND name >= :from AND name < :to" },
+    { Statement::UPDATE_FILE, "UPDATE_FILE", OWNER,
+       "UPDATE files SET"
+       " parent_id = :parent_id,"
+       " write_time = :write_time,"
+       " is_dir = :is_dir,"
+       " name = :name,"
+       " sort_key = :sort_key,"
+       " size = :size,"
+       " root_id = (SELECT IFNULL(root_id, id) FROM files WHERE id = :parent_id)"
+       " WHERE id = :id" },
+    // not stored for directories deleted meanwhile
+    { Statement::SET_DIR_SCHEDULE, "SET_DIR_SCHEDULE", OWNER,
+       "INSERT OR REPLACE INTO dir_schedule"
+       " (dir_id, next_check, interval, changes, last_change)"
+       " SELECT :dir_id, :next_check, :interval, :changes, :last_change"
+       " WHERE EXISTS (SELECT 1 FROM files WHERE id = :dir_id)" },
+    { Statement::UPDATE_TRACK, "UPDATE_TRACK", OWNER,
+       "UPDATE tracks SET"
+       " write_time = :write_time,"
+       " title = :title,"
+       " artist_id = :artist_id,"
+       " album_id = :album_id,"
+       " genre = :genre,"
+       " year = :year,"
+       " track_no = :track_no,"
+       " duration = :duration"
+       " WHERE file_id = :file_id" },
+    // selecting from files skips records deleted while the tags were read
+    { Statement::INSERT_TRACK, "INSERT_TRACK", OWNER,
+       "INSERT INTO tracks"
+       " (write_time, title, artist_id, album_id, genre, year, track_no,"
+       " duration, file_id)"
+       " SELECT :write_time, :title, :artist_id, :album_id, :genre, :year,"
+       " :track_no, :duration, id FROM files WHERE id = :file_id" },
+    { Statement::FILE_PARENT, "FILE_PARENT", OWNER,
+       "SELECT parent_id FROM files WHERE id = :id" },
+    { Statement::DELETE_TRIGRAMS, "DELETE_TRIGRAMS", OWNER,
+       "DELETE FROM trigrams WHERE file_id = :file_id" },
+    // nothing is inserted for records deleted while tags were read
+    { Statement::INSERT_TRIGRAM, "INSERT_TRIGRAM", OWNER,
+       "INSERT INTO trigrams (tri, file_id)"
+       " SELECT :tri, id FROM files WHERE id = :file_id" },
+    { Statement::INSERT_ARTIST, "INSERT_ARTIST", OWNER,
+       "INSERT OR IGNORE INTO artists (name) VALUES(:name)" },
+    { Statement::ARTIST_ID, "ARTIST_ID", OWNER,
+       "SELECT id FROM artists WHERE name = :name" },
+    { Statement::INSERT_ALBUM, "INSERT_ALBUM", OWNER,
+       "INSERT OR IGNORE INTO albums (artist_id, title)"
+       " VALUES(:artist_id, :title)" },
+    { Statement::ALBUM_ID, "ALBUM_ID", OWNER,
+       "SELECT id FROM albums WHERE artist_id = :artist_id AND title = :title" },
+    { Statement::BEGIN, "BEGIN", OWNER,
+       "BEGIN TRANSACTION" },
+    { Statement::COMMIT, "COMMIT", OWNER,
+       "COMMIT TRANSACTION" },
+    { Statement::ROLLBACK, "ROLLBACK", OWNER,
+       "ROLLBACK TRANSACTION" },
+    { Statement::SAVEPOINT_DIRS, "SAVEPOINT_DIRS", OWNER,
+       "SAVEPOINT dirs" },
+    { Statement::RELEASE_DIRS, "RELEASE_DIRS", OWNER,
+       "RELEASE SAVEPOINT dirs" },
+    { Statement::ROLLBACK_DIRS, "ROLLBACK_DIRS", OWNER,
+       "ROLLBACK TO SAVEPOINT dirs" },
+    { Statement::STALE_DIRS, "STALE_DIRS", OWNER,
+       "SELECT dir_id FROM stale_dirs" },
+    { Statement::ADD_STALE_DIR, "ADD_STALE_DIR", OWNER,
+       "INSERT OR IGNORE INTO stale_dirs (dir_id) VALUES(:dir_id)" },
+    { Statement::CLEAR_STALE_DIRS, "CLEAR_STALE_DIRS", OWNER,
+       "DELETE FROM stale_dirs" },
+    { Statement::DIR_DEPTH, "DIR_DEPTH", OWNER,
+       "WITH RECURSIVE up(id) AS ("
+         " SELECT parent_id FROM files WHERE id = :id"
+         " UNION ALL"
+         " SELECT f.parent_id FROM files f JOIN up ON f.id = up.id)"
+       " SELECT COUNT(*) FROM up" },
+    { Statement::DIR_CHILDREN, "DIR_CHILDREN", OWNER,
+       "SELECT f.name, f.write_time, f.size, f.digest, f.is_dir,"
+       " f.file_count, f.total_size, f.duration, t.duration"
+       " FROM files f LEFT JOIN tracks t ON t.file_id = f.id"
+       " WHERE f.parent_id = :parent_id" },
+    { Statement::DIR_TOTALS, "DIR_TOTALS", OWNER,
+       "SELECT parent_id, digest, file_count, total_size, duration"
+       " FROM files WHERE id = :id" },
+    { Statement::SET_DIR_TOTALS, "SET_DIR_TOTALS", OWNER,
+       "UPDATE files SET digest = :digest, file_count = :file_count,"
+       " total_size = :total_size, duration = :duration WHERE id = :id" },
+    { Statement::ANCESTORS, "ANCESTORS", ANY,
+       "WITH RECURSIVE up(id, parent_id) AS ("
+         " SELECT id, parent_id FROM files WHERE id = :id"
+         " UNION ALL"
+         " SELECT f.id, f.parent_id FROM files f JOIN up ON f.id = up.parent_id)"
+       " SELECT id, parent_id FROM up" },
+    { Statement::FILE_BY_ID, "FILE_BY_ID", ANY,
+       "SELECT parent_id, write_time, is_dir, name, sort_key, size, digest,"
+       " file_count, total_size, duration"
+       " FROM files WHERE id = :id" },
+    { Statement::FILES_BY_IDS, "FILES_BY_IDS", ANY, FILES_BY_IDS_SQL.data() },
+    { Statement::CHILDREN, "CHILDREN", ANY,
+       "SELECT id, parent_id, write_time, is_dir, name, sort_key, size, digest,"
+       " file_count, total_size, duration"
+       " FROM files"
+       " WHERE parent_id = :parent_id"
+         " OR (parent_id IS NULL AND :parent_id IS NULL)"
+       " ORDER BY sort_key" },
+    { Statement::DIRS, "DIRS", ANY,
+       "SELECT id, parent_id, write_time, is_dir, name, sort_key, size, digest,"
+       " file_count, total_size, duration"
+       " FROM files WHERE is_dir" },
+    { Statement::DIR_SCHEDULES, "DIR_SCHEDULES", ANY,
+       "SELECT dir_id, next_check, interval, changes, last_change"
+       " FROM dir_schedule" },
+    { Statement::STALE_TRACKS, "STALE_TRACKS", ANY,
+       "SELECT f.id, f.parent_id, f.write_time, f.is_dir, f.name, f.sort_key,"
+       " f.size, f.digest, f.file_count, f.total_size, f.duration"
+       " FROM files f LEFT JOIN tracks t ON t.file_id = f.id"
+       " WHERE f.id > :after_id AND NOT f.is_dir"
+         " AND (t.file_id IS NULL OR t.write_time <> f.write_time)"
+       " ORDER BY f.id LIMIT :limit" },
+    { Statement::TAG_GROUPS, "TAG_GROUPS", ANY,
+       "SELECT id, name, count, sort_key FROM tag_groups"
+       " WHERE mode = :mode AND parent_id = :parent_id"
+       " ORDER BY sort_key" },
+    { Statement::GROUP_OF, "GROUP_OF", ANY,
+       "SELECT mode, parent_id FROM tag_groups WHERE id = :id" },
+    { Statement::ARTIST_TRACKS, "ARTIST_TRACKS", ANY,
+       "SELECT t.file_id, t.track_no, t.title, f.name"
+       " FROM tag_groups g JOIN tracks t ON t.artist_id = g.group_key"
+       " JOIN files f ON f.id = t.file_id"
+       " WHERE g.id = :id" },
+    { Statement::ARTIST_ALBUM_TRACKS, "ARTIST_ALBUM_TRACKS", ANY,
+       "SELECT t.file_id, t.track_no, t.title, f.name"
+       " FROM tag_groups g JOIN albums al ON al.artist_id = g.group_key"
+       " JOIN tracks t ON t.album_id = al.id"
+       " JOIN files f ON f.id = t.file_id"
+       " WHERE g.id = :id" },
+    { Statement::ALBUM_TRACKS, "ALBUM_TRACKS", ANY,
+       "SELECT t.file_id, t.track_no, t.title, f.name"
+       " FROM tag_groups g JOIN tracks t ON t.album_id = g.group_key"
+       " JOIN files f ON f.id = t.file_id"
+       " WHERE g.id = :id" },
+    { Statement::GENRE_TRACKS, "GENRE_TRACKS", ANY,
+       "SELECT t.file_id, t.track_no, t.title, f.name"
+       " FROM tag_groups g JOIN tracks t ON t.genre = g.group_key"
+       " JOIN files f ON f.id = t.file_id"
+       " WHERE g.id = :id" },
+    { Statement::YEAR_TRACKS, "YEAR_TRACKS", ANY,
+       "SELECT t.file_id, t.track_no, t.title, f.name"
+       " FROM tag_groups g JOIN tracks t ON t.year = g.group_key"
+       " JOIN files f ON f.id = t.file_id"
+       " WHERE g.id = :id" },
+    { Statement::DIR_NAME, "DIR_NAME", ANY,
+       "SELECT name, IFNULL(root_id, id) FROM files WHERE id = :id AND is_dir" },
+    { Statement::SUBTREE_FILES, "SUBTREE_FILES", ANY,
+       "SELECT id, parent_id, is_dir, name, sort_key FROM files"
+       " WHERE root_id = :root_id AND name >= :from AND name < :to" },
+    { Statement::COUNT_SUBTREE_FILES, "COUNT_SUBTREE_FILES", ANY,
+       "SELECT COUNT(*) FROM files WHERE root_id = :root_id"
+       " AND name >= :from AND name < :to AND NOT is_dir" },
+    { Statement::LARGEST_DIRS, "LARGEST_DIRS", ANY,
+       "SELECT id, parent_id, write_time, is_dir, name, sort_key, size, digest,"
+       " file_count, total_size, duration"
+       " FROM files WHERE is_dir"
+       " ORDER BY total_size DESC LIMIT :limit" },
+    { Statement::SEEK_TRIGRAM, "SEEK_TRIGRAM", ANY,
+       "SELECT file_id FROM trigrams"
+       " WHERE tri = :tri AND file_id >= :file_id"
+       " ORDER BY file_id LIMIT 1" },
+    { Statement::FILE_TEXT, "FILE_TEXT", ANY,
+       "SELECT f.parent_id, f.write_time, f.is_dir, f.name, f.sort_key,"
+       " t.title, ar.name, al.title"
+       " FROM files f LEFT JOIN tracks t ON t.file_id = f.id"
+       " LEFT JOIN artists ar ON ar.id = t.artist_id"
+       " LEFT JOIN albums al ON al.id = t.album_id"
+       " WHERE f.id = :id" },
+};
+
+static_assert(std::size(STATEMENTS) == STATEMENT_COUNT, 
+        "every Statement needs its SQL");
+
+constexpr bool inStatementOrder()
+{
+    for (size_t i = 0; i < STATEMENT_COUNT; ++i)
+    {
+        if (static_cast<size_t>(STATEMENTS[i].id) != i)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static_assert(inStatementOrder(), "STATEMENTS are indexed by Statement");
+
+/*
+ * tag_groups rows a track is counted in, parents before children. The
+ * expressions refer to the track row as '$', which is NEW or OLD in triggers.
+ */
+struct GroupSpec
+{
+    GroupMode    mode;
+    const char * parent;
+    const char * key;
+    const char * name;
+};
+
+const GroupSpec GROUP_SPECS[] =
+{
+    { GroupMode::ARTIST, "0", "$.artist_id",
+      "(SELECT name FROM artists WHERE id = $.artist_id)" },
+    { GroupMode::ALBUM, "0",
+      "(SELECT artist_id FROM albums WHERE id = $.album_id)",
+      "(SELECT ar.name FROM albums al JOIN artists ar ON ar.id = al.artist_id"
+      " WHERE al.id = $.album_id)" },
+    { GroupMode::ALBUM,
+      "(SELECT id FROM tag_groups WHERE mode = 1 AND parent_id = 0"
+      " AND group_key = (SELECT artist_id FROM albums WHERE id = $.album_id))",
+      "$.album_id",
+      "(SELECT title FROM albums WHERE id = $.album_id)" },
+    { GroupMode::GENRE, "0", "$.genre", "$.genre" },
+    { GroupMode::YEAR, "0", "$.year",
+      "CASE WHEN $.year > 0 THEN $.year ELSE '' END" }
+};
+
+
+std::string forRow(const char * szExpr, const char * szRow)
+{
+    std::string result;
+    
+    for (const char * p = szExpr; *p; ++p)
+    {
+        if (*p == '$')
+        {
+            result += szRow;
+        }
+        else
+        {
+            result += *p;
+        }
+    }
+    
+    return result;
+}
+
+
+std::string groupCondition(const GroupSpec& spec, const char * szRow)
+{
+    return " WHERE mode = " + std::to_string(static_cast<int>(spec.mode)) +
+           " AND parent_id = " + forRow(spec.parent, szRow) +
+           " AND group_key = " + forRow(spec.key, szRow) + ";";
+}
+
+
+// groups are created when they get their first track
+std::string incGroupsSQL(const char * szRow)
+{
+    std::string sql;
+    
+    for (const GroupSpec& spec : GROUP_SPECS)
+    {
+        sql += "INSERT OR IGNORE INTO tag_groups"
+               " (mode, parent_id, group_key, name, sort_key, count) VALUES(" + 
+               std::to_string(static_cast<int>(spec.mode)) + ", " +
+               forRow(spec.parent, szRow) + ", " + 
+               forRow(spec.key, szRow) + ", " + 
+               forRow(spec.name, szRow) + ", " + 
+               "sort_key(" + forRow(spec.name, szRow) + "), 0);";
+        sql += "UPDATE tag_groups SET count = count + 1" + 
+               groupCondition(spec, szRow);
+    }
+    
+    return sql;
+}
+
+
+std::string decGroupsSQL(const char * szRow)
+{
+    std::string sql;
+    
+    for (const GroupSpec& spec : GROUP_SPECS)
+    {
+        sql += "UPDATE tag_groups SET count = count - 1" + 
+               groupCondition(spec, szRow);
+    }
+    
+    return sql;
+}
+
+
+// empty groups are deleted separately, after the counts of a changed track
+// are moved, so that groups keeping their tracks keep their ids as well
+std::string purgeGroupsSQL(const char * szRow)
+{
+    std::string sql;
+    
+    for (auto it = std::rbegin(GROUP_SPECS); it != std::rend(GROUP_SPECS); ++it)
+    {
+        sql += "DELETE FROM tag_groups" + groupCondition(*it, szRow);
+        sql.insert(sql.size() - 1, " AND count <= 0");
+    }
+    
+    return sql;
+}
+
+
+// the name shown for a file, the whole path for roots
+std::string baseName(std::string_view fileName)
+{
+    auto const slash = fileName.find_last_of('/');
+    return std::string(slash == std::string::npos || slash + 1 == fileName.size() ? 
+            fileName : fileName.substr(slash + 1));
+}
+
+
+// search text of a file: its name and tags, one per line so that a query
+// can't match across fields; folded like queries
+std::string searchText(std::string_view fileName, 
+        const std::string& title = std::string(), 
+        const std::string& artist = std::string(), 
+        const std::string& album = std::string())
+{
+    std::string text = baseName(fileName);
+    
+    for (const std::string* pField : { &title, &artist, &album })
+    {
+        if (!pField->empty())
+        {
+            text += '\n';
+            text += *pField;
+        }
+    }
+    
+    return foldText(text);
+}
+
+
+// distinct byte trigrams packed into integers, sorted
+std::vector<int> trigrams(const std::string& text)
+{
+    std::vector<int> result;
+    
+    for (size_t i = 0; i + 3 <= text.size(); ++i)
+    {
+        auto const * p = reinterpret_cast<const unsigned char*>(&text[i]);
+        result.push_back((p[0] << 16) | (p[1] << 8) | p[2]);
+    }
+    
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+
+// sort_key(text) for triggers, keys of tag group names
+void sqlSortKey(sqlite3_context * pCtx, int /*argc*/, sqlite3_value ** ppArgs)
+try
+{
+    auto const * pText = sqlite3_value_text(ppArgs[0]);
+    std::string const key = pText ? 
+            sortKey(reinterpret_cast<const char*>(pText)) : std::string();
+    
+    sqlite3_result_blob(pCtx, key.data(), key.size(), SQLITE_TRANSIENT);
+}
+catch(const std::bad_alloc&)
+{
+    sqlite3_result_error_nomem(pCtx);
+}
+
+
+// bounds of the names below a directory, [from, to)
+std::pair<std::string, std::string> subtreeRange(const std::string& dirName)
+{
+    std::string from = dirName;
+    
+    if (from.empty() || from.back() != '/')
+    {
+        from += '/';
+    }
+    
+    std::string to = from;
+    to.back() = '/' + 1;
+    return { from, to };
+}
+
+
+uint64_t mix(uint64_t x)
+{ // splitmix64 finalizer
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+
+// what a directory's digest sums up for one of its children
+uint64_t entryDigest(const std::string& fileName, std::time_t lastWriteTime,
+        uint64_t size, uint64_t digest)
+{
+    uint64_t h = 0xCBF29CE484222325ull; // FNV-1a of the base name
+    
+    for (char c : baseName(fileName))
+    {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001B3ull;
+    }
+    
+    h = mix(h ^ mix(static_cast<uint64_t>(lastWriteTime)));
+    h = mix(h ^ mix(size + 1));
+    return mix(h ^ digest);
+}
+
+
+// the progress handler of an owner being opened, a non-zero result
+// interrupts the statement
+int isCancelled(void* pCancel)
+{
+    return *static_cast<std::atomic<bool>*>(pCancel) ? 1 : 0;
+}
+
+
+// runs a statement which returns no rows
+void stepDone(sqlite3_stmt * pStmt)
+{
+    auto const res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+}
+
+
+std::string columnBlob(sqlite3_stmt * pStmt, int col)
+{
+    auto const * pData = static_cast<const char*>(sqlite3_column_blob(pStmt, col));
+    return pData ? std::string(pData, sqlite3_column_bytes(pStmt, col)) : 
+                   std::string();
+}
+
+
+// the bytes are SQLite's, valid until the statement steps or is reset
+std::string_view columnView(sqlite3_stmt * pStmt, int col)
+{
+    auto const * pData = static_cast<const char*>(sqlite3_column_blob(pStmt, col));
+    return pData ? std::string_view(pData, sqlite3_column_bytes(pStmt, col)) : 
+                   std::string_view();
+}
+
+} // end of anonymous namespace
+
+DbOwner::DbOwner(const std::string& fileName, 
+                 const std::atomic<bool>* pCancel)
     : DbReader(nullptr)
     , fileName_(fileName)
+    , pCancel_(pCancel)
 {
     CHECK_SQLITE(sqlite3_enable_shared_cache(true));
     
@@ -25,6 +660,14 @@ DbOwner::DbOwner(const std::string& fileName)
         throw DbException(res);
     }
     
+    if (pCancel_)
+    { // long statements of the upgrade are interrupted
+        sqlite3_progress_handler(pDb_, CANCEL_CHECK_OPS, &isCancelled, 
+                const_cast<std::atomic<bool>*>(pCancel_));
+    }
+    
+    // the schema of version 0, migrate() brings it up to date; the foreign
+    // keys to files are gone since version 5
     const char * const szSQL =
     "PRAGMA foreign_keys = ON;"
     "CREATE TABLE IF NOT EXISTS files("
@@ -34,7 +677,64 @@ DbOwner::DbOwner(const std::string& fileName)
         "is_dir BOOLEAN,"
         "name TEXT,"
         "FOREIGN KEY(parent_id) REFERENCES files(id) ON DELETE CASCADE"
-        ");";
+        ");"
+    "CREATE TABLE IF NOT EXISTS dir_schedule("
+        "dir_id INTEGER PRIMARY KEY,"
+        "next_check DATETIME,"
+        "interval INTEGER,"
+        "changes INTEGER,"
+        "last_change DATETIME,"
+        "FOREIGN KEY(dir_id) REFERENCES files(id) ON DELETE CASCADE"
+        ");"
+    "CREATE TABLE IF NOT EXISTS artists("
+        "id INTEGER PRIMARY KEY ASC,"
+        "name TEXT UNIQUE"
+        ");"
+    "CREATE TABLE IF NOT EXISTS albums("
+        "id INTEGER PRIMARY KEY ASC,"
+        "artist_id INTEGER,"
+        "title TEXT,"
+        "UNIQUE(artist_id, title),"
+        "FOREIGN KEY(artist_id) REFERENCES artists(id)"
+        ");"
+    "CREATE TABLE IF NOT EXISTS tracks("
+        "file_id INTEGER PRIMARY KEY,"
+        "write_time DATETIME,"
+        "title TEXT,"
+        "artist_id INTEGER,"
+        "album_id INTEGER,"
+        "genre TEXT,"
+        "year INTEGER,"
+        "track_no INTEGER,"
+        "duration INTEGER,"
+        "FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE,"
+        "FOREIGN KEY(artist_id) REFERENCES artists(id),"
+        "FOREIGN KEY(album_id) REFERENCES albums(id)"
+        ");"
+    "CREATE INDEX IF NOT EXISTS tracks_artist ON tracks(artist_id);"
+    "CREATE INDEX IF NOT EXISTS tracks_album ON tracks(album_id);"
+    "CREATE INDEX IF NOT EXISTS tracks_genre ON tracks(genre);"
+    "CREATE INDEX IF NOT EXISTS tracks_year ON tracks(year);"
+    // track counts per browse mode grouping, maintained by the triggers below
+    "CREATE TABLE IF NOT EXISTS tag_groups("
+        "id INTEGER PRIMARY KEY ASC,"
+        "mode INTEGER,"
+        "parent_id INTEGER,"
+        "group_key,"
+        "name TEXT,"
+        "count INTEGER,"
+        "UNIQUE(mode, parent_id, group_key)"
+        ");"
+    "CREATE INDEX IF NOT EXISTS tag_groups_sorted"
+        " ON tag_groups(mode, parent_id, name);"
+    // substring search index over names and tags
+    "CREATE TABLE IF NOT EXISTS trigrams("
+        "tri INTEGER,"
+        "file_id INTEGER,"
+        "PRIMARY KEY(tri, file_id),"
+        "FOREIGN KEY(file_id) REFERENCES files(id) ON DELETE CASCADE"
+        ") WITHOUT ROWID;"
+    "CREATE INDEX IF NOT EXISTS trigrams_file ON trigrams(file_id);";
     
     res = sqlite3_exec(pDb_, szSQL, nullptr, nullptr, nullptr);
     
@@ -44,86 +744,610 @@ DbOwner::DbOwner(const std::string& fileName)
         throw DbException(res);
     }
     
+    // used by the triggers, which only run on this connection
+    CHECK_SQLITE(sqlite3_create_function_v2(pDb_, "sort_key", 1, 
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, 
+            &sqlSortKey, nullptr, nullptr, nullptr));
+    
     statements_.setDb(pDb_);
+    migrate();
+    // the schema is the current one from here on
+    statements_.prepareAll(true);
+    
+    std::string const triggersSQL = 
+        "CREATE TRIGGER IF NOT EXISTS tracks_inserted AFTER INSERT ON tracks"
+        " BEGIN " + incGroupsSQL("NEW") + " END;"
+        "CREATE TRIGGER IF NOT EXISTS tracks_deleted AFTER DELETE ON tracks"
+        " BEGIN " + decGroupsSQL("OLD") + purgeGroupsSQL("OLD") + " END;"
+        "CREATE TRIGGER IF NOT EXISTS tracks_updated"
+        " AFTER UPDATE OF artist_id, album_id, genre, year ON tracks"
+        " WHEN OLD.artist_id IS NOT NEW.artist_id"
+          " OR OLD.album_id IS NOT NEW.album_id"
+          " OR OLD.genre IS NOT NEW.genre"
+          " OR OLD.year IS NOT NEW.year"
+        " BEGIN " + decGroupsSQL("OLD") + incGroupsSQL("NEW") + 
+            purgeGroupsSQL("OLD") + " END;";
+    
+    res = sqlite3_exec(pDb_, triggersSQL.c_str(), nullptr, nullptr, nullptr);
+    
+    if (res != SQLITE_OK)
+    {
+        std::clog << "Failed to create database triggers" << std::endl;
+        throw DbException(res);
+    }
+    
+    rebuildTagGroups();
+    checkCancelled();
+    rebuildSearchIndex();
+    checkCancelled();
+    // recomputes the directories a failed commit left stale
+    beginTransaction();
+    commit();
+    checkCancelled();
+    
+    sqlite3_progress_handler(pDb_, 0, nullptr, nullptr);
+    pCancel_ = nullptr;
 }
 
 
-RecordID DbOwner::addFile(const FileInfo& record)
+void DbOwner::checkCancelled() const
 {
-    constexpr const char * const szSQL =
-       "INSERT INTO files (parent_id, write_time, is_dir, name)"
-       " VALUES(:parent_id, :write_time, :is_dir, :name)";
-    
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, szSQL);
-    
-    if (record.parentID != NULL_RECORD_ID)
+    if (pCancel_ && *pCancel_)
     {
-        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, record.parentID));
+        throw DbException(SQLITE_INTERRUPT);
     }
-    else
+}
+
+
+// brings a database written by an older version up to SCHEMA_VERSION;
+// the schema above is the one of version 0, later columns are added here
+void DbOwner::migrate()
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::USER_VERSION);
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_ROW)
     {
-        CHECK_SQLITE(sqlite3_bind_null(pStmt, 1));
+        throw DbException(res);
     }
     
-    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, record.lastWriteTime));
-    CHECK_SQLITE(sqlite3_bind_int(pStmt, 3, record.isDir ? 1 : 0));
-    CHECK_SQLITE(sqlite3_bind_text(pStmt, 4, 
-       record.fileName.c_str(), record.fileName.length(), SQLITE_TRANSIENT));
+    int const version = sqlite3_column_int(pStmt, 0);
+    CHECK_SQLITE(sqlite3_reset(pStmt));
     
-    auto res = sqlite3_blocking_step(pStmt);
+    if (version >= SCHEMA_VERSION)
+    {
+        return;
+    }
     
-    if (res != SQLITE_DONE)
+    checkCancelled();
+    std::clog << "Upgrading database from version " << version << std::endl;
+    // tables are rebuilt without the foreign keys to files, whose cascades
+    // would empty them as the old files table is dropped; the pragma has
+    // no effect within a transaction
+    CHECK_SQLITE(sqlite3_exec(pDb_, "PRAGMA foreign_keys = OFF;", 
+            nullptr, nullptr, nullptr));
+    beginTransaction();
+    
+    try
     {
-        throw DbException(res);
+        if (version < 1)
+        {
+            migrateSortKeys();
+        }
+        
+        if (version < 2)
+        {
+            migrateDigests();
+        }
+        
+        // version 3 indexed full paths, replaced by the index of version 5
+        
+        if (version < 4)
+        {
+            migrateTotals();
+        }
+        
+        if (version < 5)
+        {
+            migrateRoots();
+        }
+        
+        if (version < 6)
+        { // directories whose totals failed to update, see commit()
+            CHECK_SQLITE(sqlite3_exec(pDb_, 
+                    "CREATE TABLE stale_dirs(dir_id INTEGER PRIMARY KEY);",
+                    nullptr, nullptr, nullptr));
+        }
+        
+        std::string const setVersionSQL = 
+                "PRAGMA user_version = " + std::to_string(SCHEMA_VERSION);
+        CHECK_SQLITE(sqlite3_exec(pDb_, setVersionSQL.c_str(), 
+                nullptr, nullptr, nullptr));
+    }
+    catch(...)
+    {
+        rollback();
+        sqlite3_exec(pDb_, "PRAGMA foreign_keys = ON;", nullptr, nullptr, nullptr);
+        throw;
     }
     
-    return sqlite3_last_insert_rowid(pDb_);
+    commit();
+    CHECK_SQLITE(sqlite3_exec(pDb_, "PRAGMA foreign_keys = ON;", 
+            nullptr, nullptr, nullptr));
 }
 
 
-void DbOwner::delFile(RecordID id)
+// version 1: collation keys of file and group names, folded search index
+void DbOwner::migrateSortKeys()
 {
     constexpr const char * const szSQL =
-       "DELETE FROM files WHERE id = :id";
+    // recreated with sort keys once the migration is done
+    "DROP TRIGGER IF EXISTS tracks_inserted;"
+    "DROP TRIGGER IF EXISTS tracks_deleted;"
+    "DROP TRIGGER IF EXISTS tracks_updated;"
+    "ALTER TABLE files ADD COLUMN sort_key BLOB;"
+    "ALTER TABLE tag_groups ADD COLUMN sort_key BLOB;"
+    "CREATE INDEX files_sorted ON files(parent_id, sort_key);"
+    "DROP INDEX IF EXISTS tag_groups_sorted;"
+    "CREATE INDEX tag_groups_sorted ON tag_groups(mode, parent_id, sort_key);"
+    "UPDATE tag_groups SET sort_key = sort_key(name);"
+    // indexed by rebuildSearchIndex() with folded text
+    "DELETE FROM trigrams;";
     
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, szSQL);
+    CHECK_SQLITE(sqlite3_exec(pDb_, szSQL, nullptr, nullptr, nullptr));
     
-    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
-    auto res = sqlite3_blocking_step(pStmt);
+    std::vector<std::pair<RecordID, std::string>> files;
+    sqlite3_stmt * pStmt = statements_.get(Statement::ALL_FILE_NAMES);
+    int res;
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        auto const * pName = sqlite3_column_text(pStmt, 1);
+        
+        files.emplace_back(sqlite3_column_int64(pStmt, 0), 
+                pName ? reinterpret_cast<const char*>(pName) : "");
+    }
     
     if (res != SQLITE_DONE)
     {
         throw DbException(res);
     }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    for (const auto& file : files)
+    {
+        checkCancelled();
+        std::string const key = sortKey(baseName(file.second));
+        pStmt = statements_.get(Statement::SET_SORT_KEY);
+        
+        CHECK_SQLITE(sqlite3_bind_blob(pStmt, 1, 
+           key.data(), key.size(), SQLITE_TRANSIENT));
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, file.first));
+        res = sqlite3_blocking_step(pStmt);
+        
+        if (res != SQLITE_DONE)
+        {
+            throw DbException(res);
+        }
+    }
 }
 
 
-void DbOwner::replaceFile(RecordID id, const FileInfo& record)
+// version 2: file sizes and subtree digests; sizes of the files already
+// known stay 0 until they change, the digests are computed along with the
+// totals of version 4, which updateDirs() reads
+void DbOwner::migrateDigests()
 {
     constexpr const char * const szSQL =
-       "UPDATE files SET"
-       " parent_id = :parent_id,"
-       " write_time = :write_time,"
-       " is_dir = :is_dir,"
-       " name = :name"
-       " WHERE id = :id";
+    "ALTER TABLE files ADD COLUMN size INTEGER DEFAULT 0;"
+    "ALTER TABLE files ADD COLUMN digest INTEGER DEFAULT 0;";
     
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, szSQL);
+    CHECK_SQLITE(sqlite3_exec(pDb_, szSQL, nullptr, nullptr, nullptr));
+}
+
+
+// version 4: file count, size and duration totals of directories
+void DbOwner::migrateTotals()
+{
+    constexpr const char * const szSQL =
+    "ALTER TABLE files ADD COLUMN file_count INTEGER DEFAULT 0;"
+    "ALTER TABLE files ADD COLUMN total_size INTEGER DEFAULT 0;"
+    "ALTER TABLE files ADD COLUMN duration INTEGER DEFAULT 0;"
+    "CREATE INDEX files_dir_size ON files(total_size) WHERE is_dir;";
     
-    if (record.parentID != NULL_RECORD_ID)
-    {
-        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, record.parentID));
-    }
-    else
-    {
+    CHECK_SQLITE(sqlite3_exec(pDb_, szSQL, nullptr, nullptr, nullptr));
+    changedAllDirs();
+    updateDirs();
+    dirtyDirs_.clear();
+}
+
+
+// version 5: the root each file was found under, and no foreign keys to
+// files; the paths below a root nested in another one are also in the
+// range of the outer root's copy of the directory, but only reachable from
+// the inner root. Deleting a subtree deletes the rows of its files by the
+// range instead of cascading row by row, see delSubtree(). The tables are
+// copied, SQLite can't drop constraints, and only reachable files are kept.
+void DbOwner::migrateRoots()
+{
+    constexpr const char * const szSQL =
+    "CREATE TEMP TABLE file_roots(id INTEGER PRIMARY KEY, root_id INTEGER);"
+    "INSERT INTO file_roots"
+    " WITH RECURSIVE tree(id, root_id) AS ("
+    "  SELECT id, id FROM files WHERE parent_id IS NULL"
+    "  UNION ALL"
+    "  SELECT f.id, t.root_id FROM files f JOIN tree t ON f.parent_id = t.id)"
+    " SELECT id, root_id FROM tree;"
+    "CREATE TABLE files_v5("
+        "id INTEGER PRIMARY KEY ASC,"
+        "parent_id INTEGER,"
+        "write_time DATETIME,"
+        "is_dir BOOLEAN,"
+        "name TEXT,"
+        "sort_key BLOB,"
+        "size INTEGER DEFAULT 0,"
+        "digest INTEGER DEFAULT 0,"
+        "file_count INTEGER DEFAULT 0,"
+        "total_size INTEGER DEFAULT 0,"
+        "duration INTEGER DEFAULT 0,"
+        // NULL for the roots themselves
+        "root_id INTEGER"
+        ");"
+    "INSERT INTO files_v5"
+    " SELECT f.id, f.parent_id, f.write_time, f.is_dir, f.name, f.sort_key,"
+    " f.size, f.digest, f.file_count, f.total_size, f.duration,"
+    " NULLIF(r.root_id, f.id)"
+    " FROM files f JOIN file_roots r ON r.id = f.id;"
+    "DROP TABLE file_roots;"
+    "DROP TABLE files;"
+    "ALTER TABLE files_v5 RENAME TO files;"
+    "CREATE INDEX files_sorted ON files(parent_id, sort_key);"
+    "CREATE INDEX files_dir_size ON files(total_size) WHERE is_dir;"
+    "CREATE INDEX files_subtree ON files(root_id, name, is_dir);"
+    "CREATE TABLE dir_schedule_v5("
+        "dir_id INTEGER PRIMARY KEY,"
+        "next_check DATETIME,"
+        "interval INTEGER,"
+        "changes INTEGER,"
+        "last_change DATETIME"
+        ");"
+    "INSERT INTO dir_schedule_v5 SELECT * FROM dir_schedule"
+    " WHERE dir_id IN (SELECT id FROM files);"
+    "DROP TABLE dir_schedule;"
+    "ALTER TABLE dir_schedule_v5 RENAME TO dir_schedule;"
+    // its triggers are dropped along, the constructor creates them again
+    "CREATE TABLE tracks_v5("
+        "file_id INTEGER PRIMARY KEY,"
+        "write_time DATETIME,"
+        "title TEXT,"
+        "artist_id INTEGER,"
+        "album_id INTEGER,"
+        "genre TEXT,"
+        "year INTEGER,"
+        "track_no INTEGER,"
+        "duration INTEGER,"
+        "FOREIGN KEY(artist_id) REFERENCES artists(id),"
+        "FOREIGN KEY(album_id) REFERENCES albums(id)"
+        ");"
+    "INSERT INTO tracks_v5 SELECT * FROM tracks"
+    " WHERE file_id IN (SELECT id FROM files);"
+    "DROP TABLE tracks;"
+    "ALTER TABLE tracks_v5 RENAME TO tracks;"
+    "CREATE INDEX tracks_artist ON tracks(artist_id);"
+    "CREATE INDEX tracks_album ON tracks(album_id);"
+    "CREATE INDEX tracks_genre ON tracks(genre);"
+    "CREATE INDEX tracks_year ON tracks(year);"
+    "CREATE TABLE trigrams_v5("
+        "tri INTEGER,"
+        "file_id INTEGER,"
+        "PRIMARY KEY(tri, file_id)"
+        ") WITHOUT ROWID;"
+    "INSERT INTO trigrams_v5 SELECT tri, file_id FROM trigrams"
+    " WHERE file_id IN (SELECT id FROM files);"
+    "DROP TABLE trigrams;"
+    "ALTER TABLE trigrams_v5 RENAME TO trigrams;"
+    "CREATE INDEX trigrams_file ON trigrams(file_id);";
+    
+    CHECK_SQLITE(sqlite3_exec(pDb_, szSQL, nullptr, nullptr, nullptr));
+}
+
+
+void DbOwner::changedAllDirs()
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::ALL_DIR_IDS);
+    int res;
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        dirtyDirs_.insert(sqlite3_column_int64(pStmt, 0));
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+}
+
+
+// fills tag_groups of tracks stored before the groups were introduced
+void DbOwner::rebuildTagGroups()
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::NEEDS_TAG_GROUPS);
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    bool const needed = sqlite3_column_int(pStmt, 0) != 0;
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    if (!needed)
+    {
+        return;
+    }
+    
+    std::clog << "Building tag groups" << std::endl;
+    
+    constexpr const char * const szSQL =
+    "BEGIN TRANSACTION;"
+    "INSERT INTO tag_groups (mode, parent_id, group_key, name, count)"
+        " SELECT 0, 0, t.artist_id, ar.name, COUNT(*)"
+        " FROM tracks t JOIN artists ar ON ar.id = t.artist_id"
+        " GROUP BY t.artist_id;"
+    "INSERT INTO tag_groups (mode, parent_id, group_key, name, count)"
+        " SELECT 1, 0, al.artist_id, ar.name, COUNT(*)"
+        " FROM tracks t JOIN albums al ON al.id = t.album_id"
+        " JOIN artists ar ON ar.id = al.artist_id"
+        " GROUP BY al.artist_id;"
+    "INSERT INTO tag_groups (mode, parent_id, group_key, name, count)"
+        " SELECT 1, g.id, t.album_id, al.title, COUNT(*)"
+        " FROM tracks t JOIN albums al ON al.id = t.album_id"
+        " JOIN tag_groups g ON g.mode = 1 AND g.parent_id = 0"
+          " AND g.group_key = al.artist_id"
+        " GROUP BY t.album_id;"
+    "INSERT INTO tag_groups (mode, parent_id, group_key, name, count)"
+        " SELECT 2, 0, genre, genre, COUNT(*) FROM tracks GROUP BY genre;"
+    "INSERT INTO tag_groups (mode, parent_id, group_key, name, count)"
+        " SELECT 3, 0, year, CASE WHEN year > 0 THEN year ELSE '' END, COUNT(*)"
+        " FROM tracks GROUP BY year;"
+    "UPDATE tag_groups SET sort_key = sort_key(name);"
+    "COMMIT TRANSACTION;";
+    
+    res = sqlite3_exec(pDb_, szSQL, nullptr, nullptr, nullptr);
+    
+    if (res != SQLITE_OK)
+    {
+        sqlite3_exec(pDb_, "ROLLBACK TRANSACTION", nullptr, nullptr, nullptr);
+        throw DbException(res);
+    }
+}
+
+
+// indexes files stored before the search index was introduced
+void DbOwner::rebuildSearchIndex()
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::NEEDS_SEARCH_INDEX);
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    bool const needed = sqlite3_column_int(pStmt, 0) != 0;
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    if (!needed)
+    {
+        return;
+    }
+    
+    std::clog << "Building search index" << std::endl;
+    
+    std::vector<std::pair<RecordID, TrackTags>> files;
+    std::vector<std::string> fileNames;
+    pStmt = statements_.get(Statement::FILE_TEXTS);
+    
+    auto const column = [&pStmt](int col)
+    {
+        auto const * pText = sqlite3_column_text(pStmt, col);
+        return pText ? std::string(reinterpret_cast<const char*>(pText)) : 
+                       std::string();
+    };
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        TrackTags tags;
+        
+        tags.title = column(2);
+        tags.artist = column(3);
+        tags.album = column(4);
+        
+        files.emplace_back(sqlite3_column_int64(pStmt, 0), std::move(tags));
+        fileNames.push_back(column(1));
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    beginTransaction();
+    
+    try
+    {
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            checkCancelled();
+            indexFile(files[i].first, fileNames[i], files[i].second);
+        }
+    }
+    catch(...)
+    {
+        rollback();
+        throw;
+    }
+    
+    commit();
+}
+
+
+RecordID DbOwner::addFile(const FileInfo& record)
+{
+    return addFile(RecordView(NULL_RECORD_ID, record));
+}
+
+
+RecordID DbOwner::addFile(const RecordView& record)
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::INSERT_FILE);
+    
+    if (record.parentID != NULL_RECORD_ID)
+    {
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, record.parentID));
+    }
+    else
+    {
+        CHECK_SQLITE(sqlite3_bind_null(pStmt, 1));
+    }
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, record.lastWriteTime));
+    CHECK_SQLITE(sqlite3_bind_int(pStmt, 3, record.isDir ? 1 : 0));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 4, 
+       record.fileName.data(), record.fileName.length(), SQLITE_TRANSIENT));
+    
+    std::string const key = sortKey(baseName(record.fileName));
+    CHECK_SQLITE(sqlite3_bind_blob(pStmt, 5, 
+       key.data(), key.size(), SQLITE_TRANSIENT));
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 6, record.size));
+    
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    changed(record.parentID);
+    return sqlite3_last_insert_rowid(pDb_);
+}
+
+
+// the subtree of a directory goes first as a range of paths
+RecordID DbOwner::delFile(RecordID id)
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::FILE_TO_DELETE);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    auto res = sqlite3_blocking_step(pStmt);
+    std::optional<Subtree> subtree;
+    RecordID parentId = NULL_RECORD_ID;
+    
+    if (res == SQLITE_ROW)
+    {
+        parentId = sqlite3_column_int64(pStmt, 0);
+        changed(parentId);
+        auto const * pName = sqlite3_column_text(pStmt, 2);
+        
+        if (sqlite3_column_int(pStmt, 1) && pName)
+        {
+            subtree = Subtree{ sqlite3_column_int64(pStmt, 3), 
+                    subtreeRange(reinterpret_cast<const char*>(pName)) };
+        }
+    }
+    else if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    if (subtree)
+    {
+        delSubtree(*subtree);
+    }
+    
+    // the trigrams of the file have a statement of their own
+    for (Statement stmt : { Statement::DELETE_FILE_TRACK, Statement::DELETE_TRIGRAMS, 
+            Statement::DELETE_FILE_SCHEDULE, Statement::DELETE_FILE })
+    {
+        pStmt = statements_.get(stmt);
+        
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+        res = sqlite3_blocking_step(pStmt);
+        
+        if (res != SQLITE_DONE)
+        {
+            throw DbException(res);
+        }
+    }
+    
+    return parentId;
+}
+
+
+// the rows of the files in the range first, while they can be found by it
+void DbOwner::delSubtree(const Subtree& subtree)
+{
+    auto const& range = subtree.range;
+    
+    for (Statement stmt : { Statement::DELETE_SUBTREE_TRACKS, 
+            Statement::DELETE_SUBTREE_TRIGRAMS, Statement::DELETE_SUBTREE_SCHEDULES, 
+            Statement::DELETE_SUBTREE })
+    {
+        sqlite3_stmt * pStmt = statements_.get(stmt);
+        
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, subtree.rootId));
+        CHECK_SQLITE(sqlite3_bind_text(pStmt, 2, 
+           range.first.c_str(), range.first.length(), SQLITE_TRANSIENT));
+        CHECK_SQLITE(sqlite3_bind_text(pStmt, 3, 
+           range.second.c_str(), range.second.length(), SQLITE_TRANSIENT));
+        auto res = sqlite3_blocking_step(pStmt);
+        
+        if (res != SQLITE_DONE)
+        {
+            throw DbException(res);
+        }
+    }
+}
+
+
+void DbOwner::replaceFile(RecordID id, const FileInfo& record)
+{
+    replaceFile(RecordView(id, record));
+}
+
+
+void DbOwner::replaceFile(const RecordView& record)
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::UPDATE_FILE);
+    
+    if (record.parentID != NULL_RECORD_ID)
+    {
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, record.parentID));
+    }
+    else
+    {
         CHECK_SQLITE(sqlite3_bind_null(pStmt, 1));
     }
     
     CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, record.lastWriteTime));
     CHECK_SQLITE(sqlite3_bind_int(pStmt, 3, record.isDir ? 1 : 0));
     CHECK_SQLITE(sqlite3_bind_text(pStmt, 4, 
-       record.fileName.c_str(), record.fileName.length(), SQLITE_TRANSIENT));
-    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 5, id));
+       record.fileName.data(), record.fileName.length(), SQLITE_TRANSIENT));
+    
+    std::string const key = sortKey(baseName(record.fileName));
+    CHECK_SQLITE(sqlite3_bind_blob(pStmt, 5, 
+       key.data(), key.size(), SQLITE_TRANSIENT));
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 6, record.size));
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 7, record.id));
     
     auto res = sqlite3_blocking_step(pStmt);
     
@@ -131,163 +1355,1176 @@ void DbOwner::replaceFile(RecordID id, const FileInfo& record)
     {
         throw DbException(res);
     }
+    
+    changed(record.parentID);
 }
     
 
-void DbOwner::beginTransaction()
+void DbOwner::setDirSchedule(RecordID id, const DirSchedule& schedule)
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::SET_DIR_SCHEDULE);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, schedule.nextCheck));
+    CHECK_SQLITE(sqlite3_bind_int(pStmt, 3, schedule.intervalSec));
+    CHECK_SQLITE(sqlite3_bind_int(pStmt, 4, schedule.changeCount));
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 5, schedule.lastChange));
+    
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+}
+
+
+void DbOwner::setTrack(
+        RecordID id, std::time_t writeTime, const TrackTags& tags)
+{
+    // unknown names are stored as empty ones, so every track has an album
+    RecordID const artistId = artistID(tags.artist);
+    RecordID const albumArtistId = tags.albumArtist.empty() || 
+            tags.albumArtist == tags.artist ? 
+                artistId : artistID(tags.albumArtist);
+    RecordID const albumId = albumID(albumArtistId, tags.album);
+    
+    auto const bindAndStep = [&](sqlite3_stmt * pStmt)
+    {
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, writeTime));
+        CHECK_SQLITE(sqlite3_bind_text(pStmt, 2, 
+           tags.title.c_str(), tags.title.length(), SQLITE_TRANSIENT));
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 3, artistId));
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 4, albumId));
+        CHECK_SQLITE(sqlite3_bind_text(pStmt, 5, 
+           tags.genre.c_str(), tags.genre.length(), SQLITE_TRANSIENT));
+        CHECK_SQLITE(sqlite3_bind_int(pStmt, 6, tags.year));
+        CHECK_SQLITE(sqlite3_bind_int(pStmt, 7, tags.trackNo));
+        CHECK_SQLITE(sqlite3_bind_int(pStmt, 8, tags.durationSec));
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 9, id));
+        
+        auto res = sqlite3_blocking_step(pStmt);
+        
+        if (res != SQLITE_DONE)
+        {
+            throw DbException(res);
+        }
+    };
+    
+    // updated in place rather than replaced, so that the group triggers see
+    // the old and new values of the row
+    bindAndStep(statements_.get(Statement::UPDATE_TRACK));
+    
+    if (sqlite3_changes(pDb_) == 0)
+    {
+        bindAndStep(statements_.get(Statement::INSERT_TRACK));
+    }
+    
+    // the duration is part of the totals of the directory
+    sqlite3_stmt * pStmt = statements_.get(Statement::FILE_PARENT);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    auto const res = sqlite3_blocking_step(pStmt);
+    
+    if (res == SQLITE_ROW)
+    {
+        changed(sqlite3_column_int64(pStmt, 0));
+    }
+    else if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+}
+
+
+void DbOwner::indexFile(
+        RecordID id, std::string_view fileName, const TrackTags& tags)
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::DELETE_TRIGRAMS);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    std::string const text = searchText(
+            fileName, tags.title, tags.artist, tags.album);
+    
+    for (int tri : trigrams(text))
+    {
+        pStmt = statements_.get(Statement::INSERT_TRIGRAM);
+        
+        CHECK_SQLITE(sqlite3_bind_int(pStmt, 1, tri));
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, id));
+        res = sqlite3_blocking_step(pStmt);
+        
+        if (res != SQLITE_DONE)
+        {
+            throw DbException(res);
+        }
+    }
+}
+
+
+RecordID DbOwner::artistID(const std::string& name)
 {
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, "BEGIN TRANSACTION");
+    sqlite3_stmt * pStmt = statements_.get(Statement::INSERT_ARTIST);
+    
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 1, 
+       name.c_str(), name.length(), SQLITE_TRANSIENT));
+    
     auto res = sqlite3_blocking_step(pStmt);
     
     if (res != SQLITE_DONE)
     {
         throw DbException(res);
     }
+    
+    if (sqlite3_changes(pDb_) > 0)
+    {
+        return sqlite3_last_insert_rowid(pDb_);
+    }
+    
+    pStmt = statements_.get(Statement::ARTIST_ID);
+    
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 1, 
+       name.c_str(), name.length(), SQLITE_TRANSIENT));
+    
+    res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    RecordID const id = sqlite3_column_int64(pStmt, 0);
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return id;
+}
+
+
+RecordID DbOwner::albumID(RecordID artistId, const std::string& title)
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::INSERT_ALBUM);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, artistId));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 2, 
+       title.c_str(), title.length(), SQLITE_TRANSIENT));
+    
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    if (sqlite3_changes(pDb_) > 0)
+    {
+        return sqlite3_last_insert_rowid(pDb_);
+    }
+    
+    pStmt = statements_.get(Statement::ALBUM_ID);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, artistId));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 2, 
+       title.c_str(), title.length(), SQLITE_TRANSIENT));
+    
+    res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    RecordID const id = sqlite3_column_int64(pStmt, 0);
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return id;
+}
+
+
+void DbOwner::beginTransaction()
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::BEGIN);
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+}
+
+
+void DbOwner::commit()
+{
+    try
+    { // those a failed commit left stale first
+        sqlite3_stmt * pStmt = statements_.get(Statement::STALE_DIRS);
+        int res;
+        
+        while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+        {
+            dirtyDirs_.insert(sqlite3_column_int64(pStmt, 0));
+        }
+        
+        if (res != SQLITE_DONE)
+        {
+            throw DbException(res);
+        }
+        
+        CHECK_SQLITE(sqlite3_reset(pStmt));
+        stepDone(statements_.get(Statement::SAVEPOINT_DIRS));
+        stepDone(statements_.get(Statement::CLEAR_STALE_DIRS));
+        updateDirs();
+        stepDone(statements_.get(Statement::RELEASE_DIRS));
+    }
+    catch(const std::exception& ex)
+    { // the totals updated so far are undone and the directories marked, 
+      // the rest of the transaction is still worth keeping
+        std::cerr << "Failed to update directory totals: " << ex.what() 
+                << std::endl;
+        
+        if (!markStaleDirs())
+        {
+            rollback();
+            return;
+        }
+    }
+    
+    dirtyDirs_.clear();
+    sqlite3_stmt * pStmt = statements_.get(Statement::COMMIT);
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        std::cerr << "Failed to commit transaction";
+    }
+}
+
+
+// after updateDirs() failed within the savepoint, for the next commit or
+// start to recompute
+bool DbOwner::markStaleDirs()
+{
+    try
+    {
+        stepDone(statements_.get(Statement::ROLLBACK_DIRS));
+        stepDone(statements_.get(Statement::RELEASE_DIRS));
+        
+        for (RecordID id : dirtyDirs_)
+        {
+            sqlite3_stmt * pStmt = statements_.get(Statement::ADD_STALE_DIR);
+            
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+            auto const res = sqlite3_blocking_step(pStmt);
+            
+            if (res != SQLITE_DONE)
+            {
+                throw DbException(res);
+            }
+        }
+        
+        return true;
+    }
+    catch(const std::exception& ex)
+    {
+        std::cerr << "Failed to mark directories stale: " << ex.what() 
+                << std::endl;
+        return false;
+    }
+}
+
+    
+void DbOwner::rollback()
+{
+    dirtyDirs_.clear();
+    sqlite3_stmt * pStmt = statements_.get(Statement::ROLLBACK);
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res != SQLITE_DONE)
+    {
+        std::cerr << "Failed to rollback transaction";
+    }
+}
+    
+    
+void DbOwner::changed(RecordID dirId)
+{
+    if (dirId != NULL_RECORD_ID)
+    {
+        dirtyDirs_.insert(dirId);
+    }
+}
+
+
+// sums up the children of changed directories, deepest first, so that
+// each of them and their ancestors is read and written once per transaction
+void DbOwner::updateDirs()
+{
+    std::map<int, RecordIDs, std::greater<int>> byDepth;
+    
+    for (RecordID id : dirtyDirs_)
+    {
+        sqlite3_stmt * pStmt = statements_.get(Statement::DIR_DEPTH);
+        
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+        auto const res = sqlite3_blocking_step(pStmt);
+        
+        if (res != SQLITE_ROW)
+        {
+            throw DbException(res);
+        }
+        
+        int const depth = sqlite3_column_int(pStmt, 0);
+        CHECK_SQLITE(sqlite3_reset(pStmt));
+        
+        if (depth > 0) // deleted otherwise
+        {
+            byDepth[depth].insert(id);
+        }
+    }
+    
+    while (!byDepth.empty())
+    {
+        int const depth = byDepth.begin()->first;
+        RecordIDs const ids = std::move(byDepth.begin()->second);
+        byDepth.erase(byDepth.begin());
+        
+        for (RecordID id : ids)
+        {
+            sqlite3_stmt * pStmt = statements_.get(Statement::DIR_CHILDREN);
+            uint64_t digest = 0;
+            uint64_t fileCount = 0;
+            uint64_t totalSize = 0;
+            uint64_t duration = 0;
+            int res;
+            
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+            
+            while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+            { // a sum doesn't depend on the order of the children
+                auto const * pName = sqlite3_column_text(pStmt, 0);
+                
+                digest += entryDigest(
+                        pName ? reinterpret_cast<const char*>(pName) : "",
+                        sqlite3_column_int64(pStmt, 1),
+                        sqlite3_column_int64(pStmt, 2),
+                        sqlite3_column_int64(pStmt, 3));
+                
+                if (sqlite3_column_int(pStmt, 4))
+                {
+                    fileCount += sqlite3_column_int64(pStmt, 5);
+                    totalSize += sqlite3_column_int64(pStmt, 6);
+                    duration += sqlite3_column_int64(pStmt, 7);
+                }
+                else
+                { // NULL without tags, read as 0
+                    fileCount += 1;
+                    totalSize += sqlite3_column_int64(pStmt, 2);
+                    duration += sqlite3_column_int64(pStmt, 8);
+                }
+            }
+            
+            if (res != SQLITE_DONE)
+            {
+                throw DbException(res);
+            }
+            
+            CHECK_SQLITE(sqlite3_reset(pStmt));
+            
+            pStmt = statements_.get(Statement::DIR_TOTALS);
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+            res = sqlite3_blocking_step(pStmt);
+            
+            if (res != SQLITE_ROW)
+            {
+                throw DbException(res);
+            }
+            
+            RecordID const parentId = sqlite3_column_int64(pStmt, 0);
+            bool const same = 
+                    digest == uint64_t(sqlite3_column_int64(pStmt, 1)) &&
+                    fileCount == uint64_t(sqlite3_column_int64(pStmt, 2)) &&
+                    totalSize == uint64_t(sqlite3_column_int64(pStmt, 3)) &&
+                    duration == uint64_t(sqlite3_column_int64(pStmt, 4));
+            CHECK_SQLITE(sqlite3_reset(pStmt));
+            
+            if (same)
+            {
+                continue; // the ancestors stay as they are
+            }
+            
+            pStmt = statements_.get(Statement::SET_DIR_TOTALS);
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, digest));
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, fileCount));
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 3, totalSize));
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 4, duration));
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, 5, id));
+            res = sqlite3_blocking_step(pStmt);
+            
+            if (res != SQLITE_DONE)
+            {
+                throw DbException(res);
+            }
+            
+            if (parentId != NULL_RECORD_ID)
+            {
+                byDepth[depth - 1].insert(parentId);
+            }
+        }
+    }
+}
+    
+    
+DbReader DbOwner::createReader()
+{
+    sqlite3* pDb = nullptr;
+    
+    auto res = sqlite3_open_v2(
+        fileName_.c_str(), &pDb, SQLITE_OPEN_READONLY, nullptr);
+    
+    DbReader reader(pDb);
+    
+    if (res != SQLITE_OK)
+    {
+        std::clog << "Failed to open read-only database at " << fileName_ << std::endl;
+        throw DbException(res);
+    }
+    
+    reader.statements_.prepareAll(false);
+    return reader;
+}
+
+
+// --- DbReader ----------------------------------------------------------------
+
+DbReader::DbReader(sqlite3* pDb) 
+    : pDb_(pDb)
+    , statements_(pDb)
+{
+}
+
+
+DbReader::DbReader(DbReader&& other)
+    : pDb_(other.pDb_)
+    , statements_(std::move(other.statements_))
+    , pFileCache_(std::move(other.pFileCache_))
+{
+    other.pDb_ = nullptr;
+}
+
+
+DbReader::~DbReader()
+{
+    close();
+}
+
+
+void DbReader::close()
+{
+    if (!pDb_)
+    {
+        return;
+    }
+    
+    statements_.clear();
+
+    auto res = sqlite3_close_v2(pDb_);
+
+    pDb_ = nullptr;
+
+    if (res != SQLITE_OK)
+    {
+        std::clog << "Database closed with error: " << sqlite3_errstr(res) 
+                << std::endl;
+    }
+}
+
+
+FileInfo DbReader::getFile(RecordID id) const
+{
+    if (!pFileCache_)
+    {
+        return readFile(id);
+    }
+    
+    FileCache& cache = *pFileCache_;
+    auto const itCached = cache.byId.find(id);
+    
+    if (itCached != cache.byId.end())
+    {
+        ++cache.stats.hits;
+        cache.records.splice(cache.records.begin(), cache.records, 
+                itCached->second);
+        return itCached->second->second;
+    }
+    
+    ++cache.stats.misses;
+    FileInfo rec = readFile(id);
+    
+    if (rec.parentID != NULL_RECORD_ID && !cache.parents.count(rec.parentID))
+    {
+        linkAncestors(rec.parentID);
+    }
+    
+    cache.link(id, rec.parentID);
+    cache.records.emplace_front(id, rec);
+    cache.byId[id] = cache.records.begin();
+    
+    if (cache.records.size() > cache.capacity)
+    {
+        cache.erase(cache.records.back().first);
+    }
+    
+    if (cache.parents.size() >= cache.pruneAt)
+    {
+        cache.prune();
+    }
+    
+    return rec;
+}
+
+
+void DbReader::enableFileCache(size_t capacity)
+{
+    pFileCache_.reset(new FileCache());
+    pFileCache_->capacity = std::max<size_t>(capacity, 1);
+    pFileCache_->pruneAt = 2 * pFileCache_->capacity;
+}
+
+
+void DbReader::invalidate(RecordID id, RecordID parentId)
+{
+    if (!pFileCache_)
+    {
+        return;
+    }
+    
+    FileCache& cache = *pFileCache_;
+    size_t const before = cache.records.size();
+    
+    if (parentId != NULL_RECORD_ID)
+    { // its id may be one a deleted record had
+        if (!cache.parents.count(parentId))
+        {
+            linkAncestors(parentId);
+        }
+        
+        cache.link(id, parentId);
+    }
+    else if (!cache.parents.count(id))
+    {
+        linkAncestors(id);
+    }
+    
+    std::vector<RecordID> below{ id };
+    
+    while (!below.empty())
+    {
+        RecordID const belowId = below.back();
+        below.pop_back();
+        cache.erase(belowId);
+        
+        auto const itChildren = cache.children.find(belowId);
+        
+        if (itChildren != cache.children.end())
+        {
+            below.insert(below.end(), 
+                    itChildren->second.begin(), itChildren->second.end());
+        }
+    }
+    
+    auto itParent = cache.parents.find(id);
+    
+    while (itParent != cache.parents.end() && itParent->second != NULL_RECORD_ID)
+    {
+        cache.erase(itParent->second);
+        itParent = cache.parents.find(itParent->second);
+    }
+    
+    if (cache.parents.size() >= cache.pruneAt)
+    {
+        cache.prune();
+    }
+    
+    cache.stats.invalidated += before - cache.records.size();
+}
+
+
+void DbReader::linkAncestors(RecordID id) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::ANCESTORS);
+    int res;
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        pFileCache_->link(sqlite3_column_int64(pStmt, 0), 
+                sqlite3_column_int64(pStmt, 1));
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+}
+
+
+FileCacheStats DbReader::fileCacheStats() const
+{
+    return pFileCache_ ? pFileCache_->stats : FileCacheStats();
+}
+
+
+std::vector<StatementStats> DbReader::statementStats() const
+{
+    return statements_.stats();
+}
+
+
+void DbReader::FileCache::erase(RecordID id)
+{
+    auto const itCached = byId.find(id);
+    
+    if (itCached != byId.end())
+    {
+        records.erase(itCached->second);
+        byId.erase(itCached);
+    }
+}
+
+
+void DbReader::FileCache::link(RecordID id, RecordID parentId)
+{
+    auto const itParent = parents.find(id);
+    
+    if (itParent != parents.end())
+    {
+        if (itParent->second == parentId)
+        {
+            return;
+        }
+        
+        children[itParent->second].erase(id);
+    }
+    
+    parents[id] = parentId;
+    children[parentId].insert(id);
+}
+
+
+void DbReader::FileCache::prune()
+{
+    std::vector<RecordID> unused;
+    
+    for (const auto& idParent : parents)
+    {
+        auto const itChildren = children.find(idParent.first);
+        
+        if (!byId.count(idParent.first) && 
+                (itChildren == children.end() || itChildren->second.empty()))
+        {
+            unused.push_back(idParent.first);
+        }
+    }
+    
+    while (!unused.empty())
+    { // leaves first, then the directories left without children
+        RecordID const id = unused.back();
+        unused.pop_back();
+        children.erase(id);
+        
+        auto const itParent = parents.find(id);
+        RecordID const parentId = itParent->second;
+        parents.erase(itParent);
+        
+        RecordIDs& siblings = children[parentId];
+        siblings.erase(id);
+        
+        if (siblings.empty() && !byId.count(parentId) && parents.count(parentId))
+        {
+            unused.push_back(parentId);
+        }
+    }
+    
+    pruneAt = std::max(2 * parents.size(), 2 * capacity);
+}
+
+
+FileInfo DbReader::readFile(RecordID id) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::FILE_BY_ID);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res == SQLITE_DONE)
+    {
+        throw std::out_of_range("No such file record");
+    }
+    else if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    FileInfo rec;
+    
+    rec.parentID = sqlite3_column_int64(pStmt, 0);
+    rec.lastWriteTime = sqlite3_column_int64(pStmt, 1);
+    rec.isDir = sqlite3_column_int(pStmt, 2) != 0;
+    auto const * pFileName = sqlite3_column_text(pStmt, 3);
+    
+    if (pFileName)
+    {
+        rec.fileName = reinterpret_cast<const char*>(pFileName);
+    }
+    
+    rec.sortKey = columnBlob(pStmt, 4);
+    rec.size = sqlite3_column_int64(pStmt, 5);
+    rec.digest = sqlite3_column_int64(pStmt, 6);
+    rec.fileCount = sqlite3_column_int64(pStmt, 7);
+    rec.totalSize = sqlite3_column_int64(pStmt, 8);
+    rec.durationSec = sqlite3_column_int64(pStmt, 9);
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return rec;
+}
+
+
+FileRecords DbReader::getFiles(const std::vector<RecordID>& ids) const
+{
+    FileRecords result;
+    result.reserve(ids.size());
+    
+    for (size_t from = 0; from < ids.size(); from += ID_CHUNK)
+    {
+        sqlite3_stmt * pStmt = statements_.get(Statement::FILES_BY_IDS);
+        size_t const count = std::min(ID_CHUNK, ids.size() - from);
+        
+        CHECK_SQLITE(sqlite3_clear_bindings(pStmt));
+        
+        for (size_t i = 0; i < count; ++i)
+        {
+            CHECK_SQLITE(sqlite3_bind_int64(pStmt, i + 1, ids[from + i]));
+        }
+        
+        while (auto rec = readNextRecord(pStmt))
+        {
+            result.push_back(std::move(*rec));
+        }
+    }
+    
+    return result;
+}
+
+
+FileRecords DbReader::childrenFiles(RecordID id) const
+{
+    FileRecords result;
+    
+    forEachChild(id, [&result](const RecordView& rec)
+    {
+        result.push_back(rec.toRecord());
+    });
+    
+    return result;
+}   
+
+
+void DbReader::forEachChild(RecordID id, const RecordVisitor& visit) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::CHILDREN);
+    
+    if (id)
+    {
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+    }
+    else
+    {
+        CHECK_SQLITE(sqlite3_bind_null(pStmt, 1));
+    }
+    
+    visitRecords(pStmt, visit);
+}
+
+
+FileRecords DbReader::dirs() const
+{
+    FileRecords result;
+    
+    forEachDir([&result](const RecordView& rec)
+    {
+        result.push_back(rec.toRecord());
+    });
+    
+    return result;
+}
+
+
+void DbReader::forEachDir(const RecordVisitor& visit) const
+{
+    visitRecords(statements_.get(Statement::DIRS), visit);
+}
+
+
+DirSchedules DbReader::dirSchedules() const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::DIR_SCHEDULES);
+    
+    DirSchedules result;
+    int res;
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        DirSchedule schedule;
+        
+        schedule.nextCheck = sqlite3_column_int64(pStmt, 1);
+        schedule.intervalSec = sqlite3_column_int(pStmt, 2);
+        schedule.changeCount = sqlite3_column_int(pStmt, 3);
+        schedule.lastChange = sqlite3_column_int64(pStmt, 4);
+        
+        result.emplace_back(sqlite3_column_int64(pStmt, 0), schedule);
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return result;
+}
+
+
+FileRecords DbReader::staleTracks(RecordID afterId, int limit) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::STALE_TRACKS);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, afterId));
+    CHECK_SQLITE(sqlite3_bind_int(pStmt, 2, limit));
+    
+    FileRecords result;
+    
+    while (auto rec = readNextRecord(pStmt))
+    {
+        result.push_back(std::move(*rec));
+    }
+    
+    return result;
+}
+
+
+TagGroups DbReader::tagGroups(GroupMode mode, RecordID parentId) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::TAG_GROUPS);
+    
+    CHECK_SQLITE(sqlite3_bind_int(pStmt, 1, static_cast<int>(mode)));
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, parentId));
+    
+    TagGroups result;
+    int res;
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        TagGroup group;
+        
+        group.id = sqlite3_column_int64(pStmt, 0);
+        auto const * pName = sqlite3_column_text(pStmt, 1);
+        
+        if (pName)
+        {
+            group.name = reinterpret_cast<const char*>(pName);
+        }
+        
+        group.count = sqlite3_column_int(pStmt, 2);
+        group.sortKey = columnBlob(pStmt, 3);
+        result.push_back(std::move(group));
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return result;
+}
+
+
+TrackRecords DbReader::groupTracks(RecordID groupId) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::GROUP_OF);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, groupId));
+    auto res = sqlite3_blocking_step(pStmt);
+    
+    if (res == SQLITE_DONE)
+    {
+        return TrackRecords(); // deleted meanwhile
+    }
+    else if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    auto const mode = static_cast<GroupMode>(sqlite3_column_int(pStmt, 0));
+    bool const isTopLevel = sqlite3_column_int64(pStmt, 1) == NULL_RECORD_ID;
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    switch (mode)
+    {
+    case GroupMode::ARTIST:
+        pStmt = statements_.get(Statement::ARTIST_TRACKS);
+        break;
+        
+    case GroupMode::ALBUM:
+        if (isTopLevel)
+        {
+            pStmt = statements_.get(Statement::ARTIST_ALBUM_TRACKS);
+        }
+        else
+        {
+            pStmt = statements_.get(Statement::ALBUM_TRACKS);
+        }
+        break;
+        
+    case GroupMode::GENRE:
+        pStmt = statements_.get(Statement::GENRE_TRACKS);
+        break;
+        
+    case GroupMode::YEAR:
+        pStmt = statements_.get(Statement::YEAR_TRACKS);
+        break;
+    }
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, groupId));
+    
+    TrackRecords result;
+    
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        TrackRecord track;
+        
+        track.fileId = sqlite3_column_int64(pStmt, 0);
+        track.trackNo = sqlite3_column_int(pStmt, 1);
+        auto const * pTitle = sqlite3_column_text(pStmt, 2);
+        auto const * pFileName = sqlite3_column_text(pStmt, 3);
+        
+        if (pTitle)
+        {
+            track.title = reinterpret_cast<const char*>(pTitle);
+        }
+        
+        if (pFileName)
+        {
+            track.fileName = reinterpret_cast<const char*>(pFileName);
+        }
+        
+        result.push_back(std::move(track));
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return result;
+}
+
+
+FileRecords DbReader::differingDirs(RecordID dirId, 
+        const std::function<std::optional<uint64_t>(const std::string&)>& digestOf)
+        const
+{
+    FileRecords result;
+    std::vector<RecordID> queue{ dirId };
+    
+    while (!queue.empty())
+    {
+        RecordID const id = queue.back();
+        queue.pop_back();
+        
+        for (FileRecord& child : childrenFiles(id))
+        {
+            if (child.second.isDir && 
+                    digestOf(child.second.fileName) != child.second.digest)
+            {
+                queue.push_back(child.first);
+                result.push_back(std::move(child));
+            }
+        }
+    }
+    
+    return result;
+}
+
+
+std::optional<DbReader::Subtree> DbReader::subtreeOf(RecordID dirId) const
+{
+    sqlite3_stmt * pStmt = statements_.get(Statement::DIR_NAME);
+    
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, dirId));
+    auto const res = sqlite3_blocking_step(pStmt);
+    
+    if (res == SQLITE_DONE)
+    {
+        CHECK_SQLITE(sqlite3_reset(pStmt));
+        return std::nullopt;
+    }
+    else if (res != SQLITE_ROW)
+    {
+        throw DbException(res);
+    }
+    
+    auto const * pName = sqlite3_column_text(pStmt, 0);
+    std::string const name = pName ? reinterpret_cast<const char*>(pName) : "";
+    RecordID const rootId = sqlite3_column_int64(pStmt, 1);
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    return Subtree{ rootId, subtreeRange(name) };
 }
 
 
-void DbOwner::commit()
+// the rows come as a range of paths and are put in display order here
+std::vector<std::string> DbReader::subtreeFiles(RecordID dirId) const
 {
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, "COMMIT TRANSACTION");
-    auto res = sqlite3_blocking_step(pStmt);
-    
-    if (res != SQLITE_DONE)
+    struct Entry
     {
-        std::cerr << "Failed to commit transaction";
-    }
-}
-
+        RecordID    id;
+        bool        isDir;
+        std::string name;
+        std::string sortKey;
+    };
     
-void DbOwner::rollback()
-{
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, "ROLLBACK TRANSACTION");
-    auto res = sqlite3_blocking_step(pStmt);
+    auto const subtree = subtreeOf(dirId);
     
-    if (res != SQLITE_DONE)
+    if (!subtree)
     {
-        std::cerr << "Failed to rollback transaction";
+        return {};
     }
-}
     
+    auto const& range = subtree->range;
+    sqlite3_stmt * pStmt = statements_.get(Statement::SUBTREE_FILES);
     
-DbReader DbOwner::createReader()
-{
-    sqlite3* pDb = nullptr;
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, subtree->rootId));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 2, 
+       range.first.c_str(), range.first.length(), SQLITE_TRANSIENT));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 3, 
+       range.second.c_str(), range.second.length(), SQLITE_TRANSIENT));
     
-    auto res = sqlite3_open_v2(
-        fileName_.c_str(), &pDb, SQLITE_OPEN_READONLY, nullptr);
+    std::unordered_map<RecordID, std::vector<Entry>> children;
+    int res;
     
-    DbReader reader(pDb);
+    while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
+    {
+        auto const * pName = sqlite3_column_text(pStmt, 3);
+        
+        children[sqlite3_column_int64(pStmt, 1)].push_back(Entry{
+                sqlite3_column_int64(pStmt, 0),
+                sqlite3_column_int(pStmt, 2) != 0,
+                pName ? reinterpret_cast<const char*>(pName) : "",
+                columnBlob(pStmt, 4) });
+    }
     
-    if (res != SQLITE_OK)
+    if (res != SQLITE_DONE)
     {
-        std::clog << "Failed to open read-only database at " << fileName_ << std::endl;
         throw DbException(res);
     }
     
-    return reader;
-}
-
-
-// --- DbReader ----------------------------------------------------------------
-
-DbReader::DbReader(sqlite3* pDb) 
-    : pDb_(pDb)
-    , statements_(pDb)
-{
-}
-
-
-DbReader::DbReader(DbReader&& other)
-    : pDb_(other.pDb_)
-    , statements_(std::move(other.statements_))
-{
-    other.pDb_ = nullptr;
-}
-
-
-DbReader::~DbReader()
-{
-    close();
-}
-
-
-void DbReader::close()
-{
-    if (!pDb_)
+    CHECK_SQLITE(sqlite3_reset(pStmt));
+    
+    for (auto& siblings : children)
     {
-        return;
+        std::sort(siblings.second.begin(), siblings.second.end(), 
+            [](const Entry& left, const Entry& right)
+            {
+                return std::tie(left.sortKey, left.name) < 
+                        std::tie(right.sortKey, right.name);
+            });
     }
     
-    statements_.clear();
-
-    auto res = sqlite3_close_v2(pDb_);
-
-    pDb_ = nullptr;
-
-    if (res != SQLITE_OK)
+    // children of a directory are visited before its remaining siblings
+    std::vector<std::string> result;
+    std::vector<std::pair<const std::vector<Entry>*, size_t>> stack;
+    auto const itTop = children.find(dirId);
+    
+    if (itTop != children.end())
     {
-        std::clog << "Database closed with error: " << sqlite3_errstr(res) 
-                << std::endl;
+        stack.emplace_back(&itTop->second, 0);
+    }
+    
+    while (!stack.empty())
+    {
+        auto& top = stack.back();
+        
+        if (top.second == top.first->size())
+        {
+            stack.pop_back();
+            continue;
+        }
+        
+        Entry const& entry = (*top.first)[top.second++];
+        
+        if (!entry.isDir)
+        {
+            result.push_back(entry.name);
+        }
+        else
+        {
+            auto const itChildren = children.find(entry.id);
+            
+            if (itChildren != children.end())
+            {
+                stack.emplace_back(&itChildren->second, 0);
+            }
+        }
     }
+    
+    return result;
 }
 
 
-FileInfo DbReader::getFile(RecordID id) const
+size_t DbReader::countSubtreeFiles(RecordID dirId) const
 {
-    constexpr const char * const szSQL =
-       "SELECT parent_id, write_time, is_dir, name"
-       " FROM files WHERE id = :id";
-    
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, szSQL);
-    
-    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
-    auto res = sqlite3_blocking_step(pStmt);
+    auto const subtree = subtreeOf(dirId);
     
-    if (res == SQLITE_DONE)
-    {
-        throw std::out_of_range("No such file record");
-    }
-    else if (res != SQLITE_ROW)
+    if (!subtree)
     {
-        throw DbException(res);
+        return 0;
     }
     
-    FileInfo rec;
+    auto const& range = subtree->range;
+    sqlite3_stmt * pStmt = statements_.get(Statement::COUNT_SUBTREE_FILES);
     
-    rec.parentID = sqlite3_column_int64(pStmt, 0);
-    rec.lastWriteTime = sqlite3_column_int64(pStmt, 1);
-    rec.isDir = sqlite3_column_int(pStmt, 2) != 0;
-    auto const * pFileName = sqlite3_column_text(pStmt, 3);
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, subtree->rootId));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 2, 
+       range.first.c_str(), range.first.length(), SQLITE_TRANSIENT));
+    CHECK_SQLITE(sqlite3_bind_text(pStmt, 3, 
+       range.second.c_str(), range.second.length(), SQLITE_TRANSIENT));
+    auto const res = sqlite3_blocking_step(pStmt);
     
-    if (pFileName)
+    if (res != SQLITE_ROW)
     {
-        rec.fileName = reinterpret_cast<const char*>(pFileName);
+        throw DbException(res);
     }
     
+    size_t const count = sqlite3_column_int64(pStmt, 0);
     CHECK_SQLITE(sqlite3_reset(pStmt));
-    return rec;
+    return count;
 }
 
 
-FileRecords DbReader::childrenFiles(RecordID id) const
+FileRecords DbReader::largestDirs(size_t limit) const
 {
-    constexpr const char * const szSQL =
-       "SELECT id, parent_id, write_time, is_dir, name"
-       " FROM files"
-       " WHERE parent_id = :parent_id"
-         " OR (parent_id IS NULL AND :parent_id IS NULL)";
-    
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, szSQL);
+    sqlite3_stmt * pStmt = statements_.get(Statement::LARGEST_DIRS);
     
-    if (id)
-    {
-        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
-    }
-    else
-    {
-        CHECK_SQLITE(sqlite3_bind_null(pStmt, 1));
-    }
+    CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, limit));
     
     FileRecords result;
     
@@ -297,22 +2534,115 @@ FileRecords DbReader::childrenFiles(RecordID id) const
     }
     
     return result;
-}   
+}
 
 
-FileRecords DbReader::dirs() const
+FileRecords DbReader::search(const std::string& query, size_t limit,
+        const std::function<bool()>& isCancelled) const
 {
-    constexpr const char * const szSQL =
-       "SELECT id, parent_id, write_time, is_dir, name"
-       " FROM files WHERE is_dir";
+    std::string const needle = foldText(query);
+    std::vector<int> const tris = trigrams(needle);
+    FileRecords result;
     
-    sqlite3_stmt * pStmt = statements_.get(__LINE__, szSQL);
+    if (tris.empty())
+    {
+        return result;
+    }
     
-    FileRecords result;
+    // the first file id >= 'from' having trigram 'tri', 0 if none
+    auto const seek = [this](int tri, RecordID from) -> RecordID
+    {
+        sqlite3_stmt * pStmt = statements_.get(Statement::SEEK_TRIGRAM);
+        
+        CHECK_SQLITE(sqlite3_bind_int(pStmt, 1, tri));
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 2, from));
+        auto const res = sqlite3_blocking_step(pStmt);
+        
+        if (res == SQLITE_DONE)
+        {
+            return NULL_RECORD_ID;
+        }
+        else if (res != SQLITE_ROW)
+        {
+            throw DbException(res);
+        }
+        
+        return sqlite3_column_int64(pStmt, 0);
+    };
     
-    while (auto rec = readNextRecord(pStmt))
+    auto const column = [](sqlite3_stmt * pStmt, int col)
     {
-        result.push_back(std::move(*rec));
+        auto const * pText = sqlite3_column_text(pStmt, col);
+        return pText ? std::string(reinterpret_cast<const char*>(pText)) : 
+                       std::string();
+    };
+    
+    // candidates are checked against the text, trigrams may be apart
+    auto const verify = [&](RecordID id)
+    {
+        sqlite3_stmt * pStmt = statements_.get(Statement::FILE_TEXT);
+        
+        CHECK_SQLITE(sqlite3_bind_int64(pStmt, 1, id));
+        auto const res = sqlite3_blocking_step(pStmt);
+        
+        if (res == SQLITE_DONE)
+        {
+            return;
+        }
+        else if (res != SQLITE_ROW)
+        {
+            throw DbException(res);
+        }
+        
+        FileInfo file;
+        
+        file.parentID = sqlite3_column_int64(pStmt, 0);
+        file.lastWriteTime = sqlite3_column_int64(pStmt, 1);
+        file.isDir = sqlite3_column_int(pStmt, 2) != 0;
+        file.fileName = column(pStmt, 3);
+        file.sortKey = columnBlob(pStmt, 4);
+        
+        std::string const text = searchText(file.fileName, 
+                column(pStmt, 5), column(pStmt, 6), column(pStmt, 7));
+        
+        if (text.find(needle) != std::string::npos)
+        {
+            result.emplace_back(id, std::move(file));
+        }
+    };
+    
+    // leapfrog intersection of the posting lists: each list in turn skips
+    // to the current candidate, which is a match once all lists agree
+    RecordID candidate = 1;
+    size_t agreed = 0;
+    unsigned steps = 0;
+    
+    for (size_t i = 0; result.size() < limit; i = (i + 1) % tris.size())
+    {
+        if (isCancelled && ++steps % CANCEL_CHECK_STEPS == 0 && isCancelled())
+        {
+            break;
+        }
+        
+        RecordID const next = seek(tris[i], candidate);
+        
+        if (next == NULL_RECORD_ID)
+        {
+            break;
+        }
+        
+        if (next != candidate)
+        { // a new candidate, this list is the first to agree
+            candidate = next;
+            agreed = 0;
+        }
+        
+        if (++agreed == tris.size())
+        {
+            verify(candidate);
+            ++candidate;
+            agreed = 0;
+        }
     }
     
     return result;
@@ -334,75 +2664,218 @@ std::optional<FileRecord> DbReader::readNextRecord(sqlite3_stmt* pStmt)
     {
         throw DbException(res);
     }
-    else
-    {
-        FileRecord rec;
-        
-        rec.first = sqlite3_column_int64(pStmt, 0);
-        rec.second.parentID = sqlite3_column_int64(pStmt, 1);
-        rec.second.lastWriteTime = sqlite3_column_int64(pStmt, 2);
-        rec.second.isDir = sqlite3_column_int(pStmt, 3) != 0;
-        auto const * pFileName = sqlite3_column_text(pStmt, 4);
+    
+    return viewRecord(pStmt).toRecord();
+}
 
-        if (pFileName)
-        {
-            rec.second.fileName = reinterpret_cast<const char*>(pFileName);
-        }
-        else
+
+// columns as selected by readNextRecord()'s callers
+RecordView DbReader::viewRecord(sqlite3_stmt* pStmt)
+{
+    RecordView rec;
+    
+    rec.id = sqlite3_column_int64(pStmt, 0);
+    rec.parentID = sqlite3_column_int64(pStmt, 1);
+    rec.lastWriteTime = sqlite3_column_int64(pStmt, 2);
+    rec.isDir = sqlite3_column_int(pStmt, 3) != 0;
+    rec.fileName = columnView(pStmt, 4);
+    rec.sortKey = columnView(pStmt, 5);
+    rec.size = sqlite3_column_int64(pStmt, 6);
+    rec.digest = sqlite3_column_int64(pStmt, 7);
+    rec.fileCount = sqlite3_column_int64(pStmt, 8);
+    rec.totalSize = sqlite3_column_int64(pStmt, 9);
+    rec.durationSec = sqlite3_column_int64(pStmt, 10);
+    return rec;
+}
+
+
+void DbReader::visitRecords(sqlite3_stmt* pStmt, const RecordVisitor& visit)
+{
+    assert(pStmt);
+    int res;
+    
+    try
+    {
+        while ((res = sqlite3_blocking_step(pStmt)) == SQLITE_ROW)
         {
-            rec.second.fileName.clear();
+            visit(viewRecord(pStmt));
         }
-        
-        return rec;
     }
+    catch(...)
+    { // the statement is cached, it mustn't stay on a row
+        sqlite3_reset(pStmt);
+        throw;
+    }
+    
+    if (res != SQLITE_DONE)
+    {
+        sqlite3_reset(pStmt);
+        throw DbException(res);
+    }
+    
+    CHECK_SQLITE(sqlite3_reset(pStmt));
 }
 
-// --- StatementCache ----------------------------------------------------------
+// --- PreparedStatements ----------------------------------------------------
 
-StatementCache::StatementCache(sqlite3* pDb)
-    : pDb_(pDb)
+struct PreparedStatements::Table
 {
+    struct Entry
+    {
+        sqlite3_stmt * pStmt = nullptr;
+        uint64_t       runs = 0;
+        uint64_t       nsec = 0;
+        // of the current run, while it's on its way
+        bool           running = false;
+        std::chrono::steady_clock::time_point started;
+    };
     
+    sqlite3 *                                  pDb = nullptr;
+    Entry                                      entries[STATEMENT_COUNT];
+    // index in entries of the statements prepared, for onTrace()
+    std::unordered_map<sqlite3_stmt*, size_t>  byStmt;
+};
+
+
+PreparedStatements::PreparedStatements(sqlite3* pDb)
+    : pTable_(new Table())
+{
+    setDb(pDb);
 }
 
-StatementCache::~StatementCache()
+
+PreparedStatements::PreparedStatements(PreparedStatements&& other) = default;
+
+
+PreparedStatements::~PreparedStatements()
 {
     clear();
 }
     
 
-void StatementCache::setDb(sqlite3* pDb)
+void PreparedStatements::setDb(sqlite3* pDb)
 {
-    pDb_ = pDb;
+    pTable_->pDb = pDb;
+    
+    if (pDb)
+    { // the runs are timed whether or not this works
+        sqlite3_trace_v2(pDb, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE, 
+                &onTrace, pTable_.get());
+    }
 }
 
                 
-sqlite3_stmt* StatementCache::get(int id, const char* szSQL)
+sqlite3_stmt* PreparedStatements::get(Statement id)
 {
-    auto& pStmt = statements_[id];
+    size_t const index = static_cast<size_t>(id);
+    Table::Entry& entry = pTable_->entries[index];
     
-    if (!pStmt)
+    if (!entry.pStmt)
     {
-        CHECK_SQLITE(sqlite3_blocking_prepare_v2(pDb_, szSQL, -1, &pStmt, nullptr));
+        prepare(index);
     }
     else
+    { // ends the previous run, if it's still on a row
+        CHECK_SQLITE(sqlite3_reset(entry.pStmt));
+    }
+    
+    ++entry.runs;
+    return entry.pStmt;
+}
+
+
+void PreparedStatements::prepareAll(bool owner)
+{
+    for (size_t i = 0; i < STATEMENT_COUNT; ++i)
     {
-//        assert(sqlite3_stmt_busy(pStmt) == 0);
-        CHECK_SQLITE(sqlite3_reset(pStmt));
+        if (!pTable_->entries[i].pStmt && 
+                (owner || STATEMENTS[i].connections == ANY))
+        {
+            prepare(i);
+        }
+    }
+}
+
+
+void PreparedStatements::prepare(size_t index)
+{
+    Table::Entry& entry = pTable_->entries[index];
+    
+    CHECK_SQLITE(sqlite3_blocking_prepare_v2(pTable_->pDb, 
+            STATEMENTS[index].sql, -1, &entry.pStmt, nullptr));
+    pTable_->byStmt[entry.pStmt] = index;
+}
+    
+
+void PreparedStatements::clear()
+{
+    if (!pTable_)
+    {
+        return; // moved from
     }
     
-    return pStmt;
+    for (Table::Entry& entry : pTable_->entries)
+    {
+        sqlite3_finalize(entry.pStmt);
+        entry.pStmt = nullptr;
+    }
+    
+    pTable_->byStmt.clear();
 }
+
+
+std::vector<StatementStats> PreparedStatements::stats() const
+{
+    std::vector<StatementStats> result;
+    
+    for (size_t i = 0; i < STATEMENT_COUNT; ++i)
+    {
+        Table::Entry const& entry = pTable_->entries[i];
+        
+        if (entry.runs > 0)
+        {
+            result.push_back(StatementStats{ 
+                    STATEMENTS[i].name, entry.runs, entry.nsec });
+        }
+    }
     
+    return result;
+}
 
-void StatementCache::clear()
+
+// called as a run starts and again as it finishes, on the thread running
+// it; the time SQLite reports is in whole milliseconds on most systems, 
+// too coarse for most statements, so the run is timed here
+int PreparedStatements::onTrace(
+        unsigned type, void* pContext, void* pStmt, void*)
 {
-    for (auto stmt : statements_)
+    auto const now = std::chrono::steady_clock::now();
+    Table& table = *static_cast<Table*>(pContext);
+    auto const itIndex = table.byStmt.find(static_cast<sqlite3_stmt*>(pStmt));
+    
+    if (itIndex == table.byStmt.end())
     {
-        sqlite3_finalize(stmt.second);
+        return 0;
     }
     
-    statements_.clear();
+    Table::Entry& entry = table.entries[itIndex->second];
+    
+    if (type == SQLITE_TRACE_STMT)
+    { // triggers start again within the run
+        if (!entry.running)
+        {
+            entry.running = true;
+            entry.started = now;
+        }
+    }
+    else if (entry.running)
+    {
+        entry.running = false;
+        entry.nsec += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now - entry.started).count();
+    }
+    
+    return 0;
 }
 
 // --- DbException -------------------------------------------------------------
@@ -3,29 +3,75 @@
 
 #include "db_record.hpp"
 
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
 #include <string>
 #include <memory>
 #include <stdexcept>
 #include <unordered_map>
 #include <optional>
+#include <vector>
 
 struct sqlite3;
 struct sqlite3_stmt;
 
+// ids of the statements the db runs, their SQL is in database.cpp
+enum class Statement : uint8_t;
 
-class StatementCache
+
+// runs of a statement on one connection
+struct StatementStats
+{
+    const char * name;
+    uint64_t     runs = 0;
+    // from the first step until the run finished
+    uint64_t     nsec = 0;
+};
+
+
+/*
+ * The prepared statements of a connection in an array indexed by Statement,
+ * the same table of SQL for the owner and the readers. Those a connection
+ * runs are prepared as it opens, the rest on first use, e.g. by migrations
+ * of an older schema.
+ */
+class PreparedStatements
 {
 public:
-    explicit StatementCache(sqlite3* pDb);
-    ~StatementCache();
+    explicit PreparedStatements(sqlite3* pDb);
+    PreparedStatements(PreparedStatements&& other);
+    ~PreparedStatements();
     
-    sqlite3_stmt* get(int id, const char* szSQL);
+    // reset, ready to be bound and stepped
+    sqlite3_stmt* get(Statement id);
+    // all statements, or those readers run
+    void prepareAll(bool owner);
     void clear();
     void setDb(sqlite3* pDb);
+    // of the statements run so far
+    std::vector<StatementStats> stats() const;
     
 private:
-    sqlite3*                               pDb_;
-    std::unordered_map<int, sqlite3_stmt*> statements_;
+    struct Table;
+    
+    void prepare(size_t index);
+    static int onTrace(unsigned type, void* pContext, void* pStmt, 
+                       void* pData);
+    
+    // allocated, the trace callback keeps a pointer to it
+    std::unique_ptr<Table> pTable_;
+};
+
+
+// counters of DbReader's file cache since it was enabled
+struct FileCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // records dropped because they or their subtrees changed
+    uint64_t invalidated = 0;
 };
 
 
@@ -39,8 +85,49 @@ public:
     DbReader& operator=(DbReader const&) = delete;
     
     FileInfo    getFile(RecordID id) const;
+    // keeps up to 'capacity' records read by getFile(), least recently used
+    // ones are dropped first; only for readers told about every change
+    // through invalidate()
+    void        enableFileCache(size_t capacity);
+    // a record was added, changed or deleted: drops it, the subtree of a
+    // directory, and the directories above, whose digests and totals
+    // include it; the parent, if known, saves looking it up and is the
+    // only way to those above a deleted record
+    void        invalidate(RecordID id, RecordID parentId = NULL_RECORD_ID);
+    FileCacheStats fileCacheStats() const;
+    // runs and times of the statements this reader ran
+    std::vector<StatementStats> statementStats() const;
+    // records of the ids which exist, looked up a chunk of ids per query
+    FileRecords getFiles(const std::vector<RecordID>& ids) const;
     FileRecords childrenFiles(RecordID id) const;
     FileRecords dirs() const;
+    // the same rows without copying them, visit() gets each one while the
+    // query is on it and mustn't use this reader meanwhile
+    void        forEachChild(RecordID id, const RecordVisitor& visit) const;
+    void        forEachDir(const RecordVisitor& visit) const;
+    DirSchedules dirSchedules() const;
+    // files without tags or with tags older than the file, in id order
+    FileRecords staleTracks(RecordID afterId, int limit) const;
+    // groups sorted by name, parentId is NULL_RECORD_ID for the top level
+    TagGroups   tagGroups(GroupMode mode, RecordID parentId) const;
+    // tracks of a group including those of its subgroups
+    TrackRecords groupTracks(RecordID groupId) const;
+    // files below a directory depth first, siblings in display order
+    std::vector<std::string> subtreeFiles(RecordID dirId) const;
+    // number of files below a directory
+    size_t      countSubtreeFiles(RecordID dirId) const;
+    // directories by the total size of their files, largest first
+    FileRecords largestDirs(size_t limit) const;
+    // directories below dirId whose digest isn't the one digestOf() knows
+    // for their path (a snapshot, another copy of the library), nullopt if
+    // unknown; subtrees with equal digests are skipped as a whole
+    FileRecords differingDirs(RecordID dirId, 
+            const std::function<std::optional<uint64_t>(const std::string&)>& 
+                digestOf) const;
+    // files whose name or tags contain the query, at least 3 bytes long;
+    // case and accent insensitive, stops early once isCancelled returns true
+    FileRecords search(const std::string& query, size_t limit,
+                       const std::function<bool()>& isCancelled = {}) const;
     
 protected:
     friend class DbOwner;
@@ -48,22 +135,77 @@ protected:
     
     void close();
     static std::optional<FileRecord> readNextRecord(sqlite3_stmt* pStmt);
+    static RecordView viewRecord(sqlite3_stmt* pStmt);
+    static void visitRecords(sqlite3_stmt* pStmt, const RecordVisitor& visit);
+    // the records below a directory: those of its root with paths in the
+    // range, a root nested in it has its own records of the same paths
+    struct Subtree
+    {
+        RecordID                            rootId;
+        std::pair<std::string, std::string> range;
+    };
     
-    sqlite3*                pDb_;
-    mutable StatementCache  statements_;
+    // nullopt if the id isn't one of a directory
+    std::optional<Subtree> subtreeOf(RecordID dirId) const;
+    FileInfo    readFile(RecordID id) const;
+    // links the record and the directories above it in the file cache,
+    // nothing once it's deleted
+    void        linkAncestors(RecordID id) const;
+    
+    struct FileCache
+    {
+        typedef std::list<FileRecord> Records;
+        
+        size_t                                          capacity;
+        // most recently used first
+        Records                                         records;
+        std::unordered_map<RecordID, Records::iterator> byId;
+        // the parents of the records and of the directories above them, 
+        // cached or not, for the ancestors of changed records; a known 
+        // parent's own one is known as well
+        std::unordered_map<RecordID, RecordID>          parents;
+        // the other way around, for the subtrees of changed records
+        std::unordered_map<RecordID, RecordIDs>         children;
+        // parents' size at which prune() runs next
+        size_t                                          pruneAt;
+        FileCacheStats                                  stats;
+        
+        void erase(RecordID id);
+        void link(RecordID id, RecordID parentId);
+        // drops the parents of ids neither cached nor above cached ones
+        void prune();
+    };
+    
+    sqlite3*                   pDb_;
+    mutable PreparedStatements statements_;
+    // null unless enabled
+    std::unique_ptr<FileCache> pFileCache_;
 };
 
 
 class DbOwner : public DbReader
 {
 public:
-    explicit DbOwner(const std::string& fileName);
+    // setting *pCancel from another thread makes opening give up with a
+    // DbException; the upgrade or rebuild it interrupts is rolled back
+    // and done again on the next open
+    explicit DbOwner(const std::string& fileName, 
+                     const std::atomic<bool>* pCancel = nullptr);
 
     DbOwner(const DbOwner&) = delete;
     
     RecordID    addFile(const FileInfo& record);
-    void        delFile(RecordID id);
+    // the id of the view is ignored
+    RecordID    addFile(const RecordView& record);
+    // returns the parent, NULL_RECORD_ID for roots and unknown ids
+    RecordID    delFile(RecordID id);
     void        replaceFile(RecordID id, const FileInfo& record);
+    void        replaceFile(const RecordView& record);
+    void        setDirSchedule(RecordID id, const DirSchedule& schedule);
+    void        setTrack(RecordID id, std::time_t writeTime, const TrackTags& tags);
+    // updates the search index of a file, tags are added when known
+    void        indexFile(RecordID id, std::string_view fileName, 
+                          const TrackTags& tags = TrackTags());
     
     void beginTransaction();
     void commit();
@@ -72,7 +214,32 @@ public:
     DbReader createReader();
     
 private:    
+    // throws once opening is cancelled
+    void     checkCancelled() const;
+    void     migrate();
+    void     migrateSortKeys();
+    void     migrateDigests();
+    void     migrateTotals();
+    void     migrateRoots();
+    // marks the digest and totals of a directory stale, NULL_RECORD_ID
+    // is ignored
+    void     changed(RecordID dirId);
+    void     changedAllDirs();
+    // recomputes the stale digests and totals and those of their ancestors
+    void     updateDirs();
+    bool     markStaleDirs();
+    // everything below a directory, not the directory itself
+    void     delSubtree(const Subtree& subtree);
+    void     rebuildTagGroups();
+    void     rebuildSearchIndex();
+    RecordID artistID(const std::string& name);
+    RecordID albumID(RecordID artistId, const std::string& title);
+    
     const std::string fileName_;
+    // while the constructor runs
+    const std::atomic<bool>* pCancel_;
+    // directories whose children changed in the current transaction
+    RecordIDs         dirtyDirs_;
 };
 
 using DbOwnerPtr = std::unique_ptr<DbOwner>;
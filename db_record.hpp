@@ -2,9 +2,11 @@
 #define DB_RECORD_HPP
 
 #include <string>
+#include <string_view>
 #include <ctime>
 #include <vector>
 #include <set>
+#include <functional>
 
 #include <stdint.h>
 
@@ -21,6 +23,16 @@ struct FileInfo
     std::time_t lastWriteTime;
     bool	isDir;
     std::string fileName;
+    std::string sortKey; // of the base name, filled when read from the db
+    uint64_t    size = 0; // files only
+    // of the names, times, sizes and digests of a directory's children,
+    // maintained by the db
+    uint64_t    digest = 0;
+    // totals of the files below a directory, maintained by the db; the
+    // duration counts the files with known tags
+    uint64_t    fileCount = 0;
+    uint64_t    totalSize = 0;
+    uint64_t    durationSec = 0;
 };
 
 using FileRecord = std::pair<RecordID, FileInfo>;
@@ -33,4 +45,114 @@ inline FileRecord make_Record(RecordIDT&& id, RecordDataT&& data)
 }
 
 using FileRecords = std::vector<FileRecord>;
+
+// a record without copies of its strings, which point into the row a query
+// is on or into the FileRecord it was made of; valid as long as those are
+struct RecordView
+{
+    RecordID         id;
+    RecordID         parentID;
+    std::time_t      lastWriteTime;
+    bool             isDir;
+    std::string_view fileName;
+    std::string_view sortKey;
+    uint64_t         size = 0;
+    uint64_t         digest = 0;
+    uint64_t         fileCount = 0;
+    uint64_t         totalSize = 0;
+    uint64_t         durationSec = 0;
+    
+    RecordView() = default;
+    
+    RecordView(RecordID recId, const FileInfo& info)
+     : id(recId)
+     , parentID(info.parentID)
+     , lastWriteTime(info.lastWriteTime)
+     , isDir(info.isDir)
+     , fileName(info.fileName)
+     , sortKey(info.sortKey)
+     , size(info.size)
+     , digest(info.digest)
+     , fileCount(info.fileCount)
+     , totalSize(info.totalSize)
+     , durationSec(info.durationSec)
+    {
+    }
+    
+    explicit RecordView(const FileRecord& rec)
+     : RecordView(rec.first, rec.second)
+    {
+    }
+    
+    // a copy which outlives the row
+    FileRecord toRecord() const
+    {
+        FileInfo info;
+        info.parentID = parentID;
+        info.lastWriteTime = lastWriteTime;
+        info.isDir = isDir;
+        info.fileName = fileName;
+        info.sortKey = sortKey;
+        info.size = size;
+        info.digest = digest;
+        info.fileCount = fileCount;
+        info.totalSize = totalSize;
+        info.durationSec = durationSec;
+        return FileRecord(id, std::move(info));
+    }
+};
+
+using RecordVisitor = std::function<void(const RecordView&)>;
+
+// polling state of a directory, adapted to how often it changes
+struct DirSchedule
+{
+    std::time_t nextCheck;
+    int         intervalSec;
+    int         changeCount;
+    std::time_t lastChange;
+};
+
+using DirSchedules = std::vector<std::pair<RecordID, DirSchedule>>;
+
+struct TrackTags
+{
+    std::string title;
+    std::string artist;
+    std::string albumArtist;
+    std::string album;
+    std::string genre;
+    int         year = 0;
+    int         trackNo = 0;
+    int         durationSec = 0; // 0 if unknown
+};
+
+// browse modes based on tags, stored in the database as numbers
+enum class GroupMode
+{
+    ARTIST = 0,
+    ALBUM  = 1, // album artist, then album
+    GENRE  = 2,
+    YEAR   = 3
+};
+
+struct TagGroup
+{
+    RecordID    id;
+    std::string name;
+    int         count; // tracks in the group and its subgroups
+    std::string sortKey;
+};
+
+using TagGroups = std::vector<TagGroup>;
+
+struct TrackRecord
+{
+    RecordID    fileId;
+    int         trackNo;
+    std::string title;
+    std::string fileName;
+};
+
+using TrackRecords = std::vector<TrackRecord>;
 #endif /* DB_RECORD_HPP */
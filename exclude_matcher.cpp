@@ -0,0 +1,327 @@
+#include "exclude_matcher.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <deque>
+#include <map>
+#include <stdexcept>
+
+namespace {
+
+// keeps pathological pattern sets from taking megabytes
+constexpr size_t MAX_STATES = 4096;
+
+struct Token
+{
+    enum Kind { STAR, BYTES } kind;
+    // bytes matched by the token, '/' never is
+    std::bitset<256>          bytes;
+};
+
+struct Pattern
+{
+    std::vector<Token> tokens;
+    // matches names at any depth rather than the path from the root
+    bool               anyDepth;
+    // ended with '/'
+    bool               dirOnly;
+};
+
+// [!a-z] style class starting after '[', npos if not terminated
+size_t parseClass(const std::string& glob, size_t pos, std::bitset<256>& bytes)
+{
+    bool const negated = pos < glob.size() &&
+            (glob[pos] == '!' || glob[pos] == '^');
+    size_t i = negated ? pos + 1 : pos;
+    bool first = true;
+
+    for (; i < glob.size() && (first || glob[i] != ']'); first = false)
+    {
+        unsigned char const from = glob[i];
+        unsigned char to = from;
+
+        if (i + 2 < glob.size() && glob[i + 1] == '-' && glob[i + 2] != ']')
+        {
+            to = glob[i + 2];
+            i += 3;
+        }
+        else
+        {
+            ++i;
+        }
+
+        for (unsigned c = from; c <= to; ++c)
+        {
+            bytes.set(c);
+        }
+    }
+
+    if (i >= glob.size())
+    {
+        return std::string::npos;
+    }
+
+    if (negated)
+    {
+        bytes.flip();
+    }
+
+    bytes.reset('/');
+    return i + 1;
+}
+
+
+Pattern parse(std::string glob)
+{
+    Pattern result;
+    result.anyDepth = glob.find('/') == std::string::npos;
+    result.dirOnly = glob.back() == '/';
+
+    while (glob.size() > 1 && glob.back() == '/')
+    {
+        glob.pop_back(); // "dir/" names the directory
+    }
+
+    if (!result.anyDepth && glob.front() == '/')
+    {
+        glob.erase(0, 1);
+    }
+
+    for (size_t i = 0; i < glob.size();)
+    {
+        Token token{ Token::BYTES, {} };
+        char const c = glob[i];
+
+        if (c == '*')
+        {
+            token.kind = Token::STAR;
+            ++i;
+        }
+        else if (c == '?')
+        {
+            token.bytes.set();
+            token.bytes.reset('/');
+            ++i;
+        }
+        else if (c == '[')
+        {
+            size_t const end = parseClass(glob, i + 1, token.bytes);
+
+            if (end != std::string::npos)
+            {
+                i = end;
+            }
+            else
+            { // unterminated class, a plain character
+                token.bytes.reset();
+                token.bytes.set('[');
+                ++i;
+            }
+        }
+        else
+        {
+            if (c == '\\' && i + 1 < glob.size())
+            {
+                ++i;
+            }
+
+            token.bytes.set(static_cast<unsigned char>(glob[i++]));
+        }
+
+        result.tokens.push_back(std::move(token));
+    }
+
+    return result;
+}
+
+} // end of anonymous namespace
+
+
+ExcludeMatcher::ExcludeMatcher()
+ : ExcludeMatcher(std::vector<std::string>())
+{
+}
+
+
+/*
+ * Subset construction over the positions of all patterns. A position is the
+ * pattern index and the number of its tokens matched, the extra SEEK
+ * position of an any-depth pattern skips leading components.
+ */
+ExcludeMatcher::ExcludeMatcher(const std::vector<std::string>& patterns)
+ : empty_(true)
+{
+    typedef uint32_t Position;
+    typedef std::vector<Position> PositionSet;
+    constexpr uint32_t SEEK = 0xFFFF;
+
+    std::vector<Pattern> parsed;
+
+    for (const std::string& glob : patterns)
+    {
+        if (!glob.empty() && glob != "/")
+        {
+            parsed.push_back(parse(glob));
+        }
+    }
+
+    empty_ = parsed.empty();
+
+    auto const position = [](size_t pattern, uint32_t index)
+    {
+        return static_cast<Position>(pattern << 16 | index);
+    };
+
+    // adds the positions reachable by letting stars match nothing
+    auto const close = [&](PositionSet& set)
+    {
+        for (size_t i = 0; i < set.size(); ++i)
+        {
+            uint32_t const index = set[i] & 0xFFFF;
+            Pattern const& pattern = parsed[set[i] >> 16];
+
+            if (index != SEEK && index < pattern.tokens.size() &&
+                    pattern.tokens[index].kind == Token::STAR)
+            {
+                set.push_back(set[i] + 1);
+            }
+        }
+
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+
+        // a pattern ending with a star accepts the rest of the component,
+        // the entry is excluded whatever the others do and isn't entered;
+        // unless it's a file and the pattern is for directories
+        for (Position pos : set)
+        {
+            uint32_t const index = pos & 0xFFFF;
+            Pattern const& pattern = parsed[pos >> 16];
+
+            if (index != SEEK && !pattern.dirOnly && 
+                    index == pattern.tokens.size() &&
+                    index > 0 && pattern.tokens[index - 1].kind == Token::STAR)
+            {
+                set.assign({ pos - 1, pos });
+                break;
+            }
+        }
+    };
+
+    PositionSet startSet;
+
+    for (size_t i = 0; i < parsed.size(); ++i)
+    {
+        startSet.push_back(position(i, 0));
+
+        if (parsed[i].anyDepth)
+        {
+            startSet.push_back(position(i, SEEK));
+        }
+    }
+
+    close(startSet);
+
+    std::map<PositionSet, State> ids;
+    std::deque<PositionSet> queue;
+
+    auto const stateOf = [&](PositionSet&& set)
+    {
+        auto const inserted = ids.emplace(set, transitions_.size());
+
+        if (inserted.second)
+        {
+            if (transitions_.size() >= MAX_STATES)
+            {
+                throw std::invalid_argument("too many exclude patterns");
+            }
+
+            Match accepting = Match::NONE;
+
+            for (Position pos : set)
+            {
+                Pattern const& pattern = parsed[pos >> 16];
+
+                if ((pos & 0xFFFF) == pattern.tokens.size())
+                {
+                    accepting = std::max(accepting, 
+                            pattern.dirOnly ? Match::DIRECTORY : Match::ANY);
+                }
+            }
+
+            transitions_.emplace_back();
+            accepting_.push_back(accepting);
+            queue.push_back(std::move(set));
+        }
+
+        return inserted.first->second;
+    };
+
+    stateOf(PositionSet());          // DEAD_STATE
+    stateOf(std::move(startSet));    // START_STATE
+
+    for (State state = DEAD_STATE; !queue.empty(); ++state)
+    {
+        PositionSet const set = std::move(queue.front());
+        queue.pop_front();
+
+        for (unsigned c = 0; c < 256; ++c)
+        {
+            PositionSet next;
+
+            for (Position pos : set)
+            {
+                uint32_t const index = pos & 0xFFFF;
+                Pattern const& pattern = parsed[pos >> 16];
+
+                if (index == SEEK)
+                {
+                    next.push_back(pos);
+
+                    if (c == '/')
+                    {
+                        next.push_back(pos - SEEK);
+                    }
+                }
+                else if (index < pattern.tokens.size())
+                {
+                    Token const& token = pattern.tokens[index];
+
+                    if (token.kind == Token::STAR ? c != '/' : token.bytes[c])
+                    {
+                        next.push_back(token.kind == Token::STAR ? pos : pos + 1);
+                    }
+                }
+            }
+
+            close(next);
+            State const target = stateOf(std::move(next));
+            transitions_[state][c] = target;
+        }
+    }
+}
+
+
+ExcludeMatcher::State ExcludeMatcher::run(State state, const std::string& text) const
+{
+    for (size_t i = 0; i < text.size() && state != DEAD_STATE; ++i)
+    {
+        state = transitions_[state][static_cast<unsigned char>(text[i])];
+    }
+
+    return state;
+}
+
+
+ExcludeMatcher::State ExcludeMatcher::enter(State state, const std::string& name) const
+{
+    state = run(state, name);
+    return state == DEAD_STATE ? state : transitions_[state]['/'];
+}
+
+
+ExcludeMatcher::Match ExcludeMatcher::match(
+        State state, const std::string& name) const
+{
+    return accepting_[run(state, name)];
+}
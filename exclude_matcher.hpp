@@ -0,0 +1,58 @@
+#ifndef EXCLUDE_MATCHER_HPP
+#define	EXCLUDE_MATCHER_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Exclude patterns of a root compiled into one DFA, which is run over the
+ * path relative to the root one component at a time while the tree is
+ * walked. A pattern without '/' is a shell pattern matching entry names at
+ * any depth (".git", "@eaDir", "*.tmp"), one with '/' matches the path from
+ * the root ("Samples/", "Artist/Live"). A trailing '/' only matches
+ * directories. '*', '?' and [] classes don't match '/'. A matched directory
+ * is pruned together with its subtree.
+ */
+class ExcludeMatcher
+{
+public:
+    typedef uint32_t State;
+    
+    enum class Match : uint8_t
+    {
+        NONE,
+        // only by patterns ending with '/'
+        DIRECTORY,
+        ANY
+    };
+
+    // no patterns, nothing matches
+    ExcludeMatcher();
+    // throws std::invalid_argument for patterns giving too large automaton
+    explicit ExcludeMatcher(const std::vector<std::string>& patterns);
+
+    bool  empty() const { return empty_; }
+
+    // state of the root directory itself
+    State start() const { return START_STATE; }
+    // state of the directory entered from the one in 'state'
+    State enter(State state, const std::string& name) const;
+    // whether the entry 'name' of the directory in 'state' is excluded,
+    // DIRECTORY if it is only when it's a directory
+    Match match(State state, const std::string& name) const;
+
+private:
+    // nothing can match anymore
+    static constexpr State DEAD_STATE = 0;
+    static constexpr State START_STATE = 1;
+
+    State run(State state, const std::string& text) const;
+
+    std::vector<std::array<State, 256>> transitions_;
+    std::vector<Match>                  accepting_;
+    bool                                empty_;
+};
+
+#endif	/* EXCLUDE_MATCHER_HPP */
@@ -0,0 +1,657 @@
+#include "file_system.hpp"
+#include "throttle.hpp"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+// --- NativeFileSystem --------------------------------------------------------
+
+bool NativeFileSystem::isDirectory(const fs::path& path)
+{
+    return fs::is_directory(path);
+}
+
+
+std::time_t NativeFileSystem::lastWriteTime(const fs::path& path)
+{
+    return fs::last_write_time(path).time_since_epoch().count();
+}
+
+
+std::uintmax_t NativeFileSystem::fileSize(const fs::path& path)
+{
+    return fs::file_size(path);
+}
+
+
+std::vector<fs::path> NativeFileSystem::listDirectory(const fs::path& path)
+{
+    std::vector<fs::path> entries;
+
+    for (const fs::directory_entry& entry : fs::directory_iterator(path))
+    {
+        entries.push_back(entry.path());
+    }
+
+    return entries;
+}
+
+std::uintmax_t NativeFileSystem::deviceId(const fs::path& path)
+{
+    struct stat st;
+
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        throw fs::filesystem_error("stat", path,
+                std::error_code(errno, std::generic_category()));
+    }
+
+    return st.st_dev;
+}
+
+
+bool NativeFileSystem::isSymlink(const fs::path& path)
+{
+    return fs::is_symlink(path);
+}
+
+
+std::vector<char> NativeFileSystem::readFile(
+        const fs::path& path, std::uintmax_t offset, size_t size)
+{
+    std::ifstream in(path, std::ios::binary);
+
+    if (!in)
+    {
+        throw fs::filesystem_error("open", path,
+                std::error_code(errno, std::generic_category()));
+    }
+
+    std::vector<char> data(size);
+    in.seekg(offset);
+    in.read(data.data(), size);
+
+    if (in.bad())
+    {
+        throw fs::filesystem_error("read", path,
+                std::make_error_code(std::errc::io_error));
+    }
+
+    data.resize(in.gcount());
+    return data;
+}
+
+// --- GuardedFileSystem -------------------------------------------------------
+
+namespace {
+
+// how often a waiting operation checks whether it was cancelled
+constexpr std::chrono::milliseconds CANCEL_CHECK_INTERVAL(50);
+
+}
+
+
+class GuardedFileSystem::Helper
+{
+public:
+    Helper()
+        : abandoned_(false)
+        , finished_(false)
+    {
+    }
+
+    // the thread keeps the helper alive, so it can be detached safely
+    static std::shared_ptr<Helper> start()
+    {
+        auto pHelper = std::make_shared<Helper>();
+        std::thread(&Helper::run, pHelper).detach();
+        return pHelper;
+    }
+
+    void post(std::function<void()> task)
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        tasks_.push_back(std::move(task));
+        cond_.notify_one();
+    }
+
+    void abandon()
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        abandoned_ = true;
+        cond_.notify_one();
+    }
+
+    bool finished() const
+    {
+        return finished_;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+
+        while (true)
+        {
+            cond_.wait(lock, [this] { return abandoned_ || !tasks_.empty(); });
+
+            if (abandoned_)
+            {
+                break;
+            }
+
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+
+        finished_ = true;
+    }
+
+    std::mutex                          mtx_;
+    std::condition_variable             cond_;
+    std::deque<std::function<void()>>   tasks_;
+    bool                                abandoned_;
+    std::atomic<bool>                   finished_;
+};
+
+
+GuardedFileSystem::GuardedFileSystem(
+        FileSystem& target, std::chrono::milliseconds timeout)
+    : target_(target)
+    , timeout_(timeout)
+    , degraded_(false)
+    , cancelled_(false)
+    , ioIdle_(false)
+    , ioClassChanged_(false)
+{
+}
+
+
+GuardedFileSystem::~GuardedFileSystem()
+{
+    if (pHelper_)
+    {
+        pHelper_->abandon();
+    }
+}
+
+
+template<typename Result>
+Result GuardedFileSystem::call(const fs::path& path, std::function<Result()> func)
+{
+    if (throttle_)
+    {
+        throttle_();
+    }
+
+    if (cancelled_)
+    {
+        throw fs::filesystem_error("operation cancelled", path,
+                std::make_error_code(std::errc::operation_canceled));
+    }
+
+    if (pAbandoned_)
+    {
+        if (!pAbandoned_->finished())
+        {
+            throw fs::filesystem_error("previous operation still pending", path,
+                    std::make_error_code(std::errc::timed_out));
+        }
+
+        pAbandoned_.reset();
+    }
+
+    if (!pHelper_)
+    { // inherits the I/O class of this thread
+        pHelper_ = Helper::start();
+        ioClassChanged_ = false;
+    }
+    else if (ioClassChanged_)
+    {
+        pHelper_->post([idle = ioIdle_] { setThreadIoIdle(idle); });
+        ioClassChanged_ = false;
+    }
+
+    auto pTask = std::make_shared<std::packaged_task<Result()>>(std::move(func));
+    std::future<Result> result = pTask->get_future();
+    pHelper_->post([pTask] { (*pTask)(); });
+
+    auto const deadline = std::chrono::steady_clock::now() + timeout_;
+    bool ready = false;
+
+    while (!ready && !cancelled_ && std::chrono::steady_clock::now() < deadline)
+    {
+        ready = result.wait_until(std::min(deadline,
+                std::chrono::steady_clock::now() + CANCEL_CHECK_INTERVAL))
+                == std::future_status::ready;
+    }
+
+    if (!ready)
+    {
+        pHelper_->abandon();
+        pAbandoned_ = std::move(pHelper_);
+
+        if (cancelled_)
+        {
+            throw fs::filesystem_error("operation cancelled", path,
+                    std::make_error_code(std::errc::operation_canceled));
+        }
+
+        degraded_ = true;
+
+        throw fs::filesystem_error("operation timed out", path,
+                std::make_error_code(std::errc::timed_out));
+    }
+
+    degraded_ = false;
+    return result.get();
+}
+
+
+void GuardedFileSystem::setIoIdle(bool idle)
+{
+    ioClassChanged_ = ioClassChanged_ || idle != ioIdle_;
+    ioIdle_ = idle;
+}
+
+
+bool GuardedFileSystem::isDirectory(const fs::path& path)
+{
+    FileSystem& target = target_;
+    return call<bool>(path, [&target, path] { return target.isDirectory(path); });
+}
+
+
+std::time_t GuardedFileSystem::lastWriteTime(const fs::path& path)
+{
+    FileSystem& target = target_;
+    return call<std::time_t>(path,
+            [&target, path] { return target.lastWriteTime(path); });
+}
+
+
+std::uintmax_t GuardedFileSystem::fileSize(const fs::path& path)
+{
+    FileSystem& target = target_;
+    return call<std::uintmax_t>(path,
+            [&target, path] { return target.fileSize(path); });
+}
+
+
+std::vector<fs::path> GuardedFileSystem::listDirectory(const fs::path& path)
+{
+    FileSystem& target = target_;
+    return call<std::vector<fs::path>>(path,
+            [&target, path] { return target.listDirectory(path); });
+}
+
+
+std::uintmax_t GuardedFileSystem::deviceId(const fs::path& path)
+{
+    FileSystem& target = target_;
+    return call<std::uintmax_t>(path,
+            [&target, path] { return target.deviceId(path); });
+}
+
+
+bool GuardedFileSystem::isSymlink(const fs::path& path)
+{
+    FileSystem& target = target_;
+    return call<bool>(path, [&target, path] { return target.isSymlink(path); });
+}
+
+
+std::vector<char> GuardedFileSystem::readFile(
+        const fs::path& path, std::uintmax_t offset, size_t size)
+{
+    FileSystem& target = target_;
+    return call<std::vector<char>>(path, [&target, path, offset, size]
+            { return target.readFile(path, offset, size); });
+}
+
+// --- MemFileSystem -----------------------------------------------------------
+
+namespace {
+
+bool isUnder(const fs::path& path, const fs::path& base)
+{
+    auto itBase = base.begin();
+    auto itPath = path.begin();
+
+    for (; itBase != base.end(); ++itBase, ++itPath)
+    {
+        if (itPath == path.end() || *itPath != *itBase)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // end of anonymous namespace
+
+
+MemFileSystem::MemFileSystem()
+    : clock_(1)
+    , latency_{}
+{
+    nodes_.emplace("/", Node{ true, clock_, 0, {} });
+}
+
+
+bool MemFileSystem::isDirectory(const fs::path& path)
+{
+    enter(Op::IS_DIRECTORY, path);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto itNode = nodes_.find(path);
+    return itNode != nodes_.end() && itNode->second.isDir;
+}
+
+
+std::time_t MemFileSystem::lastWriteTime(const fs::path& path)
+{
+    enter(Op::LAST_WRITE_TIME, path);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    return node(path, "last_write_time").lastWriteTime;
+}
+
+
+std::uintmax_t MemFileSystem::fileSize(const fs::path& path)
+{
+    enter(Op::FILE_SIZE, path);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    Node const& file = node(path, "file_size");
+
+    if (file.isDir)
+    {
+        throw fs::filesystem_error("file_size", path,
+                std::make_error_code(std::errc::is_a_directory));
+    }
+
+    return file.size;
+}
+
+
+std::vector<fs::path> MemFileSystem::listDirectory(const fs::path& path)
+{
+    enter(Op::LIST_DIRECTORY, path);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    Node const& dir = node(path, "directory_iterator");
+
+    if (!dir.isDir)
+    {
+        throw fs::filesystem_error("directory_iterator", path,
+                std::make_error_code(std::errc::not_a_directory));
+    }
+
+    std::vector<fs::path> entries;
+    entries.reserve(dir.children.size());
+
+    for (const std::string& name : dir.children)
+    {
+        entries.push_back(path / name);
+    }
+
+    return entries;
+}
+
+
+std::uintmax_t MemFileSystem::deviceId(const fs::path& path)
+{
+    enter(Op::DEVICE_ID, path);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    node(path, "stat");
+
+    std::uintmax_t id = 0;
+    size_t matched = 0;
+
+    for (const auto& device : devices_)
+    {
+        size_t const len = std::distance(device.first.begin(), device.first.end());
+
+        if (len >= matched && isUnder(path, device.first))
+        {
+            id = device.second;
+            matched = len;
+        }
+    }
+
+    return id;
+}
+
+
+bool MemFileSystem::isSymlink(const fs::path& path)
+{
+    enter(Op::IS_SYMLINK, path);
+    return false;
+}
+
+
+std::vector<char> MemFileSystem::readFile(
+        const fs::path& path, std::uintmax_t offset, size_t size)
+{
+    enter(Op::READ_FILE, path);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    Node const& file = node(path, "open");
+
+    if (file.isDir)
+    {
+        throw fs::filesystem_error("read", path,
+                std::make_error_code(std::errc::is_a_directory));
+    }
+
+    auto const begin = file.content.begin() + 
+            std::min<std::uintmax_t>(offset, file.content.size());
+    auto const end = begin + std::min<size_t>(size, file.content.end() - begin);
+    return std::vector<char>(begin, end);
+}
+
+
+void MemFileSystem::setDevice(const fs::path& path, std::uintmax_t id)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    devices_[path] = id;
+}
+
+
+void MemFileSystem::addDir(const fs::path& path, std::time_t lastWriteTime)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    add(path, true, lastWriteTime, 0);
+}
+
+
+void MemFileSystem::addFile(
+        const fs::path& path, std::time_t lastWriteTime, std::uintmax_t size)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    add(path, false, lastWriteTime, size);
+}
+
+
+void MemFileSystem::writeFile(const fs::path& path, std::string content,
+        std::time_t lastWriteTime)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    add(path, false, lastWriteTime, content.size());
+    nodes_[path].content = std::move(content);
+}
+
+
+void MemFileSystem::touch(const fs::path& path, std::time_t lastWriteTime,
+        std::optional<std::uintmax_t> size)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto itNode = nodes_.find(path);
+
+    if (itNode != nodes_.end())
+    {
+        itNode->second.lastWriteTime = lastWriteTime ? lastWriteTime : ++clock_;
+        itNode->second.size = size.value_or(itNode->second.size);
+    }
+}
+
+
+void MemFileSystem::remove(const fs::path& path)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    if (!nodes_.count(path) || path == path.root_path())
+    {
+        return;
+    }
+
+    removeNode(path);
+    nodes_[path.parent_path()].children.erase(path.filename().string());
+    modified(path.parent_path());
+}
+
+
+void MemFileSystem::setLatency(Op op, std::chrono::microseconds latency)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    latency_[static_cast<int>(op)] = latency;
+}
+
+
+void MemFileSystem::injectError(
+        Op op, const fs::path& path, std::errc err, int count)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    errors_.push_back(Error{ op, path, err, count });
+}
+
+
+void MemFileSystem::clearErrors()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    errors_.clear();
+}
+
+
+void MemFileSystem::setHook(Hook hook)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    hook_ = std::move(hook);
+}
+
+
+void MemFileSystem::enter(Op op, const fs::path& path)
+{
+    Hook hook;
+    std::chrono::microseconds latency;
+    std::error_code error;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        hook = hook_;
+        latency = latency_[static_cast<int>(op)];
+
+        for (auto itError = errors_.begin(); itError != errors_.end(); ++itError)
+        {
+            if (itError->op == op && isUnder(path, itError->path))
+            {
+                error = std::make_error_code(itError->err);
+
+                if (itError->count > 0 && --itError->count == 0)
+                {
+                    errors_.erase(itError);
+                }
+
+                break;
+            }
+        }
+    }
+
+    if (hook)
+    {
+        hook(op, path);
+    }
+
+    if (latency.count() > 0)
+    {
+        std::this_thread::sleep_for(latency);
+    }
+
+    if (error)
+    {
+        throw fs::filesystem_error("injected error", path, error);
+    }
+}
+
+
+void MemFileSystem::add(const fs::path& path, bool isDir, 
+        std::time_t lastWriteTime, std::uintmax_t size)
+{
+    fs::path const parent = path.parent_path();
+
+    if (parent == path)
+    {
+        return; // root always exists
+    }
+
+    if (!nodes_.count(parent))
+    {
+        add(parent, true, 0, 0);
+    }
+
+    Node& entry = nodes_[path];
+    entry.isDir = isDir;
+    entry.lastWriteTime = lastWriteTime ? lastWriteTime : ++clock_;
+    entry.size = size;
+    entry.content.clear();
+
+    if (nodes_[parent].children.insert(path.filename().string()).second)
+    {
+        modified(parent);
+    }
+}
+
+
+void MemFileSystem::removeNode(const fs::path& path)
+{
+    auto itNode = nodes_.find(path);
+
+    for (const std::string& child : itNode->second.children)
+    {
+        removeNode(path / child);
+    }
+
+    nodes_.erase(itNode);
+}
+
+
+void MemFileSystem::modified(const fs::path& parent)
+{
+    nodes_[parent].lastWriteTime = ++clock_;
+}
+
+
+MemFileSystem::Node const& MemFileSystem::node(
+        const fs::path& path, const char* what) const
+{
+    auto itNode = nodes_.find(path);
+
+    if (itNode == nodes_.end())
+    {
+        throw fs::filesystem_error(what, path,
+                std::make_error_code(std::errc::no_such_file_or_directory));
+    }
+
+    return itNode->second;
+}
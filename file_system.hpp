@@ -0,0 +1,207 @@
+#ifndef FILE_SYSTEM_HPP
+#define	FILE_SYSTEM_HPP
+
+#include <filesystem>
+namespace fs = std::filesystem;
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <system_error>
+#include <vector>
+
+/*
+ * Filesystem access used by the scanner. Failures are reported as
+ * fs::filesystem_error, the same way std::filesystem does, so the scanner
+ * can tell vanished entries (ENOENT) from unreachable ones.
+ */
+class FileSystem
+{
+public:
+    virtual ~FileSystem() = default;
+
+    // false for missing entries, like fs::is_directory
+    virtual bool                  isDirectory(const fs::path& path) = 0;
+    virtual std::time_t           lastWriteTime(const fs::path& path) = 0;
+    virtual std::uintmax_t        fileSize(const fs::path& path) = 0;
+    virtual std::vector<fs::path> listDirectory(const fs::path& path) = 0;
+    // identifies the mount the entry resides on (st_dev)
+    virtual std::uintmax_t        deviceId(const fs::path& path) = 0;
+    // true for the link itself rather than its target, false for missing entries
+    virtual bool                  isSymlink(const fs::path& path) = 0;
+    // up to 'size' bytes of a file from 'offset', fewer at its end
+    virtual std::vector<char>     readFile(const fs::path& path, 
+                                           std::uintmax_t offset, size_t size) = 0;
+};
+
+
+class NativeFileSystem : public FileSystem
+{
+public:
+    bool                  isDirectory(const fs::path& path) override;
+    std::time_t           lastWriteTime(const fs::path& path) override;
+    std::uintmax_t        fileSize(const fs::path& path) override;
+    std::vector<fs::path> listDirectory(const fs::path& path) override;
+    std::uintmax_t        deviceId(const fs::path& path) override;
+    bool                  isSymlink(const fs::path& path) override;
+    std::vector<char>     readFile(const fs::path& path, 
+                                   std::uintmax_t offset, size_t size) override;
+};
+
+
+/*
+ * Runs the operations of another FileSystem on a helper thread and gives up
+ * waiting after a timeout, reporting ETIMEDOUT. A helper stuck in the kernel
+ * (e.g. on a dead network share) is abandoned; until it returns, further
+ * operations fail immediately instead of piling up more stuck threads.
+ */
+class GuardedFileSystem : public FileSystem
+{
+public:
+    GuardedFileSystem(FileSystem& target, std::chrono::milliseconds timeout);
+    ~GuardedFileSystem();
+
+    bool                  isDirectory(const fs::path& path) override;
+    std::time_t           lastWriteTime(const fs::path& path) override;
+    std::uintmax_t        fileSize(const fs::path& path) override;
+    std::vector<fs::path> listDirectory(const fs::path& path) override;
+    std::uintmax_t        deviceId(const fs::path& path) override;
+    bool                  isSymlink(const fs::path& path) override;
+    std::vector<char>     readFile(const fs::path& path, 
+                                   std::uintmax_t offset, size_t size) override;
+
+    // true since the last timed out operation until one succeeds again
+    bool isDegraded() const { return degraded_; }
+
+    // fails the pending and all further operations with ECANCELED without
+    // waiting for the timeout, may be called from any thread
+    void cancel() { cancelled_ = true; }
+
+    // I/O class of the helper thread, which otherwise keeps the one of the
+    // thread it was started by; called by the thread using the filesystem
+    void setIoIdle(bool idle);
+
+    // called on the calling thread before every operation, which it may
+    // delay to pace the I/O
+    using Throttle = std::function<void()>;
+    void setThrottle(Throttle throttle) { throttle_ = std::move(throttle); }
+
+private:
+    class Helper;
+
+    template<typename Result>
+    Result call(const fs::path& path, std::function<Result()> func);
+
+    FileSystem&                     target_;
+    const std::chrono::milliseconds timeout_;
+    std::atomic<bool>               degraded_;
+    std::atomic<bool>               cancelled_;
+    std::shared_ptr<Helper>         pHelper_;
+    std::shared_ptr<Helper>         pAbandoned_;
+    bool                            ioIdle_;
+    // the helper's I/O class differs from ioIdle_
+    bool                            ioClassChanged_;
+    Throttle                        throttle_;
+};
+
+
+/*
+ * In-memory tree for reproducing slow or flaky storage: every operation can
+ * be delayed, made to fail with a given error, or intercepted by a hook which
+ * may mutate the tree while a scan is in progress.
+ */
+class MemFileSystem : public FileSystem
+{
+public:
+    enum class Op
+    {
+        IS_DIRECTORY, LAST_WRITE_TIME, FILE_SIZE, LIST_DIRECTORY, DEVICE_ID,
+        IS_SYMLINK, READ_FILE, COUNT
+    };
+
+    // called before every operation, outside of the internal lock
+    using Hook = std::function<void(Op op, const fs::path& path)>;
+
+    MemFileSystem();
+
+    bool                  isDirectory(const fs::path& path) override;
+    std::time_t           lastWriteTime(const fs::path& path) override;
+    std::uintmax_t        fileSize(const fs::path& path) override;
+    std::vector<fs::path> listDirectory(const fs::path& path) override;
+    std::uintmax_t        deviceId(const fs::path& path) override;
+    // the tree has no links
+    bool                  isSymlink(const fs::path& path) override;
+    // the content written by writeFile(), files added otherwise are empty
+    std::vector<char>     readFile(const fs::path& path, 
+                                   std::uintmax_t offset, size_t size) override;
+
+    // places 'path' and everything below it on a separate mount
+    void setDevice(const fs::path& path, std::uintmax_t id);
+
+    // tree mutations, missing parent directories are created;
+    // the parent's write time is bumped as a real filesystem would do
+    void addDir(const fs::path& path, std::time_t lastWriteTime = 0);
+    void addFile(const fs::path& path, std::time_t lastWriteTime = 0,
+                 std::uintmax_t size = 0);
+    // adds or replaces a file with the given content and its size
+    void writeFile(const fs::path& path, std::string content,
+                   std::time_t lastWriteTime = 0);
+    // 'size' keeps the current one unless given
+    void touch(const fs::path& path, std::time_t lastWriteTime = 0,
+               std::optional<std::uintmax_t> size = std::nullopt);
+    void remove(const fs::path& path);
+
+    void setLatency(Op op, std::chrono::microseconds latency);
+
+    // fails the next 'count' operations on 'path' and everything below it,
+    // count < 0 fails them until clearErrors() is called
+    void injectError(Op op, const fs::path& path, std::errc err, int count = 1);
+    void clearErrors();
+
+    void setHook(Hook hook);
+
+private:
+    struct Node
+    {
+        bool                  isDir;
+        std::time_t           lastWriteTime;
+        std::uintmax_t        size;
+        std::set<std::string> children;
+        std::string           content;
+    };
+
+    struct Error
+    {
+        Op        op;
+        fs::path  path;
+        std::errc err;
+        int       count;
+    };
+
+    void        enter(Op op, const fs::path& path);
+    void        add(const fs::path& path, bool isDir, std::time_t lastWriteTime,
+                    std::uintmax_t size);
+    void        removeNode(const fs::path& path);
+    void        modified(const fs::path& parent);
+    Node const& node(const fs::path& path, const char* what) const;
+
+    mutable std::mutex                  mtx_;
+    std::map<fs::path, Node>            nodes_;
+    std::map<fs::path, std::uintmax_t>  devices_;
+    std::time_t                         clock_;
+    std::chrono::microseconds           latency_[static_cast<int>(Op::COUNT)];
+    std::vector<Error>                  errors_;
+    Hook                                hook_;
+};
+
+#endif	/* FILE_SYSTEM_HPP */
@@ -1,34 +1,177 @@
 #include "main_widget.hpp"
 
 #include "settings_dlg.hpp"
+#include "collation.hpp"
+#include "tree_snapshot.hpp"
 #include "medialib.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 
 struct ByDirectoryColumns : Gtk::TreeModel::ColumnRecord
 {
 	Gtk::TreeModelColumn<RecordID>	fileId;
 	Gtk::TreeModelColumn<Glib::ustring>	filename;
-	ByDirectoryColumns() { add(fileId); add(filename); }
+	// set for group rows of tag modes, which have no file;
+	// a row with neither is a placeholder for children not loaded yet
+	Gtk::TreeModelColumn<RecordID>	groupId;
+	// collation key of the name, rows are sorted by it
+	Gtk::TreeModelColumn<std::string>	sortKey;
+	// file count, size and duration of a directory, if shown
+	Gtk::TreeModelColumn<Glib::ustring>	totals;
+	ByDirectoryColumns() 
+	{ add(fileId); add(filename); add(groupId); add(sortKey); add(totals); }
 };
 
 static const ByDirectoryColumns byDirColumns; // TODO: make non-static
 
 
+// keys are compared bytewise, equal ones (names differing in case or accents
+// only) by the names themselves
+static int compareRows(
+        const Gtk::TreeModel::iterator& itA, 
+        const Gtk::TreeModel::iterator& itB)
+{
+    std::string const keyA = (*itA)[byDirColumns.sortKey];
+    std::string const keyB = (*itB)[byDirColumns.sortKey];
+    int const res = keyA.compare(keyB);
+    
+    if (res != 0)
+    {
+        return res;
+    }
+    
+    Glib::ustring const nameA = (*itA)[byDirColumns.filename];
+    Glib::ustring const nameB = (*itB)[byDirColumns.filename];
+    return nameA.raw().compare(nameB.raw());
+}
+
+// shorter queries would match most of the library
+static const size_t MIN_QUERY_LENGTH = 3;
+
+// records read by getFile() kept between scan events
+static const size_t FILE_CACHE_SIZE = 4096;
+
+// expanded directories file: the header followed by the RecordIDs
+struct ExpandedRowsHeader
+{
+    uint32_t magic;
+    uint32_t count;
+};
+
+static const uint32_t EXPANDED_ROWS_MAGIC = 0x3158454D; // "MEX1"
+
+
+// "12 tracks, 1.5 GB, 0:52:10", the duration of tagged tracks only
+static std::string formatTotals(RecordView const& dir)
+{
+    if (dir.fileCount == 0)
+    {
+        return std::string();
+    }
+    
+    static const char* const UNITS[] = { "B", "KB", "MB", "GB", "TB" };
+    double size = dir.totalSize;
+    size_t unit = 0;
+    
+    while (size >= 1024 && unit + 1 < std::size(UNITS))
+    {
+        size /= 1024;
+        ++unit;
+    }
+    
+    char buf[96];
+    int length = std::snprintf(buf, sizeof(buf), "%llu %s, %.*f %s", 
+            static_cast<unsigned long long>(dir.fileCount),
+            dir.fileCount == 1 ? "track" : "tracks",
+            unit == 0 ? 0 : 1, size, UNITS[unit]);
+    
+    if (dir.durationSec > 0 && length > 0 && length < int(sizeof(buf)))
+    {
+        std::snprintf(buf + length, sizeof(buf) - length, ", %llu:%02u:%02u",
+                static_cast<unsigned long long>(dir.durationSec / 3600),
+                unsigned(dir.durationSec / 60 % 60), 
+                unsigned(dir.durationSec % 60));
+    }
+    
+    return buf;
+}
+
+
+// path bytes kept in file URIs, as by g_filename_to_uri()
+static bool isUriSafe(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
+           (c >= '0' && c <= '9') || 
+           (c != '\0' && std::strchr("-._~!$&'()*+,;=:@/", c));
+}
+
+
+static size_t fileUriLength(std::string const& path)
+{
+    size_t length = std::strlen("file://");
+    
+    for (char c : path)
+    {
+        length += isUriSafe(c) ? 1 : 3;
+    }
+    
+    return length;
+}
+
+
+static void appendFileUri(std::string& uris, std::string const& path)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    
+    uris += "file://";
+    
+    for (char c : path)
+    {
+        unsigned char const byte = c;
+        
+        if (isUriSafe(byte))
+        {
+            uris += c;
+        }
+        else
+        {
+            uris += '%';
+            uris += HEX[byte >> 4];
+            uris += HEX[byte & 0x0F];
+        }
+    }
+}
+
+
 MainWidget::MainWidget(
-        DbReader&& db, 
         ScanEventSource scanEventSource,
         fs::path const& configDir)
- : db_(std::move(db))
- , scanEventSource_(scanEventSource)
- , expandRowsFileName_((configDir / "expanded_rows").string())
+ : scanEventSource_(scanEventSource)
+ , pModeCombo_(nullptr)
+ , pTotalsColumn_(nullptr)
+ , pTreeWindow_(nullptr)
+ , pResultsWindow_(nullptr)
+ , searchGeneration_(0)
+ , expandRowsFileName_((configDir / "expanded_dirs").string())
+ , snapshotFileName_((configDir / "medialib_tree").string())
 {
     // "mode" combo
-    auto pModeCombo = Gtk::manage(new Gtk::ComboBoxText());
-    pModeCombo->set_tooltip_text("Display mode");
-    pModeCombo->append("By directory structure");
-    pModeCombo->set_active(0);
+    // entries follow GroupMode, offset by the directory mode
+    pModeCombo_ = Gtk::manage(new Gtk::ComboBoxText());
+    pModeCombo_->set_tooltip_text("Display mode");
+    pModeCombo_->append("By directory structure");
+    pModeCombo_->append("By artist");
+    pModeCombo_->append("By album artist / album");
+    pModeCombo_->append("By genre");
+    pModeCombo_->append("By year");
+    pModeCombo_->set_active(0);
+    pModeCombo_->signal_changed().connect(
+            sigc::mem_fun(*this, &MainWidget::onModeChanged));
     
     // button "Refresh"
     auto pRefreshImg = Gtk::manage(
@@ -50,30 +193,55 @@ MainWidget::MainWidget(
     
     // row with "mode" combo, "refresh" and "properties" buttons
     auto pPirstRow = Gtk::manage(new Gtk::HBox());
-	pPirstRow->pack_start(*pModeCombo, Gtk::PACK_EXPAND_WIDGET);
+	pPirstRow->pack_start(*pModeCombo_, Gtk::PACK_EXPAND_WIDGET);
     pPirstRow->pack_end(*pBtnSettings, Gtk::PACK_SHRINK);
     pPirstRow->pack_end(*pBtnRefresh, Gtk::PACK_SHRINK);
 	
 	pTreeModel_ = Gtk::TreeStore::create(byDirColumns);
+	pTreeModel_->set_sort_func(byDirColumns.filename, &compareRows);
 	pTreeModel_->set_sort_column(byDirColumns.filename, Gtk::SORT_ASCENDING);
-	// adding mapping of root record to root row 
-	file2row_.insert(std::make_pair(ROOT_RECORD_ID, 
-		Gtk::TreeModel::RowReference(pTreeModel_, Gtk::TreeModel::Path("0"))));
-	fillData(ROOT_RECORD_ID, pTreeModel_->children());
+	// the scanner gets the directories shown before they're loaded
+	activeRecords_->ids = loadExpandedRows();
+	fillSnapshot();
 	setupTreeView();
     
+    // search entry, filters as the user types
+    searchEntry_.set_tooltip_text("Search names and tags");
+#ifndef USE_GTK2
+    searchEntry_.set_placeholder_text("Search");
+#endif
+    searchEntry_.signal_changed().connect(
+            sigc::mem_fun(*this, &MainWidget::onSearchChanged));
+    
+    pResultsModel_ = Gtk::ListStore::create(byDirColumns);
+    pResultsModel_->set_sort_func(byDirColumns.filename, &compareRows);
+    pResultsModel_->set_sort_column(byDirColumns.filename, Gtk::SORT_ASCENDING);
+    setupResultsView();
+    
     // main window containing the tree view
-    auto pScrolledWindow = Gtk::manage(new Gtk::ScrolledWindow());
-	pScrolledWindow->set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
-    pScrolledWindow->add(treeVeiew_);
+    pTreeWindow_ = Gtk::manage(new Gtk::ScrolledWindow());
+	pTreeWindow_->set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
+    pTreeWindow_->add(treeVeiew_);
+    
+    // shown instead of the tree, so that its expanded rows are kept
+    pResultsWindow_ = Gtk::manage(new Gtk::ScrolledWindow());
+	pResultsWindow_->set_policy(Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
+    pResultsWindow_->add(resultsView_);
     
     // entire plugin widget
     auto pSideBar = Gtk::manage(new Gtk::VBox());
 	pSideBar->pack_start(*pPirstRow, Gtk::PACK_SHRINK);
-	pSideBar->pack_start(*pScrolledWindow, Gtk::PACK_EXPAND_WIDGET);
+	pSideBar->pack_start(searchEntry_, Gtk::PACK_SHRINK);
+	pSideBar->pack_start(*pTreeWindow_, Gtk::PACK_EXPAND_WIDGET);
+	pSideBar->pack_start(*pResultsWindow_, Gtk::PACK_EXPAND_WIDGET);
     add(*pSideBar);
-    restoreExpandedRows();
+    restoreExpandedRows(pTreeModel_->children());
     show_all();
+    pResultsWindow_->hide();
+    
+    // enabled once the database is open
+    pModeCombo_->set_sensitive(false);
+    searchEntry_.set_sensitive(false);
 	
 	changeConnection_ = onChangesDisp_.connect(
 			sigc::mem_fun(*this, &MainWidget::onChanged));
@@ -82,8 +250,103 @@ MainWidget::MainWidget(
 
 MainWidget::~MainWidget()
 {
+    searchConnection_.disconnect();
     changeConnection_.disconnect();
     saveExpandedRows();
+    saveSnapshot();
+}
+
+
+void MainWidget::attach(DbReader&& db, DbReader&& searchDb)
+{
+    db_.emplace(std::move(db));
+    // every change reaches the widget as a scan event
+    db_->enableFileCache(FILE_CACHE_SIZE);
+    pSearchWorker_.reset(new SearchWorker(std::move(searchDb)));
+	searchConnection_ = pSearchWorker_->getOnResultsDisp().connect(
+			sigc::mem_fun(*this, &MainWidget::onSearchResults));
+    
+    // live rows replace the snapshot, expanded ones are kept
+    pTreeModel_->clear();
+    file2row_.clear();
+    fillData(ROOT_RECORD_ID, pTreeModel_->children());
+    restoreExpandedRows(pTreeModel_->children());
+    
+    pModeCombo_->set_sensitive(true);
+    searchEntry_.set_sensitive(true);
+    onSearchChanged(); // in case text came before the database
+}
+
+
+// rows shown when the widget was closed, until the database is open
+void MainWidget::fillSnapshot()
+try
+{
+    TreeSnapshot const snapshot(snapshotFileName_);
+    
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+        FileRecord const rec = snapshot.record(i);
+        
+        if (rec.second.parentID == ROOT_RECORD_ID)
+        {
+            fillRow(pTreeModel_->append(), RecordView(rec));
+            continue;
+        }
+        
+        auto const itParent = file2row_.find(rec.second.parentID);
+        
+        if (itParent == file2row_.end())
+        {
+            continue;
+        }
+        
+        Gtk::TreeModel::iterator const itParentRow = 
+                pTreeModel_->get_iter(itParent->second.get_path());
+        
+        if (!isLoaded(*itParentRow))
+        { // the placeholder goes with the first child
+            pTreeModel_->erase(itParentRow->children().begin());
+        }
+        
+        fillRow(pTreeModel_->append(itParentRow->children()), RecordView(rec));
+    }
+}
+catch(const std::exception& e)
+{
+	std::cerr << "Failed to read tree snapshot: " << e.what() << std::endl;
+}
+
+
+// top level rows and the children of expanded ones, parents first
+void MainWidget::saveSnapshot()
+try
+{
+    if (groupMode_ || !db_)
+    {
+        return;
+    }
+    
+    RecordIDs const expanded = activeRecords_->ids;
+    FileRecords records = db_->childrenFiles(ROOT_RECORD_ID);
+    
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        RecordID const id = records[i].first;
+        
+        if (records[i].second.isDir && expanded.count(id))
+        {
+            FileRecords children = db_->childrenFiles(id);
+            std::move(children.begin(), children.end(), 
+                    std::back_inserter(records));
+        }
+    }
+    
+    TreeSnapshot::write(snapshotFileName_, records);
+}
+catch(const std::exception& e)
+{
+	std::cerr << "Failed to save tree snapshot: " << e.what() << std::endl;
 }
 
 
@@ -91,9 +354,11 @@ void MainWidget::setupTreeView()
 {
     treeVeiew_.set_model(pTreeModel_);
 	treeVeiew_.append_column("File Name", byDirColumns.filename);
+	int const columns = treeVeiew_.append_column("Totals", byDirColumns.totals);
+	pTotalsColumn_ = treeVeiew_.get_column(columns - 1);
+	pTotalsColumn_->set_visible(Plugin::getSettings().showTotals);
 	treeVeiew_.set_headers_visible(false);
-// TODO: support multi-line drag'n'drop 
-//    treeVeiew_.get_selection()->set_mode(Gtk::SELECTION_MULTIPLE);
+    treeVeiew_.get_selection()->set_mode(Gtk::SELECTION_MULTIPLE);
 	treeVeiew_.signal_row_activated().connect(
         sigc::mem_fun(*this, &MainWidget::onRowActivated));
     treeVeiew_.signal_row_expanded().connect(
@@ -107,110 +372,545 @@ void MainWidget::setupTreeView()
                 Gtk::TARGET_SAME_APP | Gtk::TARGET_OTHER_WIDGET) };
     
     treeVeiew_.enable_model_drag_source(targets);
-    treeVeiew_.signal_drag_data_get().connect(
-        sigc::mem_fun(*this, &MainWidget::onDragDataGet));
+    treeVeiew_.signal_drag_data_get().connect(sigc::bind(
+        sigc::mem_fun(*this, &MainWidget::onDragDataGet), &treeVeiew_));
+}
+
+
+void MainWidget::setupResultsView()
+{
+    resultsView_.set_model(pResultsModel_);
+	resultsView_.append_column("File Name", byDirColumns.filename);
+	resultsView_.set_headers_visible(false);
+    resultsView_.get_selection()->set_mode(Gtk::SELECTION_MULTIPLE);
+	resultsView_.signal_row_activated().connect(
+        sigc::mem_fun(*this, &MainWidget::onResultActivated));
+    
+    std::vector<Gtk::TargetEntry> targets =
+        { Gtk::TargetEntry("text/uri-list", 
+                Gtk::TARGET_SAME_APP | Gtk::TARGET_OTHER_WIDGET) };
+    
+    resultsView_.enable_model_drag_source(targets);
+    resultsView_.signal_drag_data_get().connect(sigc::bind(
+        sigc::mem_fun(*this, &MainWidget::onDragDataGet), &resultsView_));
+}
+
+
+void MainWidget::onSearchChanged()
+{
+    std::string const query = searchEntry_.get_text();
+    
+    if (!pSearchWorker_)
+    {
+        return;
+    }
+    
+    if (query.size() < MIN_QUERY_LENGTH)
+    {
+        searchGeneration_ = pSearchWorker_->search(std::string()); // cancels
+        pResultsModel_->clear();
+        pResultsWindow_->hide();
+        pTreeWindow_->show();
+        return;
+    }
+    
+    searchGeneration_ = pSearchWorker_->search(query);
+}
+
+
+void MainWidget::onSearchResults()
+{
+    auto results = pSearchWorker_->takeResults();
+    
+    if (!results || results->generation != searchGeneration_)
+    {
+        return; // a newer query is on its way
+    }
+    
+    pResultsModel_->clear();
+    
+    for (FileRecord const& rec : results->files)
+    {
+        Gtk::TreeModel::iterator itRow = pResultsModel_->append();
+        (*itRow)[byDirColumns.fileId] = rec.first;
+        (*itRow)[byDirColumns.groupId] = NULL_RECORD_ID;
+        (*itRow)[byDirColumns.sortKey] = rec.second.sortKey;
+        (*itRow)[byDirColumns.filename] = 
+                fs::path(rec.second.fileName).filename().string();
+    }
+    
+    pTreeWindow_->hide();
+    pResultsWindow_->show();
 }
 
 
 void MainWidget::saveExpandedRows()
 try
 {
-    std::ofstream expRowsFile(expandRowsFileName_);
+    if (groupMode_)
+    {
+        return; // directory mode rows are kept while browsing by tags
+    }
+    
+    // directories gone meanwhile have never been loaded
+    RecordIDs const expanded = activeRecords_->ids;
+    std::vector<RecordID> ids;
+    
+    for (RecordID id : expanded)
+    {
+        if (file2row_.count(id))
+        {
+            ids.push_back(id);
+        }
+    }
+    
+    ExpandedRowsHeader const header{ EXPANDED_ROWS_MAGIC, 
+            static_cast<uint32_t>(ids.size()) };
+    std::string const tmpFileName = expandRowsFileName_ + ".tmp";
     
-    treeVeiew_.map_expanded_rows(
-    [&expRowsFile](Gtk::TreeView* tree_view, const Gtk::TreeModel::Path& path)
     {
-        expRowsFile << path.to_string() << std::endl;
-    });
+        std::ofstream expRowsFile(tmpFileName, std::ios::binary);
+        expRowsFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        expRowsFile.write(reinterpret_cast<const char*>(ids.data()), 
+                ids.size() * sizeof(RecordID));
+        
+        if (!expRowsFile.flush())
+        {
+            throw std::runtime_error("failed to write " + tmpFileName);
+        }
+    }
+    
+    fs::rename(tmpFileName, expandRowsFileName_);
 }
-catch(std::exception const& e)
+catch(const std::exception& e)
 {
 	std::cerr << "Failed to save expanded rows: " << e.what() << std::endl;
 }
 
 
-void MainWidget::restoreExpandedRows()
+RecordIDs MainWidget::loadExpandedRows() const
+try
+{
+    std::ifstream expRowsFile(expandRowsFileName_, std::ios::binary);
+    ExpandedRowsHeader header;
+    
+    if (!expRowsFile.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            header.magic != EXPANDED_ROWS_MAGIC)
+    {
+        return RecordIDs(); // none saved yet
+    }
+    
+    // a corrupt count mustn't allocate more than the file holds
+    uint64_t const idsSize = fs::file_size(expandRowsFileName_) - sizeof(header);
+    
+    if (uint64_t(header.count) * sizeof(RecordID) > idsSize)
+    {
+        std::cerr << "Expanded rows file is truncated" << std::endl;
+        return RecordIDs();
+    }
+    
+    std::vector<RecordID> ids(header.count);
+    
+    if (!expRowsFile.read(reinterpret_cast<char*>(ids.data()), 
+            ids.size() * sizeof(RecordID)))
+    {
+        std::cerr << "Expanded rows file is truncated" << std::endl;
+        return RecordIDs();
+    }
+    
+    return RecordIDs(ids.begin(), ids.end());
+}
+catch(const std::exception& e)
+{
+	std::cerr << "Failed to load expanded rows: " << e.what() << std::endl;
+	return RecordIDs();
+}
+
+
+// expands rows which were expanded before, their children are restored in 
+// turn by onRowExpanded() as they are loaded
+void MainWidget::restoreExpandedRows(const Gtk::TreeModel::Children& rows)
 {
-    std::ifstream expRowsFile(expandRowsFileName_);
-    char buff[256];
+    RecordIDs const expanded = activeRecords_->ids;
+    std::vector<Gtk::TreeModel::Path> paths;
+    
+    for (auto itRow = rows.begin(); itRow != rows.end(); ++itRow)
+    {
+        RecordID const id = (*itRow)[byDirColumns.fileId];
+        
+        if (id != NULL_RECORD_ID && expanded.count(id) && !isLoaded(*itRow))
+        {
+            paths.push_back(pTreeModel_->get_path(itRow));
+        }
+    }
+    
+    for (Gtk::TreeModel::Path const& path : paths)
+    {
+        treeVeiew_.expand_row(path, /*expand all*/false);
+    }
+}
+
+
+void MainWidget::onDisconnect()
+{
+    saveExpandedRows();
+    saveSnapshot();
+    
+    if (db_)
+    {
+        FileCacheStats const stats = db_->fileCacheStats();
+        uint64_t const reads = stats.hits + stats.misses;
+        
+        std::clog << "[Widget] file cache: " << stats.hits << " hits, " 
+                << stats.misses << " misses (" 
+                << (reads ? stats.hits * 100 / reads : 0) << "%), "
+                << stats.invalidated << " invalidated" << std::endl;
+        
+        // where the widget's queries spent their time
+        std::vector<StatementStats> statements = db_->statementStats();
+        size_t const top = std::min<size_t>(statements.size(), 5);
+        
+        std::partial_sort(statements.begin(), statements.begin() + top, 
+            statements.end(), [](const StatementStats& a, const StatementStats& b)
+            {
+                return a.nsec > b.nsec;
+            });
+        
+        for (size_t i = 0; i < top; ++i)
+        {
+            std::clog << "[Widget] " << statements[i].name << ": " 
+                    << statements[i].runs << " runs, " 
+                    << statements[i].nsec / 1000000 << " ms" << std::endl;
+        }
+    }
+}
+
+
+void MainWidget::onSettings()
+{
+    Settings settings = Plugin::getSettings();
+    SettingsDlg dlgSettings(settings);
+    
+    if (dlgSettings.run() == Gtk::RESPONSE_OK)
+    {
+        bool const showTotals = settings.showTotals;
+        Plugin::storeSettings(std::move(settings));
+        
+        if (showTotals != pTotalsColumn_->get_visible())
+        {
+            pTotalsColumn_->set_visible(showTotals);
+            refreshTotals();
+        }
+    }
+}
+
+
+void MainWidget::fillData(
+		const RecordID& from, const Gtk::TreeModel::Children& to)
+{
+	db_->forEachChild(from, [&](RecordView const& rec)
+	{
+		fillRow(pTreeModel_->append(to), rec);
+	});
+}
+
+
+void MainWidget::fillRow(Gtk::TreeModel::iterator itRow, RecordView const& rec)
+{
+	(*itRow)[byDirColumns.fileId] = rec.id;
+	// the key first, the row is moved into place once its name is set
+	(*itRow)[byDirColumns.sortKey] = std::string(rec.sortKey);
+	(*itRow)[byDirColumns.filename] = 
+			std::string(rec.fileName.substr(rec.fileName.rfind('/') + 1));
+	
+	if (rec.isDir)
+	{
+		(*itRow)[byDirColumns.totals] = formatTotals(rec);
+	}
+
+	Gtk::TreeModel::Path path = pTreeModel_->get_path(itRow);
+
+	file2row_.insert(std::make_pair(rec.id, 
+		Gtk::TreeModel::RowReference(pTreeModel_, std::move(path))));
+	
+	if (rec.isDir && itRow->children().empty())
+	{ // children are loaded on expansion
+		Gtk::TreeModel::iterator itChild = pTreeModel_->append(itRow->children());
+		(*itChild)[byDirColumns.fileId] = NULL_RECORD_ID;
+		(*itChild)[byDirColumns.groupId] = NULL_RECORD_ID;
+	}
+}
+
+
+void MainWidget::onModeChanged()
+{
+    int const active = pModeCombo_->get_active_row_number();
+    std::optional<GroupMode> mode;
+    
+    if (active > 0)
+    {
+        mode = static_cast<GroupMode>(active - 1);
+    }
+    
+    if (mode == groupMode_)
+    {
+        return;
+    }
+    
+    saveExpandedRows();
+    groupMode_ = mode;
+    
+    pTreeModel_->clear();
+    file2row_.clear();
+    
+    {
+        // expanded directories aren't shown anymore or are restored below
+        auto locked = activeRecords_.synchronize();
+        locked->ids = groupMode_ ? RecordIDs() : loadExpandedRows();
+        
+        if (locked->onChanged)
+        {
+            locked->onChanged(/*restart*/false);
+        }
+    }
+    
+    if (groupMode_)
+    {
+        fillGroups(NULL_RECORD_ID, pTreeModel_->children());
+    }
+    else
+    {
+        fillData(ROOT_RECORD_ID, pTreeModel_->children());
+        restoreExpandedRows(pTreeModel_->children());
+    }
+}
+
+
+void MainWidget::fillGroups(
+        RecordID parentId, const Gtk::TreeModel::Children& to)
+try
+{
+    for (TagGroup const& group : db_->tagGroups(*groupMode_, parentId))
+    {
+        fillGroupRow(pTreeModel_->append(to), group);
+    }
+}
+catch(const std::exception& e)
+{
+	std::cerr << "Failed to read tag groups: " << e.what() << std::endl;
+}
+
+
+void MainWidget::fillGroupRow(
+        Gtk::TreeModel::iterator itRow, TagGroup const& group)
+{
+    std::string const name = group.name.empty() ? "[unknown]" : group.name;
+    
+	(*itRow)[byDirColumns.fileId] = NULL_RECORD_ID;
+	(*itRow)[byDirColumns.groupId] = group.id;
+	(*itRow)[byDirColumns.sortKey] = group.sortKey;
+	(*itRow)[byDirColumns.filename] = 
+            name + " (" + std::to_string(group.count) + ")";
+    
+    if (itRow->children().empty())
+    { // children are loaded on expansion
+        Gtk::TreeModel::iterator itChild = pTreeModel_->append(itRow->children());
+        (*itChild)[byDirColumns.fileId] = NULL_RECORD_ID;
+        (*itChild)[byDirColumns.groupId] = NULL_RECORD_ID;
+    }
+}
+
+
+void MainWidget::fillTracks(RecordID groupId, const Gtk::TreeModel::Children& to)
+try
+{
+    bool const isAlbum = groupMode_ == GroupMode::ALBUM;
+    
+    for (TrackRecord const& track : db_->groupTracks(groupId))
+    {
+        std::string name = track.title.empty() ? 
+                fs::path(track.fileName).filename().string() : track.title;
+        
+        if (isAlbum && track.trackNo > 0)
+        {
+            char number[16];
+            snprintf(number, sizeof(number), "%02d. ", track.trackNo);
+            name.insert(0, number);
+        }
+        
+        Gtk::TreeModel::iterator itRow = pTreeModel_->append(to);
+        (*itRow)[byDirColumns.fileId] = track.fileId;
+        (*itRow)[byDirColumns.groupId] = NULL_RECORD_ID;
+        // track labels aren't stored, so their keys are made here once
+        (*itRow)[byDirColumns.sortKey] = sortKey(name);
+        (*itRow)[byDirColumns.filename] = name;
+    }
+}
+catch(const std::exception& e)
+{
+	std::cerr << "Failed to read group tracks: " << e.what() << std::endl;
+}
+
+
+bool MainWidget::isLoaded(Gtk::TreeModel::Row const& row) const
+{
+    auto const children = row.children();
+    
+    if (children.empty())
+    {
+        return true;
+    }
+    
+    Gtk::TreeModel::Row const first = *children.begin();
+    RecordID const fileId = first[byDirColumns.fileId];
+    RecordID const groupId = first[byDirColumns.groupId];
+    
+    return fileId != NULL_RECORD_ID || groupId != NULL_RECORD_ID;
+}
+
+
+bool MainWidget::hasSubgroups(Gtk::TreeModel::Path const& path) const
+{
+    return groupMode_ == GroupMode::ALBUM && path.size() == 1;
+}
+
+
+// brings loaded group rows in line with the database after tags changed,
+// keeping rows of groups which still exist along with their expansion
+void MainWidget::syncGroups(
+        RecordID parentId, const Gtk::TreeModel::Children& rows)
+{
+    std::unordered_map<RecordID, TagGroup> groups;
+    
+    for (TagGroup& group : db_->tagGroups(*groupMode_, parentId))
+    {
+        RecordID const id = group.id;
+        groups.emplace(id, std::move(group));
+    }
+    
+    // relabelled rows move within the sorted store, so they're collected
+    // first; TreeStore iterators stay valid while rows are reordered
+    std::vector<Gtk::TreeModel::iterator> existing;
+    
+    for (auto itRow = rows.begin(); itRow != rows.end(); ++itRow)
+    {
+        existing.push_back(itRow);
+    }
+    
+    for (Gtk::TreeModel::iterator const& itRow : existing)
+    {
+        RecordID const groupId = (*itRow)[byDirColumns.groupId];
+        auto const itGroup = groups.find(groupId);
+        
+        if (itGroup == groups.end())
+        {
+            pTreeModel_->erase(itRow);
+            continue;
+        }
+        
+        Glib::ustring const oldLabel = (*itRow)[byDirColumns.filename];
+        fillGroupRow(itRow, itGroup->second);
+        groups.erase(itGroup);
+        
+        if (!isLoaded(*itRow))
+        {
+            continue;
+        }
+        
+        if (hasSubgroups(pTreeModel_->get_path(itRow)))
+        {
+            syncGroups(groupId, itRow->children());
+            continue;
+        }
+        
+        Glib::ustring const newLabel = (*itRow)[byDirColumns.filename];
+        
+        if (oldLabel != newLabel)
+        { // the count changed, track rows are simply reloaded
+            while (!itRow->children().empty())
+            {
+                pTreeModel_->erase(itRow->children().begin());
+            }
+            
+            fillTracks(groupId, itRow->children());
+        }
+    }
     
-    while (expRowsFile.getline(buff, sizeof(buff)))
+    for (auto const& group : groups)
     {
-        Glib::ustring const str(buff, expRowsFile.gcount() - 1);
-        Gtk::TreeModel::Path const path(str);
-        treeVeiew_.expand_row(path, /*expand all*/false);
+        fillGroupRow(pTreeModel_->append(rows), group.second);
     }
 }
 
 
-void MainWidget::onDisconnect()
-{
-    saveExpandedRows();
-}
-
-
-void MainWidget::onSettings()
+std::vector<std::string> MainWidget::rowFiles(Gtk::TreeModel::Row const& row)
 {
-    Settings settings = Plugin::getSettings();
-    SettingsDlg dlgSettings(settings);
+    std::vector<std::string> files;
+    RecordID const groupId = row[byDirColumns.groupId];
+    RecordID const fileId = row[byDirColumns.fileId];
     
-    if (dlgSettings.run() == Gtk::RESPONSE_OK)
+    if (groupId != NULL_RECORD_ID)
     {
-        Plugin::storeSettings(std::move(settings));
+        for (TrackRecord& track : db_->groupTracks(groupId))
+        {
+            files.push_back(std::move(track.fileName));
+        }
     }
-}
-
-
-void MainWidget::fillData(
-		const RecordID& from, const Gtk::TreeModel::Children& to)
-{
-    std::set<RecordID> subdirIDs;
-    
-	for (FileRecord const& rec : db_.childrenFiles(from))
-	{
-		Gtk::TreeModel::iterator itRow = pTreeModel_->append(to);
-		
-		fillRow(itRow, rec);
-		
-		if (rec.second.isDir)
-		{
-			subdirIDs.insert(rec.first);
-		}
-	}
-    
-    for (auto itRow = to.begin(); itRow != to.end(); ++itRow)
+    else if (fileId != NULL_RECORD_ID)
     {
-        RecordID id = (*itRow)[byDirColumns.fileId];
+        FileInfo file = db_->getFile(fileId);
         
-        if (subdirIDs.count(id))
+        if (file.isDir)
+        { // from the library, so that deadbeef doesn't walk the folder again
+            files = db_->subtreeFiles(fileId);
+        }
+        else
         {
-            fillData(id, (*itRow)->children());
+            files.push_back(std::move(file.fileName));
         }
     }
+    
+    return files;
 }
 
 
-void MainWidget::fillRow(Gtk::TreeModel::iterator itRow, FileRecord const& rec)
+void MainWidget::onRowActivated(
+		const Gtk::TreeModel::Path& path, 
+		Gtk::TreeViewColumn* /*column*/)
 {
-	(*itRow)[byDirColumns.fileId] = rec.first;
-	(*itRow)[byDirColumns.filename] = 
-			fs::path(rec.second.fileName).filename().string();
-
-	Gtk::TreeModel::Path path = pTreeModel_->get_path(itRow);
-
-	file2row_.insert(std::make_pair(rec.first, 
-		Gtk::TreeModel::RowReference(pTreeModel_, std::move(path))));
+	activateRow(pTreeModel_->get_iter(path));
 }
 
 
-void MainWidget::onRowActivated(
+void MainWidget::onResultActivated(
 		const Gtk::TreeModel::Path& path, 
 		Gtk::TreeViewColumn* /*column*/)
+{
+	activateRow(pResultsModel_->get_iter(path));
+}
+
+
+void MainWidget::activateRow(Gtk::TreeModel::iterator itRow)
 try
 {
-	Gtk::TreeModel::iterator itRow = pTreeModel_->get_iter(path);
+	if (!itRow || !db_)
+	{
+		return;
+	}
+	
+	RecordID const fileId = (*itRow)[byDirColumns.fileId];
+	RecordID const groupId = (*itRow)[byDirColumns.groupId];
+	
+	if (groupId == NULL_RECORD_ID && fileId != NULL_RECORD_ID && 
+			db_->getFile(fileId).isDir)
+	{
+		requestCheck(fileId);
+	}
+	
+	// read before the playlists are locked, large folders take a while
+	std::vector<std::string> const files = rowFiles(*itRow);
 	
-	if (!itRow)
+	if (files.empty())
 	{
 		return;
 	}
@@ -255,21 +955,11 @@ try
 		ddb_playlist_t* const plt_;
 	} lockPlaylist(plt);
 	
-	FileInfo const rec = db_.getFile((*itRow)[byDirColumns.fileId]);
-	
-	if (rec.isDir)
+	for (std::string const& fileName : files)
 	{
-		if (deadbeef->plt_add_dir2 (0, plt, rec.fileName.c_str(), NULL, NULL) < 0)
+		if (deadbeef->plt_add_file2 (0, plt, fileName.c_str(), NULL, NULL) < 0)
 		{
-			std::cerr << "Failed to add folder '" << rec.fileName
-					<< "' to playlist" << std::endl;
-		}
-	}
-	else if (fs::is_regular_file(rec.fileName.c_str()))
-	{
-		if (deadbeef->plt_add_file2 (0, plt, rec.fileName.c_str(), NULL, NULL) < 0)
-        {
-			std::cerr << "Failed to add file '" << rec.fileName
+			std::cerr << "Failed to add file '" << fileName
 					<< "' to playlist" << std::endl;
 		}
 	}
@@ -284,38 +974,141 @@ void MainWidget::onDragDataGet(
         const Glib::RefPtr<Gdk::DragContext>& context,
         Gtk::SelectionData& selection_data, 
         guint /*info*/, 
-        guint /*time*/)
+        guint /*time*/,
+        Gtk::TreeView* pView)
 try
 {
-    Glib::RefPtr<Gtk::TreeSelection> pSelection = treeVeiew_.get_selection();
-    Glib::ustring uris;
+    if (!db_)
+    {
+        return; // snapshot rows only
+    }
+    
+    Glib::RefPtr<Gtk::TreeSelection> pSelection = pView->get_selection();
+    std::vector<Gtk::TreeModel::iterator> rows;
+    std::vector<RecordID> fileIds;
     
     pSelection->selected_foreach_iter(
-        [this, &uris](const Gtk::TreeModel::iterator& itRow)
+        [&](const Gtk::TreeModel::iterator& itRow)
         {
-            FileInfo const rec = db_.getFile((*itRow)[byDirColumns.fileId]);
-
-            if (!uris.empty())
+            // rows within a selected folder or group come along with it
+            for (auto itParent = itRow->parent(); itParent; 
+                    itParent = itParent->parent())
             {
-                uris += ' ';
+                if (pSelection->is_selected(itParent))
+                {
+                    return;
+                }
             }
             
-            uris += Glib::filename_to_uri(rec.fileName);
+            rows.push_back(itRow);
+            RecordID const groupId = (*itRow)[byDirColumns.groupId];
+            RecordID const fileId = (*itRow)[byDirColumns.fileId];
+            
+            if (groupId == NULL_RECORD_ID && fileId != NULL_RECORD_ID)
+            {
+                fileIds.push_back(fileId);
+            }
         });
+    
+    std::unordered_map<RecordID, FileInfo> records;
+    
+    for (FileRecord& rec : db_->getFiles(fileIds))
+    {
+        records.emplace(rec.first, std::move(rec.second));
+    }
+    
+    std::vector<std::string> fileNames;
+    
+    for (Gtk::TreeModel::iterator const& itRow : rows)
+    {
+        RecordID const groupId = (*itRow)[byDirColumns.groupId];
+        RecordID const fileId = (*itRow)[byDirColumns.fileId];
+        auto const itRecord = records.find(fileId);
+        
+        if (groupId != NULL_RECORD_ID)
+        {
+            for (std::string& fileName : rowFiles(*itRow))
+            {
+                fileNames.push_back(std::move(fileName));
+            }
+        }
+        else if (itRecord == records.end())
+        {
+            continue; // placeholder or deleted meanwhile
+        }
+        else if (itRecord->second.isDir)
+        {
+            for (std::string& fileName : db_->subtreeFiles(fileId))
+            {
+                fileNames.push_back(std::move(fileName));
+            }
+        }
+        else
+        {
+            fileNames.push_back(std::move(itRecord->second.fileName));
+        }
+    }
+    
+    // sized up front, the list of a few albums is megabytes long
+    size_t length = 0;
+    
+    for (std::string const& fileName : fileNames)
+    {
+        length += fileUriLength(fileName) + 1;
+    }
+    
+    std::string uris;
+    uris.reserve(length);
+    
+    for (std::string const& fileName : fileNames)
+    {
+        if (!uris.empty())
+        {
+            uris += ' ';
+        }
         
-    selection_data.set(selection_data.get_target(), uris);
+        appendFileUri(uris, fileName);
+    }
+    
+    selection_data.set(selection_data.get_target(), 8, 
+            reinterpret_cast<const guint8*>(uris.data()), uris.size());
 }
 catch(const Glib::Exception& e)
 {
 	std::cerr << "Failed to drag'n'drop file to playlist: " << e.what() << std::endl;
 }
+catch(const std::exception& e)
+{
+	std::cerr << "Failed to drag'n'drop file to playlist: " << e.what() << std::endl;
+}
 
 
 void MainWidget::onChanged()
 {
+    showDegradedRoots();
+    
+    bool groupsChanged = false;
+    // and the parents of deleted ones, which can't be looked up anymore
+    RecordIDs changedIds;
+    
 	while (!scanEventSource_.empty())
 	{
 		ScanEvent e = scanEventSource_.pull();
+		forgetCached(e);
+		
+		if (groupMode_)
+		{ // deleted files take their tracks along
+			groupsChanged = groupsChanged || 
+					e.type == ScanEvent::TAGGED || e.type == ScanEvent::DELETED;
+			continue;
+		}
+		
+		changedIds.insert(e.id);
+		
+		if (e.parentId != NULL_RECORD_ID)
+		{
+			changedIds.insert(e.parentId);
+		}
 		
 		switch(e.type)
 		{
@@ -332,8 +1125,174 @@ void MainWidget::onChanged()
 		case ScanEvent::UPDATED:
             std::clog << "[Widget] onUpdated " << e.id << std::endl;
 			break;
+			
+		case ScanEvent::TAGGED:
+			// not shown in the directory view
+			break;
 		}
 	}
+    
+    if (!changedIds.empty())
+    {
+        refreshTotals(changedIds);
+    }
+    
+    if (!groupsChanged)
+    {
+        return;
+    }
+    
+    try
+    {
+        syncGroups(NULL_RECORD_ID, pTreeModel_->children());
+    }
+    catch(std::exception const& e)
+    {
+        std::cerr << "Failed to update tag groups: " << e.what() << std::endl;
+    }
+}
+
+
+void MainWidget::forgetCached(const ScanEvent& event)
+try
+{
+    if (db_)
+    {
+        db_->invalidate(event.id, event.parentId);
+    }
+}
+catch(std::exception const& e)
+{ // dropped as a whole then, stale records mustn't be shown
+    std::cerr << "Failed to invalidate cached file: " << e.what() << std::endl;
+    db_->enableFileCache(FILE_CACHE_SIZE);
+}
+
+
+void MainWidget::showDegradedRoots()
+{
+    std::vector<std::string> roots = Plugin::degradedRoots();
+    
+    if (roots == degradedRoots_)
+    {
+        return;
+    }
+    
+    degradedRoots_ = std::move(roots);
+    
+    if (degradedRoots_.empty())
+    {
+        treeVeiew_.set_has_tooltip(false);
+        return;
+    }
+    
+    std::string text = "Not responding, retried in the background:";
+    
+    for (const std::string& root : degradedRoots_)
+    {
+        text += "\n" + root;
+    }
+    
+    treeVeiew_.set_tooltip_text(text);
+}
+
+
+// totals of the directory rows shown, summed up by the db as files change
+void MainWidget::refreshTotals()
+{
+    if (groupMode_ || !db_ || !pTotalsColumn_->get_visible())
+    {
+        return;
+    }
+    
+    std::vector<RecordID> dirIds;
+    
+    for (auto const& entry : file2row_)
+    {
+        Gtk::TreeModel::iterator const itRow = 
+                pTreeModel_->get_iter(entry.second.get_path());
+        
+        if (!itRow->children().empty())
+        { // files have no children, not even a placeholder
+            dirIds.push_back(entry.first);
+        }
+    }
+    
+    fillTotals(dirIds);
+}
+
+
+void MainWidget::refreshTotals(const RecordIDs& changedIds)
+try
+{
+    if (groupMode_ || !db_ || !pTotalsColumn_->get_visible())
+    {
+        return;
+    }
+    
+    RecordIDs dirIds;
+    
+    for (RecordID id : changedIds)
+    {
+        try
+        { // records without a row are followed up to one which has it
+            while (id != ROOT_RECORD_ID && !file2row_.count(id))
+            {
+                id = db_->getFile(id).parentID;
+            }
+        }
+        catch(std::out_of_range const&)
+        {
+            continue; // deleted, its parent is among the changed ids
+        }
+        
+        if (id == ROOT_RECORD_ID)
+        {
+            continue;
+        }
+        
+        for (Gtk::TreeModel::iterator itRow = 
+                pTreeModel_->get_iter(file2row_.at(id).get_path()); 
+                itRow; itRow = itRow->parent())
+        {
+            RecordID const rowId = (*itRow)[byDirColumns.fileId];
+            
+            if (itRow->children().empty())
+            {
+                continue; // a file
+            }
+            
+            if (!dirIds.insert(rowId).second)
+            {
+                break; // the rows above it are in already
+            }
+        }
+    }
+    
+    fillTotals(std::vector<RecordID>(dirIds.begin(), dirIds.end()));
+}
+catch(std::exception const& e)
+{
+    std::cerr << "Failed to update folder totals: " << e.what() << std::endl;
+}
+
+
+void MainWidget::fillTotals(const std::vector<RecordID>& dirIds)
+try
+{
+    for (FileRecord const& rec : db_->getFiles(dirIds))
+    {
+        auto const itRow = file2row_.find(rec.first);
+        
+        if (itRow != file2row_.end())
+        {
+            (*pTreeModel_->get_iter(itRow->second.get_path()))
+                    [byDirColumns.totals] = formatTotals(RecordView(rec));
+        }
+    }
+}
+catch(std::exception const& e)
+{
+    std::cerr << "Failed to update folder totals: " << e.what() << std::endl;
 }
 
 void MainWidget::delRec(const RecordID& id)
@@ -342,8 +1301,7 @@ void MainWidget::delRec(const RecordID& id)
 			
 	if (itRecord == file2row_.end())
 	{
-		assert(false);
-		return;
+		return; // its directory hasn't been expanded
 	}
 	
 	assert(itRecord->second.is_valid());
@@ -372,20 +1330,37 @@ void MainWidget::onPreDeleteRow(Gtk::TreeModel::Row const& row)
 void MainWidget::addRec(const RecordID& id)
 try
 {
-	FileInfo recData = db_.getFile(id);
-	FileToRowMap::iterator const itParentRecord = 
-			file2row_.find(recData.parentID);
-			
-	if (itParentRecord == file2row_.end())
+	if (file2row_.count(id))
+	{
+		return; // loaded along with its directory already
+	}
+	
+	FileInfo recData = db_->getFile(id);
+	Gtk::TreeModel::Children siblings = pTreeModel_->children();
+	
+	if (recData.parentID != ROOT_RECORD_ID)
 	{
-		assert(false);
-		throw std::runtime_error("Can't find parent row");
+		FileToRowMap::iterator const itParentRecord = 
+				file2row_.find(recData.parentID);
+		
+		if (itParentRecord == file2row_.end())
+		{
+			return; // not loaded, the record shows up once it is
+		}
+		
+		Gtk::TreeModel::Path const parentPath = itParentRecord->second.get_path();
+		Gtk::TreeModel::iterator const itParentRow = pTreeModel_->get_iter(parentPath);
+		
+		if (!isLoaded(*itParentRow))
+		{
+			return;
+		}
+		
+		siblings = itParentRow->children();
 	}
 	
-	Gtk::TreeModel::Path const parentPath = itParentRecord->second.get_path();
-	Gtk::TreeModel::iterator const itParentRow = pTreeModel_->get_iter(parentPath);
-	Gtk::TreeModel::iterator const itNewRow = pTreeModel_->append(itParentRow->children());
-	fillRow(itNewRow, make_Record(id, std::move(recData)));
+	fillRow(pTreeModel_->append(siblings), 
+			RecordView(make_Record(id, std::move(recData))));
 }
 catch(std::exception const& e)
 {
@@ -397,15 +1372,53 @@ void MainWidget::onRowExpanded(
     const Gtk::TreeModel::iterator& iter, 
     const Gtk::TreeModel::Path& path)
 {
-    auto fileId = (*iter)[byDirColumns.fileId];
+    if (groupMode_)
+    {
+        if (!isLoaded(*iter))
+        {
+            RecordID const groupId = (*iter)[byDirColumns.groupId];
+            Gtk::TreeModel::iterator const itPlaceholder = iter->children().begin();
+            
+            if (hasSubgroups(path))
+            {
+                fillGroups(groupId, iter->children());
+            }
+            else
+            {
+                fillTracks(groupId, iter->children());
+            }
+            
+            pTreeModel_->erase(itPlaceholder);
+        }
+        
+        return;
+    }
+    
+    RecordID const fileId = (*iter)[byDirColumns.fileId];
     std::clog << "[Widget] onRowExpanded " << fileId << std::endl;
     
+    if (!isLoaded(*iter) && db_)
+    {
+        Gtk::TreeModel::iterator const itPlaceholder = iter->children().begin();
+        fillData(fileId, iter->children());
+        pTreeModel_->erase(itPlaceholder);
+    }
+    
+    activeRecords_->ids.insert(fileId);
+    requestCheck(fileId);
+    restoreExpandedRows(iter->children());
+}
+
+
+void MainWidget::requestCheck(RecordID dirId)
+{
     auto locked = activeRecords_.synchronize();
     
-    if (locked->ids.insert(fileId).second && 
-        locked->onChanged)
+    locked->urgent.insert(dirId);
+    
+    if (locked->onUrgent)
     {
-        locked->onChanged(/*restart*/false);
+        locked->onUrgent();
     }
 }
 
@@ -436,6 +1449,11 @@ void MainWidget::onRowCollapsed(
     const Gtk::TreeModel::iterator& iter, 
     const Gtk::TreeModel::Path& path)
 {
+    if (groupMode_)
+    {
+        return;
+    }
+    
     auto fileId = (*iter)[ byDirColumns.fileId ];
     std::clog << "[Widget] onRowCollapsed " << fileId << std::endl;
     
@@ -4,9 +4,11 @@
 #include "plugin.hpp"
 #include "database.hpp"
 #include "scan_event.hpp"
+#include "search_worker.hpp"
 
 #include <filesystem>
 namespace fs = std::filesystem;
+#include <optional>
 #include <unordered_map>
 
 #include <gtkmm.h>
@@ -16,12 +18,15 @@ class MainWidget : public Gtk::EventBox
 {
 public:
     MainWidget(
-            DbReader&& db, 
             ScanEventSource scanEventSource,
             fs::path const& configDir);
 	virtual ~MainWidget() override;
     
+    // switches from the snapshot to the database once it's open
+    void attach(DbReader&& db, DbReader&& searchDb);
+    
     Glib::Dispatcher& getOnChangedDisp() { return onChangesDisp_; }
+    Glib::Dispatcher& getOnDbReadyDisp() { return onDbReadyDisp_; }
     ActiveRecordsSync & getActiveRecords() { return activeRecords_; }
     void onDisconnect();
     
@@ -32,6 +37,9 @@ private:
     void onRowActivated(
             const Gtk::TreeModel::Path& path, 
             Gtk::TreeViewColumn* column);
+    void onResultActivated(
+            const Gtk::TreeModel::Path& path, 
+            Gtk::TreeViewColumn* column);
     void onRowExpanded(
             const Gtk::TreeModel::iterator& iter, 
             const Gtk::TreeModel::Path& path);
@@ -42,31 +50,74 @@ private:
             const Glib::RefPtr<Gdk::DragContext>& context,
             Gtk::SelectionData& selection_data, 
             guint info, 
-            guint time);
+            guint time,
+            Gtk::TreeView* pView);
 	void onChanged();
+    void refreshTotals();
+    // of the rows above the records changed, whose totals include them
+    void refreshTotals(const RecordIDs& changedIds);
+    void fillTotals(const std::vector<RecordID>& dirIds);
+    void forgetCached(const ScanEvent& event);
+    // in the tree's tooltip, while their mounts don't respond
+    void showDegradedRoots();
+    void onModeChanged();
+    void onSearchChanged();
+    void onSearchResults();
     
     // auxiliary functions
     void fillData(const RecordID& from, const Gtk::TreeModel::Children& to);
+    void fillGroups(RecordID parentId, const Gtk::TreeModel::Children& to);
+    void fillTracks(RecordID groupId, const Gtk::TreeModel::Children& to);
+    void fillGroupRow(Gtk::TreeModel::iterator itRow, TagGroup const& group);
+    void syncGroups(RecordID parentId, const Gtk::TreeModel::Children& rows);
+    bool isLoaded(Gtk::TreeModel::Row const& row) const;
+    bool hasSubgroups(Gtk::TreeModel::Path const& path) const;
+    std::vector<std::string> rowFiles(Gtk::TreeModel::Row const& row);
     void setupTreeView();
-    void fillRow(Gtk::TreeModel::iterator itRow, FileRecord const& rec);
+    void setupResultsView();
+    void activateRow(Gtk::TreeModel::iterator itRow);
+    void fillRow(Gtk::TreeModel::iterator itRow, RecordView const& rec);
     void delRec(const RecordID& id);
     void addRec(const RecordID& id);
     void onPreDeleteRow(Gtk::TreeModel::Row const& row);
+    void requestCheck(RecordID dirId);
+    void fillSnapshot();
+    void saveSnapshot();
     void saveExpandedRows();
-    void restoreExpandedRows();
+    RecordIDs loadExpandedRows() const;
+    void restoreExpandedRows(const Gtk::TreeModel::Children& rows);
     
     typedef std::unordered_map<
             RecordID, 
             Gtk::TreeModel::RowReference> FileToRowMap;
 	
-    DbReader                        db_;
+    // nullopt while the rows come from the snapshot
+    std::optional<DbReader>         db_;
     ScanEventSource                 scanEventSource_;
+    Gtk::ComboBoxText*              pModeCombo_;
+    // nullopt when browsing by directory structure
+    std::optional<GroupMode>        groupMode_;
+    Gtk::Entry                      searchEntry_;
     Gtk::TreeView                   treeVeiew_;
     Glib::RefPtr<Gtk::TreeStore>    pTreeModel_;
+    // hidden unless Settings::showTotals
+    Gtk::TreeViewColumn*            pTotalsColumn_;
+    // search results replace the tree while the query is long enough
+    Gtk::TreeView                   resultsView_;
+    Glib::RefPtr<Gtk::ListStore>    pResultsModel_;
+    Gtk::ScrolledWindow*            pTreeWindow_;
+    Gtk::ScrolledWindow*            pResultsWindow_;
+    // shown in the tree's tooltip
+    std::vector<std::string>        degradedRoots_;
+    std::unique_ptr<SearchWorker>   pSearchWorker_;
+    unsigned                        searchGeneration_;
+    sigc::connection                searchConnection_;
     FileToRowMap                    file2row_;
     Glib::Dispatcher                onChangesDisp_;
+    Glib::Dispatcher                onDbReadyDisp_;
     sigc::connection                changeConnection_;
     std::string const               expandRowsFileName_;
+    std::string const               snapshotFileName_;
     ActiveRecordsSync               activeRecords_;
 };
 
@@ -45,6 +45,7 @@ extern "C" DB_plugin_t *
     plugin.stop            = &Plugin::stop;
     plugin.connect         = &Plugin::connect;
     plugin.disconnect      = &Plugin::disconnect;
+    plugin.message         = &Plugin::message;
     plugin.configdialog    = nullptr;
     
     return &plugin;
@@ -0,0 +1,305 @@
+#include "metadata_pool.hpp"
+#include "tag_reader.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <chrono>
+#include <iostream>
+
+namespace {
+
+// results stored per transaction
+constexpr size_t BATCH_SIZE = 500;
+// a partial batch is stored after that long
+constexpr int FLUSH_MS = 1000;
+// files fetched per backfill query, the next chunk is fetched when the queue
+// runs low so readers don't wait for the database
+constexpr int BACKFILL_CHUNK = 2000;
+constexpr size_t BACKFILL_LOW_WATER = 500;
+// how long reading a file may take before its mount counts as unreachable
+constexpr int READ_TIMEOUT_MS = 10000;
+
+}
+
+
+MetadataPool::MetadataPool(
+        FileSystem& fileSystem,
+        DbOwner& db,
+        std::mutex& dbMtx,
+        ScanEventSink eventSink,
+        Glib::Dispatcher& onChangedDisp)
+ : db_(db)
+ , dbMtx_(dbMtx)
+ , eventSink_(eventSink)
+ , onChangedDisp_(onChangedDisp)
+ , pQueue_(std::make_shared<Queue>(fileSystem))
+{
+    unsigned const count = std::max(1u, std::thread::hardware_concurrency());
+    pQueue_->readers = count;
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        std::thread(&MetadataPool::readerLoop, pQueue_).detach();
+    }
+
+    writer_ = std::thread(&MetadataPool::writerLoop, this);
+}
+
+
+MetadataPool::~MetadataPool()
+{
+    if (writer_.joinable())
+    {
+        stop(std::chrono::steady_clock::now());
+    }
+}
+
+
+void MetadataPool::stop(std::chrono::steady_clock::time_point deadline)
+{
+    Queue& q = *pQueue_;
+    std::unique_lock<std::mutex> lock(q.mtx);
+    q.stop = true;
+    q.jobsCond.notify_all();
+
+    if (!q.readersCond.wait_until(lock, deadline, [&] { return q.readers == 0; }))
+    {
+        std::clog << "[Tags] " << q.readers << " readers left behind" << std::endl;
+    }
+
+    q.stopWriter = true;
+    q.resultsCond.notify_all();
+    lock.unlock();
+
+    writer_.join(); // stores the results delivered so far
+}
+
+
+void MetadataPool::enqueue(const RecordView& file)
+{
+    Queue& q = *pQueue_;
+    std::lock_guard<std::mutex> lock(q.mtx);
+    q.jobs.push_back(Job{ file.id, file.parentID, file.lastWriteTime, 
+            std::string(file.fileName) });
+    q.jobsCond.notify_one();
+}
+
+
+void MetadataPool::startBackfill()
+{
+    Queue& q = *pQueue_;
+    std::lock_guard<std::mutex> lock(q.mtx);
+    q.backfillCursor = NULL_RECORD_ID;
+    q.backfill = true;
+    q.resultsCond.notify_one();
+}
+
+
+// static
+void MetadataPool::readerLoop(std::shared_ptr<Queue> pQueue)
+{
+    Queue& q = *pQueue;
+    GuardedFileSystem fileSystem(q.fileSystem, 
+            std::chrono::milliseconds(READ_TIMEOUT_MS));
+    std::unique_lock<std::mutex> lock(q.mtx);
+
+    while (true)
+    {
+        q.jobsCond.wait(lock, [&] { return q.stop || !q.jobs.empty(); });
+
+        if (q.stop)
+        {
+            break;
+        }
+
+        Job job = std::move(q.jobs.front());
+        q.jobs.pop_front();
+
+        if (q.backfill && q.jobs.size() == BACKFILL_LOW_WATER)
+        {
+            q.resultsCond.notify_one();
+        }
+
+        lock.unlock();
+
+        Result result{ job.id, job.parentId, job.writeTime, job.fileName, 
+                TrackTags() };
+
+        try
+        {
+            // unreadable files are stored with empty tags as well,
+            // they're read again once they change
+            if (auto tags = readTags(fileSystem, job.fileName))
+            {
+                result.tags = std::move(*tags);
+            }
+        }
+        catch(const fs::filesystem_error& ex)
+        { // unreachable or gone, nothing is stored
+            std::cerr << "[Tags] Failed to read '" << job.fileName << "': "
+                    << ex.what() << std::endl;
+            lock.lock();
+            continue;
+        }
+        catch(const std::exception& ex)
+        {
+            std::cerr << "[Tags] Failed to read '" << job.fileName << "': "
+                    << ex.what() << std::endl;
+        }
+
+        lock.lock();
+        q.results.push_back(std::move(result));
+
+        if (q.results.size() == BATCH_SIZE)
+        {
+            q.resultsCond.notify_one();
+        }
+    }
+
+    --q.readers;
+    q.readersCond.notify_all();
+}
+
+
+void MetadataPool::writerLoop()
+{
+    Queue& q = *pQueue_;
+    std::unique_lock<std::mutex> lock(q.mtx);
+
+    while (true)
+    {
+        auto const isReady = [&]
+        {
+            return q.stopWriter || q.results.size() >= BATCH_SIZE ||
+                    (q.backfill && q.jobs.size() <= BACKFILL_LOW_WATER);
+        };
+
+        if (q.results.empty())
+        {
+            q.resultsCond.wait(lock,
+                    [&] { return isReady() || !q.results.empty(); });
+        }
+        else
+        {
+            q.resultsCond.wait_for(lock,
+                    std::chrono::milliseconds(FLUSH_MS), isReady);
+        }
+
+        bool const needRefill =
+                !q.stop && q.backfill && q.jobs.size() <= BACKFILL_LOW_WATER;
+        std::vector<Result> results;
+        results.swap(q.results);
+        bool const stop = q.stopWriter;
+
+        lock.unlock();
+
+        store(results);
+
+        if (stop)
+        {
+            break;
+        }
+
+        if (needRefill)
+        {
+            refill();
+        }
+
+        lock.lock();
+    }
+}
+
+
+void MetadataPool::refill()
+{
+    Queue& q = *pQueue_;
+    RecordID afterId;
+
+    {
+        std::lock_guard<std::mutex> lock(q.mtx);
+        afterId = q.backfillCursor;
+    }
+
+    FileRecords files;
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        files = db_.staleTracks(afterId, BACKFILL_CHUNK);
+    }
+    catch(const std::exception& ex)
+    {
+        std::cerr << "[Tags] Failed to query untagged files: " << ex.what()
+                << std::endl;
+    }
+
+    std::lock_guard<std::mutex> lock(q.mtx);
+
+    if (q.backfillCursor != afterId)
+    {
+        return; // restarted meanwhile
+    }
+
+    if (files.empty())
+    {
+        q.backfill = false;
+        return;
+    }
+
+    for (FileRecord& file : files)
+    {
+        q.jobs.push_back(Job{ file.first, file.second.parentID,
+                file.second.lastWriteTime, std::move(file.second.fileName) });
+    }
+
+    q.backfillCursor = files.back().first;
+    q.jobsCond.notify_all();
+}
+
+
+void MetadataPool::store(std::vector<Result>& results)
+{
+    if (results.empty())
+    {
+        return;
+    }
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        db_.beginTransaction();
+        bool succeed = false;
+
+        BOOST_SCOPE_EXIT(&db_, &succeed)
+        {
+            if (succeed)
+            {
+                db_.commit();
+            }
+            else
+            {
+                db_.rollback();
+            }
+        } BOOST_SCOPE_EXIT_END
+
+        for (const Result& result : results)
+        {
+            db_.setTrack(result.id, result.writeTime, result.tags);
+            db_.indexFile(result.id, result.fileName, result.tags);
+        }
+
+        succeed = true;
+    }
+    catch(const std::exception& ex)
+    {
+        std::cerr << "[Tags] Failed to store tags: " << ex.what() << std::endl;
+        return;
+    }
+
+    for (const Result& result : results)
+    {
+        eventSink_.push(ScanEvent{ ScanEvent::TAGGED, result.id, result.parentId });
+    }
+
+    onChangedDisp_();
+}
@@ -0,0 +1,104 @@
+#ifndef METADATA_POOL_HPP
+#define	METADATA_POOL_HPP
+
+#include "database.hpp"
+#include "file_system.hpp"
+#include "scan_event.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glibmm/dispatcher.h>
+
+/*
+ * Reads tags of files saved by the scan threads. Tag reading is spread over
+ * one reader thread per core, a single writer stores the results in batches
+ * under dbMtx. Files whose tags are missing or older than the file itself
+ * are picked up from the database in chunks, so a cold library is tagged in
+ * the background and later only changed files are re-read.
+ * Files are read through a GuardedFileSystem per reader, so an unreachable
+ * mount fails the reads after a timeout; their tags stay stale in the
+ * database and get read by a later backfill.
+ */
+class MetadataPool
+{
+public:
+    // fileSystem has to outlive the readers, which may be detached
+    MetadataPool(FileSystem& fileSystem,
+                 DbOwner& db,
+                 std::mutex& dbMtx,
+                 ScanEventSink eventSink,
+                 Glib::Dispatcher& onChangedDisp);
+    ~MetadataPool();
+
+    MetadataPool(const MetadataPool&) = delete;
+
+    // queues a file added or changed by the scanner
+    void enqueue(const RecordView& file);
+    // (re)starts walking the database for files with stale tags
+    void startBackfill();
+    // stores the tags read until the deadline, readers still busy by then
+    // are detached; the destructor stops without waiting
+    void stop(std::chrono::steady_clock::time_point deadline);
+
+private:
+    struct Job
+    {
+        RecordID    id;
+        RecordID    parentId;
+        std::time_t writeTime;
+        std::string fileName;
+    };
+
+    struct Result
+    {
+        RecordID    id;
+        RecordID    parentId;
+        std::time_t writeTime;
+        std::string fileName;
+        TrackTags   tags;
+    };
+
+    // shared with the readers, so that it outlives the detached ones
+    struct Queue
+    {
+        explicit Queue(FileSystem& fs) : fileSystem(fs) {}
+
+        FileSystem&                 fileSystem;
+        std::mutex                  mtx;
+        std::condition_variable     jobsCond;
+        std::condition_variable     resultsCond;
+        std::condition_variable     readersCond;
+        std::deque<Job>             jobs;
+        std::vector<Result>         results;
+        // the last file id queued by the backfill, NULL_RECORD_ID when done
+        RecordID                    backfillCursor = NULL_RECORD_ID;
+        bool                        backfill = false;
+        bool                        stop = false;
+        // set once the readers finished or the deadline passed
+        bool                        stopWriter = false;
+        unsigned                    readers = 0;
+    };
+
+    static void readerLoop(std::shared_ptr<Queue> pQueue);
+    void writerLoop();
+    void refill();
+    void store(std::vector<Result>& results);
+
+    DbOwner&                    db_;
+    std::mutex&                 dbMtx_;
+    ScanEventSink               eventSink_;
+    Glib::Dispatcher&           onChangedDisp_;
+
+    std::shared_ptr<Queue>      pQueue_;
+    std::thread                 writer_;
+};
+
+#endif	/* METADATA_POOL_HPP */
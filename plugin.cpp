@@ -3,16 +3,21 @@
 #include "medialib.h"
 #include "main_widget.hpp"
 #include "database.hpp"
-#include "scan_thread.hpp"
+#include "scan_manager.hpp"
+#include "file_system.hpp"
+#include "throttle.hpp"
 
 #include <sys/types.h>
 
 #include "deadbeef/gtkui_api.h"
 
+#include <atomic>
 #include <filesystem>
 namespace fs = std::filesystem;
 #include <iostream>
 #include <memory.h>
+#include <mutex>
+#include <thread>
 
 const std::string	CONFIG_FILENAME = "medialib";
 const std::string	DB_FILENAME = "medialib.db";
@@ -25,16 +30,20 @@ public:
     ~Impl();
     int connect();
 	int disconnect();
+    void onPlaybackChanged();
     
     Settings getSettings() const;
     void     storeSettings(Settings settings);
+    std::vector<std::string> degradedRoots() const;
     
 private:
     
     static ddb_gtkui_widget_t * createWidget();
     static void destroyWidget(ddb_gtkui_widget_t *w);
+    static void openDb(fs::path pathDb);
+    static void attachDb();
     
-	typedef std::unique_ptr<ScanThread> ScanThreadPtr;
+	typedef std::unique_ptr<ScanManager> ScanManagerPtr;
 
 #ifdef USE_GTK2
   std::unique_ptr<Gtk::Main>            app_;
@@ -45,16 +54,29 @@ private:
     static ddb_gtkui_t              *   pGtkUi_;
     const fs::path                      fnSettings_;
 	static SettingsProvider             settings_;
+	static NativeFileSystem             fileSystem_;
+	// scan threads slow down on the mount being played from
+	static PlaybackState                playback_;
+	// db_ and pMainWidget_ are shared with the thread opening the database
+	static std::mutex                   dbMtx_;
+	static std::thread                  dbOpener_;
+	// makes the opener give up an upgrade when disconnecting
+	static std::atomic<bool>            cancelOpen_;
 	static DbOwnerPtr					db_;
-	static ScanThreadPtr				pScanThread_;
+	static ScanManagerPtr				pScanManager_;
     static MainWidget               *   pMainWidget_;
 };
 
 ScanEventQueue                  Plugin::Impl::eventQueue_;
 ddb_gtkui_t *					Plugin::Impl::pGtkUi_ = nullptr;
 SettingsProvider				Plugin::Impl::settings_;
+NativeFileSystem				Plugin::Impl::fileSystem_;
+PlaybackState					Plugin::Impl::playback_;
+std::mutex                      Plugin::Impl::dbMtx_;
+std::thread                     Plugin::Impl::dbOpener_;
+std::atomic<bool>               Plugin::Impl::cancelOpen_(false);
 DbOwnerPtr						Plugin::Impl::db_;
-Plugin::Impl::ScanThreadPtr		Plugin::Impl::pScanThread_;
+Plugin::Impl::ScanManagerPtr	Plugin::Impl::pScanManager_;
 MainWidget *                    Plugin::Impl::pMainWidget_ = nullptr;
 std::unique_ptr<Plugin::Impl>	Plugin::s_pImpl;
 
@@ -106,6 +128,25 @@ int Plugin::disconnect ()
 	return s_pImpl->disconnect();
 }
 
+//static 
+int Plugin::message(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2)
+{
+    switch (id)
+    {
+    case DB_EV_SONGSTARTED:
+    case DB_EV_SONGFINISHED:
+    case DB_EV_PAUSED:
+    case DB_EV_STOP:
+        if (s_pImpl)
+        {
+            s_pImpl->onPlaybackChanged();
+        }
+        break;
+    }
+    
+    return 0;
+}
+
 // static 
 Settings Plugin::getSettings()
 {
@@ -118,6 +159,12 @@ void Plugin::storeSettings(Settings settings)
     s_pImpl->storeSettings(std::move(settings));
 }
 
+// static 
+std::vector<std::string> Plugin::degradedRoots()
+{
+    return s_pImpl->degradedRoots();
+}
+
 
 Plugin::Impl::Impl() 
  : fnSettings_(fs::path(deadbeef->get_config_dir()) / CONFIG_FILENAME)
@@ -129,7 +176,7 @@ Plugin::Impl::Impl()
 
 Plugin::Impl::~Impl()
 {
-	assert(!pScanThread_);
+	assert(!pScanManager_);
 }
 
 
@@ -160,8 +207,9 @@ int Plugin::Impl::connect()
 try
 {
 	const fs::path pathDb = fs::path(deadbeef->get_config_dir()) / DB_FILENAME;
-	std::clog << "[" PLUGIN_NAME " ] Opening database at " << pathDb << std::endl;
-	db_.reset(new DbOwner(pathDb.string()));
+	// the widget shows its snapshot meanwhile
+	cancelOpen_ = false;
+	dbOpener_ = std::thread(&Impl::openDb, pathDb);
 	
     pGtkUi_ = (ddb_gtkui_t *) deadbeef->plug_get_for_id(DDB_GTKUI_PLUGIN_ID);
     
@@ -201,12 +249,6 @@ try
 	std::clog << "[" PLUGIN_NAME " ] Successfully connected" << std::endl;
     return 0;
 }
-catch(const DbException & ex)
-{
-	std::cerr << "[" PLUGIN_NAME " ] Failed to open database: " 
-			<< ex.what() << std::endl;
-	return -1;
-}
 catch(const std::exception & ex)
 {
 	std::cerr << "[" PLUGIN_NAME " ] Failed to connect plugin: " 
@@ -217,16 +259,22 @@ catch(const std::exception & ex)
 int Plugin::Impl::disconnect()
 try
 {
-	std::clog << "Stopping scanning thread" << std::endl;
-	pScanThread_.reset();
-	std::clog << "[" PLUGIN_NAME " ] Closing database " << std::endl;
-	db_.reset();
+    if (dbOpener_.joinable())
+    { // an upgrade in progress is rolled back and redone on the next start
+        cancelOpen_ = true;
+        dbOpener_.join();
+    }
+    
+	std::clog << "Stopping scanning threads" << std::endl;
+	pScanManager_.reset();
     
     if (pMainWidget_)
     {
-        pMainWidget_->onDisconnect();
+        pMainWidget_->onDisconnect(); // reads the snapshot rows
     }
     
+	std::clog << "[" PLUGIN_NAME " ] Closing database " << std::endl;
+	db_.reset();
 	return 0;
 }
 catch(const DbException & ex)
@@ -242,6 +290,32 @@ catch(const std::exception & ex)
 	return -1;
 }
 
+void Plugin::Impl::onPlaybackChanged()
+{
+    std::optional<std::string> playing;
+    DB_output_t* pOutput = deadbeef->get_output();
+    DB_playItem_t* pTrack = deadbeef->streamer_get_playing_track();
+    
+    if (pTrack)
+    {
+        if (pOutput && pOutput->state() == OUTPUT_STATE_PLAYING)
+        {
+            deadbeef->pl_lock();
+            
+            if (const char* szUri = deadbeef->pl_find_meta(pTrack, ":URI"))
+            {
+                playing = szUri;
+            }
+            
+            deadbeef->pl_unlock();
+        }
+        
+        deadbeef->pl_item_unref(pTrack);
+    }
+    
+    playback_.setPlaying(std::move(playing));
+}
+
 // static
 ddb_gtkui_widget_t * Plugin::Impl::createWidget()
 try
@@ -250,17 +324,14 @@ try
     ddb_gtkui_widget_t *w = 
             static_cast<ddb_gtkui_widget_t*>(malloc(sizeof(ddb_gtkui_widget_t)));
     memset(w, 0, sizeof (*w));
-    pMainWidget_ = new MainWidget(
-            db_->createReader(), eventQueue_, deadbeef->get_config_dir());
-	
-	std::clog << "[" PLUGIN_NAME " ] Starting scan thread " << std::endl;
-	pScanThread_.reset(new ScanThread(
-						settings_, 
-						getSupportedExtensions(), 
-						*db_,
-						eventQueue_,
-                        pMainWidget_->getOnChangedDisp(),
-                        pMainWidget_->getActiveRecords()));
+    
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        pMainWidget_ = new MainWidget(eventQueue_, deadbeef->get_config_dir());
+        pMainWidget_->getOnDbReadyDisp().connect(&Impl::attachDb);
+    }
+    
+    attachDb(); // the database may be open already
 	
     w->widget = GTK_WIDGET( pMainWidget_->gobj() );
     w->destroy = &destroyWidget;
@@ -283,11 +354,67 @@ catch(const std::exception & ex)
 // static 
 void Plugin::Impl::destroyWidget(ddb_gtkui_widget_t * w)
 {
-    std::clog << "[" PLUGIN_NAME " ] Stopping scan thread " << std::endl;
-	pScanThread_.reset();
+    std::clog << "[" PLUGIN_NAME " ] Stopping scan threads " << std::endl;
+	pScanManager_.reset();
     std::clog << "[" PLUGIN_NAME " ] Destroying widget " << std::endl;
-    delete Glib::wrap(w->widget);
-    pMainWidget_ = nullptr;
+    MainWidget* pMainWidget = nullptr;
+    
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        std::swap(pMainWidget, pMainWidget_);
+    }
+    
+    delete pMainWidget;
+}
+
+// static, runs on its own thread
+void Plugin::Impl::openDb(fs::path pathDb)
+try
+{
+	std::clog << "[" PLUGIN_NAME " ] Opening database at " << pathDb << std::endl;
+	DbOwnerPtr db(new DbOwner(pathDb.string(), &cancelOpen_));
+    std::lock_guard<std::mutex> lock(dbMtx_);
+    db_ = std::move(db);
+    
+    if (pMainWidget_)
+    {
+        pMainWidget_->getOnDbReadyDisp()(); // attachDb on the GUI thread
+    }
+}
+catch(const std::exception & ex)
+{
+	std::cerr << "[" PLUGIN_NAME " ] Failed to open database: " 
+			<< ex.what() << std::endl;
+}
+
+// static, the widget switches to the database once both exist
+void Plugin::Impl::attachDb()
+try
+{
+    std::lock_guard<std::mutex> lock(dbMtx_);
+    
+    if (!db_ || !pMainWidget_ || pScanManager_)
+    {
+        return;
+    }
+    
+    pMainWidget_->attach(db_->createReader(), db_->createReader());
+	
+	std::clog << "[" PLUGIN_NAME " ] Starting scan threads " << std::endl;
+	pScanManager_.reset(new ScanManager(
+						settings_, 
+						getSupportedExtensions(), 
+						fileSystem_,
+						playback_,
+						*db_,
+						eventQueue_,
+                        pMainWidget_->getOnChangedDisp(),
+                        pMainWidget_->getActiveRecords()));
+}
+catch(const std::exception & ex)
+{
+	std::cerr << "[" PLUGIN_NAME " ] Failed to attach database: " 
+			<< ex.what() << std::endl;
 }
 
 Settings Plugin::Impl::getSettings() const
@@ -299,5 +426,15 @@ void Plugin::Impl::storeSettings(Settings settings)
 {
 	settings.save(fnSettings_.string());
 	settings_.setSettings(std::move(settings));
-	pScanThread_->restart();
+    
+    if (pScanManager_)
+    {
+        pScanManager_->applySettings();
+    }
+}
+
+std::vector<std::string> Plugin::Impl::degradedRoots() const
+{
+    return pScanManager_ ? pScanManager_->degradedRoots() 
+                         : std::vector<std::string>();
 }
@@ -3,7 +3,10 @@
 
 #include "settings.hpp"
 
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
 class Plugin
 {
@@ -12,9 +15,12 @@ public:
     static int stop();
     static int connect();
     static int disconnect();
+    static int message(uint32_t id, uintptr_t ctx, uint32_t p1, uint32_t p2);
     
     static Settings getSettings();
     static void     storeSettings(Settings settings);
+    // roots on mounts which stopped responding, empty until scanning starts
+    static std::vector<std::string> degradedRoots();
     
 private:
     class Impl;
@@ -0,0 +1,145 @@
+#include "poll_scheduler.hpp"
+
+#include <algorithm>
+
+PollScheduler::PollScheduler(int minIntervalSec, int maxIntervalSec)
+    : defaultBounds_{ minIntervalSec, maxIntervalSec }
+{
+}
+
+
+void PollScheduler::load(const DirSchedules& schedules)
+{
+    for (const auto& rec : schedules)
+    {
+        auto itDir = dirs_.find(rec.first);
+        
+        if (itDir != dirs_.end())
+        {
+            Bounds const bounds = itDir->second.bounds;
+            DirSchedule schedule = rec.second;
+            schedule.intervalSec = std::clamp(schedule.intervalSec, 
+                    bounds.minIntervalSec, bounds.maxIntervalSec);
+            // don't wait longer than the (possibly lowered) maximum interval
+            schedule.nextCheck = std::min(schedule.nextCheck, 
+                    itDir->second.schedule.nextCheck + bounds.maxIntervalSec);
+            this->schedule(rec.first, schedule, bounds);
+        }
+    }
+}
+
+
+void PollScheduler::add(RecordID id, std::time_t now)
+{
+    add(id, now, defaultBounds_);
+}
+
+
+void PollScheduler::add(RecordID id, std::time_t now, Bounds bounds)
+{
+    if (dirs_.count(id) == 0)
+    {
+        schedule(id, DirSchedule{ now, bounds.minIntervalSec, 0, 0 }, bounds);
+    }
+}
+
+
+void PollScheduler::remove(RecordID id)
+{
+    auto itDir = dirs_.find(id);
+    
+    if (itDir != dirs_.end())
+    {
+        deadlines_.erase(Deadline(itDir->second.schedule.nextCheck, id));
+        dirs_.erase(itDir);
+    }
+}
+
+
+void PollScheduler::clear()
+{
+    dirs_.clear();
+    deadlines_.clear();
+}
+
+
+std::vector<RecordID> PollScheduler::due(std::time_t now) const
+{
+    std::vector<RecordID> result;
+    
+    for (auto itDeadline = deadlines_.begin(); 
+         itDeadline != deadlines_.end() && itDeadline->first <= now; 
+         ++itDeadline)
+    {
+        result.push_back(itDeadline->second);
+    }
+    
+    return result;
+}
+
+
+std::optional<std::time_t> PollScheduler::nextDeadline() const
+{
+    if (deadlines_.empty())
+    {
+        return std::nullopt;
+    }
+    
+    return deadlines_.begin()->first;
+}
+
+
+DirSchedule const& PollScheduler::checked(
+        RecordID id, bool changed, std::time_t now)
+{
+    auto const itDir = dirs_.find(id);
+    Bounds const bounds = itDir != dirs_.end() ? 
+            itDir->second.bounds : defaultBounds_;
+    DirSchedule schedule = itDir != dirs_.end() ? 
+            itDir->second.schedule : 
+            DirSchedule{ now, bounds.minIntervalSec, 0, 0 };
+    
+    if (changed)
+    {
+        // poll at least twice as often as the directory has been changing
+        int sinceLastChange = schedule.lastChange ? 
+                static_cast<int>(std::min<std::time_t>(
+                    now - schedule.lastChange, bounds.maxIntervalSec)) : 
+                bounds.maxIntervalSec;
+        
+        schedule.intervalSec = std::min(
+                schedule.intervalSec / 2, sinceLastChange / 2);
+        schedule.lastChange = now;
+        ++schedule.changeCount;
+    }
+    else
+    { // at least a second, intervals below 2 s would never grow otherwise
+        schedule.intervalSec += std::max(1, schedule.intervalSec / 2);
+    }
+    
+    schedule.intervalSec = std::clamp(schedule.intervalSec, 
+            bounds.minIntervalSec, bounds.maxIntervalSec);
+    schedule.nextCheck = now + schedule.intervalSec;
+    
+    this->schedule(id, schedule, bounds);
+    return dirs_[id].schedule;
+}
+
+
+void PollScheduler::schedule(
+        RecordID id, DirSchedule const& schedule, Bounds bounds)
+{
+    auto itDir = dirs_.find(id);
+    
+    if (itDir != dirs_.end())
+    {
+        deadlines_.erase(Deadline(itDir->second.schedule.nextCheck, id));
+        itDir->second = Entry{ schedule, bounds };
+    }
+    else
+    {
+        dirs_.emplace(id, Entry{ schedule, bounds });
+    }
+    
+    deadlines_.insert(Deadline(schedule.nextCheck, id));
+}
@@ -0,0 +1,63 @@
+#ifndef POLL_SCHEDULER_HPP
+#define	POLL_SCHEDULER_HPP
+
+#include "db_record.hpp"
+
+#include <ctime>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Decides when each directory is checked next. Directories which changed
+ * recently are polled often, the interval of unchanged ones grows up to
+ * the directory's maximum. Deadlines are kept ordered, so picking due directories
+ * doesn't depend on the size of the library.
+ */
+class PollScheduler
+{
+public:
+    struct Bounds
+    {
+        int minIntervalSec;
+        int maxIntervalSec;
+    };
+    
+    // bounds of directories added without their own
+    PollScheduler(int minIntervalSec, int maxIntervalSec);
+    
+    // restores persisted state, directories without one are due immediately
+    void load(const DirSchedules& schedules);
+    
+    void add(RecordID id, std::time_t now);
+    void add(RecordID id, std::time_t now, Bounds bounds);
+    void remove(RecordID id);
+    void clear();
+    
+    // directories with passed deadlines, earliest first
+    std::vector<RecordID> due(std::time_t now) const;
+    std::optional<std::time_t> nextDeadline() const;
+    
+    // adapts the interval to the check result, returns the state to persist
+    DirSchedule const& checked(RecordID id, bool changed, std::time_t now);
+    
+    size_t size() const { return dirs_.size(); }
+    
+private:
+    using Deadline = std::pair<std::time_t, RecordID>;
+    
+    struct Entry
+    {
+        DirSchedule schedule;
+        Bounds      bounds;
+    };
+    
+    void schedule(RecordID id, DirSchedule const& schedule, Bounds bounds);
+    
+    const Bounds                                defaultBounds_;
+    std::unordered_map<RecordID, Entry>         dirs_;
+    std::set<Deadline>                          deadlines_;
+};
+
+#endif	/* POLL_SCHEDULER_HPP */
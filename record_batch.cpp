@@ -0,0 +1,118 @@
+#include "record_batch.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+
+RecordView RecordBatch::operator[](size_t i) const
+{
+    RecordView rec;
+
+    rec.id = ids_[i];
+    rec.parentID = parentIDs_[i];
+    rec.lastWriteTime = writeTimes_[i];
+    rec.isDir = (flags_[i] & DIR) != 0;
+    rec.fileName = name(i);
+    rec.size = sizes_[i];
+    return rec;
+}
+
+
+void RecordBatch::push_back(const RecordView& rec)
+{
+    ids_.push_back(rec.id);
+    parentIDs_.push_back(rec.parentID);
+    writeTimes_.push_back(rec.lastWriteTime);
+    sizes_.push_back(rec.size);
+    flags_.push_back(rec.isDir ? DIR : 0);
+    names_.append(rec.fileName.data(), rec.fileName.size());
+    nameEnds_.push_back(static_cast<uint32_t>(names_.size()));
+    byName_.clear();
+}
+
+
+void RecordBatch::append(const RecordBatch& other)
+{
+    uint32_t const offset = static_cast<uint32_t>(names_.size());
+
+    ids_.insert(ids_.end(), other.ids_.begin(), other.ids_.end());
+    parentIDs_.insert(parentIDs_.end(),
+            other.parentIDs_.begin(), other.parentIDs_.end());
+    writeTimes_.insert(writeTimes_.end(),
+            other.writeTimes_.begin(), other.writeTimes_.end());
+    sizes_.insert(sizes_.end(), other.sizes_.begin(), other.sizes_.end());
+    flags_.insert(flags_.end(), other.flags_.begin(), other.flags_.end());
+    names_ += other.names_;
+
+    for (uint32_t end : other.nameEnds_)
+    {
+        nameEnds_.push_back(offset + end);
+    }
+
+    byName_.clear();
+}
+
+
+void RecordBatch::reserve(size_t records, size_t nameBytes)
+{
+    ids_.reserve(records);
+    parentIDs_.reserve(records);
+    writeTimes_.reserve(records);
+    sizes_.reserve(records);
+    flags_.reserve(records);
+    nameEnds_.reserve(records);
+    names_.reserve(nameBytes);
+}
+
+
+// keeps the capacity, a batch is usually refilled with as many records
+void RecordBatch::clear()
+{
+    ids_.clear();
+    parentIDs_.clear();
+    writeTimes_.clear();
+    sizes_.clear();
+    flags_.clear();
+    nameEnds_.clear();
+    names_.clear();
+    byName_.clear();
+}
+
+
+void RecordBatch::indexByName()
+{
+    byName_.resize(size());
+    std::iota(byName_.begin(), byName_.end(), 0);
+    std::sort(byName_.begin(), byName_.end(), [this](uint32_t a, uint32_t b)
+    {
+        return name(a) < name(b);
+    });
+}
+
+
+// the first record of that name which isn't taken yet
+size_t RecordBatch::find(std::string_view fileName) const
+{
+    auto it = std::lower_bound(byName_.begin(), byName_.end(), fileName,
+        [this](uint32_t i, std::string_view key)
+        {
+            return name(i) < key;
+        });
+
+    for (; it != byName_.end() && name(*it) == fileName; ++it)
+    {
+        if (!taken(*it))
+        {
+            return *it;
+        }
+    }
+
+    return npos;
+}
+
+
+std::string_view RecordBatch::name(size_t i) const
+{
+    size_t const begin = i ? nameEnds_[i - 1] : 0;
+    return std::string_view(names_).substr(begin, nameEnds_[i] - begin);
+}
@@ -0,0 +1,60 @@
+#ifndef RECORD_BATCH_HPP
+#define	RECORD_BATCH_HPP
+
+#include "db_record.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * File records of a scan batch as a struct of arrays, the names packed into
+ * one buffer, so that a batch grows a handful of arrays instead of taking
+ * a node and a string from the heap per record. Records are read back as
+ * RecordViews, valid until the batch is changed.
+ */
+class RecordBatch
+{
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    size_t size() const { return ids_.size(); }
+    bool   empty() const { return ids_.empty(); }
+    // the other columns of the views are 0
+    RecordView operator[](size_t i) const;
+
+    void push_back(const RecordView& rec);
+    void append(const RecordBatch& other);
+    void reserve(size_t records, size_t nameBytes);
+    void clear();
+
+    // lookup by name, once the records are indexed; taken records are
+    // what a scan has seen, the rest are missing from the directory
+    void   indexByName();
+    size_t find(std::string_view fileName) const;
+    void   take(size_t i) { flags_[i] |= TAKEN; }
+    bool   taken(size_t i) const { return (flags_[i] & TAKEN) != 0; }
+
+private:
+    enum Flags : uint8_t
+    {
+        DIR   = 1,
+        TAKEN = 2
+    };
+
+    std::string_view name(size_t i) const;
+
+    std::vector<RecordID>    ids_;
+    std::vector<RecordID>    parentIDs_;
+    std::vector<std::time_t> writeTimes_;
+    std::vector<uint64_t>    sizes_;
+    std::vector<uint8_t>     flags_;
+    // end of each name in names_, it starts where the previous one ends
+    std::vector<uint32_t>    nameEnds_;
+    std::string              names_;
+    // record indexes sorted by name
+    std::vector<uint32_t>    byName_;
+};
+
+#endif	/* RECORD_BATCH_HPP */
@@ -9,10 +9,13 @@
 
 struct ScanEvent
 {
-	enum Type { ADDED, DELETED, UPDATED };
+	enum Type { ADDED, DELETED, UPDATED, TAGGED };
 	
 	Type		type;
 	RecordID	id;
+	// the parent of the record, where known; the only way to it from a
+	// DELETED record, which can't be looked up anymore
+	RecordID	parentId = NULL_RECORD_ID;
 };
 
 typedef boost::sync_queue<ScanEvent> ScanEventQueue;
@@ -22,9 +25,13 @@ typedef boost::queue_front_view<ScanEventQueue> ScanEventSource;
 struct ActiveRecords
 {
     using OnChanged = std::function<void(/*restart*/bool)>;
+    using OnUrgent = std::function<void()>;
     
     RecordIDs ids;
+    // directories the user is waiting for, checked ahead of background scan
+    RecordIDs urgent;
     OnChanged onChanged;
+    OnUrgent  onUrgent;
 };
 
 using ActiveRecordsSync = boost::synchronized_value<ActiveRecords>;
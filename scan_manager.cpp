@@ -0,0 +1,457 @@
+#include "scan_manager.hpp"
+
+#include <boost/scope_exit.hpp>
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+#include <map>
+
+namespace pl = std::placeholders;
+
+namespace {
+
+// device id lookups only stat the roots, so they shouldn't take long
+constexpr int STAT_TIMEOUT_MS = 2000;
+// how long stopping may take to save what was found, a stuck filesystem
+// call doesn't count as it's abandoned right away
+constexpr int STOP_DEADLINE_MS = 2000;
+
+std::chrono::steady_clock::time_point stopDeadline()
+{
+    return std::chrono::steady_clock::now() + 
+            std::chrono::milliseconds(STOP_DEADLINE_MS);
+}
+
+}
+
+
+ScanManager::ScanManager(
+        const SettingsProvider& settings,
+        const Extensions& extensions,
+        FileSystem& fileSystem,
+        const PlaybackState& playback,
+        DbOwner& db,
+        ScanEventSink eventSink,
+        Glib::Dispatcher& onChangedDisp,
+        ActiveRecordsSync& activeFiles)
+ : settings_(settings)
+ , extensions_(extensions)
+ , fileSystem_(fileSystem)
+ , playback_(playback)
+ , db_(db)
+ , eventSink_(eventSink)
+ , metadataPool_(fileSystem, db, dbMtx_, eventSink, onChangedDisp)
+ , onChangedDisp_(onChangedDisp)
+ , activeFiles_(activeFiles)
+ , applyPending_(true) // starts the threads
+ , stopApplier_(false)
+{
+    setCallbacks(true);
+    metadataPool_.startBackfill();
+    applier_ = std::thread(&ScanManager::applierLoop, this);
+}
+
+
+ScanManager::~ScanManager()
+{
+    {
+        std::lock_guard<std::mutex> lock(applyMtx_);
+        stopApplier_ = true;
+        applyCond_.notify_one();
+    }
+    
+    applier_.join();
+    logPrunedEntries();
+    auto const deadline = stopDeadline();
+    stop(deadline);
+    metadataPool_.stop(deadline);
+}
+
+
+void ScanManager::applySettings()
+{
+    std::lock_guard<std::mutex> lock(applyMtx_);
+    applyPending_ = true;
+    applyCond_.notify_one();
+}
+
+
+void ScanManager::applierLoop()
+{
+    std::unique_lock<std::mutex> lock(applyMtx_);
+    
+    while (true)
+    {
+        applyCond_.wait(lock, [this] { return stopApplier_ || applyPending_; });
+        
+        if (stopApplier_)
+        {
+            break;
+        }
+        
+        // settings stored meanwhile are applied once more afterwards
+        applyPending_ = false;
+        lock.unlock();
+        
+        try
+        {
+            updateThreads();
+        }
+        catch(const std::exception& ex)
+        {
+            std::cerr << "[Scan] Failed to apply settings: " 
+                    << ex.what() << std::endl;
+        }
+        
+        lock.lock();
+    }
+}
+
+
+namespace {
+
+bool sharesRoot(const Settings::Directories& roots, 
+                const Settings::Directories& group)
+{
+    return std::any_of(roots.begin(), roots.end(), 
+        [&group](const Settings::Directories::value_type& root)
+        {
+            return group.count(root.first) != 0;
+        });
+}
+
+
+// a thread can take the group over unless one of its roots moved to
+// another mount or it changed what the root record is
+bool canTakeOver(const Settings::Directories& roots, 
+                 const Settings::Directories& group,
+                 const Settings::Directories& dirs)
+{
+    for (const auto& root : roots)
+    {
+        auto const it = group.find(root.first);
+        
+        if (it == group.end() ? dirs.count(root.first) != 0 
+                              : it->second.recursive != root.second.recursive)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+}
+
+
+void ScanManager::updateThreads()
+{
+    auto const dirs = settings_.getSettings().directories;
+    std::vector<Settings::Directories> groups = groupByMount(dirs);
+    auto const deadline = stopDeadline();
+    std::vector<ScanThreadPtr> stopped;
+    std::vector<std::pair<ScanThread*, Settings::Directories>> takenOver;
+    
+    logPrunedEntries(); // with the patterns being replaced
+    
+    {
+        std::lock_guard<std::mutex> lock(threadsMtx_);
+        std::vector<ScanThreadPtr> kept;
+        
+        for (ScanThreadPtr& pThread : threads_)
+        {
+            Settings::Directories const roots = pThread->roots();
+            auto const itGroup = std::find_if(groups.begin(), groups.end(), 
+                [&roots](const Settings::Directories& group)
+                {
+                    return sharesRoot(roots, group);
+                });
+            
+            if (itGroup != groups.end() && canTakeOver(roots, *itGroup, dirs))
+            {
+                if (*itGroup != roots)
+                {
+                    takenOver.emplace_back(pThread.get(), std::move(*itGroup));
+                }
+                
+                groups.erase(itGroup);
+                kept.push_back(std::move(pThread));
+            }
+            else
+            { // all of its roots were removed or it has to start over
+                pThread->stop(deadline);
+                stopped.push_back(std::move(pThread));
+            }
+        }
+        
+        threads_ = std::move(kept);
+    }
+    
+    // roots of the stopped threads may be handed over to the kept ones,
+    // which mustn't walk them at the same time
+    stopped.clear();
+    std::set<std::string> removing;
+    
+    for (const auto& thread : takenOver)
+    {
+        ScanThread& scanThread = *thread.first;
+        const Settings::Directories& group = thread.second;
+        Settings::Directories const roots = scanThread.roots();
+        std::vector<std::string> removed;
+        Settings::Directories changed;
+        
+        for (const auto& root : roots)
+        {
+            if (!group.count(root.first))
+            {
+                removed.push_back(root.first);
+                removing.insert(root.first);
+            }
+        }
+        
+        for (const auto& root : group)
+        {
+            auto const it = roots.find(root.first);
+            
+            if (it == roots.end() || !(it->second == root.second))
+            {
+                changed.insert(root);
+            }
+        }
+        
+        if (!removed.empty())
+        {
+            scanThread.removeRoots(removed);
+        }
+        
+        if (!changed.empty())
+        {
+            scanThread.addRoots(changed);
+        }
+    }
+    
+    try
+    {
+        deleteStaleRoots(dirs, removing);
+    }
+    catch(const std::exception& ex)
+    {
+        std::cerr << "Failed to delete removed root directories: " 
+                << ex.what() << std::endl;
+    }
+    
+    for (Settings::Directories& group : groups)
+    {
+        ScanThreadPtr pThread(new ScanThread(
+                std::move(group), 
+                extensions_, 
+                fileSystem_, 
+                playback_,
+                db_, 
+                dbMtx_, 
+                metadataPool_,
+                eventSink_, 
+                onChangedDisp_, 
+                activeFiles_));
+        
+        std::lock_guard<std::mutex> lock(threadsMtx_);
+        threads_.push_back(std::move(pThread));
+    }
+}
+
+
+std::vector<std::string> ScanManager::degradedRoots() const
+{
+    std::vector<std::string> result;
+    std::lock_guard<std::mutex> lock(threadsMtx_);
+    
+    for (const ScanThreadPtr& pThread : threads_)
+    {
+        if (pThread->isDegraded())
+        {
+            for (const auto& root : pThread->roots())
+            {
+                result.push_back(root.first);
+            }
+        }
+    }
+    
+    return result;
+}
+
+
+size_t ScanManager::prunedEntries() const
+{
+    size_t result = 0;
+    std::lock_guard<std::mutex> lock(threadsMtx_);
+    
+    for (const ScanThreadPtr& pThread : threads_)
+    {
+        result += pThread->prunedCount();
+    }
+    
+    return result;
+}
+
+
+void ScanManager::logPrunedEntries() const
+{
+    if (size_t const pruned = prunedEntries())
+    {
+        std::clog << "[Scan] " << pruned 
+                << " entries skipped by exclude patterns" << std::endl;
+    }
+}
+
+
+void ScanManager::setCallbacks(bool set)
+{
+    auto locked = activeFiles_.synchronize();
+    
+    if (set)
+    {
+        locked->onChanged = 
+                std::bind(&ScanManager::onActiveFilesChanged, this, pl::_1);
+        locked->onUrgent = std::bind(&ScanManager::onUrgent, this);
+    }
+    else
+    {
+        locked->onChanged = ActiveRecords::OnChanged();
+        locked->onUrgent = ActiveRecords::OnUrgent();
+    }
+}
+
+
+void ScanManager::stop(std::chrono::steady_clock::time_point deadline)
+{
+    setCallbacks(false);
+    std::vector<ScanThreadPtr> threads;
+    
+    {
+        std::lock_guard<std::mutex> lock(threadsMtx_);
+        threads.swap(threads_);
+    }
+    
+    // all threads wind down at once
+    for (const ScanThreadPtr& pThread : threads)
+    {
+        pThread->stop(deadline);
+    }
+}
+
+
+void ScanManager::deleteStaleRoots(const Settings::Directories& dirs,
+                                   const std::set<std::string>& keep)
+{
+    std::lock_guard<std::mutex> lock(dbMtx_);
+    bool succeed = false;
+    std::vector<ScanEvent> events;
+    
+    db_.beginTransaction();
+    
+    BOOST_SCOPE_EXIT(&db_, &succeed, &events, &eventSink_)
+    {
+        if (succeed)
+        {
+            db_.commit();
+            
+            for (const ScanEvent& event : events)
+            {
+                eventSink_.push(event);
+            }
+        }
+        else
+        {
+            db_.rollback();
+        }
+    } BOOST_SCOPE_EXIT_END
+    
+    for (const FileRecord& rec : db_.childrenFiles(ROOT_RECORD_ID))
+    {
+        if (dirs.count(rec.second.fileName) == 0 && 
+                keep.count(rec.second.fileName) == 0)
+        {
+            std::clog << "[Scan] root " << rec.second.fileName 
+                    << " removed" << std::endl;
+            RecordID const parentId = db_.delFile(rec.first);
+            events.push_back(
+                    ScanEvent{ ScanEvent::DELETED, rec.first, parentId });
+        }
+    }
+    
+    succeed = true;
+}
+
+
+std::vector<Settings::Directories> ScanManager::groupByMount(
+        const Settings::Directories& dirs)
+{
+    // the roots are looked up at once, each with a timeout of its own, so
+    // dead mounts take no longer than one of them and don't fail the
+    // lookups queued behind them
+    std::vector<std::future<std::uintmax_t>> deviceIds;
+    
+    for (const auto& dir : dirs)
+    {
+        deviceIds.push_back(std::async(std::launch::async, 
+            [this, path = fs::path(dir.first)]
+            {
+                GuardedFileSystem fileSystem(
+                        fileSystem_, std::chrono::milliseconds(STAT_TIMEOUT_MS));
+                return fileSystem.deviceId(path);
+            }));
+    }
+    
+    std::map<std::uintmax_t, Settings::Directories> groups;
+    std::uintmax_t unknownId = ~std::uintmax_t(0);
+    auto itDeviceId = deviceIds.begin();
+    
+    for (const auto& dir : dirs)
+    {
+        std::uintmax_t deviceId;
+        
+        try
+        {
+            deviceId = (itDeviceId++)->get();
+        }
+        catch(const fs::filesystem_error& ex)
+        { // unreachable roots get a thread of their own
+            std::clog << "[Scan] " << ex.what() << std::endl;
+            deviceId = unknownId--;
+        }
+        
+        groups[deviceId].insert(dir);
+    }
+    
+    std::vector<Settings::Directories> result;
+    
+    for (auto& group : groups)
+    {
+        result.push_back(std::move(group.second));
+    }
+    
+    return result;
+}
+
+
+void ScanManager::onActiveFilesChanged(bool restart)
+{
+    std::lock_guard<std::mutex> lock(threadsMtx_);
+    
+    for (const ScanThreadPtr& pThread : threads_)
+    {
+        pThread->onActiveFilesChanged(restart);
+    }
+}
+
+
+void ScanManager::onUrgent()
+{
+    std::lock_guard<std::mutex> lock(threadsMtx_);
+    
+    for (const ScanThreadPtr& pThread : threads_)
+    {
+        pThread->onUrgent();
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef SCAN_MANAGER_HPP
+#define	SCAN_MANAGER_HPP
+
+#include "scan_thread.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Distributes the configured root directories among scan threads, one per
+ * mount (grouped by device id), so a slow or dead mount can't hold up the
+ * others. All threads share the database writer and the metadata pool
+ * which reads tags of the files they find. A thread slows down while
+ * music is played from its mount.
+ * Settings are applied on a thread of the manager's own, as looking up the
+ * mounts of the roots may wait for dead ones.
+ */
+class ScanManager
+{
+public:
+    ScanManager(const SettingsProvider& settings,
+                const Extensions& extensions,
+                FileSystem& fileSystem,
+                const PlaybackState& playback,
+                DbOwner& db,
+                ScanEventSink eventSink,
+                Glib::Dispatcher& onChangedDisp,
+                ActiveRecordsSync& activeFiles);
+    ~ScanManager();
+    
+    // re-reads settings in the background; roots are added to and removed
+    // from the running threads of their mounts, a thread is only replaced
+    // when a root moves to another mount or its 'recursive' flag changes;
+    // removed roots are deleted
+    void applySettings();
+    
+    std::vector<std::string> degradedRoots() const;
+    // entries skipped by exclude patterns, in the current threads
+    size_t prunedEntries() const;
+    
+private:
+    using ScanThreadPtr = std::unique_ptr<ScanThread>;
+    
+    void logPrunedEntries() const;
+    void setCallbacks(bool set);
+    void stop(std::chrono::steady_clock::time_point deadline);
+    void applierLoop();
+    void updateThreads();
+    // 'keep' are deleted by the threads they're removed from
+    void deleteStaleRoots(const Settings::Directories& dirs,
+                          const std::set<std::string>& keep);
+    std::vector<Settings::Directories> groupByMount(
+            const Settings::Directories& dirs);
+    void onActiveFilesChanged(bool restart);
+    void onUrgent();
+    
+    const SettingsProvider&     settings_;
+    const Extensions            extensions_;
+    FileSystem&                 fileSystem_;
+    const PlaybackState&        playback_;
+    DbOwner&                    db_;
+    std::mutex                  dbMtx_;
+    ScanEventSink               eventSink_;
+    MetadataPool                metadataPool_;
+    Glib::Dispatcher&           onChangedDisp_;
+    ActiveRecordsSync&          activeFiles_;
+    // changed by the applier, read by the callers of the manager
+    mutable std::mutex          threadsMtx_;
+    std::vector<ScanThreadPtr>  threads_;
+    std::mutex                  applyMtx_;
+    std::condition_variable     applyCond_;
+    bool                        applyPending_;
+    bool                        stopApplier_;
+    std::thread                 applier_;
+};
+
+#endif	/* SCAN_MANAGER_HPP */
@@ -3,40 +3,105 @@
 
 #include <boost/scope_exit.hpp>
 
+#include <algorithm>
+#include <cstring>
 #include <thread>
 #include <iostream>
 
-namespace pl = std::placeholders;
+namespace {
+
+// how long a single filesystem call may take before the mount is degraded
+constexpr int FS_TIMEOUT_MS = 10000;
+// device id lookups of the played file, whose mount may be any
+constexpr int PLAYED_STAT_TIMEOUT_MS = 2000;
+
+constexpr int SLEEP_MS = 500;
+constexpr int MAX_SLEEP_MS = 300000;
+constexpr int DEGRADED_SLEEP_MS = 30000;
+constexpr int MAX_DEGRADED_SLEEP_MS = 1800000;
+
+// bounds of polling intervals of directories outside of the roots' policies
+constexpr int MIN_POLL_SEC = 30;
+constexpr int MAX_POLL_SEC = 6 * 3600;
+
+// filesystem operations per second while music is played from the mount
+constexpr double THROTTLED_OPS_PER_SEC = 50;
+constexpr double THROTTLED_OPS_BURST = 20;
+constexpr int THROTTLED_NICE = 10;
+
+}
 
 ScanThread::ScanThread(
-		const SettingsProvider& settings,
+		Settings::Directories roots,
 		const Extensions& extensions,
+		FileSystem& fileSystem,
+		const PlaybackState& playback,
 		DbOwner& db,
+		std::mutex& dbMtx,
+		MetadataPool& metadataPool,
 		ScanEventSink eventSink,
         Glib::Dispatcher& onChangedDisp,
         ActiveRecordsSync& activeFiles)
  : stop_(false)
  , restart_(true)
+ , checkAll_(false)
  , continue_(false)
- , settings_(settings)
+ , urgent_(true)
+ , roots_(roots)
+ , newRoots_(std::move(roots))
+ , rootsChanged_(false)
  , extensions_(extensions)
+ , pruned_(0)
+ , fileSystem_(fileSystem, std::chrono::milliseconds(FS_TIMEOUT_MS))
+ , statFileSystem_(fileSystem, std::chrono::milliseconds(PLAYED_STAT_TIMEOUT_MS))
+ , playback_(playback)
+ , playbackGeneration_(0)
+ , throttled_(false)
+ , ioIdle_(false)
+ , baseNice_(0)
+ , canRenice_(false)
+ , ioBudget_(THROTTLED_OPS_PER_SEC, THROTTLED_OPS_BURST)
  , db_(db)
+ , dbMtx_(dbMtx)
+ , metadataPool_(metadataPool)
  , eventSink_(eventSink)
  , onChangedDisp_(onChangedDisp)
  , activeFiles_(activeFiles)
+ , scheduler_(MIN_POLL_SEC, MAX_POLL_SEC)
+ , flushedChanges_(false)
+ , scanDepth_(0)
+ , servingUrgent_(false)
 {
+    compileExcludes();
+    
+    // every operation on the mount is paid for, the played file's mount
+    // is looked up unthrottled
+    fileSystem_.setThrottle([this] { throttle(1); });
     thread_ = std::thread(std::ref(*this));
 }
     
 ScanThread::~ScanThread()
 {
+    if (!stop_)
+    {
+        stop(std::chrono::steady_clock::now());
+    }
+    
+	thread_.join();
+}
+
+void ScanThread::stop(std::chrono::steady_clock::time_point deadline)
+{
+    stopDeadline_ = deadline;
 	stop_ = true;
+    fileSystem_.cancel();
+    statFileSystem_.cancel();
 	cond_.notify_all();
-	thread_.join();
 }
 
 void ScanThread::restart()
 {
+	checkAll_ = true;
 	restart_ = true;
 	cond_.notify_all();
 }
@@ -54,11 +119,123 @@ void ScanThread::onActiveFilesChanged(bool rest)
     }
 }
 
+void ScanThread::onUrgent()
+{
+    urgent_ = true;
+    cond_.notify_all();
+}
+
+void ScanThread::addRoots(const Settings::Directories& roots)
+{
+    std::lock_guard<std::mutex> lock(rootsMtx_);
+    
+    for (const auto& root : roots)
+    {
+        newRoots_[root.first] = root.second;
+    }
+    
+    rootsChanged_ = true;
+    cond_.notify_all();
+}
+
+void ScanThread::removeRoots(const std::vector<std::string>& roots)
+{
+    std::lock_guard<std::mutex> lock(rootsMtx_);
+    
+    for (const std::string& root : roots)
+    {
+        newRoots_.erase(root);
+    }
+    
+    rootsChanged_ = true;
+    cond_.notify_all();
+}
+
+Settings::Directories ScanThread::roots() const
+{
+    std::lock_guard<std::mutex> lock(rootsMtx_);
+    return newRoots_;
+}
+
+void ScanThread::compileExcludes()
+{
+    excludes_.clear();
+    excludeCache_ = {};
+    
+    for (const auto& root : roots_)
+    {
+        try
+        {
+            excludes_.emplace(root.first, ExcludeMatcher(root.second.excludes));
+        }
+        catch(const std::exception& ex)
+        {
+            std::cerr << "[Scan] exclude patterns of " << root.first 
+                    << " ignored: " << ex.what() << std::endl;
+            excludes_.emplace(root.first, ExcludeMatcher());
+        }
+    }
+}
+
+/*
+ * Called between passes, when nothing is pending: the records of removed
+ * roots are deleted, added ones are picked up by the pass over the roots,
+ * which also reloads the schedule with the new poll bounds.
+ */
+void ScanThread::updateRoots()
+{
+    Settings::Directories roots;
+    
+    {
+        std::lock_guard<std::mutex> lock(rootsMtx_);
+        rootsChanged_ = false;
+        roots = newRoots_;
+    }
+    
+    std::set<std::string> removed;
+    
+    for (const auto& root : roots_)
+    {
+        if (!roots.count(root.first))
+        {
+            removed.insert(root.first);
+        }
+    }
+    
+    roots_ = std::move(roots);
+    compileExcludes();
+    applyIoPriority();
+    restart_ = true;
+    
+    if (removed.empty())
+    {
+        return;
+    }
+    
+    Changes changes;
+    
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        
+        for (const FileRecord& rec : db_.childrenFiles(ROOT_RECORD_ID))
+        {
+            if (removed.count(rec.second.fileName))
+            {
+                std::clog << "[Scan] root " << rec.second.fileName 
+                        << " removed" << std::endl;
+                changes.delEntry(rec.first);
+            }
+        }
+    }
+    
+    save(changes);
+}
+
 namespace {
 	
-const fs::path& getPath(const fs::directory_entry& dirEntry)
+const fs::path& getPath(const fs::path& dirEntry)
 {
-	return dirEntry.path();
+	return dirEntry;
 }
 
 fs::path getPath(const Settings::Directories::value_type& dirEntry)
@@ -66,7 +243,7 @@ fs::path getPath(const Settings::Directories::value_type& dirEntry)
 	return dirEntry.first;
 }
 	
-bool isRecursive(const fs::directory_entry& dirEntry)
+bool isRecursive(const fs::path& dirEntry)
 {
 	return true;
 }
@@ -76,123 +253,158 @@ bool isRecursive(const Settings::Directories::value_type& dirEntry)
 	return dirEntry.second.recursive;
 }
 
-struct CmpByPath
-{
-	bool operator() (const FileRecord& left, const FileRecord& right) const
-	{
-		return left.second.fileName < right.second.fileName;
-	}
-};
-
-time_t getLastWriteTime(const fs::path& path)
-{
-    return fs::last_write_time(path).time_since_epoch().count();
-}
-
 }
 
 
 template<typename EntriesRange>
-ScanThread::Changes ScanThread::scanDir(
+void ScanThread::scanDir(
             const RecordID& dirId, 
-            EntriesRange const& entries)
+            EntriesRange const& entries,
+            Changes& result)
 {
-    Changes result;
-    
 	if (shouldBreak())
 	{
-		return result;
+		return;
 	}
     
     std::clog << "[Scan] scanDir #" << dirId << std::endl;
 	
-    auto oldRecords = db_.childrenFiles(dirId);
+    if (scanDepth_ == oldRecords_.size())
+    {
+        oldRecords_.emplace_back();
+    }
+    
+    RecordBatch& oldRecords = oldRecords_[scanDepth_++];
+    oldRecords.clear();
+    BOOST_SCOPE_EXIT_TPL(&scanDepth_)
+    {
+        --scanDepth_;
+    } BOOST_SCOPE_EXIT_END
     
-	std::sort(oldRecords.begin(), oldRecords.end(), CmpByPath());
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        
+        db_.forEachChild(dirId, [&](const RecordView& rec)
+        { // other roots are maintained by other threads
+            if (dirId != ROOT_RECORD_ID || 
+                    roots_.count(std::string(rec.fileName)))
+            {
+                oldRecords.push_back(rec);
+            }
+        });
+    }
+    
+	oldRecords.indexByName();
+	size_t const prunedBefore = pruned_;
 		
 	for (const auto& entry : entries)
 	{
-		result += scanEntry(getPath(entry), dirId, oldRecords, isRecursive(entry));
+		scanEntry(getPath(entry), dirId, oldRecords, isRecursive(entry), result);
+		serveUrgent();
 		
 		if (shouldBreak())
 		{
-			return result;
+			return;
 		}
 	}
 	
-	for (const FileRecord& missing : oldRecords)
+	if (pruned_ != prunedBefore)
 	{
-		result.delEntry(missing.first);
+		std::clog << "[Scan] scanDir #" << dirId << ": " 
+				<< pruned_ - prunedBefore << " entries excluded" << std::endl;
+	}
+	
+	for (size_t i = 0; i < oldRecords.size(); ++i)
+	{
+		if (!oldRecords.taken(i))
+		{
+			result.delEntry(oldRecords[i].id);
+		}
 	}
-    
-    return result;
 }
 
-ScanThread::Changes ScanThread::scanEntry(
+void ScanThread::scanEntry(
 			const fs::path& path, 
 			const RecordID& parentID, 
-			FileRecords& oldRecords,
-			bool recursive)
+			RecordBatch& oldRecords,
+			bool recursive,
+			Changes& result)
 try
 {
-    Changes result;
-    
 	if (shouldBreak())
 	{
-		return result;
+		return;
 	}
     
     std::clog << "[Scan] scanEntry " << path << std::endl;
+    
+    const std::string& fileName = path.native();
+    const auto* pRoot = rootOf(fileName);
+    
+    if (pRoot && isSkipped(path, *pRoot))
+    {
+        return; // the old record is deleted, if any
+    }
 	
-	const bool isDir = fs::is_directory(path);	
+	const bool isDir = fileSystem_.isDirectory(path);
     std::clog << "[Scan] scanEntry " << path << "isDir=" << isDir << std::endl;
-	FileRecord newRecord = make_Record(
-		NULL_RECORD_ID, 
-		FileInfo{ parentID, /*last write time*/0, isDir, path.string() });
+	RecordView newRecord;
+	newRecord.id = NULL_RECORD_ID;
+	newRecord.parentID = parentID;
+	newRecord.lastWriteTime = 0;
+	newRecord.isDir = isDir;
+	newRecord.fileName = fileName;
     
-	const std::pair<FileRecords::iterator, FileRecords::iterator> oldRange = 
-		std::equal_range(oldRecords.begin(), oldRecords.end(), newRecord, CmpByPath());
-	assert(std::distance(oldRange.first, oldRange.second) <= 1);
-	
-	const FileRecords::iterator itOldRecord = oldRange.first != oldRange.second ?
-		oldRange.first : oldRecords.end();
+	const size_t oldIndex = oldRecords.find(fileName);
+	const bool isOld = oldIndex != RecordBatch::npos;
 
+	if (isDir && pRoot && pRoot->second.maxDepth > 0)
+	{
+		const fs::path relative = path.lexically_relative(pRoot->first);
+		
+		if (std::distance(relative.begin(), relative.end()) > 
+				pRoot->second.maxDepth)
+		{
+			return; // below the depth scanned
+		}
+	}
+	
 	if (isDir && recursive)
 	{
 		// if new entry
-		if (itOldRecord == oldRecords.end())
+		if (!isOld)
 		{
-            result.addEntry(std::move(newRecord.second));
+            result.addEntry(newRecord);
 		}
 	}
 	else // file
 	{
 		if (!isSupportedExtension(path))
 		{
-			return result; // unsupported extension
+			return; // unsupported extension
 		}
 				
-        newRecord.second.lastWriteTime = getLastWriteTime(path);
+        newRecord.lastWriteTime = fileSystem_.lastWriteTime(path);
         
-		if (itOldRecord == oldRecords.end())
+		if (!isOld)
 		{
-            result.addEntry(std::move(newRecord.second));
+            newRecord.size = fileSystem_.fileSize(path);
+            result.addEntry(newRecord);
 		}
-		else if(newRecord.second.lastWriteTime != 
-				itOldRecord->second.lastWriteTime)
+		else if(newRecord.lastWriteTime != 
+				oldRecords[oldIndex].lastWriteTime)
 		{
-			newRecord.first = itOldRecord->first;
-            result.replaceEntry(std::move(newRecord));
+			newRecord.id = oldRecords[oldIndex].id;
+            newRecord.size = fileSystem_.fileSize(path);
+            result.replaceEntry(newRecord);
 		}
 	}
 	
-	// record was processed, so removing from the list
-	if (oldRecords.end() != itOldRecord)
+	// record was processed, so it isn't deleted
+	if (isOld)
 	{
-		oldRecords.erase(itOldRecord);
+		oldRecords.take(oldIndex);
 	}
-    
-    return result;
 }
 catch(const fs::filesystem_error& ex)
 {
@@ -203,25 +415,19 @@ catch(const fs::filesystem_error& ex)
 	// it shouldn't be deleted from the database
 	if (ex.code().value() != ENOENT)
 	{
-		const FileRecord fakeRecord = make_Record(NULL_RECORD_ID, 
-						FileInfo{ NULL_RECORD_ID, 0, false, path.string() });
-		const FileRecords::iterator itOldRecord = std::lower_bound(
-			oldRecords.begin(), oldRecords.end(), fakeRecord, CmpByPath());
+		const size_t oldIndex = oldRecords.find(path.native());
 		
 		// prevent record from deletion
-		if (oldRecords.end() != itOldRecord)
+		if (oldIndex != RecordBatch::npos)
 		{
-			oldRecords.erase(itOldRecord);
+			oldRecords.take(oldIndex);
 		}
 	}
-    
-    return Changes();
 }
 catch(const std::exception& ex)
 {
 	std::cerr << "Failed to process filesystem element " 
 			<< path << ": " << ex.what() << std::endl;
-    return Changes();
 }
 
 
@@ -230,41 +436,256 @@ bool ScanThread::isSupportedExtension(const fs::path& fileName)
 	return extensions_.find(fileName.extension().string()) != extensions_.end();
 }
 
-ScanThread::Changes ScanThread::checkDir(const FileRecord& recDir)
+bool ScanThread::isOwnPath(std::string_view fileName) const
+{
+    return rootOf(fileName) != nullptr;
+}
+
+const Settings::Directories::value_type* ScanThread::rootOf(
+        std::string_view fileName) const
+{
+    const Settings::Directories::value_type* pResult = nullptr;
+    
+    for (const auto& root : roots_)
+    {
+        const std::string& rootPath = root.first;
+        
+        if (fileName.compare(0, rootPath.size(), rootPath) == 0 && 
+            (fileName.size() == rootPath.size() || 
+             fileName[rootPath.size()] == '/' || rootPath.back() == '/') &&
+            (!pResult || rootPath.size() > pResult->first.size()))
+        { // the innermost of nested roots
+            pResult = &root;
+        }
+    }
+    
+    return pResult;
+}
+
+// excluded names and links which aren't followed, the root itself never is
+bool ScanThread::isSkipped(
+        const fs::path& path, const Settings::Directories::value_type& root)
+{
+    const Settings::Directory& policy = root.second;
+    
+    if (path == root.first)
+    {
+        return false;
+    }
+    
+    const ExcludeMatcher& matcher = excludes_.at(root.first);
+    
+    if (!matcher.empty())
+    {
+        auto const match = matcher.match(
+                excludeState(path.parent_path(), root), path.filename().string());
+        
+        if (match == ExcludeMatcher::Match::ANY || 
+                (match == ExcludeMatcher::Match::DIRECTORY && 
+                    fileSystem_.isDirectory(path)))
+        {
+            ++pruned_;
+            return true;
+        }
+    }
+    
+    return !policy.followSymlinks && fileSystem_.isSymlink(path);
+}
+
+// entries of a directory are scanned in a row, so its state is kept
+ExcludeMatcher::State ScanThread::excludeState(
+        const fs::path& dir, const Settings::Directories::value_type& root)
+{
+    if (excludeCache_.first != dir.native())
+    {
+        const ExcludeMatcher& matcher = excludes_.at(root.first);
+        ExcludeMatcher::State state = matcher.start();
+        
+        for (const fs::path& name : dir.lexically_relative(root.first))
+        {
+            if (name != ".")
+            {
+                state = matcher.enter(state, name.string());
+            }
+        }
+        
+        excludeCache_ = std::make_pair(dir.native(), state);
+    }
+    
+    return excludeCache_.second;
+}
+
+bool ScanThread::isManual(std::string_view fileName) const
+{
+    const auto* pRoot = rootOf(fileName);
+    return pRoot && pRoot->second.watch == Settings::WatchMode::MANUAL;
+}
+
+PollScheduler::Bounds ScanThread::pollBounds(std::string_view fileName) const
+{
+    if (const auto* pRoot = rootOf(fileName))
+    {
+        return PollScheduler::Bounds{ 
+                pRoot->second.minPollSec, pRoot->second.maxPollSec };
+    }
+    
+    return PollScheduler::Bounds{ MIN_POLL_SEC, MAX_POLL_SEC };
+}
+
+// idle while throttled or if a root asks for it
+void ScanThread::applyIoPriority()
+{
+    bool const idle = throttled_ || std::any_of(roots_.begin(), roots_.end(), 
+        [](const Settings::Directories::value_type& root)
+        {
+            return root.second.ioPriority == Settings::IoPriority::IDLE;
+        });
+    
+    if (idle == ioIdle_)
+    {
+        return;
+    }
+    
+    ioIdle_ = idle;
+    fileSystem_.setIoIdle(idle);
+    
+    if (!setThreadIoIdle(idle))
+    {
+        std::cerr << "[Scan] Failed to change I/O priority: " 
+                << std::strerror(errno) << std::endl;
+    }
+}
+
+void ScanThread::throttle(double ops)
+{
+    updateThrottling();
+    
+    if (!throttled_ || stop_ || servingUrgent_)
+    {
+        return; // stopping and the user's requests go at full speed
+    }
+    
+    auto const wait = ioBudget_.take(ops, std::chrono::steady_clock::now());
+    
+    if (wait > wait.zero())
+    {
+        struct FackeLock 
+        {
+            void lock() {}
+            void unlock() {}
+        } fackeLock;
+        
+        // the debt is kept if woken up earlier
+        cond_.wait_for(fackeLock, wait);
+    }
+}
+
+void ScanThread::updateThrottling()
+{
+    uint64_t const generation = playback_.generation();
+    
+    if (generation == playbackGeneration_)
+    {
+        return;
+    }
+    
+    playbackGeneration_ = generation;
+    auto const playing = playback_.playingFile();
+    bool const throttled = playing && isPlayedHere(*playing);
+    
+    if (throttled == throttled_)
+    {
+        return;
+    }
+    
+    throttled_ = throttled;
+    std::clog << "[Scan] " << roots_.begin()->first << (throttled ? 
+            " throttled while playing " : " at full speed") 
+            << (throttled ? *playing : std::string()) << std::endl;
+    
+    ioBudget_.reset(std::chrono::steady_clock::now());
+    applyIoPriority();
+    
+    if (!canRenice_)
+    { // without CAP_SYS_NICE or RLIMIT_NICE it would stay raised for good
+        return;
+    }
+    
+    int const nice = throttled ? std::max(baseNice_, THROTTLED_NICE) : baseNice_;
+    
+    if (!setThreadNice(nice))
+    {
+        std::clog << "[Scan] Failed to change nice level: " 
+                << std::strerror(errno) << std::endl;
+    }
+}
+
+bool ScanThread::isPlayedHere(const std::string& fileName)
+{
+    if (rootOf(fileName))
+    {
+        return true;
+    }
+    
+    // not through fileSystem_: a slow mount of the played file mustn't
+    // degrade this one; roots of a thread share the mount
+    try
+    {
+        if (!rootDeviceId_)
+        {
+            rootDeviceId_ = statFileSystem_.deviceId(roots_.begin()->first);
+        }
+        
+        return statFileSystem_.deviceId(fileName) == *rootDeviceId_;
+    }
+    catch(const fs::filesystem_error&)
+    {
+        return false; // not a local file, or its mount doesn't respond
+    }
+}
+
+void ScanThread::checkDir(const FileRecord& recDir, Changes& result)
 try
 {
     const fs::path dirPath = recDir.second.fileName;
-    Changes result;
+    
+    scanning_.insert(recDir.first);
+    BOOST_SCOPE_EXIT(&scanning_, &recDir)
+    {
+        scanning_.erase(recDir.first);
+    } BOOST_SCOPE_EXIT_END
     
     std::clog << "[Scan] checkDir " << recDir.second.fileName << std::endl;
             
-    if(fs::is_directory(dirPath))
+    if(fileSystem_.isDirectory(dirPath))
     {              
-        time_t const lastWriteTime = getLastWriteTime(dirPath);
+        time_t const lastWriteTime = fileSystem_.lastWriteTime(dirPath);
 
         if(lastWriteTime != recDir.second.lastWriteTime)
         {
-            FileInfo newData = recDir.second;
-            
-            newData.lastWriteTime = lastWriteTime;
-            result.replaceEntry(make_Record(recDir.first, std::move(newData)));
-            
             std::clog << recDir.second.fileName << " changed, scanning" << std::endl;
-            result += scanDir(recDir.first, fs::directory_iterator(dirPath));
+            scanDir(recDir.first, fileSystem_.listDirectory(dirPath), result);
+            
+            // an interrupted scan keeps the old time, so the next pass
+            // lists the directory again and picks up where this one stopped
+            if (!shouldBreak())
+            {
+                RecordView newData(recDir);
+                
+                newData.lastWriteTime = lastWriteTime;
+                result.replaceEntry(newData);
+            }
         }
     }
     else
     {
         result.delEntry(recDir.first);
     }
-    
-    return result;
 }
 catch(const std::exception& ex)
 {
 	std::cerr << "Failed to check dir '" 
 			<< recDir.second.fileName << "': " << ex.what() << std::endl;
-    return Changes();
 }
 
 
@@ -274,6 +695,15 @@ bool ScanThread::Changes::empty() const
 }
 
 
+void ScanThread::Changes::clear()
+{
+    deleted.clear();
+    changed.clear();
+    added.clear();
+    schedules.clear();
+}
+
+
 void ScanThread::Changes::delEntry(const RecordID& id)
 {
     std::clog << "[Scan] delEntry " << id << std::endl;
@@ -281,89 +711,133 @@ void ScanThread::Changes::delEntry(const RecordID& id)
 }
 
 
-void ScanThread::Changes::addEntry(FileInfo&& data)
+void ScanThread::Changes::addEntry(const RecordView& rec)
 {
-    std::clog << "[Scan] addEntry " << data.fileName << std::endl;
-    added.push_back(std::move(data));
+    std::clog << "[Scan] addEntry " << rec.fileName << std::endl;
+    added.push_back(rec);
 }
 
 
-void ScanThread::Changes::replaceEntry(FileRecord&& record)
+void ScanThread::Changes::replaceEntry(const RecordView& rec)
 {
-    std::clog << "[Scan] replaceEntry " << record.second.fileName << std::endl;
-    changed.push_back(std::move(record));
+    std::clog << "[Scan] replaceEntry " << rec.fileName << std::endl;
+    changed.push_back(rec);
 }
 
 void ScanThread::operator() ()
 try
 {
 	std::clog << "Scanning thread started" << std::endl;
+    applyIoPriority();
+    baseNice_ = threadNice();
+    canRenice_ = canRestoreNice(baseNice_);
+    
+    if (!canRenice_)
+    {
+        std::clog << "[Scan] nice level kept while throttled, RLIMIT_NICE "
+                "wouldn't let it be restored" << std::endl;
+    }
     bool hasChanged = true;
+    int  sleepTimeMs = SLEEP_MS;
+    int  degradedSleepMs = DEGRADED_SLEEP_MS;
 	
 	while (!stop_)
 	{
+        if (rootsChanged_)
+        {
+            try
+            {
+                updateRoots();
+            }
+            catch(std::exception const& ex)
+            {
+                std::cerr << "Error updating root directories: " 
+                    << ex.what() << std::endl;
+            }
+        }
+        
         if (restart_)
-		{ // initially scan directories specified in settings
+		{ // initially scan root directories assigned to this thread
             std::clog << "[Scan] initial scan " << std::endl;
-			auto dirs = settings_.getSettings().directories;
             restart_ = false;
-            activeFiles_->onChanged = ActiveRecords::OnChanged();
             continue_ = false;
             hasChanged = true;
 			           
             try
             {
-                auto changes = scanDir(ROOT_RECORD_ID, dirs);
-                save(std::move(changes));
+                Changes changes;
+                scanDir(ROOT_RECORD_ID, roots_, changes);
+                save(changes);
+                loadSchedule(/*checkAll*/checkAll_.exchange(false));
             }
             catch(std::exception const& ex)
             {
                 std::cerr << "Error scanning root directories: " 
                     << ex.what() << std::endl;
             }
-            
-            activeFiles_->onChanged = 
-                    std::bind(&ScanThread::onActiveFilesChanged, this, pl::_1);
 		}
 		
-        hasChanged = save(scanDirs(/*isIdle*/!hasChanged));
-        
-        constexpr static int sleepMs = 500;
-        constexpr static int maxSleepMs = 300000; 
-        static int           sleepTimeMs = sleepMs;
+        hasChanged = scanDirs(/*isIdle*/!hasChanged);
         
-		if (!hasChanged && !stop_)
-		{
-			struct FackeLock 
-			{
-				void lock() {}
-				void unlock() {}
-			} fackeLock;
+        if (isDegraded() && !stop_)
+        {
+            std::clog << "[Scan] " << roots_.begin()->first << " is degraded,"
+                " retry in " << degradedSleepMs << " msec" << std::endl;
+            
+            if (degradedSleepMs == DEGRADED_SLEEP_MS)
+            {
+                onChangedDisp_(); // the widget shows the mount not responding
+            }
             
-            std::clog << "[Scan] Pause for " << sleepTimeMs << " msec" << std::endl;
+            sleep(degradedSleepMs);
             
-            for (int i = 0; i < sleepTimeMs; i += sleepMs)
+            try
             {
-                cond_.wait_for(fackeLock, std::chrono::milliseconds(sleepMs));
-                
-                if (shouldBreak()) break;
-                
-                if (!eventSink_.empty())
-                {
-                    onChangedDisp_(); // doesn't always gets dispatched, so need to push periodically
-                }
+                fileSystem_.isDirectory(roots_.begin()->first);
             }
+            catch(const fs::filesystem_error& ex)
+            {
+                std::clog << "[Scan] " << ex.what() << std::endl;
+            }
+            
+            if (isDegraded())
+            {
+                degradedSleepMs = std::min(degradedSleepMs * 2, MAX_DEGRADED_SLEEP_MS);
+            }
+            else
+            { // the walk interrupted by the timeout has to be redone
+                std::clog << "[Scan] " << roots_.begin()->first 
+                        << " is responsive again" << std::endl;
+                degradedSleepMs = DEGRADED_SLEEP_MS;
+                restart_ = true;
+                onChangedDisp_();
+            }
+        }
+		else if (!hasChanged && !stop_)
+		{
+            int pauseMs = sleepTimeMs;
+            
+            if (auto nextDeadline = scheduler_.nextDeadline())
+            {
+                auto const untilDeadlineMs = 
+                        (*nextDeadline - std::time(nullptr)) * 1000;
+                pauseMs = static_cast<int>(std::clamp<std::time_t>(
+                        untilDeadlineMs, SLEEP_MS, sleepTimeMs));
+            }
+            
+            std::clog << "[Scan] Pause for " << pauseMs << " msec" << std::endl;
+            sleep(pauseMs);
 			
-			if (sleepTimeMs < maxSleepMs) // don't sleep more than 5 minutes
+			if (sleepTimeMs < MAX_SLEEP_MS) // don't sleep more than 5 minutes
 			{
 			    // next iteration will wait twice as longer
                 sleepTimeMs *= 2;
-                if (sleepTimeMs > maxSleepMs) sleepTimeMs = maxSleepMs;
+                if (sleepTimeMs > MAX_SLEEP_MS) sleepTimeMs = MAX_SLEEP_MS;
             }
 		}
 		else
 		{
-			sleepTimeMs = sleepMs;
+			sleepTimeMs = SLEEP_MS;
 			std::this_thread::yield();
 		}
         
@@ -388,65 +862,265 @@ catch(...)
 }
 
 
+void ScanThread::sleep(int timeMs)
+{
+    struct FackeLock 
+    {
+        void lock() {}
+        void unlock() {}
+    } fackeLock;
+    
+    for (int i = 0; i < timeMs; i += SLEEP_MS)
+    {
+        cond_.wait_for(fackeLock, std::chrono::milliseconds(SLEEP_MS));
+        serveUrgent();
+        
+        if (shouldBreak()) break;
+        
+        if (!eventSink_.empty())
+        {
+            onChangedDisp_(); // doesn't always gets dispatched, so need to push periodically
+        }
+    }
+}
+
+
 bool ScanThread::shouldBreak() const
 {
-	return stop_ || restart_ || continue_;
+	return stop_ || restart_ || continue_ || rootsChanged_;
 }
 
 
-ScanThread::Changes ScanThread::scanDirs(bool isIdle)
+bool ScanThread::pastDeadline() const
 {
-    Changes changes;
+    return stop_ && std::chrono::steady_clock::now() >= stopDeadline_;
+}
+
+
+bool ScanThread::scanDirs(bool isIdle)
+{
+    RecordIDs checked;
+    std::time_t const now = std::time(nullptr);
     
-    if (isIdle)
+    auto checkDirById = [&](RecordID dirId, bool onlyPolled)
     {
+        try
+        {
+            FileRecord dir;
+            
+            {
+                std::lock_guard<std::mutex> lock(dbMtx_);
+                dir = make_Record(dirId, db_.getFile(dirId));
+            }
+            
+            if (onlyPolled && isManual(dir.second.fileName))
+            {
+                return;
+            }
+            
+            if (isOwnPath(dir.second.fileName) && checked.insert(dirId).second)
+            { // whole directories only, pending_ may be flushed meanwhile
+                dirChanges_.clear();
+                checkScheduled(dir, now, dirChanges_);
+                pending_ += dirChanges_;
+            }
+        }
+        catch(std::out_of_range const& e) // directory not in db already (yet)
+        {
+            std::clog << "[Scan] scanDirs #" << dirId << ": " << e.what() << std::endl;
+            scheduler_.remove(dirId);
+        }
+    };
+    
+    if (isIdle)
+    { // directories the user is looking at are checked on every pass
         auto const dirIds = activeFiles_->ids;
 
         for (auto dirId : dirIds)
         {
-            if (shouldBreak())
+            serveUrgent();
+            
+            if (shouldBreak() || isDegraded())
             {
                 break;
             }
 
-            try
-            {
-                auto dir = db_.getFile(dirId);
-                changes += checkDir(make_Record(dirId, std::move(dir)));
-            }
-            catch(std::out_of_range const& e) // directory not in db already (yet)
-            {
-                std::clog << "[Scan] scanDirs #" << dirId << ": " << e.what() << std::endl;
-            }
+            checkDirById(dirId, /*onlyPolled*/true);
         }
     }
-    else
+    
+    for (RecordID dirId : scheduler_.due(now))
     {
-        for (auto const& dir : db_.dirs())
+        serveUrgent();
+        
+        if (shouldBreak() || isDegraded())
         {
-            changes += checkDir(dir);
+            break;
         }
+        
+        checkDirById(dirId, /*onlyPolled*/false);
     }
     
-    return changes;
+    flush();
+    
+    bool const hasChanged = flushedChanges_;
+    flushedChanges_ = false;
+    return hasChanged;
+}
+
+
+bool ScanThread::flush()
+{
+    bool const hasChanged = save(pending_);
+    pending_.clear();
+    flushedChanges_ = flushedChanges_ || hasChanged;
+    return hasChanged;
+}
+
+
+void ScanThread::serveUrgent()
+{
+    if (servingUrgent_ || !urgent_.exchange(false))
+    {
+        return;
+    }
+    
+    servingUrgent_ = true;
+    BOOST_SCOPE_EXIT(&servingUrgent_)
+    {
+        servingUrgent_ = false;
+    } BOOST_SCOPE_EXIT_END
+    
+    auto const urgentIds = activeFiles_->urgent;
+    std::time_t const now = std::time(nullptr);
+    
+    // results collected so far are saved first, so that the urgent check
+    // sees the current state of the database
+    flush();
+    
+    for (RecordID dirId : urgentIds)
+    {
+        FileRecord dir;
+        
+        try
+        {
+            std::lock_guard<std::mutex> lock(dbMtx_);
+            dir = make_Record(dirId, db_.getFile(dirId));
+        }
+        catch(std::out_of_range const&)
+        {
+            activeFiles_->urgent.erase(dirId);
+            continue;
+        }
+        
+        if (!isOwnPath(dir.second.fileName))
+        {
+            continue; // other thread's directory
+        }
+        
+        activeFiles_->urgent.erase(dirId);
+        
+        if (scanning_.count(dirId))
+        {
+            continue; // the background walk is delivering it right now
+        }
+        
+        std::clog << "[Scan] urgent check of " << dir.second.fileName << std::endl;
+        
+        Changes changes;
+        checkScheduled(dir, now, changes);
+        
+        if (save(changes))
+        {
+            onChangedDisp_();
+        }
+    }
 }
 
 
-bool ScanThread::save(Changes&& changes)
+void ScanThread::checkScheduled(
+        const FileRecord& recDir, std::time_t now, Changes& changes)
 {
-    if (changes.empty())
+    size_t const before = changes.size();
+    checkDir(recDir, changes);
+    
+    if (std::find(changes.deleted.begin(), changes.deleted.end(), recDir.first) 
+            != changes.deleted.end() || isManual(recDir.second.fileName))
+    { // manually watched directories are only scheduled until checked once
+        scheduler_.remove(recDir.first);
+    }
+    else if (!isDegraded() && !stop_) // a timed out or cancelled check tells nothing
+    {
+        changes.schedules.emplace_back(recDir.first, 
+                scheduler_.checked(recDir.first, changes.size() != before, now));
+    }
+}
+
+
+void ScanThread::loadSchedule(bool checkAll)
+{
+    DirSchedules schedules;
+    std::time_t const now = std::time(nullptr);
+    scheduler_.clear();
+    
+    {
+        std::lock_guard<std::mutex> lock(dbMtx_);
+        
+        // names aren't copied, most directories of a large library are
+        // only looked at here
+        db_.forEachDir([&](const RecordView& dir)
+        {
+            // manually watched directories only until they've been walked once
+            if (isOwnPath(dir.fileName) && 
+                (checkAll || dir.lastWriteTime == 0 || !isManual(dir.fileName)))
+            {
+                scheduler_.add(dir.id, now, pollBounds(dir.fileName));
+            }
+        });
+        
+        schedules = db_.dirSchedules();
+    }
+    
+    if (!checkAll)
+    { // otherwise every directory is due now
+        scheduler_.load(schedules);
+    }
+    
+    std::clog << "[Scan] " << scheduler_.size() << " directories scheduled" << std::endl;
+}
+
+
+/*
+ * A directory's new write time is stored after everything else, so whatever
+ * prefix gets committed when the deadline cuts saving short is a checkpoint:
+ * directories whose time wasn't updated are listed again on the next start,
+ * the entries already saved are found there and aren't added twice.
+ */
+bool ScanThread::save(const Changes& changes)
+{
+    if (changes.empty() && changes.schedules.empty())
     {
         return false;
     }
     
+    std::time_t const now = std::time(nullptr);
+    
+    std::lock_guard<std::mutex> lock(dbMtx_);
     db_.beginTransaction();
     bool succeed = false;
+    // sent once committed, so that readers of an event see the change
+    std::vector<ScanEvent> events;
     
-    BOOST_SCOPE_EXIT(&db_, &succeed)
+    BOOST_SCOPE_EXIT(&db_, &succeed, &events, &eventSink_)
     {
         if (succeed)
         {
             db_.commit();
+            
+            for (const ScanEvent& event : events)
+            {
+                eventSink_.push(event);
+            }
         }
         else
         {
@@ -454,39 +1128,83 @@ bool ScanThread::save(Changes&& changes)
         }
     } BOOST_SCOPE_EXIT_END
     
-    for (FileInfo& data : changes.added)
+    for (size_t i = 0; i < changes.added.size(); ++i)
     {
-        if (shouldBreak()) break;
+        if (pastDeadline()) break;
         
-        RecordID id = db_.addFile(std::move(data));
-        eventSink_.push(ScanEvent{ ScanEvent::ADDED, id });
+        RecordView data = changes.added[i];
+        data.id = db_.addFile(data);
+        db_.indexFile(data.id, data.fileName);
+        events.push_back(ScanEvent{ ScanEvent::ADDED, data.id, data.parentID });
+        
+        if (data.isDir)
+        { // contents of a new directory are scanned on the next pass
+            scheduler_.add(data.id, now, pollBounds(data.fileName));
+        }
+        else
+        {
+            metadataPool_.enqueue(data);
+        }
     }
     
-    for (FileRecord& record : changes.changed)
+    auto const replace = [this, &events](const RecordView& record)
     {
-        if (shouldBreak()) break;
+        db_.replaceFile(record);
+        events.push_back(ScanEvent{ ScanEvent::UPDATED, record.id, record.parentID });
+        
+        if (!record.isDir)
+        {
+            metadataPool_.enqueue(record);
+        }
+    };
+    
+    for (size_t i = 0; i < changes.changed.size(); ++i)
+    {
+        if (pastDeadline()) break;
+        
+        if (!changes.changed[i].isDir)
+        {
+            replace(changes.changed[i]);
+        }
+    }
+    
+    for (const auto& schedule : changes.schedules)
+    {
+        if (pastDeadline()) break;
         
-        db_.replaceFile(record.first, std::move(record.second));
-        eventSink_.push(ScanEvent{ ScanEvent::UPDATED, record.first });
+        db_.setDirSchedule(schedule.first, schedule.second);
     }
     
     for (RecordID id : changes.deleted)
     {
-        if (shouldBreak()) break;
+        if (pastDeadline()) break;
         
-        db_.delFile(id);
-    	eventSink_.push(ScanEvent{ ScanEvent::DELETED, id });
+        RecordID const parentId = db_.delFile(id);
+    	events.push_back(ScanEvent{ ScanEvent::DELETED, id, parentId });
+        scheduler_.remove(id);
+    }
+    
+    for (size_t i = 0; i < changes.changed.size(); ++i)
+    {
+        if (pastDeadline()) break;
+        
+        if (changes.changed[i].isDir)
+        {
+            replace(changes.changed[i]);
+        }
     }
     
     succeed = true;
-    return true;
+    return !changes.empty();
 }
 
-ScanThread::Changes& ScanThread::Changes::operator+= (Changes&& other)
+ScanThread::Changes& ScanThread::Changes::operator+= (const Changes& other)
 {
-    deleted.splice(deleted.end(), std::move(other.deleted));
-    changed.splice(changed.end(), std::move(other.changed));
-    added.splice(added.end(), std::move(other.added));
+    deleted.insert(deleted.end(), other.deleted.begin(), other.deleted.end());
+    changed.append(other.changed);
+    added.append(other.added);
+    schedules.insert(schedules.end(), 
+            other.schedules.begin(), other.schedules.end());
     
     return *this;
 }
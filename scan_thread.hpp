@@ -4,15 +4,28 @@
 #include "settings.hpp"
 #include "database.hpp"
 #include "scan_event.hpp"
+#include "file_system.hpp"
+#include "poll_scheduler.hpp"
+#include "metadata_pool.hpp"
+#include "exclude_matcher.hpp"
+#include "throttle.hpp"
+#include "record_batch.hpp"
 
 #include <boost/algorithm/string/predicate.hpp>
 
 #include <filesystem>
 namespace fs = std::filesystem;
+#include <map>
+#include <optional>
 #include <set>
+#include <vector>
 #include <string>
+#include <string_view>
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <thread>
+#include <mutex>
 #include <condition_variable>
 
 #include <glibmm/dispatcher.h>
@@ -27,18 +40,47 @@ struct CaseCompare
 
 typedef std::set<std::string, CaseCompare> Extensions;
 
+/*
+ * Scans a group of root directories residing on the same mount. Filesystem
+ * calls are guarded by a timeout, so an unresponsive mount only stalls the
+ * thread responsible for it, which then backs off as degraded.
+ * Roots can be added and removed while the thread runs; they're taken over
+ * between passes and the records of removed ones are deleted by the thread.
+ * While a file on the same mount is played, the walk is limited by a token
+ * bucket and runs at idle I/O class and a higher nice level.
+ * The database is shared with other scan threads and accessed under dbMtx.
+ */
 class ScanThread
 {
 public:
-    ScanThread(const SettingsProvider& settings,
+    ScanThread(Settings::Directories roots,
                const Extensions& extensions,
+               FileSystem& fileSystem,
+               const PlaybackState& playback,
                DbOwner & db,
+               std::mutex& dbMtx,
+               MetadataPool& metadataPool,
                ScanEventSink eventSink,
                Glib::Dispatcher& onChangedDisp,
                ActiveRecordsSync& activeFiles);
     ~ScanThread();
     
+    // cancels pending filesystem calls and lets the thread save the changes
+    // found so far; saving is cut short at the deadline
+    void stop(std::chrono::steady_clock::time_point deadline);
     void restart();
+    void onActiveFilesChanged(bool restart);
+    void onUrgent();
+    // adds roots on the thread's mount or replaces the policies of its own,
+    // other than 'recursive', which the thread has to be replaced for
+    void addRoots(const Settings::Directories& roots);
+    void removeRoots(const std::vector<std::string>& roots);
+    
+    bool isDegraded() const { return fileSystem_.isDegraded(); }
+    // entries skipped by exclude patterns since the thread started
+    size_t prunedCount() const { return pruned_; }
+    // as last added and removed, the thread may not have taken them over yet
+    Settings::Directories roots() const;
 	
     void operator() ();
 
@@ -46,50 +88,128 @@ private:
     struct Changes
     {
         bool empty() const;
+        // records added, changed and deleted
+        size_t size() const { return deleted.size() + changed.size() + added.size(); }
+        // keeps the capacity for the next batch
+        void clear();
         
-        void addEntry(FileInfo&& data);
+        void addEntry(const RecordView& rec);
         void delEntry(const RecordID& id);
-        void replaceEntry(FileRecord&& record);
+        void replaceEntry(const RecordView& rec);
     
-        Changes& operator+= (Changes&& other);
+        Changes& operator+= (const Changes& other);
         
-        std::list<RecordID>   deleted;
-        std::list<FileRecord> changed;
-        std::list<FileInfo>   added;
+        std::vector<RecordID> deleted;
+        RecordBatch           changed;
+        // ids aren't known yet
+        RecordBatch           added;
+        // updated polling state of checked directories
+        std::vector<std::pair<RecordID, DirSchedule>> schedules;
     };
     
+    // the scan functions append to the changes passed
     template<typename EntriesRange>
-    Changes scanDir(
+    void scanDir(
             const RecordID& dirId, 
-            EntriesRange const& entries);
+            EntriesRange const& entries,
+            Changes& result);
     
-    Changes scanEntry(
+    void scanEntry(
             const fs::path& path, 
             const RecordID& parentID, 
-            FileRecords& oldRecords,
-            bool recursive);
+            RecordBatch& oldRecords,
+            bool recursive,
+            Changes& result);
     
-    Changes checkDir(const FileRecord& recDir);
+    void checkDir(const FileRecord& recDir, Changes& result);
+    void checkScheduled(const FileRecord& recDir, std::time_t now, 
+            Changes& changes);
     
+    void compileExcludes();
+    // takes over the roots added and removed meanwhile
+    void updateRoots();
     bool shouldBreak() const;
+    bool pastDeadline() const;
     bool isSupportedExtension(const fs::path& fileName);
+    bool isOwnPath(std::string_view fileName) const;
+    // the root the path belongs to, nullptr for other threads' paths
+    const Settings::Directories::value_type* rootOf(
+            std::string_view fileName) const;
+    bool isSkipped(const fs::path& path, 
+            const Settings::Directories::value_type& root);
+    ExcludeMatcher::State excludeState(const fs::path& dir, 
+            const Settings::Directories::value_type& root);
+    bool isManual(std::string_view fileName) const;
+    PollScheduler::Bounds pollBounds(std::string_view fileName) const;
+    void applyIoPriority();
+    // waits for the token bucket while the playback is on this mount,
+    // called before each operation of fileSystem_
+    void throttle(double ops);
+    void updateThrottling();
+    bool isPlayedHere(const std::string& fileName);
     
-    Changes scanDirs(bool isIdle);
-    bool save(Changes&& changes);
+    bool scanDirs(bool isIdle);
+    bool flush();
+    bool save(const Changes& changes);
+    void loadSchedule(bool checkAll);
+    void serveUrgent();
     
-    void onActiveFilesChanged(bool restart);
+    void sleep(int timeMs);
     
     std::thread                 thread_;
     std::condition_variable_any	cond_;
     std::atomic<bool>           stop_;
+    // set before stop_
+    std::chrono::steady_clock::time_point stopDeadline_;
     std::atomic<bool>           restart_;
+    std::atomic<bool>           checkAll_;
     std::atomic<bool>           continue_;
-    const SettingsProvider&     settings_;
+    std::atomic<bool>           urgent_;
+    // used by the thread only, updated from newRoots_
+    Settings::Directories       roots_;
+    mutable std::mutex          rootsMtx_;
+    Settings::Directories       newRoots_;
+    std::atomic<bool>           rootsChanged_;
     const Extensions            extensions_;
+    // compiled exclude patterns of each root
+    std::map<std::string, ExcludeMatcher> excludes_;
+    // matcher state of the directory being walked
+    std::pair<std::string, ExcludeMatcher::State> excludeCache_;
+    std::atomic<size_t>         pruned_;
+    GuardedFileSystem           fileSystem_;
+    // looks up the mount of the played file, with a timeout of its own
+    GuardedFileSystem           statFileSystem_;
+    // of the roots, once looked up
+    std::optional<std::uintmax_t> rootDeviceId_;
+    const PlaybackState&        playback_;
+    // generation of the playback state throttled_ reflects
+    uint64_t                    playbackGeneration_;
+    bool                        throttled_;
+    bool                        ioIdle_;
+    // nice level the thread started with, restored when throttling ends
+    int                         baseNice_;
+    // raised while throttled only if it can be restored
+    bool                        canRenice_;
+    TokenBucket                 ioBudget_;
     DbOwner&                    db_;
+    std::mutex&                 dbMtx_;
+    MetadataPool&               metadataPool_;
     ScanEventSink               eventSink_;
     Glib::Dispatcher&           onChangedDisp_;
     ActiveRecordsSync&          activeFiles_;
+    PollScheduler               scheduler_;
+    // results of the background pass which aren't saved yet
+    Changes                     pending_;
+    // of the directory being checked in the background
+    Changes                     dirChanges_;
+    bool                        flushedChanges_;
+    // records of the directories being scanned, one per scanDir() on the
+    // stack, which an urgent check can nest into; kept for their capacity
+    std::deque<RecordBatch>     oldRecords_;
+    size_t                      scanDepth_;
+    // directories being walked, their results are still on the stack
+    RecordIDs                   scanning_;
+    bool                        servingUrgent_;
 };
 
 #endif	/* SCAN_THREAD_HPP */
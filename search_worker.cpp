@@ -0,0 +1,98 @@
+#include "search_worker.hpp"
+
+#include <iostream>
+
+namespace {
+
+// more results than that aren't useful in a sidebar
+constexpr size_t MAX_RESULTS = 500;
+
+}
+
+
+SearchWorker::SearchWorker(DbReader&& db)
+ : db_(std::move(db))
+ , generation_(0)
+ , pending_(false)
+ , stop_(false)
+{
+    thread_ = std::thread(&SearchWorker::run, this);
+}
+
+
+SearchWorker::~SearchWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+        ++generation_; // makes a running query give up
+    }
+    
+    cond_.notify_one();
+    thread_.join();
+}
+
+
+unsigned SearchWorker::search(std::string query)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    
+    query_ = std::move(query);
+    pending_ = true;
+    cond_.notify_one();
+    
+    return ++generation_;
+}
+
+
+std::optional<SearchWorker::Results> SearchWorker::takeResults()
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::optional<Results> results;
+    
+    results.swap(results_);
+    return results;
+}
+
+
+void SearchWorker::run()
+{
+    std::unique_lock<std::mutex> lock(mtx_);
+    
+    while (true)
+    {
+        cond_.wait(lock, [this] { return stop_ || pending_; });
+        
+        if (stop_)
+        {
+            break;
+        }
+        
+        std::string const query = std::move(query_);
+        unsigned const generation = generation_;
+        pending_ = false;
+        
+        lock.unlock();
+        
+        Results results{ generation, FileRecords() };
+        
+        try
+        {
+            results.files = db_.search(query, MAX_RESULTS, 
+                    [this, generation] { return generation_ != generation; });
+        }
+        catch(const std::exception& ex)
+        {
+            std::cerr << "[Search] Query '" << query << "' failed: " 
+                    << ex.what() << std::endl;
+        }
+        
+        lock.lock();
+        
+        if (generation == generation_)
+        {
+            results_ = std::move(results);
+            onResultsDisp_();
+        }
+    }
+}
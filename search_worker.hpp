@@ -0,0 +1,56 @@
+#ifndef SEARCH_WORKER_HPP
+#define	SEARCH_WORKER_HPP
+
+#include "database.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include <glibmm/dispatcher.h>
+
+/*
+ * Runs search queries off the GUI thread on its own database connection.
+ * Every query gets a generation number; a query superseded by a newer one
+ * is abandoned at the next check and its results are never delivered.
+ */
+class SearchWorker
+{
+public:
+    struct Results
+    {
+        unsigned    generation;
+        FileRecords files;
+    };
+    
+    explicit SearchWorker(DbReader&& db);
+    ~SearchWorker();
+    
+    SearchWorker(const SearchWorker&) = delete;
+    
+    // replaces any pending or running query, returns its generation
+    unsigned search(std::string query);
+    // results of the latest finished query, if not taken yet
+    std::optional<Results> takeResults();
+    
+    Glib::Dispatcher& getOnResultsDisp() { return onResultsDisp_; }
+    
+private:
+    void run();
+    
+    DbReader                db_;
+    std::mutex              mtx_;
+    std::condition_variable cond_;
+    std::string             query_;
+    std::atomic<unsigned>   generation_;
+    bool                    pending_;
+    bool                    stop_;
+    std::optional<Results>  results_;
+    Glib::Dispatcher        onResultsDisp_;
+    std::thread             thread_;
+};
+
+#endif	/* SEARCH_WORKER_HPP */
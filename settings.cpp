@@ -5,11 +5,25 @@
 
 #include <filesystem>
 namespace fs = std::filesystem;
+#include <algorithm>
 #include <fstream>
 
 
 const std::string	CONFIG_DIRECTORIES_KEY = "directories";
 const std::string	CONFIG_RECURSIVE_KEY = "recursive";
+const std::string	CONFIG_WATCH_KEY = "watch";
+const std::string	CONFIG_MIN_POLL_KEY = "min_poll_sec";
+const std::string	CONFIG_MAX_POLL_KEY = "max_poll_sec";
+const std::string	CONFIG_MAX_DEPTH_KEY = "max_depth";
+const std::string	CONFIG_EXCLUDES_KEY = "excludes";
+const std::string	CONFIG_FOLLOW_SYMLINKS_KEY = "follow_symlinks";
+const std::string	CONFIG_IO_PRIORITY_KEY = "io_priority";
+const std::string	CONFIG_SHOW_TOTALS_KEY = "show_totals";
+
+const std::string	WATCH_POLL = "poll";
+const std::string	WATCH_MANUAL = "manual";
+const std::string	IO_PRIORITY_NORMAL = "normal";
+const std::string	IO_PRIORITY_IDLE = "idle";
 
 
 Settings SettingsProvider::getSettings() const
@@ -39,6 +53,7 @@ void Settings::load(std::string const& fileName)
     
     ptree tree;
 	read_json(fileName, tree);
+	showTotals = tree.get(CONFIG_SHOW_TOTALS_KEY, false);
 	ptree::assoc_iterator itDirs = tree.find(CONFIG_DIRECTORIES_KEY);
 
 	if (itDirs != tree.not_found())
@@ -46,7 +61,31 @@ void Settings::load(std::string const& fileName)
 		for (auto dir : itDirs->second)
 		{
 			Settings::Directory dirSettings;
-			dirSettings.recursive = dir.second.get(CONFIG_RECURSIVE_KEY, true);
+			ptree const& node = dir.second;
+			dirSettings.recursive = node.get(CONFIG_RECURSIVE_KEY, true);
+			// unknown modes fall back to the defaults
+			dirSettings.watch = node.get(CONFIG_WATCH_KEY, WATCH_POLL) == WATCH_MANUAL ?
+					WatchMode::MANUAL : WatchMode::POLL;
+			dirSettings.minPollSec = std::max(1, 
+					node.get(CONFIG_MIN_POLL_KEY, dirSettings.minPollSec));
+			dirSettings.maxPollSec = std::max(dirSettings.minPollSec, 
+					node.get(CONFIG_MAX_POLL_KEY, dirSettings.maxPollSec));
+			dirSettings.maxDepth = std::max(0, 
+					node.get(CONFIG_MAX_DEPTH_KEY, dirSettings.maxDepth));
+			dirSettings.followSymlinks = 
+					node.get(CONFIG_FOLLOW_SYMLINKS_KEY, true);
+			dirSettings.ioPriority = 
+					node.get(CONFIG_IO_PRIORITY_KEY, IO_PRIORITY_NORMAL) == IO_PRIORITY_IDLE ?
+					IoPriority::IDLE : IoPriority::NORMAL;
+			
+			if (auto excludes = node.get_child_optional(CONFIG_EXCLUDES_KEY))
+			{
+				for (auto const& pattern : *excludes)
+				{
+					dirSettings.excludes.push_back(pattern.second.data());
+				}
+			}
+			
 			directories[dir.first] = std::move(dirSettings);
 		}
 	}
@@ -67,9 +106,31 @@ void Settings::save(std::string const& fileName)
 		ptree::iterator itDir = itDirs->second.push_back(
 				std::make_pair(dir.first, ptree()));
 		
-		itDir->second.put(CONFIG_RECURSIVE_KEY, dir.second.recursive);
+		Settings::Directory const& dirSettings = dir.second;
+		ptree& node = itDir->second;
+		node.put(CONFIG_RECURSIVE_KEY, dirSettings.recursive);
+		node.put(CONFIG_WATCH_KEY, dirSettings.watch == WatchMode::MANUAL ? 
+				WATCH_MANUAL : WATCH_POLL);
+		node.put(CONFIG_MIN_POLL_KEY, dirSettings.minPollSec);
+		node.put(CONFIG_MAX_POLL_KEY, dirSettings.maxPollSec);
+		node.put(CONFIG_MAX_DEPTH_KEY, dirSettings.maxDepth);
+		node.put(CONFIG_FOLLOW_SYMLINKS_KEY, dirSettings.followSymlinks);
+		node.put(CONFIG_IO_PRIORITY_KEY, 
+				dirSettings.ioPriority == IoPriority::IDLE ? 
+				IO_PRIORITY_IDLE : IO_PRIORITY_NORMAL);
+		
+		// a JSON array is a node of unnamed children
+		ptree excludes;
+		
+		for (std::string const& pattern : dirSettings.excludes)
+		{
+			excludes.push_back(std::make_pair(std::string(), ptree(pattern)));
+		}
+		
+		node.add_child(CONFIG_EXCLUDES_KEY, excludes);
 	}
 	
+	treeMain.put(CONFIG_SHOW_TOTALS_KEY, showTotals);
     write_json(fileName, treeMain);
 }
     
\ No newline at end of file
@@ -4,12 +4,52 @@
 #include <map>
 #include <string>
 #include <mutex>
+#include <vector>
 
 struct Settings
 {
+    // how changes below a root are noticed
+    enum class WatchMode
+    {
+        POLL,   // directories are checked on a schedule
+        MANUAL  // only on refresh or when opened in the widget
+    };
+    
+    enum class IoPriority
+    {
+        NORMAL,
+        IDLE    // the scan thread only gets disk time nobody else wants
+    };
+    
+    // scan policy of a root directory, so that an expensive mount can be
+    // configured to cost almost nothing while idle
     struct Directory
     {
-        bool recursive;
+        bool                     recursive = true;
+        WatchMode                watch = WatchMode::POLL;
+        // bounds of the adaptive poll interval
+        int                      minPollSec = 30;
+        int                      maxPollSec = 6 * 3600;
+        // directory levels scanned below the root, 0 for no limit
+        int                      maxDepth = 0;
+        // shell patterns of entry names, or of paths from the root if they
+        // contain '/', directories only if they end with it; matching
+        // directories aren't walked
+        std::vector<std::string> excludes;
+        bool                     followSymlinks = true;
+        IoPriority               ioPriority = IoPriority::NORMAL;
+        
+        bool operator== (const Directory& other) const
+        {
+            return recursive == other.recursive &&
+                    watch == other.watch &&
+                    minPollSec == other.minPollSec &&
+                    maxPollSec == other.maxPollSec &&
+                    maxDepth == other.maxDepth &&
+                    excludes == other.excludes &&
+                    followSymlinks == other.followSymlinks &&
+                    ioPriority == other.ioPriority;
+        }
     };
     
     void load(std::string const& fileName);
@@ -17,6 +57,8 @@ struct Settings
  
     typedef std::map<std::string, Directory> Directories;
     Directories directories;
+    // file count, size and duration of folders in the tree
+    bool        showTotals = false;
 };
 
 
@@ -1,5 +1,7 @@
 #include "settings_dlg.hpp"
 
+#include <algorithm>
+#include <sstream>
 #include <vector>
 
 
@@ -11,11 +13,68 @@ struct DirListColumns : Gtk::TreeModel::ColumnRecord
 
 static const DirListColumns dirListColumns; // TODO: make non-static
 
+namespace {
+
+// separates exclude patterns in the entry
+const char EXCLUDES_SEPARATOR = ';';
+
+std::string joinPatterns(const std::vector<std::string>& patterns)
+{
+    std::string result;
+    
+    for (const std::string& pattern : patterns)
+    {
+        if (!result.empty())
+        {
+            result += EXCLUDES_SEPARATOR;
+        }
+        
+        result += pattern;
+    }
+    
+    return result;
+}
+
+std::vector<std::string> splitPatterns(const std::string& text)
+{
+    std::vector<std::string> result;
+    std::istringstream stream(text);
+    std::string pattern;
+    
+    while (std::getline(stream, pattern, EXCLUDES_SEPARATOR))
+    {
+        pattern.erase(0, pattern.find_first_not_of(' '));
+        pattern.erase(pattern.find_last_not_of(' ') + 1);
+        
+        if (!pattern.empty())
+        {
+            result.push_back(pattern);
+        }
+    }
+    
+    return result;
+}
+
+Gtk::HBox* labeledRow(const Glib::ustring& label, Gtk::Widget& widget)
+{
+    auto pRow = Gtk::manage(new Gtk::HBox());
+    pRow->pack_start(*Gtk::manage(new Gtk::Label(label)), Gtk::PACK_SHRINK, 4);
+    pRow->pack_start(widget, Gtk::PACK_EXPAND_WIDGET);
+    return pRow;
+}
+
+}
+
 
 SettingsDlg::SettingsDlg(Settings & settings) :
     Gtk::Dialog("Settings", /*modal*/ true),
     settings_(settings),
-    btnDel_(Gtk::Stock::DELETE)
+    btnDel_(Gtk::Stock::DELETE),
+    recursiveCheck_("Scan subdirectories"),
+    followSymlinksCheck_("Follow symbolic links"),
+    idleIoCheck_("Scan with idle disk priority"),
+    showTotalsCheck_("Show folder totals"),
+    updating_(false)
 {
     initDirList();
   
@@ -41,12 +100,20 @@ SettingsDlg::SettingsDlg(Settings & settings) :
     
     pMainBox->pack_start(*pFrame, Gtk::PACK_EXPAND_WIDGET, 1);
     pMainBox->pack_start(*pRightBox, Gtk::PACK_SHRINK);
+    
+    showTotalsCheck_.set_active(settings_.showTotals);
+    showTotalsCheck_.signal_toggled().connect(
+            sigc::mem_fun(*this, &SettingsDlg::onShowTotalsToggled));
 
  #ifdef USE_GTK2
     get_vbox()->pack_start(*pMainBox, Gtk::PACK_EXPAND_WIDGET, 1);
+    get_vbox()->pack_start(*initPolicyBox(), Gtk::PACK_SHRINK, 1);
+    get_vbox()->pack_start(showTotalsCheck_, Gtk::PACK_SHRINK, 1);
  #else
     get_content_area()->set_orientation(Gtk::ORIENTATION_VERTICAL);
     get_content_area()->pack_start(*pMainBox, Gtk::PACK_EXPAND_WIDGET, 1);
+    get_content_area()->pack_start(*initPolicyBox(), Gtk::PACK_SHRINK, 1);
+    get_content_area()->pack_start(showTotalsCheck_, Gtk::PACK_SHRINK, 1);
  #endif
     
     this->add_button(Gtk::Stock::OK, Gtk::RESPONSE_OK);
@@ -62,8 +129,138 @@ void SettingsDlg::initDirList()
     dirList_.set_model(pListModel_);
     dirList_.append_column("Path", dirListColumns.path);
     dirList_.set_headers_visible(false);
-    //    dirList_.signal_selection_notify_event().connect(
-    //        sigc::mem_fun(*this, &SettingsDlg::onSelNotify));
+    dirList_.get_selection()->signal_changed().connect(
+            sigc::mem_fun(*this, &SettingsDlg::onDirSelected));
+}
+
+
+Gtk::Widget* SettingsDlg::initPolicyBox()
+{
+    watchCombo_.append("Check for changes periodically");
+    watchCombo_.append("Check only on refresh");
+    
+    minPollSpin_.set_range(1, 24 * 3600);
+    minPollSpin_.set_increments(10, 600);
+    maxPollSpin_.set_range(1, 7 * 24 * 3600);
+    maxPollSpin_.set_increments(60, 3600);
+    maxDepthSpin_.set_range(0, 100);
+    maxDepthSpin_.set_increments(1, 5);
+    maxDepthSpin_.set_tooltip_text("0 scans all levels");
+    excludesEntry_.set_tooltip_text(
+            "Name patterns such as .git or *.tmp, or paths from the "
+            "directory such as /Samples, separated by semicolons");
+    
+    auto pPollRow = Gtk::manage(new Gtk::HBox());
+    pPollRow->pack_start(*labeledRow("Check every", minPollSpin_), 
+            Gtk::PACK_EXPAND_WIDGET);
+    pPollRow->pack_start(*labeledRow("to", maxPollSpin_), 
+            Gtk::PACK_EXPAND_WIDGET);
+    pPollRow->pack_start(*Gtk::manage(new Gtk::Label("seconds")), 
+            Gtk::PACK_SHRINK, 4);
+    
+    policyBox_.pack_start(recursiveCheck_, Gtk::PACK_SHRINK);
+    policyBox_.pack_start(watchCombo_, Gtk::PACK_SHRINK);
+    policyBox_.pack_start(*pPollRow, Gtk::PACK_SHRINK);
+    policyBox_.pack_start(*labeledRow("Levels scanned", maxDepthSpin_), 
+            Gtk::PACK_SHRINK);
+    policyBox_.pack_start(*labeledRow("Exclude", excludesEntry_), 
+            Gtk::PACK_SHRINK);
+    policyBox_.pack_start(followSymlinksCheck_, Gtk::PACK_SHRINK);
+    policyBox_.pack_start(idleIoCheck_, Gtk::PACK_SHRINK);
+    policyBox_.set_sensitive(false);
+    
+    auto const onChanged = sigc::mem_fun(*this, &SettingsDlg::onPolicyChanged);
+    recursiveCheck_.signal_toggled().connect(onChanged);
+    watchCombo_.signal_changed().connect(onChanged);
+    minPollSpin_.signal_value_changed().connect(onChanged);
+    maxPollSpin_.signal_value_changed().connect(onChanged);
+    maxDepthSpin_.signal_value_changed().connect(onChanged);
+    excludesEntry_.signal_changed().connect(onChanged);
+    followSymlinksCheck_.signal_toggled().connect(onChanged);
+    idleIoCheck_.signal_toggled().connect(onChanged);
+    
+    Gtk::Frame * pFrame = Gtk::manage(new Gtk::Frame("Scanning"));
+    pFrame->add(policyBox_);
+    return pFrame;
+}
+
+
+void SettingsDlg::onDirSelected()
+{
+    auto itRow = dirList_.get_selection()->get_selected();
+    policyBox_.set_sensitive(static_cast<bool>(itRow));
+    
+    if (!itRow)
+    {
+        return;
+    }
+    
+    Glib::ustring const dir = (*itRow)[ dirListColumns.path ];
+    auto const itDir = settings_.directories.find(dir);
+    
+    if (itDir == settings_.directories.end())
+    {
+        return; // being deleted
+    }
+    
+    Settings::Directory const& policy = itDir->second;
+    
+    updating_ = true;
+    recursiveCheck_.set_active(policy.recursive);
+    watchCombo_.set_active(policy.watch == Settings::WatchMode::MANUAL ? 1 : 0);
+    minPollSpin_.set_value(policy.minPollSec);
+    maxPollSpin_.set_value(policy.maxPollSec);
+    maxDepthSpin_.set_value(policy.maxDepth);
+    excludesEntry_.set_text(joinPatterns(policy.excludes));
+    followSymlinksCheck_.set_active(policy.followSymlinks);
+    idleIoCheck_.set_active(policy.ioPriority == Settings::IoPriority::IDLE);
+    updating_ = false;
+    
+    // polling bounds don't matter when nothing is polled
+    minPollSpin_.set_sensitive(policy.watch == Settings::WatchMode::POLL);
+    maxPollSpin_.set_sensitive(policy.watch == Settings::WatchMode::POLL);
+}
+
+
+void SettingsDlg::onShowTotalsToggled()
+{
+    settings_.showTotals = showTotalsCheck_.get_active();
+}
+
+
+void SettingsDlg::onPolicyChanged()
+{
+    auto itRow = dirList_.get_selection()->get_selected();
+    
+    if (updating_ || !itRow)
+    {
+        return;
+    }
+    
+    Glib::ustring const dir = (*itRow)[ dirListColumns.path ];
+    auto const itDir = settings_.directories.find(dir);
+    
+    if (itDir == settings_.directories.end())
+    {
+        return;
+    }
+    
+    Settings::Directory& policy = itDir->second;
+    
+    policy.recursive = recursiveCheck_.get_active();
+    policy.watch = watchCombo_.get_active_row_number() == 1 ? 
+            Settings::WatchMode::MANUAL : Settings::WatchMode::POLL;
+    policy.minPollSec = minPollSpin_.get_value_as_int();
+    policy.maxPollSec = std::max(policy.minPollSec, 
+            maxPollSpin_.get_value_as_int());
+    policy.maxDepth = maxDepthSpin_.get_value_as_int();
+    policy.excludes = splitPatterns(excludesEntry_.get_text());
+    policy.followSymlinks = followSymlinksCheck_.get_active();
+    policy.ioPriority = idleIoCheck_.get_active() ? 
+            Settings::IoPriority::IDLE : Settings::IoPriority::NORMAL;
+    
+    minPollSpin_.set_sensitive(policy.watch == Settings::WatchMode::POLL);
+    maxPollSpin_.set_sensitive(policy.watch == Settings::WatchMode::POLL);
 }
 
 
@@ -81,8 +278,7 @@ void SettingsDlg::onAddDir()
         
         for (std::string& dirname : dirnames)
         {
-			Settings::Directory dirSettings;
-			dirSettings.recursive = true;
+			Settings::Directory dirSettings; // default policy
 			auto inserted = settings_.directories.insert(
 				std::make_pair(std::move(dirname), std::move(dirSettings)));
 			
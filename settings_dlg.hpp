@@ -12,8 +12,12 @@ public:
     
 private:
     void initDirList();
+    Gtk::Widget* initPolicyBox();
     void onAddDir();
     void onDelDir();
+    void onDirSelected();
+    void onPolicyChanged();
+    void onShowTotalsToggled();
     
     void addDirectory(
             const std::string & dirname, 
@@ -23,6 +27,20 @@ private:
     Gtk::TreeView                dirList_;
     Glib::RefPtr<Gtk::ListStore> pListModel_;
     Gtk::Button                  btnDel_;
+    
+    // scan policy of the selected directory
+    Gtk::VBox                    policyBox_;
+    Gtk::CheckButton             recursiveCheck_;
+    Gtk::ComboBoxText            watchCombo_;
+    Gtk::SpinButton              minPollSpin_;
+    Gtk::SpinButton              maxPollSpin_;
+    Gtk::SpinButton              maxDepthSpin_;
+    Gtk::Entry                   excludesEntry_;
+    Gtk::CheckButton             followSymlinksCheck_;
+    Gtk::CheckButton             idleIoCheck_;
+    Gtk::CheckButton             showTotalsCheck_;
+    // set while the widgets are filled from the settings
+    bool                         updating_;
 };
 
 #endif	/* SETTINGS_DLG_HPP */
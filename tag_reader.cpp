@@ -0,0 +1,955 @@
+#include "tag_reader.hpp"
+
+#include <boost/algorithm/string/predicate.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <streambuf>
+#include <vector>
+
+namespace {
+
+using Bytes = std::vector<uint8_t>;
+
+// tags larger than that contain artwork which isn't needed anyway
+constexpr uint64_t MAX_TAG_SIZE = 1 << 20;
+// the last Ogg page is looked for within that many trailing bytes
+constexpr std::streamoff OGG_TAIL_SIZE = 65536;
+// bytes fetched from the filesystem per read
+constexpr size_t READ_BLOCK_SIZE = 65536;
+
+const char * const ID3V1_GENRES[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge",
+    "Hip-Hop", "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B",
+    "Rap", "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska",
+    "Death Metal", "Pranks", "Soundtrack", "Euro-Techno", "Ambient",
+    "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance", "Classical",
+    "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+    "AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative",
+    "Instrumental Pop", "Instrumental Rock", "Ethnic", "Gothic", "Darkwave",
+    "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap",
+    "Pop/Funk", "Jungle", "Native American", "Cabaret", "New Wave",
+    "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi", "Tribal",
+    "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll",
+    "Hard Rock"
+};
+
+constexpr int ID3V1_GENRES_COUNT = sizeof(ID3V1_GENRES) / sizeof(ID3V1_GENRES[0]);
+
+
+uint32_t be16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+uint32_t be24(const uint8_t* p) { return (p[0] << 16) | (p[1] << 8) | p[2]; }
+
+uint32_t be32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint64_t be64(const uint8_t* p)
+{
+    return (uint64_t(be32(p)) << 32) | be32(p + 4);
+}
+
+uint32_t le32(const uint8_t* p)
+{
+    return (uint32_t(p[3]) << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+uint64_t le64(const uint8_t* p)
+{
+    return (uint64_t(le32(p + 4)) << 32) | le32(p);
+}
+
+uint32_t syncsafe(const uint8_t* p)
+{
+    return ((p[0] & 0x7f) << 21) | ((p[1] & 0x7f) << 14) |
+           ((p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+
+/*
+ * A file read through FileSystem a block at a time. Seeking reads nothing,
+ * errors of the filesystem propagate out of the stream reading it.
+ */
+class FileBuf : public std::streambuf
+{
+public:
+    FileBuf(FileSystem& fileSystem, const std::string& fileName)
+        : fileSystem_(fileSystem)
+        , fileName_(fileName)
+        , bufferPos_(0)
+    {
+    }
+
+protected:
+    int_type underflow() override
+    {
+        uint64_t const pos = position();
+        buffer_ = fileSystem_.readFile(fileName_, pos, READ_BLOCK_SIZE);
+        bufferPos_ = pos;
+        setg(buffer_.data(), buffer_.data(), buffer_.data() + buffer_.size());
+
+        return buffer_.empty() ? traits_type::eof() : 
+                traits_type::to_int_type(buffer_.front());
+    }
+
+    pos_type seekoff(off_type off, std::ios::seekdir dir, 
+                     std::ios::openmode which) override
+    {
+        off_type base = 0;
+
+        if (dir == std::ios::cur)
+        {
+            base = position();
+        }
+        else if (dir == std::ios::end)
+        {
+            if (!size_)
+            {
+                size_ = fileSystem_.fileSize(fileName_);
+            }
+
+            base = *size_;
+        }
+
+        return seekpos(base + off, which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios::openmode) override
+    {
+        off_type const offset = pos;
+
+        if (offset < 0)
+        {
+            return pos_type(off_type(-1));
+        }
+
+        if (uint64_t(offset) >= bufferPos_ && 
+                uint64_t(offset) <= bufferPos_ + buffer_.size())
+        {
+            setg(buffer_.data(), buffer_.data() + (offset - bufferPos_), 
+                 buffer_.data() + buffer_.size());
+        }
+        else
+        { // read by the next underflow()
+            buffer_.clear();
+            bufferPos_ = offset;
+            setg(nullptr, nullptr, nullptr);
+        }
+
+        return pos;
+    }
+
+private:
+    uint64_t position() const
+    {
+        return bufferPos_ + (gptr() - eback());
+    }
+
+    FileSystem&                     fileSystem_;
+    const std::string               fileName_;
+    std::vector<char>               buffer_;
+    // of the buffer's first byte in the file
+    uint64_t                        bufferPos_;
+    std::optional<std::uintmax_t>   size_;
+};
+
+
+bool readExactly(std::istream& in, void* buff, size_t size)
+{
+    in.read(static_cast<char*>(buff), size);
+    return static_cast<size_t>(in.gcount()) == size;
+}
+
+
+Bytes readBytes(std::istream& in, uint64_t size)
+{
+    Bytes data(std::min(size, MAX_TAG_SIZE));
+    in.read(reinterpret_cast<char*>(data.data()), data.size());
+    data.resize(in.gcount());
+    return data;
+}
+
+
+void appendUtf8(std::string& out, uint32_t cp)
+{
+    if (cp < 0x80)
+    {
+        out += static_cast<char>(cp);
+    }
+    else if (cp < 0x800)
+    {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else if (cp < 0x10000)
+    {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+    else
+    {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+
+std::string latin1ToUtf8(const uint8_t* p, size_t size)
+{
+    std::string result;
+    result.reserve(size);
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        appendUtf8(result, p[i]);
+    }
+
+    return result;
+}
+
+
+std::string utf16ToUtf8(const uint8_t* p, size_t size, bool bigEndian)
+{
+    std::string result;
+    result.reserve(size);
+
+    for (size_t i = 0; i + 1 < size; i += 2)
+    {
+        uint32_t cp = bigEndian ? (p[i] << 8) | p[i + 1] : (p[i + 1] << 8) | p[i];
+
+        if (cp >= 0xd800 && cp < 0xdc00 && i + 3 < size)
+        {
+            uint32_t const low = bigEndian ?
+                    (p[i + 2] << 8) | p[i + 3] : (p[i + 3] << 8) | p[i + 2];
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            i += 2;
+        }
+
+        appendUtf8(result, cp);
+    }
+
+    return result;
+}
+
+
+// up to the first terminator, multiple values are separated by NULs
+std::string firstValue(std::string value)
+{
+    auto const nul = value.find('\0');
+
+    if (nul != std::string::npos)
+    {
+        value.resize(nul);
+    }
+
+    return value;
+}
+
+
+std::string genreName(std::string genre)
+{
+    // "(17)", "(17)Rock" or "17" refer to ID3v1 genres
+    if (!genre.empty() && genre[0] == '(')
+    {
+        auto const close = genre.find(')');
+
+        if (close != std::string::npos && close + 1 < genre.size())
+        {
+            return genre.substr(close + 1);
+        }
+
+        genre = genre.substr(1, close - 1);
+    }
+
+    if (!genre.empty() && std::all_of(genre.begin(), genre.end(), ::isdigit))
+    {
+        int const idx = std::atoi(genre.c_str());
+        return idx < ID3V1_GENRES_COUNT ? ID3V1_GENRES[idx] : std::string();
+    }
+
+    return genre;
+}
+
+// --- ID3 ---------------------------------------------------------------------
+
+std::string id3Text(const uint8_t* p, size_t size)
+{
+    if (size == 0)
+    {
+        return std::string();
+    }
+
+    uint8_t const encoding = p[0];
+    ++p;
+    --size;
+
+    switch (encoding)
+    {
+    case 0:
+        return firstValue(latin1ToUtf8(p, size));
+
+    case 1: // with BOM
+        if (size >= 2)
+        {
+            bool const bigEndian = p[0] == 0xfe && p[1] == 0xff;
+            return firstValue(utf16ToUtf8(p + 2, size - 2, bigEndian));
+        }
+        return std::string();
+
+    case 2:
+        return firstValue(utf16ToUtf8(p, size, /*bigEndian*/true));
+
+    default:
+        return firstValue(std::string(reinterpret_cast<const char*>(p), size));
+    }
+}
+
+
+void setId3Frame(TrackTags& tags, const std::string& id,
+                 const uint8_t* p, size_t size)
+{
+    if (id == "TIT2" || id == "TT2")
+    {
+        tags.title = id3Text(p, size);
+    }
+    else if (id == "TPE1" || id == "TP1")
+    {
+        tags.artist = id3Text(p, size);
+    }
+    else if (id == "TPE2" || id == "TP2")
+    {
+        tags.albumArtist = id3Text(p, size);
+    }
+    else if (id == "TALB" || id == "TAL")
+    {
+        tags.album = id3Text(p, size);
+    }
+    else if (id == "TCON" || id == "TCO")
+    {
+        tags.genre = genreName(id3Text(p, size));
+    }
+    else if (id == "TYER" || id == "TYE" || id == "TDRC")
+    {
+        tags.year = std::atoi(id3Text(p, size).c_str());
+    }
+    else if (id == "TRCK" || id == "TRK")
+    {
+        tags.trackNo = std::atoi(id3Text(p, size).c_str());
+    }
+}
+
+
+void removeUnsync(Bytes& data)
+{
+    auto itOut = data.begin();
+
+    for (auto itIn = data.begin(); itIn != data.end(); ++itIn)
+    {
+        *itOut++ = *itIn;
+
+        if (*itIn == 0xff && itIn + 1 != data.end() && *(itIn + 1) == 0)
+        {
+            ++itIn;
+        }
+    }
+
+    data.erase(itOut, data.end());
+}
+
+
+// returns the size of the tag (to skip), 0 if there is none
+uint64_t readId3v2(std::istream& in, TrackTags& tags)
+{
+    uint8_t header[10];
+
+    if (!readExactly(in, header, sizeof(header)) || memcmp(header, "ID3", 3) != 0)
+    {
+        return 0;
+    }
+
+    int const version = header[3];
+    uint8_t const flags = header[5];
+    uint64_t const size = syncsafe(header + 6);
+    Bytes data = readBytes(in, size);
+
+    if ((flags & 0x80) && version < 4)
+    {
+        removeUnsync(data);
+    }
+
+    size_t pos = 0;
+
+    if ((flags & 0x40) && data.size() >= 4)
+    { // extended header
+        pos = version < 4 ? 4 + be32(data.data()) : syncsafe(data.data());
+    }
+
+    size_t const headerSize = version < 3 ? 6 : 10;
+
+    while (pos + headerSize <= data.size() && data[pos] != 0)
+    {
+        const uint8_t* const frame = &data[pos];
+        std::string id;
+        size_t frameSize;
+        uint8_t formatFlags = 0;
+
+        if (version < 3)
+        {
+            id.assign(reinterpret_cast<const char*>(frame), 3);
+            frameSize = be24(frame + 3);
+        }
+        else
+        {
+            id.assign(reinterpret_cast<const char*>(frame), 4);
+            frameSize = version < 4 ? be32(frame + 4) : syncsafe(frame + 4);
+            formatFlags = frame[9];
+        }
+
+        if (pos + headerSize + frameSize > data.size())
+        {
+            break;
+        }
+
+        const uint8_t* body = frame + headerSize;
+        size_t bodySize = frameSize;
+
+        if (version >= 4 && (formatFlags & 0x01) && bodySize >= 4)
+        { // data length indicator
+            body += 4;
+            bodySize -= 4;
+        }
+
+        // compressed and encrypted frames are skipped
+        if (version < 4 ? (formatFlags & 0xc0) == 0 : (formatFlags & 0x0c) == 0)
+        {
+            if (version >= 4 && ((formatFlags & 0x02) || (flags & 0x80)))
+            { // unsynchronised per frame since 2.4
+                Bytes frameData(body, body + bodySize);
+                removeUnsync(frameData);
+                setId3Frame(tags, id, frameData.data(), frameData.size());
+            }
+            else
+            {
+                setId3Frame(tags, id, body, bodySize);
+            }
+        }
+
+        pos += headerSize + frameSize;
+    }
+
+    // a footer repeats the header at the end of a 2.4 tag
+    return 10 + size + (version >= 4 && (flags & 0x10) ? 10 : 0);
+}
+
+
+bool readId3v1(std::istream& in, TrackTags& tags)
+{
+    uint8_t tag[128];
+    in.clear();
+    in.seekg(-128, std::ios::end);
+
+    if (!readExactly(in, tag, sizeof(tag)) || memcmp(tag, "TAG", 3) != 0)
+    {
+        return false;
+    }
+
+    auto field = [&tag](size_t offset, size_t size)
+    {
+        std::string value = firstValue(latin1ToUtf8(tag + offset, size));
+        value.erase(value.find_last_not_of(' ') + 1);
+        return value;
+    };
+
+    tags.title = field(3, 30);
+    tags.artist = field(33, 30);
+    tags.album = field(63, 30);
+    tags.year = std::atoi(field(93, 4).c_str());
+
+    if (tag[125] == 0 && tag[126] != 0)
+    {
+        tags.trackNo = tag[126];
+    }
+
+    if (tag[127] < ID3V1_GENRES_COUNT)
+    {
+        tags.genre = ID3V1_GENRES[tag[127]];
+    }
+
+    return true;
+}
+
+// --- Vorbis comments (FLAC, Ogg) ---------------------------------------------
+
+void readVorbisComment(const uint8_t* p, size_t size, TrackTags& tags)
+{
+    const uint8_t* const end = p + size;
+
+    if (end - p < 4 || end - p - 4 < le32(p))
+    {
+        return;
+    }
+
+    p += 4 + le32(p); // vendor string
+
+    if (end - p < 4)
+    {
+        return;
+    }
+
+    uint32_t count = le32(p);
+    p += 4;
+
+    for (; count > 0 && end - p >= 4; --count)
+    {
+        uint32_t const len = le32(p);
+        p += 4;
+
+        if (end - p < len)
+        {
+            break;
+        }
+
+        std::string const comment(reinterpret_cast<const char*>(p), len);
+        p += len;
+
+        auto const eq = comment.find('=');
+
+        if (eq == std::string::npos)
+        {
+            continue;
+        }
+
+        std::string const key = comment.substr(0, eq);
+        std::string value = comment.substr(eq + 1);
+
+        using boost::iequals;
+
+        if (iequals(key, "TITLE"))
+        {
+            tags.title = std::move(value);
+        }
+        else if (iequals(key, "ARTIST"))
+        {
+            tags.artist = std::move(value);
+        }
+        else if (iequals(key, "ALBUMARTIST") || iequals(key, "ALBUM ARTIST"))
+        {
+            tags.albumArtist = std::move(value);
+        }
+        else if (iequals(key, "ALBUM"))
+        {
+            tags.album = std::move(value);
+        }
+        else if (iequals(key, "GENRE"))
+        {
+            tags.genre = std::move(value);
+        }
+        else if (iequals(key, "DATE") || iequals(key, "YEAR"))
+        {
+            tags.year = std::atoi(value.c_str());
+        }
+        else if (iequals(key, "TRACKNUMBER"))
+        {
+            tags.trackNo = std::atoi(value.c_str());
+        }
+    }
+}
+
+
+bool readFlac(std::istream& in, TrackTags& tags)
+{
+    uint8_t magic[4];
+
+    if (!readExactly(in, magic, sizeof(magic)) || memcmp(magic, "fLaC", 4) != 0)
+    {
+        return false;
+    }
+
+    bool last = false;
+
+    while (!last)
+    {
+        uint8_t header[4];
+
+        if (!readExactly(in, header, sizeof(header)))
+        {
+            break;
+        }
+
+        last = (header[0] & 0x80) != 0;
+        int const type = header[0] & 0x7f;
+        uint32_t const size = be24(header + 1);
+
+        if (type == 0 && size >= 18) // STREAMINFO
+        {
+            Bytes const info = readBytes(in, size);
+
+            if (info.size() < 18)
+            {
+                break;
+            }
+
+            uint32_t const sampleRate =
+                    (info[10] << 12) | (info[11] << 4) | (info[12] >> 4);
+            uint64_t const samples =
+                    (uint64_t(info[13] & 0x0f) << 32) | be32(&info[14]);
+
+            if (sampleRate)
+            {
+                tags.durationSec = static_cast<int>(samples / sampleRate);
+            }
+        }
+        else if (type == 4) // VORBIS_COMMENT
+        {
+            Bytes const comment = readBytes(in, size);
+            readVorbisComment(comment.data(), comment.size(), tags);
+        }
+        else
+        {
+            in.seekg(size, std::ios::cur);
+        }
+    }
+
+    return true;
+}
+
+
+bool readOgg(std::istream& in, TrackTags& tags)
+{
+    Bytes packet;
+    std::vector<Bytes> packets;
+    uint64_t bytesRead = 0;
+
+    // the identification and comment headers are the first two packets
+    while (packets.size() < 2 && bytesRead < MAX_TAG_SIZE)
+    {
+        uint8_t header[27];
+
+        if (!readExactly(in, header, sizeof(header)) || memcmp(header, "OggS", 4) != 0)
+        {
+            break;
+        }
+
+        uint8_t segments[255];
+
+        if (!readExactly(in, segments, header[26]))
+        {
+            break;
+        }
+
+        for (int i = 0; i < header[26] && packets.size() < 2; ++i)
+        {
+            size_t const offset = packet.size();
+            packet.resize(offset + segments[i]);
+
+            if (!readExactly(in, packet.data() + offset, segments[i]))
+            {
+                return false;
+            }
+
+            bytesRead += segments[i];
+
+            if (segments[i] < 255)
+            {
+                packets.push_back(std::move(packet));
+                packet.clear();
+            }
+        }
+    }
+
+    if (packets.size() < 2)
+    {
+        return false;
+    }
+
+    Bytes const& ident = packets[0];
+    Bytes const& comment = packets[1];
+    uint32_t sampleRate = 0;
+    uint64_t preSkip = 0;
+
+    if (ident.size() >= 16 && memcmp(ident.data(), "\x01vorbis", 7) == 0 &&
+        comment.size() >= 7 && memcmp(comment.data(), "\x03vorbis", 7) == 0)
+    {
+        sampleRate = le32(&ident[12]);
+        readVorbisComment(comment.data() + 7, comment.size() - 7, tags);
+    }
+    else if (ident.size() >= 12 && memcmp(ident.data(), "OpusHead", 8) == 0 &&
+             comment.size() >= 8 && memcmp(comment.data(), "OpusTags", 8) == 0)
+    {
+        sampleRate = 48000;
+        preSkip = ident[10] | (ident[11] << 8);
+        readVorbisComment(comment.data() + 8, comment.size() - 8, tags);
+    }
+    else
+    {
+        return false;
+    }
+
+    // the granule position of the last page gives the length
+    in.clear();
+    in.seekg(0, std::ios::end);
+    std::streamoff const fileSize = in.tellg();
+    std::streamoff const tailPos = std::max<std::streamoff>(0, fileSize - OGG_TAIL_SIZE);
+    in.seekg(tailPos);
+    Bytes const tail = readBytes(in, fileSize - tailPos);
+
+    for (size_t pos = tail.size() >= 14 ? tail.size() - 14 : 0; pos-- > 0; )
+    {
+        if (memcmp(&tail[pos], "OggS", 4) == 0)
+        {
+            uint64_t const granule = le64(&tail[pos + 6]);
+
+            if (sampleRate && granule > preSkip && granule != ~uint64_t(0))
+            {
+                tags.durationSec = static_cast<int>((granule - preSkip) / sampleRate);
+            }
+
+            break;
+        }
+    }
+
+    return true;
+}
+
+// --- MP4 ---------------------------------------------------------------------
+
+using AtomHandler = std::function<void(
+        const std::string& type, uint64_t bodyPos, uint64_t bodySize)>;
+
+void walkAtoms(std::istream& in, uint64_t begin, uint64_t end,
+               const AtomHandler& onAtom)
+{
+    uint64_t pos = begin;
+
+    while (pos + 8 <= end)
+    {
+        uint8_t header[16];
+        in.clear();
+        in.seekg(pos);
+
+        if (!readExactly(in, header, 8))
+        {
+            break;
+        }
+
+        uint64_t size = be32(header);
+        uint64_t headerSize = 8;
+
+        if (size == 1)
+        {
+            if (!readExactly(in, header + 8, 8))
+            {
+                break;
+            }
+
+            size = be64(header + 8);
+            headerSize = 16;
+        }
+        else if (size == 0)
+        {
+            size = end - pos;
+        }
+
+        // pos + size wraps around for 64-bit sizes of corrupt files
+        if (size < headerSize || size > end - pos)
+        {
+            break;
+        }
+
+        onAtom(std::string(reinterpret_cast<const char*>(header + 4), 4),
+               pos + headerSize, size - headerSize);
+        pos += size;
+    }
+}
+
+
+void readIlstItem(std::istream& in, const std::string& type,
+                  uint64_t bodyPos, uint64_t bodySize, TrackTags& tags)
+{
+    in.clear();
+    in.seekg(bodyPos);
+    Bytes const item = readBytes(in, bodySize);
+
+    // the value is in the "data" child: size, "data", type, locale, value
+    if (item.size() < 16 || memcmp(&item[4], "data", 4) != 0)
+    {
+        return;
+    }
+
+    size_t const dataSize = std::min<size_t>(be32(item.data()), item.size());
+
+    if (dataSize < 16)
+    {
+        return;
+    }
+
+    const uint8_t* const value = &item[16];
+    size_t const valueSize = dataSize - 16;
+    std::string const text(reinterpret_cast<const char*>(value), valueSize);
+
+    if (type == "\xa9nam")
+    {
+        tags.title = text;
+    }
+    else if (type == "\xa9" "ART")
+    {
+        tags.artist = text;
+    }
+    else if (type == "aART")
+    {
+        tags.albumArtist = text;
+    }
+    else if (type == "\xa9" "alb")
+    {
+        tags.album = text;
+    }
+    else if (type == "\xa9gen")
+    {
+        tags.genre = text;
+    }
+    else if (type == "gnre" && valueSize >= 2)
+    {
+        int const idx = be16(value) - 1;
+
+        if (idx >= 0 && idx < ID3V1_GENRES_COUNT)
+        {
+            tags.genre = ID3V1_GENRES[idx];
+        }
+    }
+    else if (type == "\xa9" "day")
+    {
+        tags.year = std::atoi(text.c_str());
+    }
+    else if (type == "trkn" && valueSize >= 4)
+    {
+        tags.trackNo = be16(value + 2);
+    }
+}
+
+
+bool readMp4(std::istream& in, TrackTags& tags)
+{
+    uint8_t header[8];
+
+    if (!readExactly(in, header, sizeof(header)) || memcmp(header + 4, "ftyp", 4) != 0)
+    {
+        return false;
+    }
+
+    in.seekg(0, std::ios::end);
+    uint64_t const fileSize = in.tellg();
+
+    AtomHandler onIlst = [&](const std::string& type, uint64_t pos, uint64_t size)
+    {
+        readIlstItem(in, type, pos, size, tags);
+    };
+
+    AtomHandler onMeta = [&](const std::string& type, uint64_t pos, uint64_t size)
+    {
+        if (type == "ilst")
+        {
+            walkAtoms(in, pos, pos + size, onIlst);
+        }
+    };
+
+    AtomHandler onUdta = [&](const std::string& type, uint64_t pos, uint64_t size)
+    {
+        if (type == "meta" && size > 4)
+        { // full atom, children follow version and flags
+            walkAtoms(in, pos + 4, pos + size, onMeta);
+        }
+    };
+
+    AtomHandler onMoov = [&](const std::string& type, uint64_t pos, uint64_t size)
+    {
+        if (type == "mvhd")
+        {
+            in.clear();
+            in.seekg(pos);
+            Bytes const mvhd = readBytes(in, std::min<uint64_t>(size, 32));
+
+            uint32_t timescale = 0;
+            uint64_t duration = 0;
+
+            if (mvhd.size() >= 20 && mvhd[0] == 0)
+            {
+                timescale = be32(&mvhd[12]);
+                duration = be32(&mvhd[16]);
+            }
+            else if (mvhd.size() >= 32 && mvhd[0] == 1)
+            {
+                timescale = be32(&mvhd[20]);
+                duration = be64(&mvhd[24]);
+            }
+
+            if (timescale)
+            {
+                tags.durationSec = static_cast<int>(duration / timescale);
+            }
+        }
+        else if (type == "udta")
+        {
+            walkAtoms(in, pos, pos + size, onUdta);
+        }
+    };
+
+    // moov may follow the audio data, which is skipped over
+    walkAtoms(in, 0, fileSize,
+        [&](const std::string& type, uint64_t pos, uint64_t size)
+        {
+            if (type == "moov")
+            {
+                walkAtoms(in, pos, pos + size, onMoov);
+            }
+        });
+
+    return true;
+}
+
+} // end of anonymous namespace
+
+
+std::optional<TrackTags> readTags(FileSystem& fileSystem, 
+                                  const std::string& fileName)
+{
+    FileBuf buf(fileSystem, fileName);
+    std::istream in(&buf);
+    // rethrows the filesystem's errors, which would end the reads silently
+    in.exceptions(std::ios::badbit);
+
+    TrackTags tags;
+
+    // ID3v2 may precede any format, FLAC in particular
+    uint64_t const id3Size = readId3v2(in, tags);
+
+    for (auto reader : { &readFlac, &readOgg, &readMp4 })
+    {
+        in.clear();
+        in.seekg(id3Size);
+
+        if (reader(in, tags))
+        {
+            return tags;
+        }
+    }
+
+    if (id3Size)
+    {
+        return tags;
+    }
+
+    if (readId3v1(in, tags))
+    {
+        return tags;
+    }
+
+    return std::nullopt;
+}
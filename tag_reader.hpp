@@ -0,0 +1,20 @@
+#ifndef TAG_READER_HPP
+#define	TAG_READER_HPP
+
+#include "db_record.hpp"
+#include "file_system.hpp"
+
+#include <optional>
+#include <string>
+
+/*
+ * Reads ID3v2 (ID3v1 as a fallback), FLAC and Ogg Vorbis/Opus comments and
+ * MP4 metadata atoms. Only the regions holding tags are read, audio data is
+ * skipped by seeking. Returns nullopt for unrecognised formats; failures of
+ * the filesystem, e.g. a timeout of a GuardedFileSystem, are thrown as
+ * fs::filesystem_error.
+ */
+std::optional<TrackTags> readTags(FileSystem& fileSystem, 
+                                  const std::string& fileName);
+
+#endif	/* TAG_READER_HPP */
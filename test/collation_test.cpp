@@ -0,0 +1,119 @@
+/*
+ * foldText() and sortKey(): folding of Latin, Greek and Cyrillic letters,
+ * numbers ordered by value, leading zeros and digit runs split into chunks.
+ *
+ * Usage:
+ *   collation_test
+ */
+
+#include "../collation.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+
+void expectFolded(const std::string& text, const std::string& expected)
+{
+    check(foldText(text) == expected, "foldText(\"" + text + "\")");
+}
+
+
+void expectSame(const std::string& left, const std::string& right)
+{
+    check(sortKey(left) == sortKey(right),
+            "sortKey(\"" + left + "\") == sortKey(\"" + right + "\")");
+}
+
+
+void expectBefore(const std::string& left, const std::string& right)
+{
+    check(sortKey(left) < sortKey(right),
+            "sortKey(\"" + left + "\") < sortKey(\"" + right + "\")");
+}
+
+} // end of anonymous namespace
+
+
+int main()
+{
+    { // folding tables
+        expectFolded("ABC xyz", "abc xyz");
+        expectFolded("ÀéÏõ", "aeio");         // Latin-1
+        expectFolded("ÆßÞÿ", "aessthy");     // ligatures
+        expectFolded("×÷", "×÷");              // kept signs
+        expectFolded("ŁćŻ", "lcz");                 // Latin Ext-A
+        expectFolded("ĲĳŒœ", "ijijoeoe");
+        expectFolded("é", "e");                              // combining
+        expectFolded("ΑΆάς", "ααασ");
+        expectFolded("АЯа", "аяа");  // Cyrillic
+        expectFolded("ЂЏ", "ђџ");
+        expectFolded("中", "中");                          // others kept
+        expectFolded(std::string("a\xC3", 2), std::string("a\xC3", 2));
+
+        // both cases of a letter fold the same way
+        expectSame("Ѐ", "ѐ");
+        expectSame("Ё", "ё");
+        expectSame("Ѐ", "е");
+        expectSame("Ѝ", "ѝ");
+        expectSame("Έ", "έ");
+    }
+
+    { // numbers by value
+        expectBefore("Track 2", "Track 10");
+        expectBefore("Track 9.mp3", "Track 10.mp3");
+        expectBefore("1", "a");
+        expectBefore("a1", "ab");
+        expectBefore("Disc 1 Track 10", "Disc 2 Track 1");
+        expectSame("track 2", "TRACK 2");
+    }
+
+    { // leading zeros
+        expectSame("Track 02", "Track 2");
+        expectSame("007", "7");
+        expectBefore("Track 002", "Track 10");
+        expectSame("0", "00");
+        expectBefore("0", "1");
+    }
+
+    { // digit runs longer than a chunk
+        std::string const nines(254, '9');
+        std::string const longer = "1" + std::string(299, '0');
+
+        expectBefore(nines, nines + "9");
+        expectBefore(longer, longer + "0");          // the zeros of the rest count
+        expectBefore("1" + std::string(299, '0') + "1", 
+                     "1" + std::string(299, '0') + "2");
+        expectSame("000" + longer, longer);
+
+        for (const std::string& text : { nines, longer, std::string(600, '5') })
+        {
+            std::string const key = sortKey(text);
+            check(std::find(key.begin(), key.end(), '\0') == key.end(),
+                    "no NUL in the key of " + std::to_string(text.size()) + " digits");
+        }
+    }
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "collation_test: ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * DbOwner's directory totals when a commit fails to update them, opening
+ * cancelled while the search index is rebuilt, and DbReader's file cache
+ * kept up to date through invalidate().
+ *
+ * Usage:
+ *   database_test [--dir PATH]
+ */
+
+#include "../database.hpp"
+
+#include "../sqlite3/sqlite3.h"
+
+#include <atomic>
+#include <filesystem>
+namespace fs = std::filesystem;
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+
+// on a connection of its own, as another process would
+void exec(const std::string& fileName, const char* szSQL)
+{
+    sqlite3* pDb = nullptr;
+    int res = sqlite3_open(fileName.c_str(), &pDb);
+
+    if (res == SQLITE_OK)
+    {
+        res = sqlite3_exec(pDb, szSQL, nullptr, nullptr, nullptr);
+    }
+
+    sqlite3_close(pDb);
+
+    if (res != SQLITE_OK)
+    {
+        throw DbException(res);
+    }
+}
+
+
+// a single number, on a connection of its own
+int64_t queryCount(const std::string& fileName, const char* szSQL)
+{
+    sqlite3* pDb = nullptr;
+    sqlite3_stmt* pStmt = nullptr;
+    int64_t result = -1;
+
+    if (sqlite3_open(fileName.c_str(), &pDb) == SQLITE_OK &&
+        sqlite3_prepare_v2(pDb, szSQL, -1, &pStmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(pStmt) == SQLITE_ROW)
+    {
+        result = sqlite3_column_int64(pStmt, 0);
+    }
+
+    sqlite3_finalize(pStmt);
+    sqlite3_close(pDb);
+    return result;
+}
+
+
+uint64_t fileCount(const DbReader& db, RecordID id)
+{
+    return db.getFile(id).fileCount;
+}
+
+
+// a failed update leaves the totals as they were, the next start
+// recomputes them
+void testStaleDirs(const std::string& fileName)
+{
+    RecordID root;
+    RecordID dir;
+
+    {
+        DbOwner db(fileName);
+        db.beginTransaction();
+        root = db.addFile(FileInfo{ NULL_RECORD_ID, 1, true, "/m" });
+        dir = db.addFile(FileInfo{ root, 1, true, "/m/a" });
+        db.addFile(FileInfo{ dir, 1, false, "/m/a/1.flac" });
+        db.commit();
+        check(fileCount(db, root) == 1, "totals committed");
+
+        exec(fileName, "CREATE TRIGGER fail_totals"
+                " BEFORE UPDATE OF file_count ON files"
+                " BEGIN SELECT RAISE(ABORT, 'test'); END;");
+
+        db.beginTransaction();
+        RecordID const added = db.addFile(FileInfo{ dir, 1, false, "/m/a/2.flac" });
+        db.commit();
+        check(db.getFile(added).fileName == "/m/a/2.flac", "file committed");
+        check(fileCount(db, dir) == 1 && fileCount(db, root) == 1,
+              "no partial totals");
+    }
+
+    exec(fileName, "DROP TRIGGER fail_totals;");
+    DbOwner db(fileName);
+    check(fileCount(db, dir) == 2 && fileCount(db, root) == 2,
+          "recomputed on start");
+
+    db.beginTransaction();
+    db.addFile(FileInfo{ dir, 1, false, "/m/a/3.flac" });
+    db.commit();
+    check(fileCount(db, dir) == 3 && fileCount(db, root) == 3,
+          "updated after recomputing");
+}
+
+
+// the rebuild is rolled back and done on the next open
+void testCancelledOpen(const std::string& fileName)
+{
+    fs::remove(fileName);
+
+    {
+        DbOwner db(fileName);
+        db.beginTransaction();
+        RecordID const root = db.addFile(FileInfo{ NULL_RECORD_ID, 1, true, "/m" });
+
+        for (int i = 0; i < 2000; ++i)
+        {
+            std::string const name = "/m/" + std::to_string(i) + ".flac";
+            db.indexFile(db.addFile(FileInfo{ root, 1, false, name }), name);
+        }
+
+        db.commit();
+    }
+
+    // as if written before the search index existed
+    exec(fileName, "DELETE FROM trigrams;");
+    std::atomic<bool> cancel(true);
+
+    try
+    {
+        DbOwner db(fileName, &cancel);
+        check(false, "cancelled: thrown");
+    }
+    catch(const DbException& ex)
+    {
+        check(std::string(ex.what()) == sqlite3_errstr(SQLITE_INTERRUPT),
+              "cancelled: interrupted");
+    }
+
+    check(queryCount(fileName, "SELECT COUNT(*) FROM trigrams") == 0,
+          "cancelled: nothing indexed");
+
+    cancel = false;
+    DbOwner db(fileName, &cancel);
+    check(queryCount(fileName, "SELECT COUNT(*) FROM trigrams") > 0,
+          "cancelled: indexed on the next open");
+    check(queryCount(fileName, "SELECT COUNT(*) FROM files") == 2001,
+          "cancelled: the files are kept");
+}
+
+
+// the cached record equals the stored one, or both are gone
+void checkCached(const DbOwner& db, const DbReader& reader, RecordID id,
+                 const std::string& what)
+{
+    bool stored = true;
+    bool cached = true;
+    FileInfo expected;
+    FileInfo actual;
+
+    try
+    {
+        expected = db.getFile(id);
+    }
+    catch(const std::out_of_range&)
+    {
+        stored = false;
+    }
+
+    try
+    {
+        actual = reader.getFile(id);
+    }
+    catch(const std::out_of_range&)
+    {
+        cached = false;
+    }
+
+    check(stored == cached && (!stored || (
+            actual.fileName == expected.fileName &&
+            actual.size == expected.size &&
+            actual.digest == expected.digest &&
+            actual.fileCount == expected.fileCount &&
+            actual.totalSize == expected.totalSize &&
+            actual.durationSec == expected.durationSec)),
+          what + ": record " + std::to_string(id));
+}
+
+
+void checkAllCached(const DbOwner& db, const DbReader& reader,
+                    const std::vector<RecordID>& ids, const std::string& what)
+{
+    for (RecordID id : ids)
+    {
+        checkCached(db, reader, id, what);
+    }
+}
+
+
+// events as the widget gets them, after the scanner committed each change;
+// a capacity below the number of records has the cache drop some meanwhile
+void testFileCache(const std::string& fileName, size_t capacity)
+{
+    fs::remove(fileName);
+    DbOwner db(fileName);
+    db.beginTransaction();
+    RecordID const root = db.addFile(FileInfo{ NULL_RECORD_ID, 1, true, "/m" });
+    RecordID const a = db.addFile(FileInfo{ root, 1, true, "/m/a" });
+    RecordID const b = db.addFile(FileInfo{ a, 1, true, "/m/a/b" });
+    RecordID const c = db.addFile(FileInfo{ root, 1, true, "/m/c" });
+    RecordID const file1 = db.addFile(FileInfo{ b, 1, false, "/m/a/b/1.flac", "", 10 });
+    RecordID const file2 = db.addFile(FileInfo{ a, 1, false, "/m/a/2.flac", "", 20 });
+    RecordID const file3 = db.addFile(FileInfo{ c, 1, false, "/m/c/3.flac", "", 30 });
+    db.commit();
+
+    std::vector<RecordID> ids{ file1, file2, file3, b, a, c, root };
+    DbReader reader = db.createReader();
+    reader.enableFileCache(capacity);
+    // the deepest first, before the directories above it were read
+    checkAllCached(db, reader, ids, "read");
+
+    db.beginTransaction();
+    RecordID const file4 = db.addFile(FileInfo{ b, 2, false, "/m/a/b/4.flac", "", 40 });
+    db.commit();
+    reader.invalidate(file4, b);
+    ids.push_back(file4);
+    checkAllCached(db, reader, ids, "added");
+
+    db.beginTransaction();
+    db.replaceFile(file1, FileInfo{ b, 3, false, "/m/a/b/1.flac", "", 11 });
+    db.commit();
+    reader.invalidate(file1, b);
+    checkAllCached(db, reader, ids, "updated");
+
+    TrackTags tags;
+    tags.title = "two";
+    tags.durationSec = 120;
+    db.beginTransaction();
+    db.setTrack(file2, 1, tags);
+    db.commit();
+    // without the parent, looked up
+    reader.invalidate(file2);
+    checkAllCached(db, reader, ids, "tagged");
+
+    db.beginTransaction();
+    RecordID const parent = db.delFile(a);
+    db.commit();
+    check(parent == root, "parent of the deleted directory");
+    reader.invalidate(a, parent);
+    checkAllCached(db, reader, ids, "deleted");
+
+    // the ids of the deleted records may come back
+    db.beginTransaction();
+    RecordID const file5 = db.addFile(FileInfo{ c, 4, false, "/m/c/5.flac", "", 50 });
+    db.commit();
+    reader.invalidate(file5, c);
+    ids.push_back(file5);
+    checkAllCached(db, reader, ids, "added again");
+
+    FileCacheStats const stats = reader.fileCacheStats();
+    check(stats.invalidated > 0, "records invalidated");
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char* argv[])
+try
+{
+    fs::path dir = fs::temp_directory_path();
+
+    if (argc == 3 && std::string(argv[1]) == "--dir")
+    {
+        dir = argv[2];
+    }
+
+    std::string const fileName = (dir / "medialib_database_test.db").string();
+    fs::remove(fileName);
+    testStaleDirs(fileName);
+    testCancelledOpen(fileName);
+    testFileCache(fileName, 100);
+    testFileCache(fileName, 2);
+    fs::remove(fileName);
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "database_test: ok" << std::endl;
+    return 0;
+}
+catch(const std::exception& ex)
+{
+    std::cerr << "database_test failed: " << ex.what() << std::endl;
+    return 1;
+}
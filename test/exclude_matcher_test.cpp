@@ -0,0 +1,148 @@
+/*
+ * ExcludeMatcher: patterns matching names at any depth or paths from the
+ * root, '/' at either end, stars, '?', classes, escapes and the size limit
+ * of the automaton.
+ *
+ * Usage:
+ *   exclude_matcher_test
+ */
+
+#include "../exclude_matcher.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+
+// whether the entry at a path relative to the root is excluded, the
+// directories above it are entered as the scan does
+bool excluded(const ExcludeMatcher& matcher, const std::string& path, bool isDir)
+{
+    ExcludeMatcher::State state = matcher.start();
+    size_t begin = 0;
+
+    for (size_t end; (end = path.find('/', begin)) != std::string::npos; begin = end + 1)
+    {
+        state = matcher.enter(state, path.substr(begin, end - begin));
+    }
+
+    auto const match = matcher.match(state, path.substr(begin));
+    return match == ExcludeMatcher::Match::ANY || 
+            (match == ExcludeMatcher::Match::DIRECTORY && isDir);
+}
+
+
+void expect(const std::vector<std::string>& patterns, 
+            const std::vector<std::string>& excludedPaths,
+            const std::vector<std::string>& keptPaths,
+            bool isDir = false)
+{
+    ExcludeMatcher const matcher(patterns);
+    std::string const what = patterns.empty() ? "" : patterns.front();
+
+    for (const std::string& path : excludedPaths)
+    {
+        check(excluded(matcher, path, isDir), 
+                "\"" + what + "\" excludes " + path);
+    }
+
+    for (const std::string& path : keptPaths)
+    {
+        check(!excluded(matcher, path, isDir), 
+                "\"" + what + "\" keeps " + path);
+    }
+}
+
+} // end of anonymous namespace
+
+
+int main()
+{
+    { // nothing to match
+        ExcludeMatcher const matcher;
+        check(matcher.empty(), "no patterns");
+        check(ExcludeMatcher({ "", "/" }).empty(), "empty patterns are ignored");
+        expect({}, {}, { "a", "a/b" });
+    }
+
+    // names at any depth
+    expect({ ".git" }, { ".git", "a/.git", "a/b/.git" }, 
+                       { "a.git", ".github", "a/.git2", "x.git/y" }, true);
+    expect({ "*.tmp" }, { "x.tmp", ".tmp", "a/b/c.tmp" }, 
+                        { "tmp", "x.tmp2", "a.tmp/b" });
+
+    // paths from the root
+    expect({ "Artist/Live" }, { "Artist/Live" }, 
+                              { "Live", "Other/Artist/Live", "Artist/Live2", 
+                                "Artist" });
+    expect({ "/Top" }, { "Top" }, { "a/Top" });
+    expect({ "A*/x" }, { "Ab/x", "A/x" }, { "A/b/x", "Ab/xy", "B/x" });
+
+    { // a trailing '/' anchors the pattern and only matches directories
+        expect({ "Samples/" }, { "Samples" }, { "Artist/Samples", "Sample" }, true);
+        expect({ "Samples/" }, {}, { "Samples", "Artist/Samples" }, false);
+        expect({ "Artist/Live/" }, { "Artist/Live" }, { "Live" }, true);
+        expect({ "Artist/Live/" }, {}, { "Artist/Live" }, false);
+
+        // a directory pattern ending with a star doesn't hide the others
+        expect({ "tmp*/", "*.log" }, { "tmp.log", "a/x.log" }, { "tmpfile" });
+        expect({ "tmp*/", "*.log" }, { "tmpdir", "tmp.log" }, { "a/tmpdir" }, true);
+    }
+
+    { // stars, '?', classes and escapes stay within a component
+        expect({ "?.mp3" }, { "a.mp3", "x/b.mp3" }, { "ab.mp3", ".mp3" });
+        expect({ "a*b" }, { "ab", "axxb", "x/ab" }, { "a/b", "abc" });
+        expect({ "*" }, { "a", ".x" }, {});
+        expect({ "[0-9][0-9] *" }, { "01 intro.mp3" }, { "a1 x", "1 x", "012 x" });
+        expect({ "[!a-z]*" }, { "Abc", "1", "x/_" }, { "abc" });
+        expect({ "[^a-z]*" }, { "Abc" }, { "abc" });
+        expect({ "[]x]" }, { "]", "x" }, { "y" });
+        expect({ "a[/]b" }, {}, { "a/b", "a]b" });
+        expect({ "\\*" }, { "*" }, { "a" });
+        expect({ "[abc" }, { "[abc" }, { "a" });
+    }
+
+    { // several patterns in one automaton
+        expect({ ".git", "@eaDir", "*.tmp", "Artist/Live" }, 
+               { ".git", "x/@eaDir", "y.tmp", "Artist/Live" }, 
+               { "Live", "x/Artist/Live", "git" });
+    }
+
+    { // a set of patterns needing too many states
+        bool thrown = false;
+
+        try
+        {
+            ExcludeMatcher const matcher({ "*a????????????" });
+        }
+        catch(const std::invalid_argument&)
+        {
+            thrown = true;
+        }
+
+        check(thrown, "too large an automaton is refused");
+    }
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "exclude_matcher_test: ok" << std::endl;
+    return 0;
+}
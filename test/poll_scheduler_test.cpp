@@ -0,0 +1,182 @@
+/*
+ * PollScheduler driven with explicit timestamps: intervals growing while
+ * directories don't change and shrinking when they do, per-directory
+ * bounds, the order of due directories and state restored by load().
+ *
+ * Usage:
+ *   poll_scheduler_test
+ */
+
+#include "../poll_scheduler.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr int MIN_SEC = 10;
+constexpr int MAX_SEC = 600;
+constexpr std::time_t T0 = 1600000000;
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+
+// interval of an unchanged directory after each check
+int checkUnchanged(PollScheduler& scheduler, RecordID id, std::time_t& now)
+{
+    DirSchedule const& schedule = scheduler.checked(id, false, now);
+    check(schedule.nextCheck == now + schedule.intervalSec, 
+            "the next check is an interval away");
+    now = schedule.nextCheck;
+    return schedule.intervalSec;
+}
+
+} // end of anonymous namespace
+
+
+int main()
+{
+    { // a new directory is due at once, then less and less often
+        PollScheduler scheduler(MIN_SEC, MAX_SEC);
+        scheduler.add(1, T0);
+
+        check(scheduler.due(T0 - 1).empty(), "nothing is due before the deadline");
+        check(scheduler.due(T0) == std::vector<RecordID>{ 1 }, "a new dir is due");
+        check(scheduler.nextDeadline() == T0, "the deadline of a new dir");
+
+        std::time_t now = T0;
+        std::vector<int> intervals;
+
+        for (int i = 0; i < 5; ++i)
+        {
+            intervals.push_back(checkUnchanged(scheduler, 1, now));
+        }
+
+        check(intervals == std::vector<int>{ 15, 22, 33, 49, 73 }, 
+                "unchanged intervals grow by half");
+        check(scheduler.due(now - 1).empty(), "not due before the grown interval");
+        check(scheduler.due(now) == std::vector<RecordID>{ 1 }, "due after it");
+
+        for (int i = 0; i < 20; ++i)
+        {
+            checkUnchanged(scheduler, 1, now);
+        }
+
+        check(checkUnchanged(scheduler, 1, now) == MAX_SEC, 
+                "the interval stops at the maximum");
+
+        // never changed before: halved, no faster than the maximum allows
+        check(scheduler.checked(1, true, now).intervalSec == MAX_SEC / 2, 
+                "the first change halves the interval");
+
+        // changed again 30 s later: polled twice as often as that
+        now += 30;
+        DirSchedule const& schedule = scheduler.checked(1, true, now);
+        check(schedule.intervalSec == 15, 
+                "a change shortens to half the time since the last one");
+        check(schedule.lastChange == now && schedule.changeCount == 2, 
+                "changes are counted");
+
+        now += 2;
+        check(scheduler.checked(1, true, now).intervalSec == MIN_SEC, 
+                "frequent changes stop at the minimum");
+    }
+
+    { // bounds of its own, below 2 s
+        PollScheduler scheduler(MIN_SEC, MAX_SEC);
+        scheduler.add(2, T0, PollScheduler::Bounds{ 1, 5 });
+
+        std::time_t now = T0;
+        std::vector<int> intervals;
+
+        for (int i = 0; i < 6; ++i)
+        {
+            intervals.push_back(checkUnchanged(scheduler, 2, now));
+        }
+
+        check(intervals == std::vector<int>{ 2, 3, 4, 5, 5, 5 }, 
+                "short intervals grow by a second at least, up to the dir's maximum");
+
+        // added again: keeps its schedule
+        scheduler.add(2, now + 1000);
+        check(scheduler.nextDeadline() == now, 
+                "adding a known dir again changes nothing");
+    }
+
+    { // due directories earliest first, removed ones aren't
+        PollScheduler scheduler(MIN_SEC, MAX_SEC);
+        scheduler.add(3, T0 + 2);
+        scheduler.add(1, T0);
+        scheduler.add(2, T0 + 1);
+        scheduler.add(4, T0 + 100);
+
+        check(scheduler.due(T0 + 2) == std::vector<RecordID>({ 1, 2, 3 }), 
+                "due dirs by deadline");
+
+        scheduler.remove(2);
+        scheduler.remove(42);
+        check(scheduler.due(T0 + 2) == std::vector<RecordID>({ 1, 3 }), 
+                "a removed dir isn't due");
+        check(scheduler.size() == 3, "size after remove");
+
+        // checked without being added: default bounds
+        check(scheduler.checked(5, false, T0).intervalSec == 15, 
+                "an unknown dir is checked with the default bounds");
+        check(scheduler.size() == 4, "and is added");
+
+        scheduler.clear();
+        check(scheduler.size() == 0 && !scheduler.nextDeadline(), "clear");
+    }
+
+    { // persisted state of the directories added, within their bounds
+        PollScheduler scheduler(MIN_SEC, MAX_SEC);
+        scheduler.add(1, T0);
+        scheduler.add(2, T0);
+        scheduler.add(3, T0, PollScheduler::Bounds{ 60, 120 });
+
+        scheduler.load(DirSchedules{
+            { 1, DirSchedule{ T0 + 50, 100, 3, T0 - 1000 } },
+            // saved with a larger maximum, or by a clock far ahead
+            { 2, DirSchedule{ T0 + 100000, 100000, 0, 0 } },
+            { 3, DirSchedule{ T0 + 5, 1, 0, 0 } },
+            // not added, e.g. a root removed meanwhile
+            { 9, DirSchedule{ T0, 10, 0, 0 } } });
+
+        check(scheduler.size() == 3, "unknown dirs aren't loaded");
+        check(scheduler.due(T0).empty(), "loaded deadlines replace the initial ones");
+        check(scheduler.due(T0 + 5) == std::vector<RecordID>{ 3 }, "a loaded deadline");
+
+        std::time_t now = T0 + 50;
+        check(scheduler.due(now) == std::vector<RecordID>({ 3, 1 }), "another one");
+
+        DirSchedule const& loaded = scheduler.checked(1, false, now);
+        check(loaded.intervalSec == 150 && loaded.changeCount == 3 && 
+                loaded.lastChange == T0 - 1000, "a loaded schedule is continued");
+
+        check(scheduler.due(T0 + MAX_SEC) == std::vector<RecordID>({ 3, 1, 2 }), 
+                "a deadline beyond the maximum interval is brought forward");
+        check(scheduler.checked(2, false, T0 + MAX_SEC).intervalSec == MAX_SEC, 
+                "a loaded interval is clamped to the maximum");
+        check(scheduler.checked(3, false, T0 + 5).intervalSec == 90, 
+                "a loaded interval is raised to the minimum");
+    }
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "poll_scheduler_test: ok" << std::endl;
+    return 0;
+}
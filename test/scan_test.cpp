@@ -0,0 +1,461 @@
+/*
+ * Scans of a MemFileSystem tree through ScanManager: an entry vanishing
+ * while its directory is walked, a file failing with EIO, a mount whose
+ * listing hangs past the timeout and is reported degraded, roots on dead
+ * mounts, roots added and removed while scanning, and a mount paced while
+ * a file on it is played.
+ *
+ * Usage:
+ *   scan_test [--dir PATH]
+ */
+
+#include "../scan_manager.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+namespace fs = std::filesystem;
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// longer than the scan thread's filesystem timeout
+constexpr auto WAIT_TIMEOUT = std::chrono::seconds(20);
+// ScanManager's timeout of looking up the mount of a root
+constexpr std::chrono::duration<double> STAT_TIMEOUT = std::chrono::seconds(2);
+// ScanThread's pace of a mount music is played from
+constexpr double THROTTLED_OPS_PER_SEC = 50;
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+
+bool waitFor(const std::function<bool()>& done)
+{
+    auto const deadline = Clock::now() + WAIT_TIMEOUT;
+
+    while (!done())
+    {
+        if (Clock::now() > deadline)
+        {
+            return false;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    return true;
+}
+
+
+std::optional<RecordID> rootId(const DbReader& db, const std::string& name)
+{
+    for (const FileRecord& rec : db.childrenFiles(ROOT_RECORD_ID))
+    {
+        if (rec.second.fileName == name)
+        {
+            return rec.first;
+        }
+    }
+
+    return std::nullopt;
+}
+
+
+std::vector<std::string> filesOf(const DbReader& db, const std::string& root)
+{
+    auto const id = rootId(db, root);
+    return id ? db.subtreeFiles(*id) : std::vector<std::string>();
+}
+
+
+bool contains(const std::vector<std::string>& files, const std::string& name)
+{
+    return std::find(files.begin(), files.end(), name) != files.end();
+}
+
+
+// the listing of a directory blocks until released
+class Gate
+{
+public:
+    void block(const fs::path& path)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        blocked_ = path;
+    }
+
+    void release()
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        blocked_.clear();
+        cond_.notify_all();
+    }
+
+    void wait(const fs::path& path)
+    {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cond_.wait(lock, [&] { return blocked_ != path; });
+    }
+
+private:
+    std::mutex              mtx_;
+    std::condition_variable cond_;
+    fs::path                blocked_;
+};
+
+
+struct Fixture
+{
+    Fixture()
+    {
+        for (const char* dir : { "/a/d0", "/a/d1", "/a/d2" })
+        {
+            for (const char* file : { "0.mp3", "1.mp3", "2.mp3" })
+            {
+                fileSystem.addFile(fs::path(dir) / file);
+            }
+        }
+
+        fileSystem.addFile("/b/0.mp3");
+        fileSystem.setDevice("/b", 2);
+
+        Settings s;
+        s.directories["/a"] = Settings::Directory();
+        settings.setSettings(s);
+    }
+
+    SettingsProvider  settings;
+    Extensions        extensions{ ".mp3" };
+    MemFileSystem     fileSystem;
+    PlaybackState     playback;
+    ScanEventQueue    events;
+    Glib::Dispatcher  onChanged;
+    ActiveRecordsSync activeFiles;
+};
+
+} // end of anonymous namespace
+
+
+int main(int argc, char* argv[])
+try
+{
+    fs::path dir = fs::temp_directory_path();
+
+    if (argc == 3 && std::string(argv[1]) == "--dir")
+    {
+        dir = argv[2];
+    }
+
+    // a scan which doesn't end fails the test rather than hanging it
+    alarm(120);
+
+    std::string const fileName = (dir / "medialib_scan_test.db").string();
+    fs::remove(fileName);
+
+    Fixture fx;
+    DbOwner db(fileName);
+    DbReader reader = db.createReader();
+
+    { // a file removed between the listing of its directory and its stat
+        fx.fileSystem.setHook([&](MemFileSystem::Op op, const fs::path& path)
+            {
+                if (op == MemFileSystem::Op::LAST_WRITE_TIME &&
+                        path == "/a/d1/1.mp3")
+                {
+                    fx.fileSystem.remove(path);
+                }
+            });
+
+        ScanManager manager(fx.settings, fx.extensions, fx.fileSystem,
+                fx.playback, db, fx.events, fx.onChanged, fx.activeFiles);
+
+        check(waitFor([&] { return filesOf(reader, "/a").size() == 8; }),
+                "ENOENT: the other files are added");
+        check(!contains(filesOf(reader, "/a"), "/a/d1/1.mp3"),
+                "ENOENT: the vanished file isn't added");
+    }
+
+    fx.fileSystem.setHook(nullptr);
+
+    { // a known file failing with EIO isn't deleted, a removed one is
+        fx.fileSystem.injectError(MemFileSystem::Op::LAST_WRITE_TIME,
+                "/a/d2/0.mp3", std::errc::io_error, -1);
+        fx.fileSystem.remove("/a/d0/0.mp3");
+        fx.fileSystem.addFile("/a/d2/3.mp3"); // d2 is listed again
+
+        // checked as soon as the thread starts, as if opened in the widget
+        for (const FileRecord& rec : reader.childrenFiles(*rootId(reader, "/a")))
+        {
+            fx.activeFiles->urgent.insert(rec.first);
+        }
+
+        ScanManager manager(fx.settings, fx.extensions, fx.fileSystem,
+                fx.playback, db, fx.events, fx.onChanged, fx.activeFiles);
+
+        check(waitFor([&]
+            {
+                auto const files = filesOf(reader, "/a");
+                return !contains(files, "/a/d0/0.mp3") && 
+                        contains(files, "/a/d2/3.mp3");
+            }), "EIO: the changes of the other files are saved");
+        check(contains(filesOf(reader, "/a"), "/a/d2/0.mp3"),
+                "EIO: the unreadable file is kept");
+        check(manager.degradedRoots().empty(), "EIO: nothing is degraded");
+    }
+
+    fx.fileSystem.clearErrors();
+
+    { // the listing of a root on another mount hangs past the timeout
+        Gate gate;
+        gate.block("/b");
+        fx.fileSystem.setHook([&](MemFileSystem::Op op, const fs::path& path)
+            {
+                if (op == MemFileSystem::Op::LIST_DIRECTORY)
+                {
+                    gate.wait(path);
+                }
+            });
+
+        Settings s = fx.settings.getSettings();
+        s.directories["/b"] = Settings::Directory();
+        fx.settings.setSettings(s);
+
+        ScanManager manager(fx.settings, fx.extensions, fx.fileSystem,
+                fx.playback, db, fx.events, fx.onChanged, fx.activeFiles);
+        std::vector<std::string> const expected{ "/b" };
+
+        check(waitFor([&] { return manager.degradedRoots() == expected; }),
+                "timeout: the hanging mount is degraded");
+        check(filesOf(reader, "/a").size() == 8,
+                "timeout: the other mount is still scanned");
+        check(filesOf(reader, "/b").empty(),
+                "timeout: nothing is added from the hanging mount");
+
+        // the abandoned listing returns before the manager is gone
+        gate.release();
+    }
+
+    fx.fileSystem.setHook(nullptr);
+
+    { // roots on dead mounts are looked up at once and don't fail the others
+        fx.fileSystem.addFile("/e/0.mp3");
+        fx.fileSystem.addFile("/f/0.mp3");
+        fx.fileSystem.setDevice("/e", 4);
+        fx.fileSystem.setDevice("/f", 4);
+
+        Gate gate;
+        gate.block("/dead");
+        std::mutex mtx;
+        std::set<std::thread::id> listedBy;
+
+        fx.fileSystem.setHook([&](MemFileSystem::Op op, const fs::path& path)
+            {
+                if (op == MemFileSystem::Op::DEVICE_ID &&
+                        path.parent_path() == "/dead")
+                {
+                    gate.wait("/dead");
+                }
+                else if (op == MemFileSystem::Op::LIST_DIRECTORY &&
+                        (path == "/e" || path == "/f"))
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    listedBy.insert(std::this_thread::get_id());
+                }
+            });
+
+        Settings s;
+        s.directories["/dead/0"] = Settings::Directory();
+        s.directories["/dead/1"] = Settings::Directory();
+        s.directories["/e"] = Settings::Directory();
+        s.directories["/f"] = Settings::Directory();
+        fx.settings.setSettings(s);
+
+        auto const started = Clock::now();
+        ScanManager manager(fx.settings, fx.extensions, fx.fileSystem,
+                fx.playback, db, fx.events, fx.onChanged, fx.activeFiles);
+        std::chrono::duration<double> const created = Clock::now() - started;
+
+        // the mounts are looked up in the background
+        check(created < STAT_TIMEOUT / 4, "dead mounts: created in " +
+                std::to_string(created.count()) + " s");
+        check(waitFor([&]
+            {
+                return filesOf(reader, "/e").size() == 1 &&
+                        filesOf(reader, "/f").size() == 1;
+            }), "dead mounts: the others are scanned");
+
+        // within one lookup timeout rather than one per dead root
+        std::chrono::duration<double> const scanned = Clock::now() - started;
+        check(scanned < STAT_TIMEOUT * 1.5, "dead mounts: scanned in " +
+                std::to_string(scanned.count()) + " s");
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            check(listedBy.size() == 1,
+                    "dead mounts: the roots of one mount share a thread");
+        }
+
+        gate.release();
+    }
+
+    fx.fileSystem.setHook(nullptr);
+
+    { // roots added to and removed from the running thread of their mount
+        fx.fileSystem.addFile("/h/0.mp3");
+        fx.fileSystem.setDevice("/h", 4);
+
+        std::mutex mtx;
+        std::set<std::thread::id> walkedBy;
+
+        fx.fileSystem.setHook([&](MemFileSystem::Op op, const fs::path& path)
+            {
+                if (op == MemFileSystem::Op::IS_DIRECTORY &&
+                        (path == "/e" || path == "/f" || path == "/h"))
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    walkedBy.insert(std::this_thread::get_id());
+                }
+            });
+
+        auto const walkers = [&]
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return walkedBy.size();
+        };
+
+        Settings s;
+        s.directories["/e"] = Settings::Directory();
+        s.directories["/f"] = Settings::Directory();
+        fx.settings.setSettings(s);
+
+        ScanManager manager(fx.settings, fx.extensions, fx.fileSystem,
+                fx.playback, db, fx.events, fx.onChanged, fx.activeFiles);
+
+        check(waitFor([&]
+            {
+                return filesOf(reader, "/e").size() == 1 &&
+                        filesOf(reader, "/f").size() == 1;
+            }), "roots: scanned");
+
+        s.directories.erase("/f");
+        s.directories["/h"] = Settings::Directory();
+        s.directories["/e"].maxPollSec = 60;
+        fx.settings.setSettings(s);
+        manager.applySettings();
+
+        check(waitFor([&]
+            {
+                return !rootId(reader, "/f") && filesOf(reader, "/h").size() == 1;
+            }), "roots: one removed, one added");
+        check(filesOf(reader, "/e").size() == 1, "roots: the kept one stays");
+        check(walkers() == 1, "roots: taken over by the running thread");
+
+        s.directories["/h"].recursive = false;
+        fx.settings.setSettings(s);
+        manager.applySettings();
+
+        check(waitFor([&] { return walkers() == 2; }),
+                "roots: the thread is replaced for 'recursive'");
+    }
+
+    fx.fileSystem.setHook(nullptr);
+
+    { // operations on the mount of the played file are paced until it stops
+        for (int d = 0; d < 20; ++d)
+        {
+            for (int f = 0; f < 30; ++f)
+            {
+                fx.fileSystem.addFile("/c/d" + std::to_string(d) + "/" + 
+                        std::to_string(f) + ".mp3");
+            }
+        }
+
+        fx.fileSystem.setDevice("/c", 3);
+        fx.playback.setPlaying(std::string("/c/d0/0.mp3"));
+
+        std::mutex mtx;
+        std::vector<Clock::time_point> ops;
+
+        fx.fileSystem.setHook([&](MemFileSystem::Op, const fs::path& path)
+            {
+                if (path.native().compare(0, 3, "/c/") == 0)
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    ops.push_back(Clock::now());
+                }
+            });
+
+        auto const opsSince = [&](Clock::time_point since)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return std::count_if(ops.begin(), ops.end(), 
+                    [since](Clock::time_point t) { return t >= since; });
+        };
+
+        Settings s;
+        s.directories["/c"] = Settings::Directory();
+        fx.settings.setSettings(s);
+
+        ScanManager manager(fx.settings, fx.extensions, fx.fileSystem,
+                fx.playback, db, fx.events, fx.onChanged, fx.activeFiles);
+
+        // past the burst the bucket starts with
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        auto const from = Clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        double const rate = opsSince(from) / 2.0;
+
+        check(rate > 0, "throttled: the scan goes on");
+        check(rate <= THROTTLED_OPS_PER_SEC * 1.2, 
+                "throttled: " + std::to_string(rate) + " operations per second");
+
+        auto const stopped = Clock::now();
+        fx.playback.setPlaying(std::nullopt);
+
+        // several times the throttled rate once the playback stops
+        check(waitFor([&] { return filesOf(reader, "/c").size() == 600; }),
+                "throttled: the scan ends at full speed");
+        std::chrono::duration<double> const took = Clock::now() - stopped;
+        double const fullRate = opsSince(stopped) / took.count();
+
+        check(fullRate > THROTTLED_OPS_PER_SEC * 4, "full speed: " + 
+                std::to_string(fullRate) + " operations per second");
+    }
+
+    fx.fileSystem.setHook(nullptr);
+    fs::remove(fileName);
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "scan_test: ok" << std::endl;
+    return 0;
+}
+catch(const std::exception& ex)
+{
+    std::cerr << "scan_test failed: " << ex.what() << std::endl;
+    return 1;
+}
@@ -0,0 +1,109 @@
+/*
+ * DbReader::search() with queries of one, two and more trigrams.
+ *
+ * Usage:
+ *   search_test [--dir PATH]
+ */
+
+#include "../database.hpp"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <filesystem>
+namespace fs = std::filesystem;
+#include <iostream>
+#include <set>
+#include <string>
+
+namespace
+{
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+
+std::set<std::string> names(const FileRecords& records)
+{
+    std::set<std::string> result;
+
+    for (const FileRecord& rec : records)
+    {
+        result.insert(rec.second.fileName);
+    }
+
+    return result;
+}
+
+
+void expect(const DbReader& db, const std::string& query,
+            const std::set<std::string>& expected)
+{
+    // no cancel callback, the search has to end by itself
+    check(names(db.search(query, 100)) == expected, "search(\"" + query + "\")");
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char* argv[])
+try
+{
+    fs::path dir = fs::temp_directory_path();
+
+    if (argc == 3 && std::string(argv[1]) == "--dir")
+    {
+        dir = argv[2];
+    }
+
+    // a search which doesn't end fails the test rather than hanging it
+    alarm(10);
+
+    std::string const fileName = (dir / "medialib_search_test.db").string();
+    fs::remove(fileName);
+
+    {
+        DbOwner db(fileName);
+        db.beginTransaction();
+
+        RecordID const root = db.addFile(FileInfo{ NULL_RECORD_ID, 1, true, "/m" });
+
+        for (const char* name : { "/m/abcdef.mp3", "/m/xabcx.flac", "/m/other.mp3" })
+        {
+            RecordID const id = db.addFile(FileInfo{ root, 1, false, name });
+            db.indexFile(id, name);
+        }
+
+        db.commit();
+
+        expect(db, "abc", { "/m/abcdef.mp3", "/m/xabcx.flac" });      // 1 trigram
+        expect(db, "abcd", { "/m/abcdef.mp3" });                        // 2
+        expect(db, "bcdef", { "/m/abcdef.mp3" });                       // 3
+        expect(db, "ABC", { "/m/abcdef.mp3", "/m/xabcx.flac" });      // folded
+        expect(db, "zzz", {});
+        expect(db, "abcz", {});
+    }
+
+    fs::remove(fileName);
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "search_test: ok" << std::endl;
+    return 0;
+}
+catch(const std::exception& ex)
+{
+    std::cerr << "search_test failed: " << ex.what() << std::endl;
+    return 1;
+}
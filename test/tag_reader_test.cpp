@@ -0,0 +1,539 @@
+/*
+ * readTags() on small files built in a MemFileSystem: ID3v2.2, 2.3 and 2.4
+ * with extended headers and unsynchronisation, ID3v1, FLAC, Ogg Vorbis and
+ * Opus, MP4; every prefix of each of them as a truncated file, corrupt
+ * sizes, and the filesystem failing or hanging.
+ *
+ * Usage:
+ *   tag_reader_test
+ */
+
+#include "../tag_reader.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+using namespace std::string_literals;
+
+namespace
+{
+
+int g_failures = 0;
+
+void check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++g_failures;
+    }
+}
+
+// --- encoding ----------------------------------------------------------------
+
+std::string be16(uint32_t v)
+{
+    return { char(v >> 8), char(v) };
+}
+
+
+std::string be24(uint32_t v)
+{
+    return { char(v >> 16), char(v >> 8), char(v) };
+}
+
+
+std::string be32(uint32_t v)
+{
+    return { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+}
+
+
+std::string be64(uint64_t v)
+{
+    return be32(uint32_t(v >> 32)) + be32(uint32_t(v));
+}
+
+
+std::string le16(uint32_t v)
+{
+    return { char(v), char(v >> 8) };
+}
+
+
+std::string le32(uint32_t v)
+{
+    return { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+}
+
+
+std::string le64(uint64_t v)
+{
+    return le32(uint32_t(v)) + le32(uint32_t(v >> 32));
+}
+
+
+std::string syncsafe(uint32_t v)
+{
+    return { char((v >> 21) & 0x7f), char((v >> 14) & 0x7f),
+             char((v >> 7) & 0x7f), char(v & 0x7f) };
+}
+
+
+// a zero byte after every 0xff
+std::string unsync(const std::string& data)
+{
+    std::string result;
+
+    for (char c : data)
+    {
+        result += c;
+
+        if (c == '\xff')
+        {
+            result += '\0';
+        }
+    }
+
+    return result;
+}
+
+// --- ID3 ---------------------------------------------------------------------
+
+// text frames in Latin-1 unless the value starts with an encoding byte
+std::string latin1(const std::string& text)
+{
+    return std::string(1, '\0') + text;
+}
+
+
+std::string frame22(const std::string& id, const std::string& body)
+{
+    return id + be24(body.size()) + body;
+}
+
+
+std::string frame23(const std::string& id, const std::string& body)
+{
+    return id + be32(body.size()) + std::string(2, '\0') + body;
+}
+
+
+std::string frame24(const std::string& id, const std::string& body,
+                    uint8_t formatFlags = 0)
+{
+    return id + syncsafe(body.size()) + '\0' + char(formatFlags) + body;
+}
+
+
+std::string id3(int version, uint8_t flags, const std::string& data)
+{
+    return "ID3" + std::string(1, char(version)) + '\0' + char(flags) +
+            syncsafe(data.size()) + data;
+}
+
+
+std::string id3v1(const std::string& title, const std::string& artist,
+                  int trackNo, int genre)
+{
+    std::string tag = "TAG";
+
+    for (const std::string& field : { title, artist, std::string("Album") })
+    {
+        tag += field + std::string(30 - field.size(), '\0');
+    }
+
+    tag += "1987" + std::string(28, '\0') + '\0' + char(trackNo) + char(genre);
+    return tag;
+}
+
+// --- FLAC, Ogg ---------------------------------------------------------------
+
+std::string vorbisComment(const std::vector<std::string>& comments)
+{
+    std::string const vendor = "test";
+    std::string result = le32(vendor.size()) + vendor + le32(comments.size());
+
+    for (const std::string& comment : comments)
+    {
+        result += le32(comment.size()) + comment;
+    }
+
+    return result;
+}
+
+
+std::string flacBlock(int type, bool last, const std::string& body)
+{
+    return std::string(1, char(type | (last ? 0x80 : 0))) + be24(body.size()) + body;
+}
+
+
+std::string streamInfo(uint32_t sampleRate, uint64_t samples)
+{
+    std::string info(10, '\0');
+    info += char(sampleRate >> 12);
+    info += char(sampleRate >> 4);
+    info += char(((sampleRate & 0x0f) << 4) | 0x02); // 2 channels
+    info += char(0xf0 | ((samples >> 32) & 0x0f)); // 16 bits
+    info += be32(uint32_t(samples));
+    info += std::string(16, '\0'); // MD5
+    return info;
+}
+
+
+std::string flac(const std::vector<std::string>& comments)
+{
+    return "fLaC" +
+            flacBlock(0, false, streamInfo(44100, 44100 * 125)) +
+            flacBlock(1, false, std::string(100, '\0')) + // padding
+            flacBlock(4, true, vorbisComment(comments)) +
+            std::string(200, '\x55'); // frames
+}
+
+
+std::string oggPage(uint64_t granule, const std::vector<std::string>& packets)
+{
+    std::string segments;
+    std::string data;
+
+    for (const std::string& packet : packets)
+    {
+        segments += std::string(packet.size() / 255, '\xff');
+        segments += char(packet.size() % 255);
+        data += packet;
+    }
+
+    return "OggS" + std::string(2, '\0') + le64(granule) +
+            std::string(12, '\0') + // serial, sequence, CRC
+            char(segments.size()) + segments + data;
+}
+
+
+std::string oggVorbis(uint64_t seconds)
+{
+    std::string const ident = "\x01vorbis" + le32(0) + '\x02' +
+            le32(44100) + std::string(13, '\0');
+    // long enough to take several segments
+    std::string const comment = "\x03vorbis" + vorbisComment({
+            "TITLE=Ogg", "ARTIST=Vorbis", "COMMENT=" + std::string(600, 'x') });
+
+    return oggPage(0, { ident }) + oggPage(0, { comment }) +
+            oggPage(44100 * seconds / 2, { std::string(50, 'a') }) +
+            oggPage(44100 * seconds, { std::string(50, 'a') });
+}
+
+
+std::string opus(uint64_t seconds)
+{
+    uint32_t const preSkip = 312;
+    std::string const ident = "OpusHead\x01\x02" + le16(preSkip) +
+            le32(44100) + std::string(3, '\0');
+    std::string const comment = "OpusTags" + vorbisComment({
+            "title=Opus", "TRACKNUMBER=9" });
+
+    return oggPage(0, { ident }) + oggPage(0, { comment }) +
+            oggPage(48000 * seconds + preSkip, { std::string(50, 'a') });
+}
+
+// --- MP4 ---------------------------------------------------------------------
+
+std::string atom(const std::string& type, const std::string& body)
+{
+    return be32(8 + body.size()) + type + body;
+}
+
+
+std::string ilstItem(const std::string& type, const std::string& value)
+{
+    return atom(type, atom("data", be32(1) + be32(0) + value));
+}
+
+
+std::string mp4()
+{
+    std::string const mvhd = std::string(4, '\0') + be32(0) + be32(0) +
+            be32(1000) + be32(245000) + std::string(80, '\0');
+    std::string const ilst =
+            ilstItem("\xa9nam", "Mp4 Title") +
+            ilstItem("\xa9" "ART", "Mp4 Artist") +
+            ilstItem("aART", "Mp4 Album Artist") +
+            ilstItem("\xa9" "alb", "Mp4 Album") +
+            ilstItem("gnre", be16(10)) + // Metal, counted from 1
+            ilstItem("\xa9" "day", "2010-01-01") +
+            ilstItem("trkn", be16(0) + be16(4) + be16(10) + be16(0));
+    std::string const meta = atom("meta", std::string(4, '\0') +
+            atom("hdlr", std::string(25, '\0')) + atom("ilst", ilst));
+
+    // the audio ahead of moov, in an atom with a 64-bit size
+    std::string const audio(300, '\x55');
+
+    return atom("ftyp", "M4A " + be32(0) + "M4A mp42isom") +
+            be32(1) + "mdat" + be64(16 + audio.size()) + audio +
+            atom("moov", atom("mvhd", mvhd) + atom("udta", meta));
+}
+
+// --- checks ------------------------------------------------------------------
+
+std::optional<TrackTags> tagsOf(MemFileSystem& fileSystem,
+                                const std::string& content)
+{
+    fileSystem.writeFile("/t/file", content);
+    return readTags(fileSystem, "/t/file");
+}
+
+
+void testId3(MemFileSystem& fs)
+{
+    { // 2.2, three-letter frames
+        auto const tags = tagsOf(fs, id3(2, 0,
+                frame22("TT2", latin1("Two Two")) +
+                frame22("TP1", latin1("Artist")) +
+                frame22("TCO", latin1("(17)")) +
+                frame22("TYE", latin1("1999")) +
+                frame22("TRK", latin1("3/12"))) + std::string(100, '\x55'));
+
+        check(tags && tags->title == "Two Two" && tags->artist == "Artist" &&
+              tags->genre == "Rock" && tags->year == 1999 && tags->trackNo == 3,
+              "ID3v2.2");
+    }
+
+    { // 2.3 with an extended header and UTF-16 text
+        std::string const ext = be32(6) + std::string(6, '\0');
+        auto const tags = tagsOf(fs, id3(3, 0x40, ext +
+                frame23("TIT2", "\x01\xff\xfe" "H\0\xe9\0l\0l\0o\0"s) +
+                frame23("TALB", "\x02\0B\0e"s) +
+                frame23("TCON", latin1("(9)Heavy")) +
+                std::string(20, '\0'))); // padding
+
+        check(tags && tags->title == "H\xc3\xa9llo" && tags->album == "Be" &&
+              tags->genre == "Heavy", "ID3v2.3 extended header");
+    }
+
+    { // 2.3 unsynchronised as a whole
+        std::string const frames = frame23("TIT2", latin1("\xff\xe0")) +
+                frame23("TPE1", latin1("Sync"));
+        auto const tags = tagsOf(fs, id3(3, 0x80, unsync(frames)));
+
+        check(tags && tags->title == "\xc3\xbf\xc3\xa0" && tags->artist == "Sync",
+              "ID3v2.3 unsynchronisation");
+    }
+
+    { // 2.4 with a footer ahead of FLAC, frames unsynchronised one by one
+        std::string const frames =
+                frame24("TPE1", "\x03" "Artist 2.4") +
+                frame24("TIT2", unsync(latin1("\xff\xe0")), 0x02) +
+                // data length indicator
+                frame24("TALB", syncsafe(6) + latin1("Album"), 0x01) +
+                frame24("TDRC", latin1("2004-05-06"));
+        std::string const tag = id3(4, 0x10, frames);
+        std::string const footer = "3DI" + tag.substr(3, 7);
+        auto const tags = tagsOf(fs, tag + footer + flac({ "ALBUM=Flac" }));
+
+        check(tags && tags->artist == "Artist 2.4" &&
+              tags->title == "\xc3\xbf\xc3\xa0" && tags->album == "Flac" &&
+              tags->year == 2004 && tags->durationSec == 125,
+              "ID3v2.4 ahead of FLAC");
+    }
+
+    { // compressed frames are skipped
+        auto const tags = tagsOf(fs, id3(3, 0,
+                "TIT2" + be32(5) + '\0' + '\x80' + latin1("Zlib") +
+                frame23("TPE1", latin1("Plain"))));
+
+        check(tags && tags->title.empty() && tags->artist == "Plain",
+              "ID3v2.3 compressed frame");
+    }
+
+    { // ID3v1 only
+        auto const tags = tagsOf(fs, std::string(500, '\x55') +
+                id3v1("Old Title", "Old Artist", 5, 8));
+
+        check(tags && tags->title == "Old Title" && tags->artist == "Old Artist" &&
+              tags->album == "Album" && tags->year == 1987 && tags->trackNo == 5 &&
+              tags->genre == "Jazz", "ID3v1");
+    }
+}
+
+
+void testFlacOgg(MemFileSystem& fs)
+{
+    {
+        auto const tags = tagsOf(fs, flac({ "TITLE=Flac Title",
+                "artist=Flac Artist", "ALBUM ARTIST=Various", "ALBUM=Flac Album",
+                "GENRE=Jazz", "DATE=2001-02-03", "TRACKNUMBER=7/9", "BROKEN" }));
+
+        check(tags && tags->title == "Flac Title" &&
+              tags->artist == "Flac Artist" && tags->albumArtist == "Various" &&
+              tags->album == "Flac Album" && tags->genre == "Jazz" &&
+              tags->year == 2001 && tags->trackNo == 7 &&
+              tags->durationSec == 125, "FLAC");
+    }
+
+    {
+        auto const tags = tagsOf(fs, oggVorbis(61));
+
+        check(tags && tags->title == "Ogg" && tags->artist == "Vorbis" &&
+              tags->durationSec == 61, "Ogg Vorbis");
+    }
+
+    {
+        auto const tags = tagsOf(fs, opus(30));
+
+        check(tags && tags->title == "Opus" && tags->trackNo == 9 &&
+              tags->durationSec == 30, "Opus");
+    }
+}
+
+
+void testMp4(MemFileSystem& fs)
+{
+    auto const tags = tagsOf(fs, mp4());
+
+    check(tags && tags->title == "Mp4 Title" && tags->artist == "Mp4 Artist" &&
+          tags->albumArtist == "Mp4 Album Artist" &&
+          tags->album == "Mp4 Album" && tags->genre == "Metal" &&
+          tags->year == 2010 && tags->trackNo == 4 && tags->durationSec == 245,
+          "MP4");
+}
+
+
+void testCorrupt(MemFileSystem& fs)
+{
+    check(!tagsOf(fs, ""), "empty file");
+    check(!tagsOf(fs, std::string(1000, 'x')), "unknown format");
+
+    { // the tag claims more than the file has
+        std::string const tag = id3(3, 0, frame23("TIT2", latin1("Kept")) +
+                frame23("TPE1", latin1("Cut off")));
+        auto const tags = tagsOf(fs, tag.substr(0, tag.size() - 3));
+
+        check(tags && tags->title == "Kept" && tags->artist.empty(),
+              "ID3 cut off");
+    }
+
+    { // a frame larger than the tag
+        auto const tags = tagsOf(fs, id3(3, 0, frame23("TIT2", latin1("Kept")) +
+                "TPE1" + be32(0x7fffffff) + std::string(2, '\0') + "x"));
+
+        check(tags && tags->title == "Kept" && tags->artist.empty(),
+              "ID3 frame too large");
+    }
+
+    { // comment counts and lengths beyond the block
+        std::string comment = vorbisComment({ "TITLE=Kept" });
+        comment.replace(8, 4, le32(1000));
+        comment += le32(0xfffffff0) + "ARTIST=Lost";
+        auto const tags = tagsOf(fs, "fLaC" + flacBlock(4, true, comment));
+
+        check(tags && tags->title == "Kept" && tags->artist.empty(),
+              "FLAC comment too long");
+    }
+
+    { // atoms smaller than their header or larger than the file
+        std::string const tail = be32(4) + "moov" + be32(1) + "moov" +
+                be64(~uint64_t(0) - 4);
+        auto const tags = tagsOf(fs, atom("ftyp", "M4A ") + tail);
+
+        check(tags && tags->title.empty(), "MP4 atom sizes");
+    }
+
+    // every prefix of each format is read without failing
+    std::vector<std::string> const files{
+        id3(3, 0x80, unsync(frame23("TIT2", latin1("\xff\xff")))) +
+                flac({ "TITLE=x" }),
+        oggVorbis(10), opus(10), mp4(),
+        std::string(200, 'x') + id3v1("t", "a", 1, 1)
+    };
+
+    for (const std::string& file : files)
+    {
+        for (size_t size = 0; size < file.size(); ++size)
+        {
+            try
+            {
+                tagsOf(fs, file.substr(0, size));
+            }
+            catch(const std::exception& ex)
+            {
+                check(false, std::string("truncated: ") + ex.what());
+            }
+        }
+    }
+}
+
+
+void testFileSystemErrors(MemFileSystem& fs)
+{
+    fs.writeFile("/t/file", flac({ "TITLE=x" }));
+    fs.injectError(MemFileSystem::Op::READ_FILE, "/t/file", std::errc::io_error);
+
+    try
+    {
+        readTags(fs, "/t/file");
+        check(false, "EIO: thrown");
+    }
+    catch(const fs::filesystem_error& ex)
+    {
+        check(ex.code() == std::errc::io_error, "EIO: thrown");
+    }
+
+    try
+    {
+        readTags(fs, "/t/missing");
+        check(false, "ENOENT: thrown");
+    }
+    catch(const fs::filesystem_error& ex)
+    {
+        check(ex.code() == std::errc::no_such_file_or_directory,
+              "ENOENT: thrown");
+    }
+
+    // a hanging mount, read with a timeout
+    fs.setLatency(MemFileSystem::Op::READ_FILE, std::chrono::milliseconds(500));
+    GuardedFileSystem guarded(fs, std::chrono::milliseconds(50));
+
+    try
+    {
+        readTags(guarded, "/t/file");
+        check(false, "timeout: thrown");
+    }
+    catch(const fs::filesystem_error& ex)
+    {
+        check(ex.code() == std::errc::timed_out, "timeout: thrown");
+    }
+
+    fs.setLatency(MemFileSystem::Op::READ_FILE, std::chrono::microseconds(0));
+}
+
+} // end of anonymous namespace
+
+
+int main()
+try
+{
+    MemFileSystem fs;
+
+    testId3(fs);
+    testFlacOgg(fs);
+    testMp4(fs);
+    testCorrupt(fs);
+    testFileSystemErrors(fs);
+
+    if (g_failures)
+    {
+        return 1;
+    }
+
+    std::cout << "tag_reader_test: ok" << std::endl;
+    return 0;
+}
+catch(const std::exception& ex)
+{
+    std::cerr << "tag_reader_test failed: " << ex.what() << std::endl;
+    return 1;
+}
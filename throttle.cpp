@@ -0,0 +1,151 @@
+#include "throttle.hpp"
+
+#include <algorithm>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifdef __linux__
+// from linux/ioprio.h, which isn't always installed
+constexpr int IOPRIO_CLASS_SHIFT = 13;
+constexpr int IOPRIO_CLASS_BE = 2;
+constexpr int IOPRIO_CLASS_IDLE = 3;
+constexpr int IOPRIO_WHO_PROCESS = 1;
+// the default level of the best effort class
+constexpr int IOPRIO_BE_NORM = 4;
+#endif
+
+}
+
+
+PlaybackState::PlaybackState()
+ : generation_(0)
+{
+}
+
+
+void PlaybackState::setPlaying(std::optional<std::string> fileName)
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    if (fileName != playing_)
+    {
+        playing_ = std::move(fileName);
+        ++generation_;
+    }
+}
+
+
+std::optional<std::string> PlaybackState::playingFile() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return playing_;
+}
+
+
+uint64_t PlaybackState::generation() const
+{
+    std::lock_guard<std::mutex> lock(mtx_);
+    return generation_;
+}
+
+
+TokenBucket::TokenBucket(double ratePerSec, double burst)
+ : ratePerSec_(ratePerSec)
+ , burst_(burst)
+ , tokens_(burst)
+ , updated_(Clock::now())
+{
+}
+
+
+TokenBucket::Clock::duration TokenBucket::take(double tokens, Clock::time_point now)
+{
+    std::chrono::duration<double> const elapsed = now - updated_;
+    tokens_ = std::min(burst_, tokens_ + elapsed.count() * ratePerSec_);
+    tokens_ -= tokens;
+    updated_ = now;
+
+    if (tokens_ >= 0)
+    {
+        return Clock::duration::zero();
+    }
+
+    return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(-tokens_ / ratePerSec_));
+}
+
+
+void TokenBucket::reset(Clock::time_point now)
+{
+    tokens_ = burst_;
+    updated_ = now;
+}
+
+
+bool setThreadIoIdle(bool idle)
+{
+#ifdef __linux__
+    int const ioprio = idle ?
+            IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT :
+            IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | IOPRIO_BE_NORM;
+    // 0 is the calling thread
+    return ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == 0;
+#else
+    return false;
+#endif
+}
+
+
+bool setThreadNice(int nice)
+{
+#ifdef __linux__
+    // threads have their own nice level on Linux
+    return ::setpriority(PRIO_PROCESS, ::syscall(SYS_gettid), nice) == 0;
+#else
+    return false;
+#endif
+}
+
+
+int threadNice()
+{
+#ifdef __linux__
+    errno = 0;
+    int const nice = ::getpriority(PRIO_PROCESS, ::syscall(SYS_gettid));
+    return errno == 0 ? nice : 0;
+#else
+    return 0;
+#endif
+}
+
+
+bool canRestoreNice(int nice)
+{
+#ifdef __linux__
+    struct rlimit limit;
+    
+    if (::geteuid() == 0)
+    {
+        return true; // has CAP_SYS_NICE unless dropped
+    }
+    
+    if (::getrlimit(RLIMIT_NICE, &limit) != 0)
+    {
+        return false;
+    }
+    
+    // the limit is a ceiling of 20 - nice
+    return limit.rlim_cur == RLIM_INFINITY || 
+            limit.rlim_cur >= static_cast<rlim_t>(20 - nice);
+#else
+    (void)nice;
+    return false;
+#endif
+}
@@ -0,0 +1,67 @@
+#ifndef THROTTLE_HPP
+#define	THROTTLE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+
+/*
+ * The file the player is playing, so that the scanner can keep its I/O away
+ * from that device. The plugin updates it from deadbeef's playback events;
+ * anything else (a test, a benchmark) may set it directly.
+ */
+class PlaybackState
+{
+public:
+    PlaybackState();
+
+    // nullopt when stopped or paused
+    void setPlaying(std::optional<std::string> fileName);
+    std::optional<std::string> playingFile() const;
+    // changes whenever setPlaying() changes the file
+    uint64_t generation() const;
+
+private:
+    mutable std::mutex          mtx_;
+    std::optional<std::string>  playing_;
+    uint64_t                    generation_;
+};
+
+
+/*
+ * Token bucket of I/O operations. Taking more tokens than available goes
+ * into debt, the caller is told how long to wait for it to be paid off.
+ */
+class TokenBucket
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    TokenBucket(double ratePerSec, double burst);
+
+    Clock::duration take(double tokens, Clock::time_point now);
+    // a full bucket, e.g. when throttling starts
+    void reset(Clock::time_point now);
+
+private:
+    const double        ratePerSec_;
+    const double        burst_;
+    double              tokens_;
+    Clock::time_point   updated_;
+};
+
+
+// I/O scheduling class of the calling thread, idle or best effort;
+// does nothing where ioprio_set isn't available
+bool setThreadIoIdle(bool idle);
+// CPU nice level of the calling thread; unprivileged threads usually
+// can't lower it again, see canRestoreNice()
+bool setThreadNice(int nice);
+int  threadNice();
+// whether RLIMIT_NICE lets the calling thread get back to 'nice' after
+// raising it; false where nice levels can't be changed
+bool canRestoreNice(int nice);
+
+#endif	/* THROTTLE_HPP */
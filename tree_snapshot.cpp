@@ -0,0 +1,182 @@
+#include "tree_snapshot.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+struct TreeSnapshot::Header
+{
+    uint32_t magic;
+    uint32_t entrySize;
+    uint64_t count;
+    uint64_t stringsSize;
+};
+
+struct TreeSnapshot::Entry
+{
+    int64_t  id;
+    int64_t  parentId;
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t keyOffset;
+    uint32_t keyLength;
+    uint32_t isDir;
+    uint32_t reserved;
+};
+
+namespace {
+
+constexpr uint32_t SNAPSHOT_MAGIC = 0x3154534D; // "MST1"
+
+}
+
+
+TreeSnapshot::TreeSnapshot(const std::string& fileName)
+ : pData_(nullptr)
+ , size_(0)
+ , count_(0)
+{
+    int const fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return; // not written yet
+    }
+
+    struct stat st;
+
+    if (::fstat(fd, &st) == 0 &&
+            static_cast<size_t>(st.st_size) >= sizeof(Header))
+    {
+        size_ = st.st_size;
+        pData_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    ::close(fd);
+
+    if (pData_ == MAP_FAILED || !pData_)
+    {
+        pData_ = nullptr;
+        return;
+    }
+
+    auto const * pHeader = static_cast<const Header*>(pData_);
+    uint64_t const entriesSize = pHeader->count * sizeof(Entry);
+
+    if (pHeader->magic != SNAPSHOT_MAGIC ||
+            pHeader->entrySize != sizeof(Entry) ||
+            pHeader->count > size_ / sizeof(Entry) ||
+            pHeader->stringsSize > size_ ||
+            sizeof(Header) + entriesSize + pHeader->stringsSize != size_)
+    {
+        std::cerr << "Ignoring malformed tree snapshot " << fileName << std::endl;
+        return;
+    }
+
+    for (uint64_t i = 0; i < pHeader->count; ++i)
+    {
+        Entry const& entry = entries()[i];
+
+        if (uint64_t(entry.nameOffset) + entry.nameLength > pHeader->stringsSize ||
+            uint64_t(entry.keyOffset) + entry.keyLength > pHeader->stringsSize)
+        {
+            std::cerr << "Ignoring malformed tree snapshot " << fileName << std::endl;
+            return;
+        }
+    }
+
+    count_ = pHeader->count;
+}
+
+
+TreeSnapshot::~TreeSnapshot()
+{
+    if (pData_)
+    {
+        ::munmap(pData_, size_);
+    }
+}
+
+
+const TreeSnapshot::Entry* TreeSnapshot::entries() const
+{
+    return reinterpret_cast<const Entry*>(
+            static_cast<const char*>(pData_) + sizeof(Header));
+}
+
+
+const char* TreeSnapshot::strings() const
+{
+    return reinterpret_cast<const char*>(entries() +
+            static_cast<const Header*>(pData_)->count);
+}
+
+
+FileRecord TreeSnapshot::record(size_t i) const
+{
+    Entry const& entry = entries()[i];
+    FileInfo info;
+
+    info.parentID = entry.parentId;
+    info.lastWriteTime = 0;
+    info.isDir = entry.isDir != 0;
+    info.fileName.assign(strings() + entry.nameOffset, entry.nameLength);
+    info.sortKey.assign(strings() + entry.keyOffset, entry.keyLength);
+
+    return make_Record(entry.id, std::move(info));
+}
+
+
+void TreeSnapshot::write(const std::string& fileName, const FileRecords& records)
+{
+    std::vector<Entry> entries;
+    std::string strings;
+
+    entries.reserve(records.size());
+
+    for (FileRecord const& rec : records)
+    {
+        Entry entry = {};
+
+        entry.id = rec.first;
+        entry.parentId = rec.second.parentID;
+        entry.isDir = rec.second.isDir ? 1 : 0;
+        entry.nameOffset = strings.size();
+        entry.nameLength = rec.second.fileName.size();
+        strings += rec.second.fileName;
+        entry.keyOffset = strings.size();
+        entry.keyLength = rec.second.sortKey.size();
+        strings += rec.second.sortKey;
+
+        entries.push_back(entry);
+    }
+
+    Header const header{ SNAPSHOT_MAGIC, sizeof(Entry),
+            entries.size(), strings.size() };
+    std::string const tmpFileName = fileName + ".tmp";
+
+    {
+        std::ofstream file(tmpFileName, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(entries.data()),
+                entries.size() * sizeof(Entry));
+        file.write(strings.data(), strings.size());
+
+        if (!file.flush())
+        {
+            throw std::runtime_error("failed to write " + tmpFileName);
+        }
+    }
+
+    // the mapping of a running instance keeps the replaced file
+    if (std::rename(tmpFileName.c_str(), fileName.c_str()) != 0)
+    {
+        throw std::runtime_error("failed to replace " + fileName);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef TREE_SNAPSHOT_HPP
+#define	TREE_SNAPSHOT_HPP
+
+#include "db_record.hpp"
+
+#include <string>
+
+/*
+ * Directory rows shown when the widget was last closed, so that it comes up
+ * before the database is open. The file is mapped as is: a header, fixed size
+ * entries with parents before their children, then the names and sort keys
+ * the entries point into.
+ */
+class TreeSnapshot
+{
+public:
+    // a missing or malformed file gives an empty snapshot
+    explicit TreeSnapshot(const std::string& fileName);
+    ~TreeSnapshot();
+
+    TreeSnapshot(const TreeSnapshot&) = delete;
+    TreeSnapshot& operator=(const TreeSnapshot&) = delete;
+
+    size_t     size() const { return count_; }
+    FileRecord record(size_t i) const;
+
+    // records have to be ordered parents first
+    static void write(const std::string& fileName, const FileRecords& records);
+
+private:
+    struct Header;
+    struct Entry;
+
+    const Entry* entries() const;
+    const char*  strings() const;
+
+    void*   pData_;
+    size_t  size_;
+    size_t  count_;
+};
+
+#endif	/* TREE_SNAPSHOT_HPP */